@@ -23,7 +23,44 @@ extern "C" {
 #endif
 
 void StartMicroserviceProfile();
-void UnregisterMonitoringThread();
+
+/*
+ * Start the profiler now rather than on the first tracer provider creation.
+ * Returns 0 if profiling is active, -1 if the library runs as a no-op because
+ * the kernel module is not available.
+ */
+int InitMicroserviceProfiler();
+
+/*
+ * Explicitly track (or stop tracking) the calling thread in the kernel
+ * module. Threads configured this way are no longer subject to the
+ * thread-name filter.
+ */
+int RegisterMonitoringThread();
+int UnregisterMonitoringThread();
+
+/*
+ * Select the threads tracked by the kernel module by name. Both arguments are
+ * comma-separated fnmatch(3) patterns; NULL leaves a list unchanged and ""
+ * clears it. A thread is tracked if it matches an include pattern (or no
+ * include pattern is set) and no exclude pattern. The filter is applied when
+ * threads start, when they are renamed, and at their next span.
+ *
+ * Defaults come from MICROSERVICE_PROFILE_THREADS and
+ * MICROSERVICE_PROFILE_EXCLUDE_THREADS. Threads created by the OpenTelemetry
+ * libraries are excluded unless MICROSERVICE_PROFILE_TRACK_SDK_THREADS=1.
+ */
+int SetMonitoringThreadFilter(const char* include_patterns,
+                              const char* exclude_patterns);
+
+/*
+ * The threads created by the calling thread between these two calls belong
+ * to the OpenTelemetry libraries: wrap the construction of batch processors
+ * and exporters whose worker threads are not named after them (see
+ * MICROSERVICE_PROFILE_SDK_THREADS).
+ */
+void BeginMonitoringSdkThreads();
+void EndMonitoringSdkThreads();
 
 #ifdef __cplusplus
 }
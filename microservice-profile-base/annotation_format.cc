@@ -0,0 +1,532 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-base/annotation_format.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include "microservice-profile-base/memory_budget.h"
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+// Charged to the memory budget for a dictionary entry besides its name.
+const size_t kDictionaryEntryOverhead = 4 * sizeof(void*) + sizeof(std::string);
+
+void PutVarint(std::string* out, uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    out->push_back((char) (value | 0x80));
+    value >>= 7;
+  }
+  out->push_back((char) value);
+}
+
+void PutSigned(std::string* out, int64_t value)
+{
+  PutVarint(out, ((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+}
+
+// Bounds-checked cursor over a column.
+struct Cursor
+{
+  const uint8_t* p;
+  const uint8_t* end;
+  bool ok = true;
+
+  uint64_t Varint()
+  {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+      if (p == end)
+        break;
+      uint8_t byte = *p++;
+      value |= (uint64_t) (byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0)
+        return value;
+    }
+    ok = false;
+    return 0;
+  }
+
+  int64_t Signed()
+  {
+    uint64_t value = Varint();
+    return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+  }
+
+  const uint8_t* Bytes(size_t size)
+  {
+    if ((size_t) (end - p) < size)
+    {
+      ok = false;
+      return nullptr;
+    }
+    const uint8_t* bytes = p;
+    p += size;
+    return bytes;
+  }
+
+  // Splits off the next length-prefixed column.
+  Cursor Column()
+  {
+    uint64_t size = Varint();
+    const uint8_t* bytes = ok ? Bytes(size) : nullptr;
+    Cursor column = {bytes, bytes ? bytes + size : nullptr};
+    column.ok = ok;
+    return column;
+  }
+};
+
+// Trace ids are random: four 11-bit slices of the id are as good as hashes.
+void BloomPositions(const uint8_t* trace_id, uint32_t positions[4])
+{
+  for (int i = 0; i < 4; ++i)
+  {
+    uint32_t bits = trace_id[15 - 2 * i] | (trace_id[14 - 2 * i] << 8);
+    positions[i] = bits % (kAnnotationBloomBytes * 8);
+  }
+}
+
+bool WriteAll(int fd, struct iovec* iov, int count)
+{
+  while (count > 0)
+  {
+    ssize_t n = writev(fd, iov, count);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    while (count > 0 && (size_t) n >= iov->iov_len)
+    {
+      n -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+    if (count > 0)
+    {
+      iov->iov_base = (char*) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+bool AnnotationBlockHeader::MayContain(const uint8_t* trace_id) const
+{
+  uint32_t positions[4];
+
+  BloomPositions(trace_id, positions);
+  for (uint32_t position : positions)
+  {
+    if ((bloom[position / 8] & (1 << (position % 8))) == 0)
+      return false;
+  }
+  return true;
+}
+
+AnnotationWriter::~AnnotationWriter()
+{
+  Close();
+}
+
+bool AnnotationWriter::Open(const char* path)
+{
+  std::lock_guard<std::mutex> guard(mutex_);
+  struct stat st;
+
+  fd_ = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (fd_ < 0)
+  {
+    std::cerr << "Couldn't open the annotation capture file: " << path
+              << std::endl;
+    return false;
+  }
+
+  if (fstat(fd_, &st) == 0 && st.st_size == 0)
+  {
+    AnnotationFileHeader file_header = {kAnnotationFileMagic,
+                                        kAnnotationFormatVersion};
+    struct iovec iov = {&file_header, sizeof(file_header)};
+    WriteAll(fd_, &iov, 1);
+  }
+  ResetBlock();
+  return true;
+}
+
+void AnnotationWriter::Close()
+{
+  std::lock_guard<std::mutex> guard(mutex_);
+
+  if (fd_ < 0)
+    return;
+  FlushLocked();
+  FreeBlock();
+  close(fd_);
+  fd_ = -1;
+}
+
+void AnnotationWriter::Abandon()
+{
+  std::lock_guard<std::mutex> guard(mutex_);
+
+  if (fd_ < 0)
+    return;
+  ResetBlock();
+  FreeBlock();
+  close(fd_);
+  fd_ = -1;
+}
+
+void AnnotationWriter::Flush()
+{
+  std::lock_guard<std::mutex> guard(mutex_);
+  FlushLocked();
+}
+
+void AnnotationWriter::ResetBlock()
+{
+  memset(&header_, 0, sizeof(header_));
+  header_.magic = kAnnotationBlockMagic;
+  header_.min_time = UINT64_MAX;
+  dictionary_.clear();
+  for (std::string* column : {&strings_, &records_, &span_ids_, &trace_ids_,
+                              &names_, &gaps_, &durations_, &offsets_})
+    column->clear();
+  offset_run_ = 0;
+}
+
+// The block being built: the columns keep their capacity from one block to
+// the next.
+size_t AnnotationWriter::Footprint() const
+{
+  size_t bytes = strings_.size() +
+                 dictionary_.size() * kDictionaryEntryOverhead;
+  for (const std::string* column : {&strings_, &records_, &span_ids_,
+                                    &trace_ids_, &names_, &gaps_, &durations_,
+                                    &offsets_})
+    bytes += column->capacity();
+  return bytes;
+}
+
+void AnnotationWriter::FreeBlock()
+{
+  std::unordered_map<std::string, uint32_t>().swap(dictionary_);
+  for (std::string* column : {&strings_, &records_, &span_ids_, &trace_ids_,
+                              &names_, &gaps_, &durations_, &offsets_})
+    std::string().swap(*column);
+  ReleaseMemory(kMemoryAnnotations, charged_);
+  charged_ = 0;
+}
+
+uint32_t AnnotationWriter::Intern(const char* name, size_t size)
+{
+  auto it = dictionary_.emplace(std::string(name, size), dictionary_.size());
+  if (it.second)
+  {
+    PutVarint(&strings_, size);
+    strings_.append(name, size);
+  }
+  return it.first->second;
+}
+
+void AnnotationWriter::Append(const uint8_t* span_id, const uint8_t* trace_id,
+                              const char* endpoint, size_t endpoint_size,
+                              uint32_t nb_syscalls,
+                              const struct syscall_desc* syscalls)
+{
+  std::lock_guard<std::mutex> guard(mutex_);
+
+  if (fd_ < 0)
+    return;
+
+  if (header_.syscalls == 0 && nb_syscalls > 0)
+  {
+    header_.base_steady = prev_end_ = syscalls[0].start_steady;
+    header_.base_offset = offset_ = (int64_t) (syscalls[0].start_system -
+                                               syscalls[0].start_steady);
+  }
+
+  PutVarint(&records_, nb_syscalls);
+  PutVarint(&records_, Intern(endpoint, endpoint_size));
+  span_ids_.append((const char*) span_id, 8);
+  trace_ids_.append((const char*) trace_id, 16);
+
+  uint32_t positions[4];
+  BloomPositions(trace_id, positions);
+  for (uint32_t position : positions)
+    header_.bloom[position / 8] |= 1 << (position % 8);
+
+  for (uint32_t i = 0; i < nb_syscalls; ++i)
+  {
+    const struct syscall_desc& sc = syscalls[i];
+    int64_t offset = (int64_t) (sc.start_system - sc.start_steady);
+
+    PutVarint(&names_, Intern(sc.name, strnlen(sc.name, sizeof(sc.name))));
+    PutSigned(&gaps_, (int64_t) (sc.start_steady - prev_end_));
+    PutSigned(&durations_, (int64_t) (sc.end_steady - sc.start_steady));
+
+    // The offset only moves when the wall clock is adjusted.
+    if (offset_run_ > 0 && offset - offset_ != offset_delta_)
+    {
+      PutSigned(&offsets_, offset_delta_);
+      PutVarint(&offsets_, offset_run_);
+      offset_run_ = 0;
+    }
+    offset_delta_ = offset - offset_;
+    offset_run_++;
+    offset_ = offset;
+    prev_end_ = sc.end_steady;
+
+    if (sc.start_system < header_.min_time)
+      header_.min_time = sc.start_system;
+    if (sc.start_system > header_.max_time)
+      header_.max_time = sc.start_system;
+  }
+
+  header_.records++;
+  header_.syscalls += nb_syscalls;
+  raw_bytes_ += RELAY_RECORD_HEADER_SIZE + nb_syscalls * sizeof(syscall_desc);
+
+  // Bounded by kAnnotationBlockRecords: charged, not reserved.
+  size_t footprint = Footprint();
+  if (footprint > charged_)
+  {
+    ChargeMemory(kMemoryAnnotations, footprint - charged_);
+    charged_ = footprint;
+  }
+
+  if (header_.records == kAnnotationBlockRecords)
+    FlushLocked();
+}
+
+void AnnotationWriter::FlushLocked()
+{
+  if (fd_ < 0 || header_.records == 0)
+    return;
+
+  if (offset_run_ > 0)
+  {
+    PutSigned(&offsets_, offset_delta_);
+    PutVarint(&offsets_, offset_run_);
+  }
+
+  std::string* columns[] = {&strings_, &span_ids_, &trace_ids_, &records_,
+                            &names_, &gaps_, &durations_, &offsets_};
+  std::string sizes[8];
+  struct iovec iov[1 + 2 * 8];
+  int count = 1;
+
+  header_.payload_size = 0;
+  for (int i = 0; i < 8; ++i)
+  {
+    PutVarint(&sizes[i], columns[i]->size());
+    iov[count++] = {&sizes[i][0], sizes[i].size()};
+    iov[count++] = {&(*columns[i])[0], columns[i]->size()};
+    header_.payload_size += sizes[i].size() + columns[i]->size();
+  }
+  iov[0] = {&header_, sizeof(header_)};
+
+  if (!WriteAll(fd_, iov, count))
+    std::cerr << "Error writing to the annotation capture file" << std::endl;
+  else
+    written_bytes_ += sizeof(header_) + header_.payload_size;
+  ResetBlock();
+}
+
+AnnotationReader::~AnnotationReader()
+{
+  Close();
+}
+
+bool AnnotationReader::Open(const char* path)
+{
+  struct stat st;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0)
+    return false;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(AnnotationFileHeader))
+  {
+    close(fd);
+    return false;
+  }
+
+  size_ = st.st_size;
+  data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data_ == MAP_FAILED)
+  {
+    data_ = nullptr;
+    return false;
+  }
+  madvise(data_, size_, MADV_SEQUENTIAL);
+
+  const uint8_t* p = static_cast<const uint8_t*>(data_);
+  const uint8_t* end = p + size_;
+  const AnnotationFileHeader* file_header =
+      reinterpret_cast<const AnnotationFileHeader*>(p);
+  if (file_header->magic != kAnnotationFileMagic ||
+      file_header->version != kAnnotationFormatVersion)
+  {
+    Close();
+    return false;
+  }
+
+  // Hop from block header to block header.
+  p += sizeof(AnnotationFileHeader);
+  while ((size_t) (end - p) >= sizeof(AnnotationBlockHeader))
+  {
+    const AnnotationBlockHeader* header =
+        reinterpret_cast<const AnnotationBlockHeader*>(p);
+    if (header->magic != kAnnotationBlockMagic ||
+        header->payload_size > (size_t) (end - p) - sizeof(*header))
+      break;
+    blocks_.push_back({header, p + sizeof(*header)});
+    p += sizeof(*header) + header->payload_size;
+  }
+  return true;
+}
+
+void AnnotationReader::Close()
+{
+  if (data_ != nullptr)
+    munmap(data_, size_);
+  data_ = nullptr;
+  size_ = 0;
+  blocks_.clear();
+}
+
+bool AnnotationReader::DecodeBlock(const Block& block, const Visitor& visitor)
+{
+  const AnnotationBlockHeader& header = *block.header;
+  Cursor payload = {block.payload, block.payload + header.payload_size};
+  Cursor strings = payload.Column();
+  Cursor span_ids = payload.Column();
+  Cursor trace_ids = payload.Column();
+  Cursor records = payload.Column();
+  Cursor names = payload.Column();
+  Cursor gaps = payload.Column();
+  Cursor durations = payload.Column();
+  Cursor offsets = payload.Column();
+
+  if (!payload.ok)
+    return false;
+
+  std::vector<std::string> dictionary;
+  while (strings.ok && strings.p != strings.end)
+  {
+    uint64_t size = strings.Varint();
+    const uint8_t* bytes = strings.Bytes(size);
+    if (bytes != nullptr)
+      dictionary.emplace_back((const char*) bytes, size);
+  }
+
+  uint64_t prev_end = header.base_steady;
+  int64_t offset = header.base_offset;
+  int64_t offset_delta = 0;
+  uint64_t offset_run = 0;
+  AnnotationRecord record;
+
+  for (uint32_t r = 0; r < header.records; ++r)
+  {
+    uint64_t nb_syscalls = records.Varint();
+    uint64_t endpoint = records.Varint();
+    const uint8_t* span_id = span_ids.Bytes(8);
+    const uint8_t* trace_id = trace_ids.Bytes(16);
+
+    if (!records.ok || !span_ids.ok || !trace_ids.ok ||
+        endpoint >= dictionary.size() || nb_syscalls > header.syscalls)
+      return false;
+
+    memcpy(record.span_id, span_id, 8);
+    memcpy(record.trace_id, trace_id, 16);
+    record.endpoint = dictionary[endpoint];
+    record.syscalls.resize(nb_syscalls);
+
+    for (auto& sc : record.syscalls)
+    {
+      uint64_t name = names.Varint();
+      if (offset_run == 0)
+      {
+        offset_delta = offsets.Signed();
+        offset_run = offsets.Varint();
+      }
+      if (!names.ok || !offsets.ok || name >= dictionary.size() ||
+          offset_run == 0)
+        return false;
+
+      const std::string& s = dictionary[name];
+      memset(sc.name, 0, sizeof(sc.name));
+      memcpy(sc.name, s.data(), std::min(s.size(), sizeof(sc.name)));
+      sc.start_steady = prev_end + gaps.Signed();
+      sc.end_steady = sc.start_steady + durations.Signed();
+      offset += offset_delta;
+      offset_run--;
+      sc.start_system = sc.start_steady + offset;
+      prev_end = sc.end_steady;
+    }
+    if (!gaps.ok || !durations.ok)
+      return false;
+
+    visitor(record);
+  }
+  return true;
+}
+
+void AnnotationReader::Select(uint64_t min_time, uint64_t max_time,
+                              const uint8_t* trace_id,
+                              const Visitor& visitor) const
+{
+  for (const Block& block : blocks_)
+  {
+    const AnnotationBlockHeader& header = *block.header;
+    if (header.max_time < min_time || header.min_time > max_time)
+      continue;
+    if (trace_id != nullptr && !header.MayContain(trace_id))
+      continue;
+
+    DecodeBlock(block, [&](const AnnotationRecord& record) {
+      if (trace_id != nullptr && memcmp(record.trace_id, trace_id, 16) != 0)
+        return;
+      for (const auto& sc : record.syscalls)
+      {
+        if (sc.start_system >= min_time && sc.start_system <= max_time)
+        {
+          visitor(record);
+          return;
+        }
+      }
+    });
+  }
+}
+
+}  // namespace microservice_profile
@@ -0,0 +1,182 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_ANNOTATION_FORMAT_H_
+#define MICROSERVICE_PROFILE_ANNOTATION_FORMAT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "microservice-profile-base/module_abi.h"
+
+namespace microservice_profile
+{
+
+// Columnar file format for relay records (see module_abi.h).
+//
+// A file is a header followed by self-contained blocks of up to
+// kAnnotationBlockRecords records. Each block starts with an
+// AnnotationBlockHeader, used as the block index: the time range of its
+// syscalls and a bloom filter of its trace ids let readers skip it. The
+// payload holds length-prefixed columns:
+//
+//   strings     block dictionary: syscall and endpoint names
+//   span ids    8 raw bytes per record
+//   trace ids   16 raw bytes per record
+//   records     per record: syscall count, endpoint string index
+//   names       per syscall: string index
+//   gaps        per syscall: start_steady - previous end_steady (zigzag)
+//   durations   per syscall: end_steady - start_steady (zigzag)
+//   offsets     start_system - start_steady, run-length encoded deltas
+//
+// Integers are LEB128 varints. The previous end_steady and the offset start
+// from values stored in the block header.
+
+const uint32_t kAnnotationFileMagic = 0x4641504d;   // "MPAF"
+const uint32_t kAnnotationBlockMagic = 0x4241504d;  // "MPAB"
+const uint32_t kAnnotationFormatVersion = 1;
+const uint32_t kAnnotationBlockRecords = 1024;
+const size_t kAnnotationBloomBytes = 256;
+
+struct AnnotationFileHeader
+{
+  uint32_t magic;
+  uint32_t version;
+} __attribute__((packed));
+
+struct AnnotationBlockHeader
+{
+  uint32_t magic;
+  uint32_t payload_size;
+  uint32_t records;
+  uint32_t syscalls;
+  uint64_t min_time;  // Earliest start_system of the block's syscalls.
+  uint64_t max_time;  // Latest start_system.
+  uint64_t base_steady;
+  int64_t base_offset;
+  uint8_t bloom[kAnnotationBloomBytes];
+
+  bool MayContain(const uint8_t* trace_id) const;
+} __attribute__((packed));
+
+struct AnnotationRecord
+{
+  uint8_t span_id[8];
+  uint8_t trace_id[16];
+  std::string endpoint;
+  std::vector<syscall_desc> syscalls;
+};
+
+// Encodes relay records and appends whole blocks to a file, with one write()
+// per block. Thread-safe.
+class AnnotationWriter
+{
+public:
+  AnnotationWriter() = default;
+  ~AnnotationWriter();
+
+  AnnotationWriter(const AnnotationWriter&) = delete;
+  AnnotationWriter& operator=(const AnnotationWriter&) = delete;
+
+  bool Open(const char* path);
+  void Close();
+  bool is_open() const { return fd_ >= 0; }
+
+  // Forgets the pending records without writing them and closes the file.
+  // For forked children, which must not write the parent's data.
+  void Abandon();
+
+  void Append(const uint8_t* span_id, const uint8_t* trace_id,
+              const char* endpoint, size_t endpoint_size,
+              uint32_t nb_syscalls, const struct syscall_desc* syscalls);
+
+  // Writes the pending records as a (short) block.
+  void Flush();
+
+  // Bytes of raw relay data and of file written so far.
+  uint64_t raw_bytes() const { return raw_bytes_; }
+  uint64_t written_bytes() const { return written_bytes_; }
+
+private:
+  uint32_t Intern(const char* name, size_t size);
+  void ResetBlock();
+  void FlushLocked();
+  size_t Footprint() const;
+  void FreeBlock();
+
+  std::mutex mutex_;
+  int fd_ = -1;
+
+  AnnotationBlockHeader header_;
+  std::unordered_map<std::string, uint32_t> dictionary_;
+  std::string strings_, records_, span_ids_, trace_ids_;
+  std::string names_, gaps_, durations_, offsets_;
+  uint64_t prev_end_ = 0;
+  int64_t offset_ = 0;
+  uint64_t offset_run_ = 0;
+  int64_t offset_delta_ = 0;
+  size_t charged_ = 0;  // To the memory budget, the largest footprint.
+
+  uint64_t raw_bytes_ = 0;
+  uint64_t written_bytes_ = 0;
+};
+
+// Reads a file mapped in memory. Truncated trailing blocks are ignored.
+class AnnotationReader
+{
+public:
+  struct Block
+  {
+    const AnnotationBlockHeader* header;
+    const uint8_t* payload;
+  };
+
+  typedef std::function<void(const AnnotationRecord& record)> Visitor;
+
+  AnnotationReader() = default;
+  ~AnnotationReader();
+
+  AnnotationReader(const AnnotationReader&) = delete;
+  AnnotationReader& operator=(const AnnotationReader&) = delete;
+
+  bool Open(const char* path);
+  void Close();
+
+  const std::vector<Block>& blocks() const { return blocks_; }
+
+  // Decodes a whole block. Returns false if it is corrupted.
+  static bool DecodeBlock(const Block& block, const Visitor& visitor);
+
+  // Visits the records with at least one syscall starting in
+  // [min_time, max_time] and, if trace_id is not null, of that trace. Only
+  // the blocks whose index matches are decoded.
+  void Select(uint64_t min_time, uint64_t max_time, const uint8_t* trace_id,
+              const Visitor& visitor) const;
+
+private:
+  void* data_ = nullptr;
+  size_t size_ = 0;
+  std::vector<Block> blocks_;
+};
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_ANNOTATION_FORMAT_H_
@@ -0,0 +1,231 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-base/block_pool.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <mutex>
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+BlockPool* pools[BlockPool::kMaxPools];
+std::atomic<size_t> nb_pools(0);
+std::once_flag fork_handlers_once;
+
+}  // namespace
+
+struct BlockPool::ThreadCache
+{
+  BlockPool* pool = nullptr;
+  FreeBlock* head = nullptr;
+  size_t count = 0;
+
+  // Set once the thread's caches are destroyed: blocks freed by the
+  // destructors of later thread-local objects go straight to malloc.
+  bool exited = false;
+
+  ~ThreadCache()
+  {
+    if (pool != nullptr)
+      pool->Drain(*this, 0);
+    exited = true;
+  }
+};
+
+BlockPool::BlockPool(size_t block_size, size_t max_depot_blocks,
+                     MemoryComponent component)
+    : block_size_(std::max(block_size, sizeof(FreeBlock))),
+      max_depot_batches_(std::max<size_t>(max_depot_blocks / kBatchSize, 1)),
+      component_(component),
+      index_(nb_pools.fetch_add(1))
+{
+  // Pools beyond the limit work, without caching.
+  if (index_ >= kMaxPools)
+    return;
+
+  pools[index_] = this;
+  std::call_once(fork_handlers_once, [] {
+    pthread_atfork(nullptr, nullptr, &BlockPool::ChildAfterFork);
+  });
+}
+
+BlockPool::ThreadCache& BlockPool::LocalCache()
+{
+  static thread_local ThreadCache caches[kMaxPools];
+  ThreadCache& cache = caches[index_];
+
+  cache.pool = this;
+  return cache;
+}
+
+void* BlockPool::Allocate()
+{
+  if (index_ < kMaxPools)
+  {
+    ThreadCache& cache = LocalCache();
+    if (cache.head == nullptr && !cache.exited)
+      Refill(cache);
+    if (cache.head != nullptr)
+    {
+      FreeBlock* block = cache.head;
+      cache.head = block->next;
+      cache.count--;
+      return block;
+    }
+  }
+
+  void* block = malloc(block_size_);
+  if (block != nullptr)
+  {
+    heap_allocations_.fetch_add(1, std::memory_order_relaxed);
+    ChargeMemory(component_, block_size_);
+  }
+  return block;
+}
+
+void BlockPool::Free(void* block)
+{
+  if (block == nullptr)
+    return;
+
+  if (index_ < kMaxPools)
+  {
+    ThreadCache& cache = LocalCache();
+    if (!cache.exited)
+    {
+      FreeBlock* free_block = static_cast<FreeBlock*>(block);
+      free_block->next = cache.head;
+      cache.head = free_block;
+      if (++cache.count >= 2 * kBatchSize)
+        Drain(cache, kBatchSize);
+      return;
+    }
+  }
+
+  free(block);
+  heap_frees_.fetch_add(1, std::memory_order_relaxed);
+  ReleaseMemory(component_, block_size_);
+}
+
+void BlockPool::Lock()
+{
+  while (lock_.test_and_set(std::memory_order_acquire))
+    sched_yield();
+}
+
+void BlockPool::Unlock()
+{
+  lock_.clear(std::memory_order_release);
+}
+
+void BlockPool::Refill(ThreadCache& cache)
+{
+  Lock();
+  FreeBlock* batch = depot_;
+  if (batch != nullptr)
+  {
+    depot_ = batch->next_batch;
+    depot_batches_--;
+    depot_blocks_ -= batch->count;
+    cache.head = batch;
+    cache.count = batch->count;
+  }
+  Unlock();
+}
+
+// Moves the blocks of a cache beyond `keep` to the depot, in batches. Those
+// the depot has no room for are freed, like all of them under memory
+// pressure.
+void BlockPool::Drain(ThreadCache& cache, size_t keep)
+{
+  bool pressure = MemoryUnderPressure();
+
+  while (cache.count > keep)
+  {
+    FreeBlock* batch = nullptr;
+    size_t count = 0;
+    while (cache.count > keep && count < kBatchSize)
+    {
+      FreeBlock* block = cache.head;
+      cache.head = block->next;
+      cache.count--;
+      block->next = batch;
+      batch = block;
+      count++;
+    }
+
+    Lock();
+    bool stored = !pressure && depot_batches_ < max_depot_batches_;
+    if (stored)
+    {
+      batch->next_batch = depot_;
+      batch->count = count;
+      depot_ = batch;
+      depot_batches_++;
+      depot_blocks_ += count;
+    }
+    Unlock();
+    if (stored)
+      continue;
+
+    while (batch != nullptr)
+    {
+      FreeBlock* block = batch;
+      batch = block->next;
+      free(block);
+    }
+    heap_frees_.fetch_add(count, std::memory_order_relaxed);
+    ReleaseMemory(component_, count * block_size_);
+  }
+}
+
+BlockPool::Stats BlockPool::stats()
+{
+  Stats stats;
+
+  stats.heap_blocks = heap_allocations_.load() - heap_frees_.load();
+  Lock();
+  stats.depot_blocks = depot_blocks_;
+  Unlock();
+  return stats;
+}
+
+// Another thread may have held a depot lock when the process forked. The
+// leaked free blocks stay shared with the parent.
+void BlockPool::ChildAfterFork()
+{
+  size_t count = std::min(nb_pools.load(), kMaxPools);
+  for (size_t i = 0; i < count; i++)
+  {
+    BlockPool* pool = pools[i];
+    if (pool == nullptr)
+      continue;
+    ReleaseMemory(pool->component_, pool->depot_blocks_ * pool->block_size_);
+    pool->depot_ = nullptr;
+    pool->depot_batches_ = 0;
+    pool->depot_blocks_ = 0;
+    pool->lock_.clear();
+  }
+}
+
+}  // namespace microservice_profile
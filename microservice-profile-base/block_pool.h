@@ -0,0 +1,111 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_BLOCK_POOL_H_
+#define MICROSERVICE_PROFILE_BLOCK_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "microservice-profile-base/memory_budget.h"
+
+namespace microservice_profile
+{
+
+// Fixed-size blocks for objects made and released at a high rate, such as
+// the recordables of spans. Each thread keeps a cache of free blocks and
+// only takes the pool's lock to exchange a batch of them with the shared
+// depot. A block may be freed by another thread than the one which
+// allocated it. The depot is bounded: blocks freed beyond it go back to
+// malloc, so a burst does not stay resident, and so are all of them while
+// the profiler's memory budget is under pressure. The blocks taken from
+// malloc are charged to a component of the budget: they are never refused,
+// the objects they hold being needed.
+//
+// Pools live as long as the process (thread caches flush into them when
+// their thread exits): create them with new and never delete them.
+//
+// The depot lock is not held across fork(), since blocks are freed under
+// other fork-protected locks: the child resets its depots instead, leaking
+// the free blocks. Create pools before the objects whose fork handlers may
+// use them, so that the child resets them first.
+class BlockPool
+{
+public:
+  struct Stats
+  {
+    uint64_t heap_blocks;   // Taken from malloc and not given back.
+    uint64_t depot_blocks;  // Free, in the shared depot.
+  };
+
+  // At most kMaxPools pools per process.
+  static const size_t kMaxPools = 8;
+
+  BlockPool(size_t block_size, size_t max_depot_blocks,
+            MemoryComponent component);
+
+  BlockPool(const BlockPool&) = delete;
+  BlockPool& operator=(const BlockPool&) = delete;
+
+  // Returns nullptr when out of memory.
+  void* Allocate();
+  void Free(void* block);
+
+  size_t block_size() const { return block_size_; }
+  Stats stats();
+
+private:
+  // The first block of a batch in the depot also links the batches.
+  struct FreeBlock
+  {
+    FreeBlock* next;
+    FreeBlock* next_batch;
+    size_t count;
+  };
+
+  struct ThreadCache;
+
+  // Blocks moved at once between a thread cache and the depot.
+  static const size_t kBatchSize = 32;
+
+  ThreadCache& LocalCache();
+  void Refill(ThreadCache& cache);
+  void Drain(ThreadCache& cache, size_t keep);
+
+  void Lock();
+  void Unlock();
+
+  static void ChildAfterFork();
+
+  size_t block_size_;
+  size_t max_depot_batches_;
+  MemoryComponent component_;
+  size_t index_;
+
+  std::atomic_flag lock_ = ATOMIC_FLAG_INIT;
+  FreeBlock* depot_ = nullptr;
+  size_t depot_batches_ = 0;
+  size_t depot_blocks_ = 0;
+
+  // Only counted on the slow paths.
+  std::atomic<uint64_t> heap_allocations_{0};
+  std::atomic<uint64_t> heap_frees_{0};
+};
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_BLOCK_POOL_H_
@@ -0,0 +1,287 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-base/control_server.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "microservice-profile-base/fork_restart.h"
+#include "microservice-profile-base/thread_filter.h"
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+const size_t kMaxRequestSize = 4096;
+
+struct ControlCommand
+{
+  std::string name;
+  std::string help;
+  ControlCommandHandler handler;
+};
+
+std::mutex server_mutex;
+std::vector<ControlCommand> commands;
+bool server_started = false;
+bool server_disabled = false;
+int listen_fd = -1;
+
+void HelpCommand(const std::string&, std::string* output)
+{
+  std::lock_guard<std::mutex> guard(server_mutex);
+  for (const auto& command : commands)
+    *output += command.name + "\t" + command.help + "\n";
+}
+
+bool AllowedPeer(int fd)
+{
+  struct ucred cred;
+  socklen_t size = sizeof(cred);
+
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &size) != 0)
+    return false;
+  return cred.uid == 0 || cred.uid == getuid();
+}
+
+void WriteAll(int fd, const std::string& data)
+{
+  size_t done = 0;
+
+  while (done < data.size())
+  {
+    ssize_t n = write(fd, data.data() + done, data.size() - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return;
+    done += n;
+  }
+}
+
+void ServeClient(int fd)
+{
+  char request[kMaxRequestSize];
+  size_t size = 0;
+  struct timeval timeout = {1, 0};
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  while (size < sizeof(request) - 1)
+  {
+    ssize_t n = read(fd, request + size, sizeof(request) - 1 - size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    size += n;
+    if (memchr(request, '\n', size) != nullptr)
+      break;
+  }
+  request[size] = '\0';
+  request[strcspn(request, "\r\n")] = '\0';
+
+  std::string line(request);
+  size_t space = line.find(' ');
+  std::string name = line.substr(0, space);
+  std::string args = space == std::string::npos ? "" : line.substr(space + 1);
+
+  // Handlers run without the lock: they may take their own.
+  ControlCommandHandler handler;
+  {
+    std::lock_guard<std::mutex> guard(server_mutex);
+    for (const auto& command : commands)
+    {
+      if (command.name == name)
+        handler = command.handler;
+    }
+  }
+
+  std::string output;
+  if (handler)
+    handler(args, &output);
+  else
+    output = "unknown command: " + name + "\n";
+  WriteAll(fd, output);
+}
+
+void ServerThread(int fd)
+{
+  MarkProfilerThread();
+
+  for (;;)
+  {
+    int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client < 0)
+    {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      break;
+    }
+    if (AllowedPeer(client))
+      ServeClient(client);
+    close(client);
+  }
+}
+
+int OpenSocket()
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  // Abstract namespace: leading null byte, not null-terminated.
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  int len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1,
+                     "microservice-profile.%d", getpid());
+  socklen_t addr_size = offsetof(struct sockaddr_un, sun_path) + 1 + len;
+
+  if (bind(fd, (struct sockaddr*) &addr, addr_size) != 0 ||
+      listen(fd, 8) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Called with server_mutex held.
+bool LaunchServer()
+{
+  listen_fd = OpenSocket();
+  if (listen_fd < 0)
+  {
+    std::cerr << "Microservice-profiler: "
+              << "Unable to open the control socket: " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+
+  try
+  {
+    std::thread(ServerThread, listen_fd).detach();
+  }
+  catch (const std::system_error& e)
+  {
+    std::cerr << "Microservice-profiler: "
+              << "Unable to start the control server: " << e.what()
+              << std::endl;
+    close(listen_fd);
+    listen_fd = -1;
+    return false;
+  }
+  return true;
+}
+
+void PrepareFork()
+{
+  server_mutex.lock();
+}
+
+void ParentAfterFork()
+{
+  server_mutex.unlock();
+}
+
+void RelaunchServer()
+{
+  std::lock_guard<std::mutex> guard(server_mutex);
+  server_started = LaunchServer();
+}
+
+// The child listens on its own socket, from its first span; the parent's one
+// stays with the parent.
+void ChildAfterFork()
+{
+  server_mutex.unlock();
+  if (!server_started)
+    return;
+  if (listen_fd >= 0)
+    close(listen_fd);
+  listen_fd = -1;
+  DeferRestartAfterFork(RelaunchServer);
+}
+
+}  // namespace
+
+void RegisterControlCommand(const char* name, const char* help,
+                            ControlCommandHandler handler)
+{
+  {
+    std::lock_guard<std::mutex> guard(server_mutex);
+    bool found = false;
+
+    for (auto& command : commands)
+    {
+      if (command.name == name)
+      {
+        command.help = help;
+        command.handler = handler;
+        found = true;
+      }
+    }
+    if (!found)
+      commands.push_back({name, help, handler});
+  }
+  StartControlServer();
+}
+
+bool StartControlServer()
+{
+  std::lock_guard<std::mutex> guard(server_mutex);
+
+  if (server_started || server_disabled)
+    return server_started;
+
+  const char* control = getenv("MICROSERVICE_PROFILE_CONTROL");
+  if (control != nullptr && strcmp(control, "0") == 0)
+  {
+    server_disabled = true;
+    return false;
+  }
+
+  commands.push_back({"help", "list the commands", HelpCommand});
+  server_started = LaunchServer();
+  if (!server_started)
+  {
+    server_disabled = true;
+    return false;
+  }
+
+  pthread_atfork(PrepareFork, ParentAfterFork, ChildAfterFork);
+  return true;
+}
+
+}  // namespace microservice_profile
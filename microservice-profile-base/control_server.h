@@ -0,0 +1,44 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_CONTROL_SERVER_H_
+#define MICROSERVICE_PROFILE_CONTROL_SERVER_H_
+
+#include <functional>
+#include <string>
+
+namespace microservice_profile
+{
+
+// Local control and stats interface: a unix socket in the abstract namespace,
+// "microservice-profile.<pid>", accepting one command line per connection
+// ("<command> [args]\n") and answering with text before closing. Only
+// clients with the same uid as the process, or root, are served.
+
+typedef std::function<void(const std::string& args, std::string* output)>
+    ControlCommandHandler;
+
+// Adds a command and starts the server if needed. A command registered twice
+// keeps its last handler.
+void RegisterControlCommand(const char* name, const char* help,
+                            ControlCommandHandler handler);
+
+// Starts the server thread unless MICROSERVICE_PROFILE_CONTROL=0. Returns
+// true if it is running. Restarted automatically in forked children.
+bool StartControlServer();
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_CONTROL_SERVER_H_
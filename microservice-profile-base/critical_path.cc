@@ -0,0 +1,297 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-base/critical_path.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "microservice-profile-base/control_server.h"
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+struct SyscallClass
+{
+  const char* name;
+  SyscallCategory category;
+};
+
+// Sorted by name for bsearch(). read/write and friends are counted as io:
+// the records do not tell whether they target a file, a socket or a pipe.
+const SyscallClass kSyscallClasses[] = {
+    {"accept", kSyscallNetwork},
+    {"accept4", kSyscallNetwork},
+    {"access", kSyscallFilesystem},
+    {"bind", kSyscallNetwork},
+    {"clock_nanosleep", kSyscallSleep},
+    {"close", kSyscallIo},
+    {"connect", kSyscallNetwork},
+    {"epoll_pwait", kSyscallNetwork},
+    {"epoll_pwait2", kSyscallNetwork},
+    {"epoll_wait", kSyscallNetwork},
+    {"faccessat", kSyscallFilesystem},
+    {"fdatasync", kSyscallFilesystem},
+    {"fstat", kSyscallFilesystem},
+    {"fsync", kSyscallFilesystem},
+    {"ftruncate", kSyscallFilesystem},
+    {"futex", kSyscallFutex},
+    {"futex_waitv", kSyscallFutex},
+    {"getdents64", kSyscallFilesystem},
+    {"getsockopt", kSyscallNetwork},
+    {"listen", kSyscallNetwork},
+    {"lseek", kSyscallFilesystem},
+    {"lstat", kSyscallFilesystem},
+    {"mkdir", kSyscallFilesystem},
+    {"mkdirat", kSyscallFilesystem},
+    {"nanosleep", kSyscallSleep},
+    {"newfstatat", kSyscallFilesystem},
+    {"open", kSyscallFilesystem},
+    {"openat", kSyscallFilesystem},
+    {"pause", kSyscallSleep},
+    {"poll", kSyscallNetwork},
+    {"ppoll", kSyscallNetwork},
+    {"pread64", kSyscallFilesystem},
+    {"preadv", kSyscallFilesystem},
+    {"pselect6", kSyscallNetwork},
+    {"pwrite64", kSyscallFilesystem},
+    {"pwritev", kSyscallFilesystem},
+    {"read", kSyscallIo},
+    {"readlink", kSyscallFilesystem},
+    {"readv", kSyscallIo},
+    {"recvfrom", kSyscallNetwork},
+    {"recvmmsg", kSyscallNetwork},
+    {"recvmsg", kSyscallNetwork},
+    {"rename", kSyscallFilesystem},
+    {"renameat2", kSyscallFilesystem},
+    {"sched_yield", kSyscallSleep},
+    {"select", kSyscallNetwork},
+    {"sendfile", kSyscallIo},
+    {"sendmmsg", kSyscallNetwork},
+    {"sendmsg", kSyscallNetwork},
+    {"sendto", kSyscallNetwork},
+    {"setsockopt", kSyscallNetwork},
+    {"shutdown", kSyscallNetwork},
+    {"socket", kSyscallNetwork},
+    {"stat", kSyscallFilesystem},
+    {"statx", kSyscallFilesystem},
+    {"truncate", kSyscallFilesystem},
+    {"unlink", kSyscallFilesystem},
+    {"unlinkat", kSyscallFilesystem},
+    {"write", kSyscallIo},
+    {"writev", kSyscallIo},
+};
+
+struct SyscallKey
+{
+  const char* name;
+  size_t size;
+};
+
+int CompareSyscall(const void* key, const void* element)
+{
+  const SyscallKey* k = static_cast<const SyscallKey*>(key);
+  const char* name = static_cast<const SyscallClass*>(element)->name;
+  int rc = strncmp(k->name, name, k->size);
+
+  if (rc == 0 && name[k->size] != '\0')
+    return -1;
+  return rc;
+}
+
+void CriticalPathCommand(const std::string&, std::string* output)
+{
+  FormatCriticalPathHeader(output);
+  GetCriticalPathAggregates().ForEach(
+      [&](const std::string& endpoint,
+          const CriticalPathAggregates::Totals& totals) {
+        FormatCriticalPathTotals(endpoint, totals, output);
+      });
+}
+
+}  // namespace
+
+const char* SyscallCategoryName(SyscallCategory category)
+{
+  switch (category)
+  {
+    case kSyscallNetwork:
+      return "net";
+    case kSyscallFilesystem:
+      return "fs";
+    case kSyscallIo:
+      return "io";
+    case kSyscallFutex:
+      return "futex";
+    case kSyscallSleep:
+      return "sleep";
+    default:
+      return "other";
+  }
+}
+
+SyscallCategory ClassifySyscall(const char* name, size_t size)
+{
+  SyscallKey key = {name, strnlen(name, size)};
+  const void* found = bsearch(
+      &key, kSyscallClasses, sizeof(kSyscallClasses) / sizeof(kSyscallClasses[0]),
+      sizeof(kSyscallClasses[0]), CompareSyscall);
+
+  if (found == nullptr)
+    return kSyscallOther;
+  return static_cast<const SyscallClass*>(found)->category;
+}
+
+int CriticalPathBreakdown::Dominant() const
+{
+  int dominant = kSyscallCategories;
+  uint64_t max = user_ns;
+
+  for (int i = 0; i < kSyscallCategories; ++i)
+  {
+    if (syscall_ns[i] > max)
+    {
+      max = syscall_ns[i];
+      dominant = i;
+    }
+  }
+  return dominant;
+}
+
+void CriticalPathAnalyzer::Reset()
+{
+  breakdown_ = CriticalPathBreakdown();
+  first_start_ = last_end_ = 0;
+  empty_ = true;
+}
+
+void CriticalPathAnalyzer::AddSyscall(const char* name, size_t name_size,
+                                      uint64_t start_ns, uint64_t end_ns)
+{
+  SyscallCategory category = ClassifySyscall(name, name_size);
+
+  if (end_ns < start_ns)
+    end_ns = start_ns;
+
+  if (empty_)
+  {
+    first_start_ = last_end_ = start_ns;
+    empty_ = false;
+  }
+
+  if (start_ns > last_end_)
+  {
+    breakdown_.user_ns += start_ns - last_end_;
+    last_end_ = start_ns;
+  }
+  if (end_ns > last_end_)
+  {
+    breakdown_.syscall_ns[category] += end_ns - last_end_;
+    last_end_ = end_ns;
+  }
+  breakdown_.syscall_count[category]++;
+  breakdown_.wall_ns = last_end_ - first_start_;
+}
+
+void CriticalPathAggregates::Totals::Add(
+    const CriticalPathBreakdown& breakdown)
+{
+  spans++;
+  sum.wall_ns += breakdown.wall_ns;
+  sum.user_ns += breakdown.user_ns;
+  for (int i = 0; i < kSyscallCategories; ++i)
+  {
+    sum.syscall_ns[i] += breakdown.syscall_ns[i];
+    sum.syscall_count[i] += breakdown.syscall_count[i];
+  }
+}
+
+void CriticalPathAggregates::Totals::Merge(const Totals& other)
+{
+  spans += other.spans;
+  sum.wall_ns += other.sum.wall_ns;
+  sum.user_ns += other.sum.user_ns;
+  for (int i = 0; i < kSyscallCategories; ++i)
+  {
+    sum.syscall_ns[i] += other.sum.syscall_ns[i];
+    sum.syscall_count[i] += other.sum.syscall_count[i];
+  }
+}
+
+CriticalPathAggregates::CriticalPathAggregates(uint64_t window_ns,
+                                               size_t max_endpoints)
+    : windows_(window_ns, max_endpoints)
+{
+}
+
+void CriticalPathAggregates::Add(const char* endpoint, size_t endpoint_size,
+                                 const CriticalPathBreakdown& breakdown)
+{
+  windows_.Update(endpoint, endpoint_size,
+                  [&](Totals& totals) { totals.Add(breakdown); });
+}
+
+void CriticalPathAggregates::ForEach(const Visitor& visitor)
+{
+  windows_.ForEach(visitor);
+}
+
+void FormatCriticalPathHeader(std::string* output)
+{
+  *output += "# wall_us: from the first syscall of each span to its last, not"
+             " the span's duration\n";
+  *output += "endpoint\tspans\twall_us\tuser_us\tnet_us\tfs_us\tio_us"
+             "\tfutex_us\tsleep_us\tother_us\n";
+}
+
+void FormatCriticalPathTotals(const std::string& endpoint,
+                              const CriticalPathAggregates::Totals& totals,
+                              std::string* output)
+{
+  const CriticalPathBreakdown& sum = totals.sum;
+  char line[256];
+
+  snprintf(line, sizeof(line),
+           "\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\n",
+           (unsigned long) totals.spans,
+           (unsigned long) sum.wall_ns / 1000,
+           (unsigned long) sum.user_ns / 1000,
+           (unsigned long) sum.syscall_ns[kSyscallNetwork] / 1000,
+           (unsigned long) sum.syscall_ns[kSyscallFilesystem] / 1000,
+           (unsigned long) sum.syscall_ns[kSyscallIo] / 1000,
+           (unsigned long) sum.syscall_ns[kSyscallFutex] / 1000,
+           (unsigned long) sum.syscall_ns[kSyscallSleep] / 1000,
+           (unsigned long) sum.syscall_ns[kSyscallOther] / 1000);
+  *output += endpoint + line;
+}
+
+CriticalPathAggregates& GetCriticalPathAggregates()
+{
+  static CriticalPathAggregates aggregates;
+  return aggregates;
+}
+
+void RegisterCriticalPathCommands()
+{
+  RegisterControlCommand("critical-path",
+                         "time per syscall category and endpoint, last 1-2 min",
+                         CriticalPathCommand);
+}
+
+}  // namespace microservice_profile
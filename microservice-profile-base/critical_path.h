@@ -0,0 +1,121 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_CRITICAL_PATH_H_
+#define MICROSERVICE_PROFILE_CRITICAL_PATH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include "microservice-profile-base/rolling_aggregates.h"
+
+namespace microservice_profile
+{
+
+enum SyscallCategory
+{
+  kSyscallNetwork,
+  kSyscallFilesystem,
+  kSyscallIo,  // On any kind of file descriptor.
+  kSyscallFutex,
+  kSyscallSleep,
+  kSyscallOther,
+  kSyscallCategories,
+};
+
+// Short name of a category ("net", "fs", "io", "futex", "sleep", "other").
+const char* SyscallCategoryName(SyscallCategory category);
+
+// Classifies a syscall by name. name need not be null-terminated.
+SyscallCategory ClassifySyscall(const char* name, size_t size);
+
+// Where the wall time of an annotated span went, from its first syscall to
+// its last one.
+struct CriticalPathBreakdown
+{
+  uint64_t wall_ns = 0;
+  uint64_t user_ns = 0;  // Gaps between syscalls.
+  uint64_t syscall_ns[kSyscallCategories] = {};
+  uint32_t syscall_count[kSyscallCategories] = {};
+
+  // The category, or user space (kSyscallCategories), with the most time.
+  int Dominant() const;
+};
+
+// Builds a breakdown incrementally from the syscalls of one span, in start
+// order. Overlapping syscalls are only counted once.
+class CriticalPathAnalyzer
+{
+public:
+  void Reset();
+  void AddSyscall(const char* name, size_t name_size, uint64_t start_ns,
+                  uint64_t end_ns);
+  const CriticalPathBreakdown& breakdown() const { return breakdown_; }
+
+private:
+  CriticalPathBreakdown breakdown_;
+  uint64_t first_start_ = 0;
+  uint64_t last_end_ = 0;
+  bool empty_ = true;
+};
+
+// Per-endpoint breakdowns over a rolling window (see RollingAggregates).
+// Thread-safe.
+class CriticalPathAggregates
+{
+public:
+  struct Totals
+  {
+    uint64_t spans = 0;
+    CriticalPathBreakdown sum;
+
+    // Counts one more span.
+    void Add(const CriticalPathBreakdown& breakdown);
+    void Merge(const Totals& other);
+  };
+
+  typedef RollingAggregates<Totals>::Visitor Visitor;
+
+  explicit CriticalPathAggregates(uint64_t window_ns = 60000000000ULL,
+                                  size_t max_endpoints = 1024);
+
+  void Add(const char* endpoint, size_t endpoint_size,
+           const CriticalPathBreakdown& breakdown);
+
+  // Calls visitor with the totals of the current and previous windows.
+  void ForEach(const Visitor& visitor);
+
+private:
+  RollingAggregates<Totals> windows_;
+};
+
+// The columns of the "critical-path" command, after a comment line saying
+// what wall_us covers, then one line per endpoint.
+void FormatCriticalPathHeader(std::string* output);
+void FormatCriticalPathTotals(const std::string& endpoint,
+                              const CriticalPathAggregates::Totals& totals,
+                              std::string* output);
+
+// The aggregates fed by the profiler's relay readers.
+CriticalPathAggregates& GetCriticalPathAggregates();
+
+// Adds the "critical-path" control command, dumping the aggregates.
+void RegisterCriticalPathCommands();
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_CRITICAL_PATH_H_
@@ -0,0 +1,364 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-base/differential_profile.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "microservice-profile-base/get_monotonic_time.h"
+#include "microservice-profile-base/memory_budget.h"
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+// Features whose decayed counts fall below this in both groups are
+// forgotten.
+const double kNegligibleCount = 0.05;
+
+// Charged to the memory budget for a hash table node besides its key and
+// value.
+const size_t kNodeOverhead = 32;
+
+struct Ranked
+{
+  std::string key;
+  double score;  // Ranks the features; those at or below 0 are left out.
+  double z;
+  double ratio;
+  double slow;
+  double fast;
+  double slow_ns;
+  double fast_ns;
+};
+
+// Two-proportion z-test: is a/total_a above b/total_b?
+double ProportionZ(double a, double total_a, double b, double total_b)
+{
+  double pooled = (a + b) / (total_a + total_b);
+  double variance = pooled * (1 - pooled) * (1 / total_a + 1 / total_b);
+  if (variance <= 0)
+    return 0;
+  return (a / total_a - b / total_b) / sqrt(variance);
+}
+
+// Poisson rates per span: is a per span of the first group above b per span
+// of the second?
+double RateZ(double a, double spans_a, double b, double spans_b)
+{
+  double rate_a = a / spans_a;
+  double rate_b = b / spans_b;
+  double variance = rate_a / spans_a + rate_b / spans_b;
+  if (variance <= 0)
+    return 0;
+  return (rate_a - rate_b) / sqrt(variance);
+}
+
+void SortAndTruncate(std::vector<Ranked>* ranked, size_t top)
+{
+  ranked->erase(std::remove_if(ranked->begin(), ranked->end(),
+                               [](const Ranked& a) { return a.score <= 0; }),
+                ranked->end());
+  std::sort(ranked->begin(), ranked->end(),
+            [](const Ranked& a, const Ranked& b) { return a.score > b.score; });
+  if (ranked->size() > top)
+    ranked->resize(top);
+}
+
+}  // namespace
+
+DifferentialProfile::DifferentialProfile(const Options& options)
+    : options_(options), nb_endpoints_(0)
+{
+}
+
+DifferentialProfile::Stripe& DifferentialProfile::StripeOf(
+    const std::string& endpoint)
+{
+  return stripes_[std::hash<std::string>()(endpoint) % kStripes];
+}
+
+DifferentialProfile::Endpoint* DifferentialProfile::Find(
+    Stripe& stripe, const std::string& name, uint64_t now)
+{
+  auto it = stripe.endpoints.find(name);
+  if (it == stripe.endpoints.end())
+  {
+    if (nb_endpoints_.fetch_add(1, std::memory_order_relaxed) >=
+        options_.max_endpoints)
+    {
+      nb_endpoints_.fetch_sub(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    if (!ReserveMemory(kMemoryStackTables, EndpointFootprint(name)))
+    {
+      nb_endpoints_.fetch_sub(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    it = stripe.endpoints.emplace(name, Endpoint()).first;
+    it->second.last_decay = now;
+  }
+
+  // A few steps per half-life keep the decay smooth.
+  if (now - it->second.last_decay >= options_.half_life_ns / 8)
+    Decay(it->second, now);
+  return &it->second;
+}
+
+size_t DifferentialProfile::EndpointFootprint(const std::string& name)
+{
+  return kNodeOverhead + sizeof(std::string) + sizeof(Endpoint) + name.size();
+}
+
+size_t DifferentialProfile::FeatureFootprint(const std::string& key)
+{
+  return kNodeOverhead + sizeof(std::string) + sizeof(Counts) + key.size();
+}
+
+void DifferentialProfile::Decay(Endpoint& endpoint, uint64_t now)
+{
+  double factor =
+      pow(0.5, (double) (now - endpoint.last_decay) / options_.half_life_ns);
+  endpoint.last_decay = now;
+
+  for (int group = 0; group < kGroups; group++)
+  {
+    endpoint.spans[group] *= factor;
+    endpoint.samples[group] *= factor;
+    endpoint.annotated[group] *= factor;
+  }
+  for (auto it = endpoint.features.begin(); it != endpoint.features.end();)
+  {
+    Counts& counts = it->second;
+    for (int group = 0; group < kGroups; group++)
+    {
+      counts.count[group] *= factor;
+      counts.ns[group] *= factor;
+    }
+    if (counts.count[kFast] < kNegligibleCount &&
+        counts.count[kSlow] < kNegligibleCount)
+    {
+      ReleaseMemory(kMemoryStackTables, FeatureFootprint(it->first));
+      it = endpoint.features.erase(it);
+    }
+    else
+      ++it;
+  }
+}
+
+DifferentialProfile::Counts* DifferentialProfile::Feature(
+    Endpoint& endpoint, const std::string& key)
+{
+  auto it = endpoint.features.find(key);
+  if (it != endpoint.features.end())
+    return &it->second;
+  if (endpoint.features.size() >= options_.max_features ||
+      !ReserveMemory(kMemoryStackTables, FeatureFootprint(key)))
+  {
+    endpoint.dropped++;
+    return nullptr;
+  }
+  return &endpoint.features[key];
+}
+
+void DifferentialProfile::AddSpan(const char* endpoint, size_t endpoint_size,
+                                  Group group, const StackSample* samples,
+                                  size_t nb_samples, double weight)
+{
+  std::string name(endpoint, endpoint_size);
+  std::string key;
+  Stripe& stripe = StripeOf(name);
+  std::lock_guard<std::mutex> guard(stripe.mutex);
+
+  Endpoint* entry = Find(stripe, name, GetMonotonicTime());
+  if (entry == nullptr)
+    return;
+
+  entry->spans[group]++;
+  for (size_t i = 0; i < nb_samples; i++)
+  {
+    key.assign(1, 's');
+    key.append(reinterpret_cast<const char*>(samples[i].frames),
+               samples[i].depth * sizeof(uintptr_t));
+    entry->samples[group] += weight;
+    Counts* counts = Feature(*entry, key);
+    if (counts != nullptr)
+      counts->count[group] += weight;
+  }
+}
+
+void DifferentialProfile::AddSyscalls(const char* endpoint,
+                                      size_t endpoint_size, Group group,
+                                      uint32_t nb_syscalls,
+                                      const struct syscall_desc* syscalls)
+{
+  std::string name(endpoint, endpoint_size);
+  std::string key;
+  Stripe& stripe = StripeOf(name);
+  std::lock_guard<std::mutex> guard(stripe.mutex);
+
+  Endpoint* entry = Find(stripe, name, GetMonotonicTime());
+  if (entry == nullptr)
+    return;
+
+  entry->annotated[group]++;
+  for (uint32_t i = 0; i < nb_syscalls; i++)
+  {
+    key.assign(1, 'y');
+    key.append(syscalls[i].name,
+               strnlen(syscalls[i].name, SYSCALL_NAME_MAX_SIZE));
+    Counts* counts = Feature(*entry, key);
+    if (counts == nullptr)
+      continue;
+    counts->count[group]++;
+    if (syscalls[i].end_steady > syscalls[i].start_steady)
+      counts->ns[group] += syscalls[i].end_steady - syscalls[i].start_steady;
+  }
+}
+
+void DifferentialProfile::Report(const std::string& name, size_t top,
+                                 std::string* output)
+{
+  std::vector<Ranked> stacks, syscalls;
+  Endpoint endpoint;
+  Stripe& stripe = StripeOf(name);
+
+  {
+    std::lock_guard<std::mutex> guard(stripe.mutex);
+    auto it = stripe.endpoints.find(name);
+    if (it == stripe.endpoints.end())
+    {
+      *output += "unknown endpoint: " + name + "\n";
+      return;
+    }
+    Decay(it->second, GetMonotonicTime());
+    endpoint = it->second;
+  }
+
+  char line[256];
+  snprintf(line, sizeof(line),
+           "spans slow=%.1f fast=%.1f samples slow=%.1f fast=%.1f "
+           "annotated slow=%.1f fast=%.1f dropped=%lu\n",
+           endpoint.spans[kSlow], endpoint.spans[kFast],
+           endpoint.samples[kSlow], endpoint.samples[kFast],
+           endpoint.annotated[kSlow], endpoint.annotated[kFast],
+           (unsigned long) endpoint.dropped);
+  *output += line;
+
+  // Smoothed, so that a feature absent from one group has a finite ratio.
+  for (const auto& feature : endpoint.features)
+  {
+    const Counts& counts = feature.second;
+    Ranked ranked;
+    ranked.key = feature.first.substr(1);
+    ranked.slow = counts.count[kSlow];
+    ranked.fast = counts.count[kFast];
+    ranked.slow_ns = counts.ns[kSlow];
+    ranked.fast_ns = counts.ns[kFast];
+
+    if (feature.first[0] == 's')
+    {
+      if (endpoint.samples[kSlow] <= 0 || endpoint.samples[kFast] <= 0)
+        continue;
+      ranked.z = ProportionZ(ranked.slow, endpoint.samples[kSlow],
+                             ranked.fast, endpoint.samples[kFast]);
+      ranked.ratio = ((ranked.slow + 0.5) / (endpoint.samples[kSlow] + 1)) /
+                     ((ranked.fast + 0.5) / (endpoint.samples[kFast] + 1));
+      ranked.score = ranked.z;
+      stacks.push_back(std::move(ranked));
+    }
+    else
+    {
+      if (endpoint.annotated[kSlow] <= 0 || endpoint.annotated[kFast] <= 0)
+        continue;
+      ranked.z = RateZ(ranked.slow, endpoint.annotated[kSlow], ranked.fast,
+                       endpoint.annotated[kFast]);
+      ranked.ratio =
+          ((ranked.slow_ns + 1) / endpoint.annotated[kSlow]) /
+          ((ranked.fast_ns + 1) / endpoint.annotated[kFast]);
+      // A syscall slower in the slow spans matters as much as one made more
+      // often: both are time the slow spans spend in it.
+      ranked.score = ranked.slow_ns / endpoint.annotated[kSlow] -
+                     ranked.fast_ns / endpoint.annotated[kFast];
+      syscalls.push_back(std::move(ranked));
+    }
+  }
+
+  if (endpoint.samples[kSlow] <= 0 || endpoint.samples[kFast] <= 0)
+    *output += "stacks: no samples in one of the groups\n";
+  SortAndTruncate(&stacks, top);
+  for (const Ranked& stack : stacks)
+  {
+    snprintf(line, sizeof(line),
+             "stack z=%.2f ratio=%.2f slow=%.1f fast=%.1f frames=", stack.z,
+             stack.ratio, stack.slow, stack.fast);
+    *output += line;
+    const uintptr_t* frames =
+        reinterpret_cast<const uintptr_t*>(stack.key.data());
+    size_t depth = stack.key.size() / sizeof(uintptr_t);
+    for (size_t i = 0; i < depth; i++)
+    {
+      snprintf(line, sizeof(line), "%s0x%lx", i > 0 ? "," : "",
+               (unsigned long) frames[i]);
+      *output += line;
+    }
+    *output += "\n";
+  }
+
+  if (endpoint.annotated[kSlow] <= 0 || endpoint.annotated[kFast] <= 0)
+    *output += "syscalls: no kernel records in one of the groups\n";
+  SortAndTruncate(&syscalls, top);
+  for (const Ranked& syscall : syscalls)
+  {
+    snprintf(line, sizeof(line),
+             "syscall z=%.2f time_ratio=%.2f calls_per_span slow=%.2f "
+             "fast=%.2f us_per_span slow=%.1f fast=%.1f name=",
+             syscall.z, syscall.ratio,
+             syscall.slow / endpoint.annotated[kSlow],
+             syscall.fast / endpoint.annotated[kFast],
+             syscall.slow_ns / endpoint.annotated[kSlow] / 1000,
+             syscall.fast_ns / endpoint.annotated[kFast] / 1000);
+    *output += line;
+    *output += syscall.key;
+    *output += "\n";
+  }
+}
+
+void DifferentialProfile::ReportEndpoints(std::string* output)
+{
+  char line[128];
+
+  for (Stripe& stripe : stripes_)
+  {
+    std::lock_guard<std::mutex> guard(stripe.mutex);
+    for (const auto& endpoint : stripe.endpoints)
+    {
+      snprintf(line, sizeof(line), "slow=%.1f fast=%.1f endpoint=",
+               endpoint.second.spans[kSlow], endpoint.second.spans[kFast]);
+      *output += line;
+      *output += endpoint.first;
+      *output += "\n";
+    }
+  }
+}
+
+}  // namespace microservice_profile
@@ -0,0 +1,131 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_DIFFERENTIAL_PROFILE_H_
+#define MICROSERVICE_PROFILE_DIFFERENTIAL_PROFILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "microservice-profile-base/module_abi.h"
+
+namespace microservice_profile
+{
+
+// The CPU stack samples and the syscalls of the slow and fast spans of each
+// endpoint, kept apart so that what the slow spans do more than the fast
+// ones can be ranked at any time. The totals are updated as the spans end,
+// and halve every half-life, so that a report reflects the recent spans and
+// costs no more than a sort. Thread-safe: striped by endpoint.
+class DifferentialProfile
+{
+public:
+  enum Group
+  {
+    kFast,
+    kSlow,
+    kGroups,
+  };
+
+  struct Options
+  {
+    size_t max_endpoints = 256;
+    size_t max_features = 4096;  // Stacks and syscalls, per endpoint.
+    uint64_t half_life_ns = 300000000000ULL;  // 5 min
+  };
+
+  struct StackSample
+  {
+    const uintptr_t* frames;  // Innermost first.
+    size_t depth;
+  };
+
+  explicit DifferentialProfile(const Options& options);
+
+  DifferentialProfile(const DifferentialProfile&) = delete;
+  DifferentialProfile& operator=(const DifferentialProfile&) = delete;
+
+  // An ended span and stacks sampled while it ran, each standing for
+  // `weight` samples when only some of them were kept.
+  void AddSpan(const char* endpoint, size_t endpoint_size, Group group,
+               const StackSample* samples, size_t nb_samples, double weight);
+
+  // The syscalls of an ended span, recorded by the kernel module.
+  void AddSyscalls(const char* endpoint, size_t endpoint_size, Group group,
+                   uint32_t nb_syscalls, const struct syscall_desc* syscalls);
+
+  // The `top` stacks most over-represented in the slow spans of an
+  // endpoint, by decreasing z-score, and the `top` syscalls taking the most
+  // extra time per slow span.
+  void Report(const std::string& endpoint, size_t top, std::string* output);
+
+  // The endpoints and their number of spans per group.
+  void ReportEndpoints(std::string* output);
+
+private:
+  static const size_t kStripes = 16;
+
+  // The counts are decayed, hence fractional.
+  struct Counts
+  {
+    double count[kGroups] = {};
+    double ns[kGroups] = {};  // Syscalls only.
+  };
+
+  struct Endpoint
+  {
+    double spans[kGroups] = {};
+    double samples[kGroups] = {};
+    double annotated[kGroups] = {};  // Spans with kernel records.
+    uint64_t last_decay = 0;
+    uint64_t dropped = 0;
+
+    // 's' and the frames for stacks, 'y' and the name for syscalls.
+    std::unordered_map<std::string, Counts> features;
+  };
+
+  struct Stripe
+  {
+    std::mutex mutex;
+    std::unordered_map<std::string, Endpoint> endpoints;
+  };
+
+  Stripe& StripeOf(const std::string& endpoint);
+
+  // Called with the stripe's mutex held; nullptr when the endpoint is new
+  // and there are too many.
+  Endpoint* Find(Stripe& stripe, const std::string& endpoint, uint64_t now);
+  void Decay(Endpoint& endpoint, uint64_t now);
+  Counts* Feature(Endpoint& endpoint, const std::string& key);
+
+  // Charged to the memory budget for each endpoint and feature.
+  static size_t EndpointFootprint(const std::string& name);
+  static size_t FeatureFootprint(const std::string& key);
+
+  Options options_;
+  Stripe stripes_[kStripes];
+
+  // Of all the stripes: the names do not spread evenly over them.
+  std::atomic<size_t> nb_endpoints_;
+};
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_DIFFERENTIAL_PROFILE_H_
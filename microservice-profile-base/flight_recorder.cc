@@ -0,0 +1,492 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-base/flight_recorder.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#include "microservice-profile-base/control_server.h"
+#include "microservice-profile-base/fork_restart.h"
+#include "microservice-profile-base/get_monotonic_time.h"
+#include "microservice-profile-base/memory_budget.h"
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+const size_t kHeaderSize = 4096;
+const size_t kMaxEntrySlots = 64;
+const uint64_t kMinSnapshotIntervalNs = 10000000000ULL;  // 10 s
+const size_t kSnapshotChunkSlots = 4096;
+
+struct FlightSlot
+{
+  std::atomic<uint64_t> seq;  // Position + 1 once complete, 0 while written.
+  uint16_t type;
+  uint16_t parts;  // Slots taken by the entry.
+  uint16_t part;   // Index of this slot in the entry.
+  uint16_t used;   // Payload bytes used in this slot.
+  uint8_t payload[kFlightSlotSize - 16];
+};
+
+static_assert(sizeof(FlightSlot) == kFlightSlotSize, "slot size");
+
+const size_t kSlotPayload = sizeof(FlightSlot::payload);
+
+// Starts the payload of the first slot of each entry.
+struct FlightEntryHeader
+{
+  uint64_t time;
+  uint32_t tid;
+  uint32_t size;
+};
+
+std::atomic<FlightRecorderHeader*> recorder(nullptr);
+FlightSlot* slots = nullptr;
+size_t mapping_size = 0;
+std::string path_template;
+std::string ring_path;
+
+// The size of the parent's ring, in a child that has not made its own yet.
+size_t child_slot_count = 0;
+
+std::mutex snapshot_mutex;
+uint64_t last_snapshot = 0;
+unsigned snapshot_count = 0;
+
+// Initial-exec TLS is safe to touch from a signal handler.
+__thread uint32_t cached_tid __attribute__((tls_model("initial-exec")));
+
+uint32_t Tid()
+{
+  if (cached_tid == 0)
+    cached_tid = syscall(SYS_gettid);
+  return cached_tid;
+}
+
+uint64_t GetRealtime()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+std::string ExpandPath(const std::string& pattern)
+{
+  std::string path;
+
+  for (size_t i = 0; i < pattern.size(); ++i)
+  {
+    if (pattern[i] == '%' && i + 1 < pattern.size() && pattern[i + 1] == 'p')
+    {
+      path += std::to_string(getpid());
+      ++i;
+    }
+    else
+    {
+      path += pattern[i];
+    }
+  }
+  return path;
+}
+
+// Keeps the ring of a process that died without closing it.
+void PreserveCrashedRing(const std::string& path)
+{
+  FlightRecorderHeader header;
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0)
+    return;
+  ssize_t n = pread(fd, &header, sizeof(header), 0);
+  close(fd);
+
+  if (n != sizeof(header) || header.magic != kFlightRecorderMagic ||
+      header.state != kFlightRunning || header.pid == getpid())
+    return;
+
+  std::string crashed = path + ".crashed-" + std::to_string(header.pid);
+  if (rename(path.c_str(), crashed.c_str()) == 0)
+    std::cerr << "Microservice-profiler: flight recorder of a dead process "
+              << "kept in " << crashed << std::endl;
+}
+
+bool MapRing(const std::string& path, size_t slot_count)
+{
+  PreserveCrashedRing(path);
+
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+  {
+    std::cerr << "Couldn't open the flight recorder: " << path << std::endl;
+    return false;
+  }
+
+  size_t size = kHeaderSize + slot_count * kFlightSlotSize;
+  void* data = MAP_FAILED;
+  if (ftruncate(fd, size) == 0)
+    data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+  {
+    std::cerr << "Couldn't map the flight recorder: " << strerror(errno)
+              << std::endl;
+    unlink(path.c_str());
+    return false;
+  }
+
+  FlightRecorderHeader* header = new (data) FlightRecorderHeader();
+  header->magic = kFlightRecorderMagic;
+  header->version = kFlightRecorderVersion;
+  header->slot_size = kFlightSlotSize;
+  header->state = kFlightRunning;
+  header->slots = slot_count;
+  header->pid = getpid();
+  header->realtime_base = GetRealtime();
+  header->monotonic_base = GetMonotonicTime();
+  header->head.store(0, std::memory_order_relaxed);
+
+  slots = reinterpret_cast<FlightSlot*>(static_cast<char*>(data) + kHeaderSize);
+  mapping_size = size;
+  ring_path = path;
+  recorder.store(header, std::memory_order_release);
+  return true;
+}
+
+// The child's ring takes over the reservation of the parent's.
+void MapChildRing()
+{
+  std::string path = ExpandPath(path_template);
+  if (path == ring_path)
+    path += "." + std::to_string(getpid());
+  if (!MapRing(path, child_slot_count))
+    ReleaseMemory(kMemorySampleRings,
+                  kHeaderSize + child_slot_count * kFlightSlotSize);
+}
+
+void SnapshotCommand(const std::string& args, std::string* output)
+{
+  std::string path;
+
+  if (SnapshotFlightRecorder(args.empty() ? "control" : args.c_str(), true,
+                             &path))
+    *output += path + "\n";
+  else
+    *output += "no flight recorder\n";
+}
+
+// Checks the slots of the entry starting at pos.
+bool EntryComplete(const FlightSlot* ring, uint64_t slot_count, uint64_t pos,
+                   uint16_t parts)
+{
+  for (uint16_t part = 0; part < parts; ++part)
+  {
+    const FlightSlot& slot = ring[(pos + part) % slot_count];
+    if (slot.seq.load(std::memory_order_relaxed) != pos + part + 1 ||
+        slot.part != part || slot.parts != parts)
+      return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+bool StartFlightRecorder()
+{
+  const char* path = getenv("MICROSERVICE_PROFILE_FLIGHT_RECORDER");
+  const char* mb = getenv("MICROSERVICE_PROFILE_FLIGHT_RECORDER_MB");
+
+  if (path == nullptr || *path == '\0' || recorder.load() != nullptr)
+    return false;
+
+  size_t size = (mb ? strtoull(mb, nullptr, 10) : 64) << 20;
+  size_t wanted = std::max<size_t>(size / kFlightSlotSize, 2 * kMaxEntrySlots);
+
+  // A smaller ring rather than none when the memory budget is short.
+  size_t slot_count = ReserveMemoryUnits(kMemorySampleRings, kHeaderSize,
+                                         kFlightSlotSize, wanted,
+                                         2 * kMaxEntrySlots);
+  if (slot_count == 0)
+  {
+    std::cerr << "Microservice-profiler: no memory left in the budget for "
+              << "the flight recorder" << std::endl;
+    return false;
+  }
+  if (slot_count < wanted)
+    std::cerr << "Microservice-profiler: flight recorder reduced to "
+              << ((kHeaderSize + slot_count * kFlightSlotSize) >> 20)
+              << " MB by the memory budget" << std::endl;
+
+  path_template = path;
+  if (!MapRing(ExpandPath(path_template), slot_count))
+  {
+    ReleaseMemory(kMemorySampleRings, kHeaderSize + slot_count * kFlightSlotSize);
+    return false;
+  }
+
+  pthread_atfork(nullptr, nullptr, ResetFlightRecorderAfterFork);
+  atexit(StopFlightRecorder);
+  RegisterFlightRecorderCommands();
+  return true;
+}
+
+// The mapping is left in place: a signal handler may still be using it.
+void StopFlightRecorder()
+{
+  FlightRecorderHeader* header = recorder.exchange(nullptr);
+
+  if (header != nullptr)
+    header->state = kFlightClosed;
+}
+
+void ResetFlightRecorderAfterFork()
+{
+  FlightRecorderHeader* header = recorder.exchange(nullptr);
+
+  if (header == nullptr)
+    return;
+
+  // The parent's ring stays the parent's. The child's is made on its first
+  // span: a child that calls exec or exits right away leaves no file behind.
+  child_slot_count = header->slots;
+  munmap(header, mapping_size);
+  cached_tid = 0;
+  DeferRestartAfterFork(MapChildRing);
+}
+
+bool FlightRecorderEnabled()
+{
+  return recorder.load(std::memory_order_relaxed) != nullptr;
+}
+
+void FlightRecord(FlightEntryType type, const struct iovec* iov, int count)
+{
+  FlightRecorderHeader* header = recorder.load(std::memory_order_acquire);
+  if (header == nullptr)
+    return;
+
+  FlightEntryHeader entry = {GetMonotonicTime(), Tid(), 0};
+  for (int i = 0; i < count; ++i)
+    entry.size += iov[i].iov_len;
+
+  size_t total = std::min(sizeof(entry) + entry.size,
+                          kMaxEntrySlots * kSlotPayload);
+  entry.size = total - sizeof(entry);
+  uint16_t parts = (total + kSlotPayload - 1) / kSlotPayload;
+  uint64_t slot_count = header->slots;
+  uint64_t pos = header->head.fetch_add(parts, std::memory_order_relaxed);
+
+  for (uint16_t part = 0; part < parts; ++part)
+    slots[(pos + part) % slot_count].seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  // Scatter the entry header and the buffers over the slots.
+  size_t part = 0, offset = 0;
+  auto copy = [&](const uint8_t* data, size_t size) {
+    while (size > 0 && part < parts)
+    {
+      FlightSlot& slot = slots[(pos + part) % slot_count];
+      size_t n = std::min(size, kSlotPayload - offset);
+      memcpy(slot.payload + offset, data, n);
+      data += n;
+      size -= n;
+      offset += n;
+      if (offset == kSlotPayload)
+      {
+        part++;
+        offset = 0;
+      }
+    }
+  };
+  copy(reinterpret_cast<const uint8_t*>(&entry), sizeof(entry));
+  for (int i = 0; i < count; ++i)
+    copy(static_cast<const uint8_t*>(iov[i].iov_base), iov[i].iov_len);
+
+  for (uint16_t p = 0; p < parts; ++p)
+  {
+    FlightSlot& slot = slots[(pos + p) % slot_count];
+    slot.type = type;
+    slot.parts = parts;
+    slot.part = p;
+    slot.used = p + 1 < parts ? kSlotPayload : total - p * kSlotPayload;
+    slot.seq.store(pos + p + 1, std::memory_order_release);
+  }
+}
+
+bool SnapshotFlightRecorder(const char* reason, bool force,
+                            std::string* snapshot_path)
+{
+  std::lock_guard<std::mutex> guard(snapshot_mutex);
+  FlightRecorderHeader* header = recorder.load(std::memory_order_acquire);
+  uint64_t now = GetMonotonicTime();
+
+  if (header == nullptr)
+    return false;
+  if (!force && last_snapshot != 0 && now - last_snapshot < kMinSnapshotIntervalNs)
+    return false;
+  last_snapshot = now;
+
+  FlightRecord(kFlightMark, reason, strlen(reason));
+
+  std::string path = ring_path + ".snapshot-" + std::to_string(++snapshot_count);
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return false;
+
+  // Copy the ring chunk by chunk; slots rewritten during the copy are
+  // dropped from it.
+  std::vector<uint8_t> chunk(std::max(kHeaderSize,
+                                      kSnapshotChunkSlots * kFlightSlotSize));
+  bool ok = true;
+
+  memcpy(chunk.data(), header, kHeaderSize);
+  reinterpret_cast<FlightRecorderHeader*>(chunk.data())->state = kFlightClosed;
+  ok &= write(fd, chunk.data(), kHeaderSize) == (ssize_t) kHeaderSize;
+
+  for (uint64_t first = 0; ok && first < header->slots; first += kSnapshotChunkSlots)
+  {
+    size_t count = std::min<uint64_t>(kSnapshotChunkSlots, header->slots - first);
+    FlightSlot* copy = reinterpret_cast<FlightSlot*>(chunk.data());
+
+    memcpy((void*) copy, &slots[first], count * kFlightSlotSize);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    for (size_t i = 0; i < count; ++i)
+    {
+      if (slots[first + i].seq.load(std::memory_order_relaxed) !=
+          copy[i].seq.load(std::memory_order_relaxed))
+        copy[i].seq.store(0, std::memory_order_relaxed);
+    }
+    ssize_t size = count * kFlightSlotSize;
+    ok &= write(fd, chunk.data(), size) == size;
+  }
+  close(fd);
+
+  if (!ok)
+  {
+    unlink(path.c_str());
+    return false;
+  }
+  if (snapshot_path != nullptr)
+    *snapshot_path = path;
+  return true;
+}
+
+void RegisterFlightRecorderCommands()
+{
+  RegisterControlCommand("snapshot",
+                         "[reason]: freeze a copy of the flight recorder",
+                         SnapshotCommand);
+}
+
+bool ReadFlightRecorder(const char* path, const FlightEntryVisitor& visitor,
+                        FlightRecorderHeader* header_out)
+{
+  struct stat st;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0)
+    return false;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < kHeaderSize)
+  {
+    close(fd);
+    return false;
+  }
+
+  size_t size = st.st_size;
+  void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return false;
+
+  const FlightRecorderHeader* header =
+      static_cast<const FlightRecorderHeader*>(data);
+  const FlightSlot* ring = reinterpret_cast<const FlightSlot*>(
+      static_cast<const char*>(data) + kHeaderSize);
+  uint64_t slot_count = header->slots;
+
+  if (header->magic != kFlightRecorderMagic ||
+      header->version != kFlightRecorderVersion ||
+      header->slot_size != kFlightSlotSize ||
+      slot_count > (size - kHeaderSize) / kFlightSlotSize)
+  {
+    munmap(data, size);
+    return false;
+  }
+  if (header_out != nullptr)
+  {
+    memcpy((void*) header_out, (const void*) header, offsetof(FlightRecorderHeader, head));
+    header_out->head.store(header->head.load());
+  }
+
+  // The slots are self-describing: the head is not needed to find the
+  // entries, only their sequence numbers.
+  std::vector<uint64_t> starts;
+  for (uint64_t i = 0; i < slot_count; ++i)
+  {
+    const FlightSlot& slot = ring[i];
+    uint64_t seq = slot.seq.load(std::memory_order_relaxed);
+    if (seq == 0 || slot.part != 0 || slot.parts == 0 ||
+        slot.parts > kMaxEntrySlots || (seq - 1) % slot_count != i)
+      continue;
+    if (EntryComplete(ring, slot_count, seq - 1, slot.parts))
+      starts.push_back(seq - 1);
+  }
+  std::sort(starts.begin(), starts.end());
+
+  std::vector<uint8_t> buffer;
+  for (uint64_t pos : starts)
+  {
+    const FlightSlot& first = ring[pos % slot_count];
+    buffer.clear();
+    for (uint16_t part = 0; part < first.parts; ++part)
+    {
+      const FlightSlot& slot = ring[(pos + part) % slot_count];
+      size_t used = std::min<size_t>(slot.used, kSlotPayload);
+      buffer.insert(buffer.end(), slot.payload, slot.payload + used);
+    }
+    if (buffer.size() < sizeof(FlightEntryHeader))
+      continue;
+
+    FlightEntryHeader entry;
+    memcpy(&entry, buffer.data(), sizeof(entry));
+    size_t entry_size = std::min<size_t>(entry.size,
+                                         buffer.size() - sizeof(entry));
+    visitor((FlightEntryType) first.type, entry.time, entry.tid,
+            buffer.data() + sizeof(entry), entry_size);
+  }
+
+  munmap(data, size);
+  return true;
+}
+
+}  // namespace microservice_profile
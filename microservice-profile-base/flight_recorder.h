@@ -0,0 +1,123 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_FLIGHT_RECORDER_H_
+#define MICROSERVICE_PROFILE_FLIGHT_RECORDER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <functional>
+#include <string>
+
+namespace microservice_profile
+{
+
+// Fixed-size ring of recent events in a shared file mapping, so that they
+// survive the death of the process: the page cache keeps what was stored.
+//
+// The ring is made of kFlightSlotSize slots. An entry takes consecutive slots,
+// reserved with one fetch_add on the header; each slot carries the sequence
+// number of its position, stored last. A reader therefore recognizes the
+// complete entries without trusting anything but the slots themselves, which
+// makes appending safe from signal handlers and lets a crashed file be read
+// back as is.
+
+enum FlightEntryType : uint16_t
+{
+  kFlightRelayRecord = 1,  // Relay record: header then syscall_desc array.
+  kFlightStackSample = 2,  // Instruction pointers, innermost first.
+  kFlightSpanAlert = 3,    // OpenSpan of a latency tracker alert.
+  kFlightMark = 4,         // Text, e.g. the reason for a snapshot.
+  kFlightSpan = 5,         // FlightSpanRecord then the span name.
+};
+
+// Recorded when a span ends, on the thread that ends it.
+struct FlightSpanRecord
+{
+  uint8_t span_id[8];
+  uint8_t trace_id[16];
+  uint64_t start;     // ns since the epoch.
+  uint64_t duration;  // ns.
+};
+
+const uint32_t kFlightRecorderMagic = 0x5246504d;  // "MPFR"
+const uint32_t kFlightRecorderVersion = 1;
+const size_t kFlightSlotSize = 256;
+
+struct FlightRecorderHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slot_size;
+  uint32_t state;  // kFlightRunning until the process closes it.
+  uint64_t slots;
+  int64_t pid;
+  uint64_t realtime_base;   // CLOCK_REALTIME and CLOCK_MONOTONIC read
+  uint64_t monotonic_base;  // together when the file was created.
+  std::atomic<uint64_t> head;  // Slots reserved so far.
+};
+
+const uint32_t kFlightRunning = 1;
+const uint32_t kFlightClosed = 2;
+
+// Opens the ring named by MICROSERVICE_PROFILE_FLIGHT_RECORDER ("%p" is the
+// pid), of MICROSERVICE_PROFILE_FLIGHT_RECORDER_MB megabytes (64 by default).
+// A file left running by a dead process is renamed to <path>.crashed-<pid>
+// first. Returns false if disabled or on error.
+bool StartFlightRecorder();
+
+// Closes the ring, marking it as cleanly closed.
+void StopFlightRecorder();
+
+// Forked children get a ring of their own, made on their first span. No-op
+// if the recorder is off.
+void ResetFlightRecorderAfterFork();
+
+// Cheap check for the hot paths.
+bool FlightRecorderEnabled();
+
+// Appends an entry made of the concatenated buffers. Uses only atomic
+// operations and memcpy(): async-signal-safe.
+void FlightRecord(FlightEntryType type, const struct iovec* iov, int count);
+
+inline void FlightRecord(FlightEntryType type, const void* data, size_t size)
+{
+  struct iovec iov = {const_cast<void*>(data), size};
+  FlightRecord(type, &iov, 1);
+}
+
+// Freezes a consistent copy of the ring into <path>.snapshot-<n> and returns
+// its name in snapshot_path. reason is recorded in the ring first. Unless
+// force is set, snapshots closer than 10 s to the previous one are skipped.
+bool SnapshotFlightRecorder(const char* reason, bool force,
+                            std::string* snapshot_path);
+
+// Adds the "snapshot [reason]" control command.
+void RegisterFlightRecorderCommands();
+
+// Visits the complete entries of a ring file (live, crashed or snapshot) in
+// the order they were recorded. time is CLOCK_MONOTONIC, in ns.
+typedef std::function<void(FlightEntryType type, uint64_t time, uint32_t tid,
+                           const uint8_t* data, size_t size)>
+    FlightEntryVisitor;
+bool ReadFlightRecorder(const char* path, const FlightEntryVisitor& visitor,
+                        FlightRecorderHeader* header = nullptr);
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_FLIGHT_RECORDER_H_
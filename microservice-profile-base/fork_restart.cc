@@ -0,0 +1,59 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-base/fork_restart.h"
+
+namespace microservice_profile
+{
+
+std::atomic<bool> restart_after_fork_pending(false);
+
+namespace
+{
+
+const int kMaxRestarts = 16;
+
+void (*restarts[kMaxRestarts])();
+int nb_restarts = 0;
+
+}  // namespace
+
+void DeferRestartAfterFork(void (*restart)())
+{
+  // A child that forks before restarting queues its restarts again.
+  for (int i = 0; i < nb_restarts; ++i)
+  {
+    if (restarts[i] == restart)
+      return;
+  }
+  if (nb_restarts < kMaxRestarts)
+    restarts[nb_restarts++] = restart;
+  restart_after_fork_pending.store(true);
+}
+
+// The first caller runs them all. The threads they start, and the other
+// threads of the child meanwhile, go on without waiting.
+void RunRestartsAfterFork()
+{
+  if (!restart_after_fork_pending.exchange(false))
+    return;
+
+  int count = nb_restarts;
+  nb_restarts = 0;
+  for (int i = 0; i < count; ++i)
+    restarts[i]();
+}
+
+}  // namespace microservice_profile
@@ -0,0 +1,46 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_FORK_RESTART_H_
+#define MICROSERVICE_PROFILE_FORK_RESTART_H_
+
+#include <atomic>
+
+namespace microservice_profile
+{
+
+// Work a fork child defers to its first span. The child fork handlers only
+// reset what the child inherited, and leave the threads, files and sockets
+// to the restarts: a child that calls exec right away starts none of them.
+
+// Called from a child fork handler: queues `restart`, in the order of the
+// calls. Neither allocates nor locks.
+void DeferRestartAfterFork(void (*restart)());
+
+extern std::atomic<bool> restart_after_fork_pending;
+
+// Runs the queued restarts, once. The first span of the child calls it.
+void RunRestartsAfterFork();
+
+// Cheap check meant for hot paths.
+inline void MaybeRestartAfterFork()
+{
+  if (restart_after_fork_pending.load(std::memory_order_relaxed))
+    RunRestartsAfterFork();
+}
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_FORK_RESTART_H_
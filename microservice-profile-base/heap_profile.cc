@@ -0,0 +1,339 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-base/heap_profile.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <new>
+
+#include "microservice-profile-base/control_server.h"
+#include "microservice-profile-base/get_monotonic_time.h"
+#include "microservice-profile-base/memory_budget.h"
+
+namespace microservice_profile
+{
+
+std::atomic<bool> heap_profiling_enabled(false);
+
+namespace
+{
+
+uint64_t sample_interval = 512 * 1024;
+
+// Charged to the memory budget for a hash table node besides its value,
+// and for a live sample.
+const size_t kNodeOverhead = 32;
+const size_t kLiveFootprint = kNodeOverhead + sizeof(void*) + 3 * sizeof(uint64_t);
+
+thread_local uint64_t random_state = 0;
+
+// Set while the thread holds a profile's lock: what it allocates then is
+// never sampled, so what it frees then needs no lookup.
+thread_local bool holding_lock = false;
+
+void ChildAfterFork()
+{
+  GetHeapProfile().Reset();
+}
+
+// heap [live|alloc] [top]
+void HeapCommand(const std::string& args, std::string* output)
+{
+  bool live = true;
+  size_t top = 20;
+  char mode[16];
+  size_t n;
+
+  int nb_args = sscanf(args.c_str(), "%15s %zu", mode, &n);
+  if (nb_args >= 1)
+  {
+    if (strcmp(mode, "alloc") == 0)
+      live = false;
+    else if (strcmp(mode, "live") != 0)
+    {
+      *output += "usage: heap [live|alloc] [top]\n";
+      return;
+    }
+  }
+  if (nb_args == 2 && n > 0)
+    top = n;
+  GetHeapProfile().Report(live, top, output);
+}
+
+}  // namespace
+
+size_t HeapProfile::KeyHash::operator()(const Key& key) const
+{
+  size_t hash = std::hash<std::string>()(key.endpoint);
+  for (uintptr_t pc : key.stack)
+    hash = hash * 31 + std::hash<uintptr_t>()(pc);
+  return hash;
+}
+
+HeapProfile::HeapProfile(const Options& options)
+    : options_(options),
+      filter_(new std::atomic<uint8_t>[1 << kFilterBits]())
+{
+  ChargeMemory(kMemoryStackTables, 1 << kFilterBits);
+}
+
+void HeapProfile::Lock()
+{
+  while (lock_.test_and_set(std::memory_order_acquire))
+    sched_yield();
+  holding_lock = true;
+}
+
+void HeapProfile::Unlock()
+{
+  holding_lock = false;
+  lock_.clear(std::memory_order_release);
+}
+
+void HeapProfile::RecordAllocation(const void* ptr, size_t size,
+                                   const char* endpoint, size_t endpoint_size,
+                                   void* const* stack, size_t stack_size)
+{
+  if (holding_lock)
+    return;
+
+  double probability = 1 - exp(-(double) size / options_.interval);
+  uint64_t objects = 1, bytes = size;
+  if (probability > 0)
+  {
+    objects = (uint64_t) (1 / probability + 0.5);
+    bytes = (uint64_t) (size / probability + 0.5);
+  }
+  Key key = {std::string(endpoint, endpoint_size),
+             std::vector<uintptr_t>(
+                 reinterpret_cast<const uintptr_t*>(stack),
+                 reinterpret_cast<const uintptr_t*>(stack) + stack_size)};
+
+  Lock();
+  auto it = sites_.find(key);
+  if (it == sites_.end())
+  {
+    // The key and the site each hold the endpoint and the stack.
+    size_t footprint = kNodeOverhead + sizeof(Key) + sizeof(Site) +
+                       2 * (endpoint_size + stack_size * sizeof(uintptr_t));
+    if (sites_.size() >= options_.max_sites ||
+        !ReserveMemory(kMemoryStackTables, footprint))
+    {
+      dropped_++;
+      Unlock();
+      return;
+    }
+    charged_ += footprint;
+    Site site = {key.endpoint, key.stack, 0, 0, 0, 0};
+    it = sites_.emplace(std::move(key), std::move(site)).first;
+  }
+
+  Site& site = it->second;
+  site.alloc_objects += objects;
+  site.alloc_bytes += bytes;
+  if (live_.size() < options_.max_live &&
+      ReserveMemory(kMemoryStackTables, kLiveFootprint))
+  {
+    if (!live_.emplace(ptr, Sample{&site, objects, bytes}).second)
+    {
+      ReleaseMemory(kMemoryStackTables, kLiveFootprint);
+      Unlock();
+      return;
+    }
+    charged_ += kLiveFootprint;
+    site.live_objects += objects;
+    site.live_bytes += bytes;
+    std::atomic<uint8_t>& counter = filter_[FilterIndex(ptr)];
+    // A saturated counter stays so.
+    uint8_t count = counter.load(std::memory_order_relaxed);
+    if (count < UINT8_MAX)
+      counter.store(count + 1, std::memory_order_relaxed);
+  }
+  Unlock();
+}
+
+void HeapProfile::RecordFree(const void* ptr)
+{
+  if (holding_lock)
+    return;
+
+  Lock();
+  auto it = live_.find(ptr);
+  if (it != live_.end())
+  {
+    Site* site = it->second.site;
+    site->live_objects -= it->second.objects;
+    site->live_bytes -= it->second.bytes;
+    live_.erase(it);
+    ReleaseMemory(kMemoryStackTables, kLiveFootprint);
+    charged_ -= kLiveFootprint;
+
+    std::atomic<uint8_t>& counter = filter_[FilterIndex(ptr)];
+    uint8_t count = counter.load(std::memory_order_relaxed);
+    if (count < UINT8_MAX)
+      counter.store(count - 1, std::memory_order_relaxed);
+  }
+  Unlock();
+}
+
+void HeapProfile::Report(bool live, size_t top, std::string* output)
+{
+  std::vector<Site> sites;
+  uint64_t live_objects = 0, live_bytes = 0;
+  uint64_t alloc_objects = 0, alloc_bytes = 0;
+  size_t nb_sites, nb_live;
+  uint64_t dropped;
+
+  Lock();
+  nb_sites = sites_.size();
+  nb_live = live_.size();
+  dropped = dropped_;
+  sites.reserve(sites_.size());
+  for (const auto& site : sites_)
+  {
+    sites.push_back(site.second);
+    live_objects += site.second.live_objects;
+    live_bytes += site.second.live_bytes;
+    alloc_objects += site.second.alloc_objects;
+    alloc_bytes += site.second.alloc_bytes;
+  }
+  Unlock();
+
+  if (live)
+  {
+    std::sort(sites.begin(), sites.end(), [](const Site& a, const Site& b) {
+      return a.live_bytes > b.live_bytes;
+    });
+  }
+  else
+  {
+    std::sort(sites.begin(), sites.end(), [](const Site& a, const Site& b) {
+      return a.alloc_bytes > b.alloc_bytes;
+    });
+  }
+  if (sites.size() > top)
+    sites.resize(top);
+
+  char line[256];
+  snprintf(line, sizeof(line),
+           "interval=%lu sites=%zu samples=%zu dropped=%lu live_objects=%lu "
+           "live_bytes=%lu alloc_objects=%lu alloc_bytes=%lu\n",
+           (unsigned long) options_.interval, nb_sites, nb_live,
+           (unsigned long) dropped, (unsigned long) live_objects,
+           (unsigned long) live_bytes, (unsigned long) alloc_objects,
+           (unsigned long) alloc_bytes);
+  *output += line;
+
+  for (const Site& site : sites)
+  {
+    if ((live ? site.live_bytes : site.alloc_bytes) == 0)
+      break;
+    snprintf(line, sizeof(line),
+             "live_objects=%lu live_bytes=%lu alloc_objects=%lu "
+             "alloc_bytes=%lu endpoint=",
+             (unsigned long) site.live_objects, (unsigned long) site.live_bytes,
+             (unsigned long) site.alloc_objects,
+             (unsigned long) site.alloc_bytes);
+    *output += line;
+    *output += site.endpoint;
+    if (!site.stack.empty())
+    {
+      *output += " stack=";
+      for (size_t i = 0; i < site.stack.size(); i++)
+      {
+        snprintf(line, sizeof(line), "%s0x%lx", i > 0 ? "," : "",
+                 (unsigned long) site.stack[i]);
+        *output += line;
+      }
+    }
+    *output += "\n";
+  }
+}
+
+// Another thread may have been updating the tables when the process
+// forked: the child leaks them and starts over. The leaked pages stay
+// shared with the parent, the child never touches them again.
+void HeapProfile::Reset()
+{
+  ReleaseMemory(kMemoryStackTables, charged_);
+  charged_ = 0;
+  new (&sites_) std::unordered_map<Key, Site, KeyHash>();
+  new (&live_) std::unordered_map<const void*, Sample>();
+  for (size_t i = 0; i < (1 << kFilterBits); i++)
+    filter_[i].store(0, std::memory_order_relaxed);
+  dropped_ = 0;
+  holding_lock = false;
+  lock_.clear();
+}
+
+bool StartHeapProfiling()
+{
+  const char* enabled = getenv("MICROSERVICE_PROFILE_HEAP");
+  if (enabled == nullptr || strcmp(enabled, "1") != 0)
+    return false;
+
+  if (HeapProfilingEnabled())
+    return true;
+
+  const char* interval = getenv("MICROSERVICE_PROFILE_HEAP_INTERVAL");
+  if (interval != nullptr && strtoull(interval, nullptr, 10) > 0)
+    sample_interval = strtoull(interval, nullptr, 10);
+
+  GetHeapProfile();
+  pthread_atfork(nullptr, nullptr, ChildAfterFork);
+  RegisterControlCommand("heap", "sampled heap profile [live|alloc] [top]",
+                         HeapCommand);
+  heap_profiling_enabled.store(true);
+  return true;
+}
+
+HeapProfile& GetHeapProfile()
+{
+  // Never destroyed: the interposers may run after static destructors.
+  static HeapProfile* profile = [] {
+    HeapProfile::Options options;
+    options.interval = sample_interval;
+    return new HeapProfile(options);
+  }();
+  return *profile;
+}
+
+int64_t NextHeapSampleInterval()
+{
+  // xorshift64*, seeded per thread.
+  if (random_state == 0)
+  {
+    random_state =
+        (GetMonotonicTime() ^ reinterpret_cast<uintptr_t>(&random_state)) | 1;
+  }
+  random_state ^= random_state >> 12;
+  random_state ^= random_state << 25;
+  random_state ^= random_state >> 27;
+  uint64_t bits = random_state * 0x2545f4914f6cdd1dull;
+
+  // Uniform in (0, 1].
+  double uniform = ((bits >> 11) + 1) * (1.0 / (1ull << 53));
+  double interval = -log(uniform) * sample_interval;
+  return interval < 1 ? 1 : (int64_t) std::min(interval, 1e15);
+}
+
+}  // namespace microservice_profile
@@ -0,0 +1,152 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_HEAP_PROFILE_H_
+#define MICROSERVICE_PROFILE_HEAP_PROFILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace microservice_profile
+{
+
+// Sampled heap allocations, per endpoint and stack. An allocation is sampled
+// when it crosses a point of a Poisson process over the allocated bytes, of
+// mean `interval`: each sample stands for size / (1 - exp(-size / interval))
+// bytes, which makes the totals unbiased estimates. Sampled allocations are
+// remembered until freed, for the live heap profile. Fed by the malloc
+// interposers of the preloaded library.
+//
+// The tables are guarded by a spinlock: the interposers call in with their
+// own reentrancy guard set, so the tables' allocations are never sampled.
+class HeapProfile
+{
+public:
+  struct Options
+  {
+    uint64_t interval = 512 * 1024;
+    size_t max_sites = 16384;
+    size_t max_live = 262144;
+  };
+
+  struct Site
+  {
+    std::string endpoint;
+    std::vector<uintptr_t> stack;  // Innermost first.
+    uint64_t alloc_objects;
+    uint64_t alloc_bytes;
+    uint64_t live_objects;
+    uint64_t live_bytes;
+  };
+
+  explicit HeapProfile(const Options& options);
+
+  HeapProfile(const HeapProfile&) = delete;
+  HeapProfile& operator=(const HeapProfile&) = delete;
+
+  const Options& options() const { return options_; }
+
+  void RecordAllocation(const void* ptr, size_t size, const char* endpoint,
+                        size_t endpoint_size, void* const* stack,
+                        size_t stack_size);
+
+  // False when ptr is certainly not a live sampled allocation: one byte
+  // load, for every free.
+  bool MaybeSampled(const void* ptr) const
+  {
+    return filter_[FilterIndex(ptr)].load(std::memory_order_relaxed) != 0;
+  }
+
+  void RecordFree(const void* ptr);
+
+  // The `top` sites with the most live bytes, or allocated bytes, one per
+  // line.
+  void Report(bool live, size_t top, std::string* output);
+
+  // Forgets everything, for fork children.
+  void Reset();
+
+private:
+  // A counting filter over the live samples' addresses, 256 KiB: small
+  // enough to stay in cache for the lookups of free.
+  static const size_t kFilterBits = 18;
+
+  struct Key
+  {
+    std::string endpoint;
+    std::vector<uintptr_t> stack;
+
+    bool operator==(const Key& other) const
+    {
+      return endpoint == other.endpoint && stack == other.stack;
+    }
+  };
+
+  struct KeyHash
+  {
+    size_t operator()(const Key& key) const;
+  };
+
+  struct Sample
+  {
+    Site* site;
+    uint64_t objects;
+    uint64_t bytes;
+  };
+
+  static size_t FilterIndex(const void* ptr)
+  {
+    return (reinterpret_cast<uintptr_t>(ptr) * 0x9e3779b97f4a7c15ull) >>
+           (64 - kFilterBits);
+  }
+
+  void Lock();
+  void Unlock();
+
+  Options options_;
+  std::unique_ptr<std::atomic<uint8_t>[]> filter_;
+  std::atomic_flag lock_ = ATOMIC_FLAG_INIT;
+  std::unordered_map<Key, Site, KeyHash> sites_;
+  std::unordered_map<const void*, Sample> live_;
+  uint64_t dropped_ = 0;
+  size_t charged_ = 0;  // To the memory budget, by the tables.
+};
+
+extern std::atomic<bool> heap_profiling_enabled;
+
+inline bool HeapProfilingEnabled()
+{
+  return heap_profiling_enabled.load(std::memory_order_relaxed);
+}
+
+// Reads MICROSERVICE_PROFILE_HEAP and MICROSERVICE_PROFILE_HEAP_INTERVAL and
+// registers the "heap" control command. Returns true if enabled.
+bool StartHeapProfiling();
+
+HeapProfile& GetHeapProfile();
+
+// Bytes the calling thread allocates before its next sample: exponentially
+// distributed, of mean the sampling interval.
+int64_t NextHeapSampleInterval();
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_HEAP_PROFILE_H_
@@ -0,0 +1,524 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-base/latency_histogram.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+#include "microservice-profile-base/control_server.h"
+#include "microservice-profile-base/get_monotonic_time.h"
+#include "microservice-profile-base/memory_budget.h"
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+const char kOtherEndpoint[] = "(other)";
+const size_t kTableSize = 2 * kMaxHistogramEndpoints;  // Power of two.
+const uint64_t kMergeIntervalNs = 1000000000ULL;
+
+// Seqlock-protected exemplar: writers that find it busy just skip it.
+struct ExemplarSlot
+{
+  std::atomic<uint32_t> seq{0};
+  std::atomic<uint64_t> trace_hi{0};
+  std::atomic<uint64_t> trace_lo{0};
+  std::atomic<uint64_t> value{0};
+  std::atomic<uint64_t> time{0};
+};
+
+struct Endpoint
+{
+  uint64_t hash;
+  size_t index;
+  size_t size;
+  char name[kHistogramNameSize];
+  ExemplarSlot exemplars[kHistogramBuckets];
+};
+
+// Written by a single thread, read by the merger. The histograms are
+// bounded by kMaxHistogramEndpoints and the number of threads: their memory
+// is charged, not reserved.
+struct Counts
+{
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> sum{0};
+  std::atomic<uint64_t> buckets[kHistogramBuckets];
+
+  Counts()
+  {
+    ChargeMemory(kMemoryStackTables, sizeof(Counts));
+    for (auto& bucket : buckets)
+      bucket.store(0, std::memory_order_relaxed);
+  }
+
+  ~Counts()
+  {
+    ReleaseMemory(kMemoryStackTables, sizeof(Counts));
+  }
+};
+
+struct ThreadShard
+{
+  std::atomic<Counts*> counts[kMaxHistogramEndpoints];
+
+  ThreadShard()
+  {
+    ChargeMemory(kMemoryStackTables, sizeof(ThreadShard));
+    for (auto& c : counts)
+      c.store(nullptr, std::memory_order_relaxed);
+  }
+
+  ~ThreadShard()
+  {
+    for (auto& c : counts)
+      delete c.load(std::memory_order_relaxed);
+    ReleaseMemory(kMemoryStackTables, sizeof(ThreadShard));
+  }
+
+  Counts* Get(size_t index)
+  {
+    Counts* c = counts[index].load(std::memory_order_relaxed);
+    if (c == nullptr)
+    {
+      c = new Counts();
+      counts[index].store(c, std::memory_order_release);
+    }
+    return c;
+  }
+};
+
+// The endpoints, looked up without locks; only insertion takes the mutex.
+std::mutex endpoints_mutex;
+std::atomic<Endpoint*> table[kTableSize];
+Endpoint* endpoints[kMaxHistogramEndpoints];
+std::atomic<size_t> endpoint_count(0);
+Endpoint* other_endpoint = nullptr;
+
+// The live thread shards, the counts of the exited threads and the last
+// merged view.
+std::mutex shards_mutex;
+std::vector<ThreadShard*> shards;
+ThreadShard retired;
+std::vector<LatencySnapshot> merged;
+uint64_t merged_time = 0;
+
+inline void Increment(std::atomic<uint64_t>& counter, uint64_t value)
+{
+  counter.store(counter.load(std::memory_order_relaxed) + value,
+                std::memory_order_relaxed);
+}
+
+void FoldInto(Counts* to, const Counts* from)
+{
+  Increment(to->count, from->count.load(std::memory_order_relaxed));
+  Increment(to->sum, from->sum.load(std::memory_order_relaxed));
+  for (size_t i = 0; i < kHistogramBuckets; ++i)
+    Increment(to->buckets[i], from->buckets[i].load(std::memory_order_relaxed));
+}
+
+void PrepareFork()
+{
+  endpoints_mutex.lock();
+  shards_mutex.lock();
+}
+
+void ParentAfterFork()
+{
+  shards_mutex.unlock();
+  endpoints_mutex.unlock();
+}
+
+void ResetExemplars();
+
+struct ShardHolder
+{
+  ThreadShard* shard = nullptr;
+
+  ThreadShard* Get()
+  {
+    if (shard == nullptr)
+    {
+      static std::once_flag once;
+      std::call_once(once, [] {
+        pthread_atfork(PrepareFork, ParentAfterFork, ChildAfterFork);
+      });
+
+      shard = new ThreadShard();
+      std::lock_guard<std::mutex> guard(shards_mutex);
+      shards.push_back(shard);
+    }
+    return shard;
+  }
+
+  // The counts of an exiting thread are kept in the retired shard.
+  ~ShardHolder()
+  {
+    if (shard == nullptr)
+      return;
+
+    std::lock_guard<std::mutex> guard(shards_mutex);
+    for (size_t i = 0; i < kMaxHistogramEndpoints; ++i)
+    {
+      Counts* c = shard->counts[i].load(std::memory_order_acquire);
+      if (c != nullptr)
+        FoldInto(retired.Get(i), c);
+    }
+    shards.erase(std::remove(shards.begin(), shards.end(), shard),
+                 shards.end());
+    delete shard;
+  }
+
+  static void ChildAfterFork();
+};
+
+thread_local ShardHolder holder;
+
+// The child starts with empty histograms: the other threads' shards belong
+// to threads that do not exist anymore.
+void ShardHolder::ChildAfterFork()
+{
+  for (ThreadShard* shard : shards)
+  {
+    if (shard != holder.shard)
+      delete shard;
+  }
+  shards.clear();
+  if (holder.shard != nullptr)
+  {
+    delete holder.shard;
+    holder.shard = new ThreadShard();
+    shards.push_back(holder.shard);
+  }
+  for (auto& c : retired.counts)
+    delete c.exchange(nullptr);
+  merged.clear();
+  merged_time = 0;
+  ResetExemplars();
+
+  shards_mutex.unlock();
+  endpoints_mutex.unlock();
+}
+
+void ResetExemplars()
+{
+  size_t count = endpoint_count.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < count; ++i)
+  {
+    for (auto& exemplar : endpoints[i]->exemplars)
+      exemplar.time.store(0, std::memory_order_relaxed);
+  }
+}
+
+uint64_t HashName(const char* name, size_t size)
+{
+  uint64_t hash = 14695981039346656037ULL;  // FNV-1a
+
+  for (size_t i = 0; i < size; ++i)
+  {
+    hash ^= (unsigned char) name[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+Endpoint* Lookup(const char* name, size_t size, uint64_t hash)
+{
+  for (size_t i = hash & (kTableSize - 1);; i = (i + 1) & (kTableSize - 1))
+  {
+    Endpoint* endpoint = table[i].load(std::memory_order_acquire);
+    if (endpoint == nullptr)
+      return nullptr;
+    if (endpoint->hash == hash && endpoint->size == size &&
+        memcmp(endpoint->name, name, size) == 0)
+      return endpoint;
+  }
+}
+
+// Called with endpoints_mutex held, and a free slot. Endpoints are never
+// freed.
+Endpoint* Add(const char* name, size_t size, uint64_t hash)
+{
+  ChargeMemory(kMemoryStackTables, sizeof(Endpoint));
+  Endpoint* endpoint = new Endpoint();
+  endpoint->hash = hash;
+  endpoint->size = size;
+  memcpy(endpoint->name, name, size);
+  endpoint->name[size] = '\0';
+  endpoint->index = endpoint_count.load(std::memory_order_relaxed);
+  endpoints[endpoint->index] = endpoint;
+
+  size_t i = hash & (kTableSize - 1);
+  while (table[i].load(std::memory_order_relaxed) != nullptr)
+    i = (i + 1) & (kTableSize - 1);
+  table[i].store(endpoint, std::memory_order_release);
+  endpoint_count.store(endpoint->index + 1, std::memory_order_release);
+  return endpoint;
+}
+
+// Called with endpoints_mutex held. The last slot is kept for the overflow
+// endpoint, which takes the names that come once the others are used.
+Endpoint* Insert(const char* name, size_t size, uint64_t hash)
+{
+  if (other_endpoint == nullptr &&
+      endpoint_count.load(std::memory_order_relaxed) <
+          kMaxHistogramEndpoints - 1)
+    return Add(name, size, hash);
+
+  if (other_endpoint == nullptr)
+    other_endpoint = Add(kOtherEndpoint, sizeof(kOtherEndpoint) - 1,
+                         HashName(kOtherEndpoint, sizeof(kOtherEndpoint) - 1));
+  return other_endpoint;
+}
+
+Endpoint* FindEndpoint(const char* name, size_t size)
+{
+  if (size >= kHistogramNameSize)
+    size = kHistogramNameSize - 1;
+
+  uint64_t hash = HashName(name, size);
+  Endpoint* endpoint = Lookup(name, size, hash);
+  if (endpoint != nullptr)
+    return endpoint;
+
+  // Checked again under the lock: another thread may have taken the slot.
+  std::lock_guard<std::mutex> guard(endpoints_mutex);
+  endpoint = Lookup(name, size, hash);
+  if (endpoint == nullptr)
+    endpoint = Insert(name, size, hash);
+  return endpoint;
+}
+
+void RecordExemplar(ExemplarSlot& exemplar, uint64_t value,
+                    const uint8_t* trace_id, uint64_t time)
+{
+  if (time - exemplar.time.load(std::memory_order_relaxed) <
+      kExemplarIntervalNs)
+    return;
+
+  uint32_t seq = exemplar.seq.load(std::memory_order_relaxed);
+  if ((seq & 1) != 0 ||
+      !exemplar.seq.compare_exchange_strong(seq, seq + 1,
+                                            std::memory_order_acquire))
+    return;
+
+  uint64_t hi, lo;
+  memcpy(&hi, trace_id, sizeof(hi));
+  memcpy(&lo, trace_id + sizeof(hi), sizeof(lo));
+  exemplar.trace_hi.store(hi, std::memory_order_relaxed);
+  exemplar.trace_lo.store(lo, std::memory_order_relaxed);
+  exemplar.value.store(value, std::memory_order_relaxed);
+  exemplar.time.store(time, std::memory_order_relaxed);
+  exemplar.seq.store(seq + 2, std::memory_order_release);
+}
+
+bool ReadExemplar(const ExemplarSlot& slot, LatencyExemplar* exemplar)
+{
+  for (int attempt = 0; attempt < 3; ++attempt)
+  {
+    uint32_t seq = slot.seq.load(std::memory_order_acquire);
+    if ((seq & 1) != 0)
+      continue;
+
+    uint64_t hi = slot.trace_hi.load(std::memory_order_relaxed);
+    uint64_t lo = slot.trace_lo.load(std::memory_order_relaxed);
+    exemplar->value = slot.value.load(std::memory_order_relaxed);
+    exemplar->time = slot.time.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.seq.load(std::memory_order_relaxed) != seq)
+      continue;
+
+    memcpy(exemplar->trace_id, &hi, sizeof(hi));
+    memcpy(exemplar->trace_id + sizeof(hi), &lo, sizeof(lo));
+    return exemplar->time != 0;
+  }
+  return false;
+}
+
+std::string FormatTraceId(const uint8_t* trace_id)
+{
+  char hex[33];
+
+  for (int i = 0; i < 16; ++i)
+    snprintf(hex + i * 2, 3, "%02x", trace_id[i]);
+  return hex;
+}
+
+void HistogramsCommand(const std::string&, std::string* output)
+{
+  char line[256];
+
+  *output += "endpoint\tcount\tmean_us\tp50_us\tp99_us\tp999_us\n";
+  for (const auto& snapshot : SnapshotLatencyHistograms())
+  {
+    snprintf(line, sizeof(line), "\t%lu\t%.1f\t%.1f\t%.1f\t%.1f\n",
+             (unsigned long) snapshot.count,
+             snapshot.sum / 1000.0 / snapshot.count,
+             snapshot.Percentile(0.5) / 1000.0,
+             snapshot.Percentile(0.99) / 1000.0,
+             snapshot.Percentile(0.999) / 1000.0);
+    *output += snapshot.name + line;
+  }
+}
+
+void HistogramCommand(const std::string& args, std::string* output)
+{
+  char line[256];
+
+  for (const auto& snapshot : SnapshotLatencyHistograms())
+  {
+    if (snapshot.name != args)
+      continue;
+
+    *output += "from_ns\tto_ns\tcount\texemplar_trace_id\texemplar_ns\n";
+    for (size_t i = 0; i < kHistogramBuckets; ++i)
+    {
+      if (snapshot.buckets[i] == 0)
+        continue;
+
+      const LatencyExemplar& exemplar = snapshot.exemplars[i];
+      bool has_exemplar = exemplar.time != 0;
+      snprintf(line, sizeof(line), "%lu\t%lu\t%lu\t%s\t%lu\n",
+               (unsigned long) HistogramBucketLowerBound(i),
+               (unsigned long) HistogramBucketLowerBound(i + 1),
+               (unsigned long) snapshot.buckets[i],
+               has_exemplar ? FormatTraceId(exemplar.trace_id).c_str() : "-",
+               (unsigned long) (has_exemplar ? exemplar.value : 0));
+      *output += line;
+    }
+    return;
+  }
+  *output += "unknown endpoint: " + args + "\n";
+}
+
+}  // namespace
+
+size_t HistogramBucket(uint64_t value)
+{
+  if (value < (1ULL << kHistogramSubBits))
+    return value;
+  if (value >= (1ULL << kHistogramMaxExponent))
+    return kHistogramBuckets - 1;
+
+  int exponent = 63 - __builtin_clzll(value);
+  size_t sub = (value >> (exponent - kHistogramSubBits)) &
+               ((1 << kHistogramSubBits) - 1);
+  return ((size_t) (exponent - kHistogramSubBits + 1) << kHistogramSubBits) |
+         sub;
+}
+
+uint64_t HistogramBucketLowerBound(size_t bucket)
+{
+  if (bucket < (1U << kHistogramSubBits))
+    return bucket;
+
+  int exponent = (bucket >> kHistogramSubBits) + kHistogramSubBits - 1;
+  uint64_t sub = bucket & ((1 << kHistogramSubBits) - 1);
+  return (1ULL << exponent) | (sub << (exponent - kHistogramSubBits));
+}
+
+void RecordLatency(const char* name, size_t name_size, uint64_t value_ns,
+                   const uint8_t* trace_id, uint64_t time_ns)
+{
+  Endpoint* endpoint = FindEndpoint(name, name_size);
+  Counts* counts = holder.Get()->Get(endpoint->index);
+  size_t bucket = HistogramBucket(value_ns);
+
+  Increment(counts->count, 1);
+  Increment(counts->sum, value_ns);
+  Increment(counts->buckets[bucket], 1);
+
+  if (trace_id != nullptr)
+    RecordExemplar(endpoint->exemplars[bucket], value_ns, trace_id, time_ns);
+}
+
+uint64_t LatencySnapshot::Percentile(double q) const
+{
+  uint64_t target = q * count;
+  uint64_t seen = 0;
+
+  if (target == 0)
+    target = 1;
+  for (size_t i = 0; i < buckets.size(); ++i)
+  {
+    seen += buckets[i];
+    if (seen >= target)
+      return HistogramBucketLowerBound(i + 1);
+  }
+  return 0;
+}
+
+std::vector<LatencySnapshot> SnapshotLatencyHistograms()
+{
+  std::lock_guard<std::mutex> guard(shards_mutex);
+  uint64_t now = GetMonotonicTime();
+
+  if (merged_time != 0 && now - merged_time < kMergeIntervalNs)
+    return merged;
+
+  merged.clear();
+  size_t count = endpoint_count.load(std::memory_order_acquire);
+  for (size_t i = 0; i < count; ++i)
+  {
+    Counts total;
+    Counts* c = retired.counts[i].load(std::memory_order_relaxed);
+
+    if (c != nullptr)
+      FoldInto(&total, c);
+    for (ThreadShard* shard : shards)
+    {
+      c = shard->counts[i].load(std::memory_order_acquire);
+      if (c != nullptr)
+        FoldInto(&total, c);
+    }
+    if (total.count.load(std::memory_order_relaxed) == 0)
+      continue;
+
+    LatencySnapshot snapshot;
+    snapshot.name = endpoints[i]->name;
+    snapshot.count = total.count.load(std::memory_order_relaxed);
+    snapshot.sum = total.sum.load(std::memory_order_relaxed);
+    snapshot.buckets.resize(kHistogramBuckets);
+    snapshot.exemplars.resize(kHistogramBuckets);
+    for (size_t b = 0; b < kHistogramBuckets; ++b)
+    {
+      snapshot.buckets[b] = total.buckets[b].load(std::memory_order_relaxed);
+      if (!ReadExemplar(endpoints[i]->exemplars[b], &snapshot.exemplars[b]))
+        snapshot.exemplars[b].time = 0;
+    }
+    merged.push_back(std::move(snapshot));
+  }
+  merged_time = now;
+  return merged;
+}
+
+void RegisterLatencyHistogramCommands()
+{
+  RegisterControlCommand("histograms", "latency percentiles per endpoint",
+                         HistogramsCommand);
+  RegisterControlCommand("histogram",
+                         "<endpoint>: buckets and exemplar traces",
+                         HistogramCommand);
+}
+
+}  // namespace microservice_profile
@@ -0,0 +1,81 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_LATENCY_HISTOGRAM_H_
+#define MICROSERVICE_PROFILE_LATENCY_HISTOGRAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace microservice_profile
+{
+
+// Per-endpoint latency histograms. Each thread counts into its own shards
+// with plain relaxed stores, so recording takes no lock and no atomic
+// read-modify-write; the shards are summed when a snapshot is taken, at most
+// once per second. Buckets are log-linear: 2^kHistogramSubBits buckets per
+// power of two, from 1 ns to 2^kHistogramMaxExponent ns. When
+// kMaxHistogramEndpoints names are known, new ones are counted as "(other)".
+//
+// Each bucket also keeps a trace-id exemplar, refreshed at most every
+// kExemplarIntervalNs, pointing to a recent span of that latency.
+
+const int kHistogramSubBits = 3;
+const int kHistogramMaxExponent = 40;  // ~18 minutes
+const size_t kHistogramBuckets =
+    (kHistogramMaxExponent - kHistogramSubBits + 1) << kHistogramSubBits;
+const size_t kMaxHistogramEndpoints = 256;
+const size_t kHistogramNameSize = 64;
+const uint64_t kExemplarIntervalNs = 100000000ULL;  // 100 ms
+
+size_t HistogramBucket(uint64_t value);
+uint64_t HistogramBucketLowerBound(size_t bucket);
+
+// Records value_ns for the endpoint. trace_id (16 bytes) may be null; time_ns
+// is when the span ended.
+void RecordLatency(const char* name, size_t name_size, uint64_t value_ns,
+                   const uint8_t* trace_id, uint64_t time_ns);
+
+struct LatencyExemplar
+{
+  uint8_t trace_id[16];
+  uint64_t value;
+  uint64_t time;  // 0 if the bucket has no exemplar.
+};
+
+struct LatencySnapshot
+{
+  std::string name;
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  std::vector<uint64_t> buckets;
+  std::vector<LatencyExemplar> exemplars;
+
+  // Upper bound of the bucket holding the q-quantile, 0 <= q <= 1.
+  uint64_t Percentile(double q) const;
+};
+
+// Merged view of all the threads, including the ones that have exited.
+std::vector<LatencySnapshot> SnapshotLatencyHistograms();
+
+// Adds the "histograms" and "histogram <endpoint>" control commands.
+void RegisterLatencyHistogramCommands();
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_LATENCY_HISTOGRAM_H_
@@ -0,0 +1,59 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-base/latency_thresholds.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+namespace microservice_profile
+{
+
+LatencyThresholds::LatencyThresholds() : default_ns_(100 * 1000000ULL)
+{
+  const char* value = getenv("MICROSERVICE_PROFILE_TAIL_THRESHOLD_MS");
+  if (value != nullptr && *value != '\0')
+    default_ns_ = strtoull(value, nullptr, 10) * 1000000ULL;
+
+  // "endpoint=ms;endpoint=ms"
+  const char* list = getenv("MICROSERVICE_PROFILE_TAIL_THRESHOLDS");
+  for (const char* p = list; p != nullptr && *p != '\0';)
+  {
+    const char* end = strchr(p, ';');
+    if (end == nullptr)
+      end = p + strlen(p);
+    std::string entry(p, end);
+    size_t equal = entry.rfind('=');
+    if (equal != std::string::npos && equal > 0)
+    {
+      endpoints_ns_[entry.substr(0, equal)] =
+          strtoull(entry.c_str() + equal + 1, nullptr, 10) * 1000000ULL;
+    }
+    p = *end ? end + 1 : end;
+  }
+}
+
+uint64_t LatencyThresholds::Of(const char* endpoint, size_t endpoint_size) const
+{
+  if (!endpoints_ns_.empty())
+  {
+    auto it = endpoints_ns_.find(std::string(endpoint, endpoint_size));
+    if (it != endpoints_ns_.end())
+      return it->second;
+  }
+  return default_ns_;
+}
+
+}  // namespace microservice_profile
@@ -0,0 +1,46 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_LATENCY_THRESHOLDS_H_
+#define MICROSERVICE_PROFILE_LATENCY_THRESHOLDS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+
+namespace microservice_profile
+{
+
+// The latency above which a span of an endpoint is slow: from
+// MICROSERVICE_PROFILE_TAIL_THRESHOLDS ("endpoint=ms;endpoint=ms"), or
+// MICROSERVICE_PROFILE_TAIL_THRESHOLD_MS (100 by default) for the endpoints
+// it does not list.
+class LatencyThresholds
+{
+public:
+  LatencyThresholds();
+
+  uint64_t Of(const char* endpoint, size_t endpoint_size) const;
+
+private:
+  uint64_t default_ns_;
+  std::unordered_map<std::string, uint64_t> endpoints_ns_;
+};
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_LATENCY_THRESHOLDS_H_
@@ -0,0 +1,330 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-base/latency_tracker.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+#include "microservice-profile-base/fork_restart.h"
+#include "microservice-profile-base/get_monotonic_time.h"
+#include "microservice-profile-base/memory_budget.h"
+#include "microservice-profile-base/thread_filter.h"
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+// Longest sleep of the ticker, for a prompt exit when nothing is due.
+const uint64_t kMaxTickerSleepNs = 100000000ULL;
+
+}  // namespace
+
+struct LatencyTracker::Entry
+{
+  WheelTimer timer;  // Must stay first: timers are converted back to entries.
+  OpenSpan span;
+  bool slow_reported;
+  Entry* next;       // Hash chain or free list.
+};
+
+struct LatencyTracker::Shard
+{
+  std::mutex mutex;
+  TimingWheel wheel;
+  std::vector<Entry> entries;
+  std::vector<Entry*> buckets;
+  Entry* free_list = nullptr;
+
+  void Reset(size_t capacity)
+  {
+    wheel.Reset(0);
+    entries.assign(capacity, Entry());
+    buckets.assign(capacity, nullptr);
+    free_list = nullptr;
+    for (auto& entry : entries)
+    {
+      entry.next = free_list;
+      free_list = &entry;
+    }
+  }
+
+  Entry** Bucket(uint64_t span_id)
+  {
+    return &buckets[(span_id >> 4) & (buckets.size() - 1)];
+  }
+
+  void Unlink(Entry* entry)
+  {
+    for (Entry** p = Bucket(entry->span.span_id); *p; p = &(*p)->next)
+    {
+      if (*p == entry)
+      {
+        *p = entry->next;
+        break;
+      }
+    }
+    if (entry->timer.armed())
+      wheel.Disarm(&entry->timer);
+    entry->next = free_list;
+    free_list = entry;
+  }
+};
+
+LatencyTracker* LatencyTracker::instance_ = nullptr;
+
+LatencyTracker::LatencyTracker(const Options& options, AlertCallback callback)
+    : options_(options),
+      callback_(std::move(callback)),
+      epoch_(GetMonotonicTime()),
+      shards_(new Shard[kShards]),
+      stop_(false),
+      slow_spans_(0),
+      abandoned_spans_(0),
+      dropped_spans_(0)
+{
+  // Per-shard capacity, rounded up to a power of two for the hash buckets.
+  size_t capacity = 1;
+  while (capacity * kShards < options_.max_open_spans)
+    capacity <<= 1;
+
+  // Halving keeps it a power of two; refused, spans beyond one per shard
+  // are dropped.
+  size_t fixed = kShards * sizeof(Shard);
+  size_t unit = kShards * (sizeof(Entry) + sizeof(Entry*));
+  size_t reserved = ReserveMemoryUnits(kMemoryStackTables, fixed, unit,
+                                       capacity, 1);
+  if (reserved == 0)
+  {
+    reserved = 1;
+    ChargeMemory(kMemoryStackTables, fixed + unit);
+  }
+  if (reserved < capacity)
+    std::cerr << "Microservice-profiler: latency tracker reduced to "
+              << reserved * kShards << " open spans by the memory budget"
+              << std::endl;
+  capacity = reserved;
+  reserved_bytes_ = fixed + capacity * unit;
+
+  for (size_t i = 0; i < kShards; ++i)
+    shards_[i].Reset(capacity);
+}
+
+LatencyTracker::~LatencyTracker()
+{
+  stop_ = true;
+  if (ticker_ && ticker_->joinable())
+    ticker_->join();
+  if (instance_ == this)
+    instance_ = nullptr;
+  ReleaseMemory(kMemoryStackTables, reserved_bytes_);
+}
+
+bool LatencyTracker::Start()
+{
+  try
+  {
+    ticker_.reset(new std::thread(&LatencyTracker::TickerThread, this));
+  }
+  catch (const std::system_error& e)
+  {
+    std::cerr << "Microservice-profiler: "
+              << "Unable to start the latency tracker: " << e.what()
+              << std::endl;
+    return false;
+  }
+
+  if (instance_ == nullptr)
+  {
+    instance_ = this;
+    pthread_atfork(&LatencyTracker::PrepareFork,
+                   &LatencyTracker::ParentAfterFork,
+                   &LatencyTracker::ChildAfterFork);
+  }
+  return true;
+}
+
+LatencyTracker::Shard& LatencyTracker::ShardFor(uint64_t span_id)
+{
+  return shards_[span_id & (kShards - 1)];
+}
+
+uint64_t LatencyTracker::ToTicks(uint64_t time) const
+{
+  return (time - epoch_ + options_.tick_ns - 1) / options_.tick_ns;
+}
+
+void LatencyTracker::OnSpanStart(uint64_t span_id, const uint8_t* trace_id,
+                                 const char* name, size_t name_size)
+{
+  uint64_t now = GetMonotonicTime();
+  Shard& shard = ShardFor(span_id);
+  std::lock_guard<std::mutex> guard(shard.mutex);
+
+  Entry* entry = shard.free_list;
+  if (entry == nullptr)
+  {
+    dropped_spans_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  shard.free_list = entry->next;
+
+  entry->span.span_id = span_id;
+  memcpy(entry->span.trace_id, trace_id, sizeof(entry->span.trace_id));
+  if (name_size >= kTrackedSpanNameSize)
+    name_size = kTrackedSpanNameSize - 1;
+  memcpy(entry->span.name, name, name_size);
+  entry->span.name[name_size] = '\0';
+  entry->span.start = now;
+  entry->span.elapsed = 0;
+  entry->slow_reported = false;
+
+  Entry** bucket = shard.Bucket(span_id);
+  entry->next = *bucket;
+  *bucket = entry;
+
+  shard.wheel.Arm(&entry->timer, ToTicks(now + options_.threshold_ns));
+}
+
+void LatencyTracker::OnSpanEnd(uint64_t span_id)
+{
+  Shard& shard = ShardFor(span_id);
+  std::lock_guard<std::mutex> guard(shard.mutex);
+
+  for (Entry* entry = *shard.Bucket(span_id); entry; entry = entry->next)
+  {
+    if (entry->span.span_id == span_id)
+    {
+      shard.Unlink(entry);
+      return;
+    }
+  }
+}
+
+// Returns the tick of the next deadline, UINT64_MAX if none is armed.
+uint64_t LatencyTracker::Tick()
+{
+  uint64_t now = GetMonotonicTime();
+  // Deadlines round up and the current time rounds down, so that no span is
+  // reported before its deadline.
+  uint64_t ticks = (now - epoch_) / options_.tick_ns;
+  uint64_t next = UINT64_MAX;
+
+  alerts_.clear();
+  for (size_t i = 0; i < kShards; ++i)
+  {
+    Shard& shard = shards_[i];
+    std::lock_guard<std::mutex> guard(shard.mutex);
+
+    shard.wheel.Advance(ticks, [&](WheelTimer* timer) {
+      Entry* entry = reinterpret_cast<Entry*>(timer);
+      OpenSpan span = entry->span;
+      span.elapsed = now - span.start;
+
+      if (!entry->slow_reported)
+      {
+        // Keep watching it until it ends or is given up on.
+        entry->slow_reported = true;
+        shard.wheel.Arm(timer, ToTicks(span.start + options_.abandon_timeout_ns));
+        alerts_.emplace_back(SpanAlert::kSlow, span);
+      }
+      else
+      {
+        shard.Unlink(entry);
+        alerts_.emplace_back(SpanAlert::kAbandoned, span);
+      }
+    });
+    next = std::min(next, shard.wheel.NextExpiry());
+  }
+
+  // Callbacks run without any shard lock held.
+  for (const auto& alert : alerts_)
+  {
+    if (alert.first == SpanAlert::kSlow)
+      slow_spans_.fetch_add(1, std::memory_order_relaxed);
+    else
+      abandoned_spans_.fetch_add(1, std::memory_order_relaxed);
+    if (callback_)
+      callback_(alert.first, alert.second);
+  }
+  return next;
+}
+
+// Sleeps until the next deadline rather than for a tick: a span started
+// while the ticker sleeps is due a threshold later at the earliest.
+void LatencyTracker::TickerThread()
+{
+  MarkProfilerThread();
+
+  while (!stop_)
+  {
+    uint64_t next = Tick();
+    uint64_t now = GetMonotonicTime();
+    uint64_t wake = now + std::min(options_.threshold_ns, kMaxTickerSleepNs);
+    if (next != UINT64_MAX)
+      wake = std::min(wake, epoch_ + next * options_.tick_ns);
+    if (wake > now)
+      std::this_thread::sleep_for(std::chrono::nanoseconds(wake - now));
+  }
+}
+
+void LatencyTracker::PrepareFork()
+{
+  if (instance_ == nullptr)
+    return;
+  for (size_t i = 0; i < kShards; ++i)
+    instance_->shards_[i].mutex.lock();
+}
+
+void LatencyTracker::ParentAfterFork()
+{
+  if (instance_ == nullptr)
+    return;
+  for (size_t i = 0; i < kShards; ++i)
+    instance_->shards_[i].mutex.unlock();
+}
+
+void LatencyTracker::ChildAfterFork()
+{
+  if (instance_ == nullptr)
+    return;
+
+  // The spans in flight belong to the parent's threads: start afresh.
+  for (size_t i = 0; i < kShards; ++i)
+  {
+    Shard& shard = instance_->shards_[i];
+    shard.mutex.unlock();
+    shard.Reset(shard.entries.size());
+  }
+  instance_->epoch_ = GetMonotonicTime();
+
+  // The ticker thread does not exist in the child; leak its handle. The
+  // child's first span starts a new one.
+  instance_->ticker_.release();
+  DeferRestartAfterFork(&LatencyTracker::RestartAfterFork);
+}
+
+void LatencyTracker::RestartAfterFork()
+{
+  instance_->Start();
+}
+
+}  // namespace microservice_profile
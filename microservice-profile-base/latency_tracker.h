@@ -0,0 +1,121 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_LATENCY_TRACKER_H_
+#define MICROSERVICE_PROFILE_LATENCY_TRACKER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "microservice-profile-base/timing_wheel.h"
+
+namespace microservice_profile
+{
+
+// Maximum span name length kept by the tracker.
+const size_t kTrackedSpanNameSize = 48;
+
+enum class SpanAlert
+{
+  kSlow,       // Still open after the latency threshold.
+  kAbandoned,  // Still open after the abandon timeout; no longer tracked.
+};
+
+struct OpenSpan
+{
+  uint64_t span_id;
+  uint8_t trace_id[16];
+  char name[kTrackedSpanNameSize];
+  uint64_t start;    // CLOCK_MONOTONIC, ns.
+  uint64_t elapsed;  // ns, when the alert fired.
+};
+
+// In-process detector of spans that stay open too long, fed by span
+// start/end. Each open span is armed on a hierarchical timing wheel; a ticker
+// thread advances the wheels and reports spans that exceed the threshold
+// while still open, then forgets the ones that never end.
+class LatencyTracker
+{
+public:
+  typedef std::function<void(SpanAlert, const OpenSpan&)> AlertCallback;
+
+  struct Options
+  {
+    uint64_t threshold_ns = 100000000ULL;          // 100 ms
+    uint64_t abandon_timeout_ns = 60000000000ULL;  // 60 s
+    uint64_t tick_ns = 1000000ULL;                 // 1 ms
+    size_t max_open_spans = 16384;
+  };
+
+  LatencyTracker(const Options& options, AlertCallback callback);
+  ~LatencyTracker();
+
+  // Starts the ticker thread.
+  bool Start();
+
+  void OnSpanStart(uint64_t span_id, const uint8_t* trace_id,
+                   const char* name, size_t name_size);
+  void OnSpanEnd(uint64_t span_id);
+
+  // Counters.
+  uint64_t slow_spans() const { return slow_spans_.load(); }
+  uint64_t abandoned_spans() const { return abandoned_spans_.load(); }
+  uint64_t dropped_spans() const { return dropped_spans_.load(); }
+
+private:
+  struct Entry;
+  struct Shard;
+
+  static const size_t kShards = 16;
+
+  Shard& ShardFor(uint64_t span_id);
+  uint64_t ToTicks(uint64_t time) const;
+  uint64_t Tick();
+  void TickerThread();
+
+  static void PrepareFork();
+  static void ParentAfterFork();
+  static void ChildAfterFork();
+  static void RestartAfterFork();
+
+  Options options_;
+  AlertCallback callback_;
+  uint64_t epoch_;
+  std::unique_ptr<Shard[]> shards_;
+  size_t reserved_bytes_;  // Of the shards, in the memory budget.
+  std::unique_ptr<std::thread> ticker_;
+  std::atomic<bool> stop_;
+  // Ticker only. Not in the memory budget: scratch space, bounded by the
+  // open spans.
+  std::vector<std::pair<SpanAlert, OpenSpan>> alerts_;
+
+  std::atomic<uint64_t> slow_spans_;
+  std::atomic<uint64_t> abandoned_spans_;
+  std::atomic<uint64_t> dropped_spans_;
+
+  static LatencyTracker* instance_;
+};
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_LATENCY_TRACKER_H_
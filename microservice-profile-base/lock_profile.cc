@@ -0,0 +1,277 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-base/lock_profile.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <new>
+
+#include "microservice-profile-base/control_server.h"
+#include "microservice-profile-base/memory_budget.h"
+
+namespace microservice_profile
+{
+
+std::atomic<bool> lock_profiling_enabled(false);
+
+namespace
+{
+
+const char* const kLockKindNames[kLockKinds] = {
+    "mutex", "read", "write", "condition"};
+
+uint32_t stack_every = 16;
+
+// Charged to the memory budget for a hash table node besides its value,
+// and for a lock site.
+const size_t kNodeOverhead = 32;
+const size_t kSiteFootprint = kNodeOverhead + sizeof(void*) + sizeof(uintptr_t);
+
+thread_local uint32_t waits_until_stack = 0;
+
+void ChildAfterFork()
+{
+  GetLockProfile().Reset();
+}
+
+void LocksCommand(const std::string& args, std::string* output)
+{
+  size_t top = strtoul(args.c_str(), nullptr, 10);
+  GetLockProfile().Report(top > 0 ? top : 20, output);
+}
+
+}  // namespace
+
+const char* LockKindName(LockKind kind)
+{
+  return kLockKindNames[kind];
+}
+
+void LockProfile::Lock()
+{
+  while (lock_.test_and_set(std::memory_order_acquire))
+    sched_yield();
+}
+
+void LockProfile::Unlock()
+{
+  lock_.clear(std::memory_order_release);
+}
+
+uintptr_t LockProfile::SiteOf(const void* lock) const
+{
+  auto it = sites_.find(lock);
+  if (it != sites_.end())
+    return it->second;
+  it = old_sites_.find(lock);
+  return it != old_sites_.end() ? it->second : 0;
+}
+
+void LockProfile::RecordCreation(const void* lock, uintptr_t site)
+{
+  Lock();
+  // A lock initialized again, at the same address, moves to the new sites.
+  if (old_sites_.erase(lock) > 0)
+  {
+    ReleaseMemory(kMemoryStackTables, kSiteFootprint);
+    charged_ -= kSiteFootprint;
+  }
+  auto it = sites_.find(lock);
+  if (it != sites_.end())
+  {
+    it->second = site;
+    Unlock();
+    return;
+  }
+  if (sites_.size() >= options_.max_sites / 2)
+  {
+    // Locks freed without pthread_*_destroy would fill the table for good.
+    size_t dropped = old_sites_.size() * kSiteFootprint;
+    ReleaseMemory(kMemoryStackTables, dropped);
+    charged_ -= dropped;
+    old_sites_.swap(sites_);
+    sites_.clear();
+  }
+  if (ReserveMemory(kMemoryStackTables, kSiteFootprint))
+  {
+    sites_.emplace(lock, site);
+    charged_ += kSiteFootprint;
+  }
+  Unlock();
+}
+
+void LockProfile::ForgetLock(const void* lock)
+{
+  Lock();
+  if (sites_.erase(lock) > 0 || old_sites_.erase(lock) > 0)
+  {
+    ReleaseMemory(kMemoryStackTables, kSiteFootprint);
+    charged_ -= kSiteFootprint;
+  }
+  Unlock();
+}
+
+void LockProfile::RecordWait(const void* lock, LockKind kind,
+                             uint64_t wait_ns, uintptr_t caller,
+                             const char* endpoint, size_t endpoint_size,
+                             void* const* stack, size_t stack_size)
+{
+  Key key = {lock, kind, std::string(endpoint, endpoint_size)};
+
+  Lock();
+  auto it = entries_.find(key);
+  if (it == entries_.end())
+  {
+    // The key and the entry each hold the endpoint.
+    size_t footprint = kNodeOverhead + sizeof(Key) + sizeof(Entry) +
+                       2 * endpoint_size;
+    if (entries_.size() >= options_.max_entries ||
+        !ReserveMemory(kMemoryStackTables, footprint))
+    {
+      dropped_++;
+      Unlock();
+      return;
+    }
+    charged_ += footprint;
+    uintptr_t site = SiteOf(lock);
+    Entry entry = {lock, kind, key.endpoint, site != 0 ? site : caller,
+                   0, 0, 0, {}};
+    it = entries_.emplace(std::move(key), std::move(entry)).first;
+  }
+
+  Entry& entry = it->second;
+  entry.waits++;
+  entry.wait_ns += wait_ns;
+  entry.max_wait_ns = std::max(entry.max_wait_ns, wait_ns);
+  // A deeper stack than the entry has room for needs more memory: without
+  // it, the entry keeps its previous stack.
+  size_t grown = stack_size > entry.stack.capacity() ?
+                     (stack_size - entry.stack.capacity()) * sizeof(uintptr_t) :
+                     0;
+  if (stack_size > 0 &&
+      (grown == 0 || ReserveMemory(kMemoryStackTables, grown)))
+  {
+    charged_ += grown;
+    entry.stack.assign(reinterpret_cast<const uintptr_t*>(stack),
+                       reinterpret_cast<const uintptr_t*>(stack) + stack_size);
+  }
+  Unlock();
+}
+
+void LockProfile::Report(size_t top, std::string* output)
+{
+  std::vector<Entry> entries;
+  uint64_t dropped;
+
+  Lock();
+  entries.reserve(entries_.size());
+  for (const auto& entry : entries_)
+    entries.push_back(entry.second);
+  dropped = dropped_;
+  Unlock();
+
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry& a, const Entry& b) { return a.wait_ns > b.wait_ns; });
+  if (entries.size() > top)
+    entries.resize(top);
+
+  char line[256];
+  for (const Entry& entry : entries)
+  {
+    snprintf(line, sizeof(line),
+             "%p %s site=0x%lx waits=%lu wait_us=%lu max_us=%lu endpoint=",
+             entry.lock, LockKindName(entry.kind), (unsigned long) entry.site,
+             (unsigned long) entry.waits,
+             (unsigned long) (entry.wait_ns / 1000),
+             (unsigned long) (entry.max_wait_ns / 1000));
+    *output += line;
+    *output += entry.endpoint;
+    if (!entry.stack.empty())
+    {
+      *output += " stack=";
+      for (size_t i = 0; i < entry.stack.size(); i++)
+      {
+        snprintf(line, sizeof(line), "%s0x%lx", i > 0 ? "," : "",
+                 (unsigned long) entry.stack[i]);
+        *output += line;
+      }
+    }
+    *output += "\n";
+  }
+  if (dropped > 0)
+    *output += "dropped " + std::to_string(dropped) + "\n";
+}
+
+// Another thread may have been updating the tables when the process
+// forked: the child leaks them and starts over.
+void LockProfile::Reset()
+{
+  ReleaseMemory(kMemoryStackTables, charged_);
+  charged_ = 0;
+  new (&entries_) std::unordered_map<Key, Entry, KeyHash>();
+  new (&sites_) SiteTable();
+  new (&old_sites_) SiteTable();
+  dropped_ = 0;
+  lock_.clear();
+}
+
+bool StartLockProfiling()
+{
+  const char* enabled = getenv("MICROSERVICE_PROFILE_LOCKS");
+  if (enabled == nullptr || strcmp(enabled, "1") != 0)
+    return false;
+
+  if (LockProfilingEnabled())
+    return true;
+
+  const char* every = getenv("MICROSERVICE_PROFILE_LOCK_STACK_EVERY");
+  if (every != nullptr && *every != '\0')
+    stack_every = strtoul(every, nullptr, 10);
+
+  GetLockProfile();
+  pthread_atfork(nullptr, nullptr, ChildAfterFork);
+  RegisterControlCommand("locks",
+                         "contended locks by total wait [top]", LocksCommand);
+  lock_profiling_enabled.store(true);
+  return true;
+}
+
+LockProfile& GetLockProfile()
+{
+  // Never destroyed: the interposers may run after static destructors.
+  static LockProfile* profile = new LockProfile(LockProfile::Options());
+  return *profile;
+}
+
+bool SampleLockStack()
+{
+  if (stack_every == 0)
+    return false;
+  if (waits_until_stack > 0)
+  {
+    waits_until_stack--;
+    return false;
+  }
+  waits_until_stack = stack_every - 1;
+  return true;
+}
+
+}  // namespace microservice_profile
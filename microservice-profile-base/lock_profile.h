@@ -0,0 +1,151 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_LOCK_PROFILE_H_
+#define MICROSERVICE_PROFILE_LOCK_PROFILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace microservice_profile
+{
+
+enum LockKind
+{
+  kLockMutex,
+  kLockRead,       // pthread_rwlock_rdlock
+  kLockWrite,      // pthread_rwlock_wrlock
+  kLockCondition,  // pthread_cond_wait, keyed by the condition
+  kLockKinds,
+};
+
+const char* LockKindName(LockKind kind);
+
+// Contended lock acquisitions, per lock and endpoint: the number of waits,
+// their total and longest time, the site that initialized the lock and the
+// last sampled stack of a waiter. Locks whose initialization was not seen
+// (static initializers, std::mutex) are named by their first contended
+// caller instead. Fed by the pthread interposers of the
+// preloaded library.
+//
+// The pthread functions are interposed, this very code included: the tables
+// are guarded by a spinlock, never a pthread mutex.
+class LockProfile
+{
+public:
+  struct Options
+  {
+    size_t max_entries = 4096;
+    size_t max_sites = 65536;
+  };
+
+  struct Entry
+  {
+    const void* lock;
+    LockKind kind;
+    std::string endpoint;
+    uintptr_t site;  // Initializer, or first contended caller.
+    uint64_t waits;
+    uint64_t wait_ns;
+    uint64_t max_wait_ns;
+    std::vector<uintptr_t> stack;  // Innermost first.
+  };
+
+  explicit LockProfile(const Options& options) : options_(options) {}
+
+  LockProfile(const LockProfile&) = delete;
+  LockProfile& operator=(const LockProfile&) = delete;
+
+  // pthread_*_init and pthread_*_destroy. Locks freed without being
+  // destroyed age out: past max_sites, the older half of the sites is
+  // dropped.
+  void RecordCreation(const void* lock, uintptr_t site);
+  void ForgetLock(const void* lock);
+
+  // `caller` called the lock function, the site of a lock whose creation
+  // was not recorded.
+  void RecordWait(const void* lock, LockKind kind, uint64_t wait_ns,
+                  uintptr_t caller, const char* endpoint, size_t endpoint_size,
+                  void* const* stack, size_t stack_size);
+
+  // The `top` entries with the longest total wait, one per line.
+  void Report(size_t top, std::string* output);
+
+  // Forgets everything, for fork children.
+  void Reset();
+
+private:
+  struct Key
+  {
+    const void* lock;
+    LockKind kind;
+    std::string endpoint;
+
+    bool operator==(const Key& other) const
+    {
+      return lock == other.lock && kind == other.kind &&
+             endpoint == other.endpoint;
+    }
+  };
+
+  struct KeyHash
+  {
+    size_t operator()(const Key& key) const
+    {
+      return std::hash<const void*>()(key.lock) ^
+             (std::hash<std::string>()(key.endpoint) * 31 + key.kind);
+    }
+  };
+
+  typedef std::unordered_map<const void*, uintptr_t> SiteTable;
+
+  void Lock();
+  void Unlock();
+  uintptr_t SiteOf(const void* lock) const;
+
+  Options options_;
+  std::atomic_flag lock_ = ATOMIC_FLAG_INIT;
+  std::unordered_map<Key, Entry, KeyHash> entries_;
+  SiteTable sites_;
+  SiteTable old_sites_;  // Before sites_ filled up, dropped next time.
+  uint64_t dropped_ = 0;
+  size_t charged_ = 0;  // To the memory budget, by the tables.
+};
+
+extern std::atomic<bool> lock_profiling_enabled;
+
+inline bool LockProfilingEnabled()
+{
+  return lock_profiling_enabled.load(std::memory_order_relaxed);
+}
+
+// Reads MICROSERVICE_PROFILE_LOCKS and MICROSERVICE_PROFILE_LOCK_STACK_EVERY
+// and registers the "locks" control command. Returns true if enabled.
+bool StartLockProfiling();
+
+LockProfile& GetLockProfile();
+
+// True for one contended wait out of MICROSERVICE_PROFILE_LOCK_STACK_EVERY
+// in the calling thread: the waits whose stack is captured.
+bool SampleLockStack();
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_LOCK_PROFILE_H_
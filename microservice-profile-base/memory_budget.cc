@@ -0,0 +1,328 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-base/memory_budget.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+
+#include "microservice-profile-base/control_server.h"
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+const uint64_t kMB = 1 << 20;
+
+// Above this, a cgroup limit means no limit.
+const uint64_t kNoLimit = 1ULL << 60;
+
+struct Component
+{
+  const char* name;
+  uint64_t quota;
+  std::atomic<uint64_t> used;
+  std::atomic<uint64_t> peak;
+  std::atomic<uint64_t> denied;
+};
+
+Component components[kMemoryComponents] = {
+    {"rings", 0, {0}, {0}, {0}},
+    {"tables", 0, {0}, {0}, {0}},
+    {"annotations", 0, {0}, {0}, {0}},
+    {"spans", 0, {0}, {0}, {0}},
+};
+
+uint64_t cap = 0;
+uint64_t container_limit = 0;  // 0 without one.
+std::atomic<uint64_t> total_used(0);
+std::atomic<uint64_t> total_peak(0);
+
+// 0: not loaded, 1: being loaded, 2: loaded.
+std::atomic<int> load_state(0);
+
+// Reads a small file into `buffer`, null-terminated, without allocating.
+bool ReadSmallFile(const char* path, char* buffer, size_t size)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  ssize_t n = read(fd, buffer, size - 1);
+  close(fd);
+  if (n <= 0)
+    return false;
+  buffer[n] = '\0';
+  return true;
+}
+
+// A limit file holds a number of bytes, or "max".
+uint64_t ReadLimit(const char* path)
+{
+  char buffer[32];
+  if (!ReadSmallFile(path, buffer, sizeof(buffer)) || buffer[0] < '0' ||
+      buffer[0] > '9')
+    return 0;
+  uint64_t limit = strtoull(buffer, nullptr, 10);
+  return limit >= kNoLimit ? 0 : limit;
+}
+
+uint64_t MinLimit(uint64_t a, uint64_t b)
+{
+  if (a == 0)
+    return b;
+  if (b == 0)
+    return a;
+  return std::min(a, b);
+}
+
+// The lowest limit of a cgroup and its parents. `line` starts with the
+// group's path in the "/proc/self/cgroup" listing.
+uint64_t GroupLimit(const char* directory, const char* file, const char* line)
+{
+  char path[512];
+  uint64_t limit = 0;
+  size_t length = strcspn(line, "\n");
+
+  while (length > 0)
+  {
+    snprintf(path, sizeof(path), "%s%.*s/%s", directory, (int) length, line,
+             file);
+    limit = MinLimit(limit, ReadLimit(path));
+    while (length > 0 && line[length - 1] != '/')
+      length--;
+    if (length > 0)
+      length--;
+  }
+  return limit;
+}
+
+// The lowest memory.max of the cgroup (v2) of the process and its parents,
+// or memory.limit_in_bytes (v1). 0 when unlimited.
+uint64_t ReadContainerLimit()
+{
+  char cgroups[2048];
+  uint64_t limit = 0;
+
+  if (ReadSmallFile("/proc/self/cgroup", cgroups, sizeof(cgroups)))
+  {
+    // "0::/path/of/the/group" for v2, "4:memory:/path/of/the/group" for v1.
+    for (const char* line = cgroups; line != nullptr && *line != '\0';)
+    {
+      const char* v1 = strstr(line, ":memory:/");
+      const char* end = strchr(line, '\n');
+      if (strncmp(line, "0::/", 4) == 0)
+        limit = MinLimit(limit,
+                         GroupLimit("/sys/fs/cgroup", "memory.max", line + 3));
+      else if (v1 != nullptr && (end == nullptr || v1 < end))
+        limit = MinLimit(limit, GroupLimit("/sys/fs/cgroup/memory",
+                                           "memory.limit_in_bytes", v1 + 8));
+      line = end != nullptr ? end + 1 : nullptr;
+    }
+  }
+
+  // In a cgroup namespace, the root of the hierarchy is the container.
+  limit = MinLimit(limit, ReadLimit("/sys/fs/cgroup/memory.max"));
+  limit = MinLimit(limit,
+                   ReadLimit("/sys/fs/cgroup/memory/memory.limit_in_bytes"));
+  return limit;
+}
+
+// "rings=64,tables=16": quotas in MB.
+void ParseQuotas(const char* value)
+{
+  while (value != nullptr && *value != '\0')
+  {
+    const char* equal = strchr(value, '=');
+    if (equal == nullptr)
+      break;
+    for (Component& component : components)
+    {
+      size_t length = strlen(component.name);
+      if ((size_t) (equal - value) == length &&
+          strncmp(value, component.name, length) == 0)
+        component.quota = strtoull(equal + 1, nullptr, 10) * kMB;
+    }
+    value = strchr(equal, ',');
+    if (value != nullptr)
+      value++;
+  }
+}
+
+// Only reads the environment and a few files, without allocating: the
+// first charge may come from inside malloc or from a signal handler.
+void Load()
+{
+  const char* value = getenv("MICROSERVICE_PROFILE_MEMORY_MB");
+  cap = (value != nullptr && *value != '\0' ? strtoull(value, nullptr, 10)
+                                            : 256) * kMB;
+
+  uint64_t percent = 10;
+  value = getenv("MICROSERVICE_PROFILE_MEMORY_PCT");
+  if (value != nullptr && atoi(value) > 0 && atoi(value) <= 100)
+    percent = atoi(value);
+  container_limit = ReadContainerLimit();
+  if (container_limit != 0)
+    cap = std::min(cap, container_limit / 100 * percent);
+
+  for (Component& component : components)
+    component.quota = cap / 2;
+  ParseQuotas(getenv("MICROSERVICE_PROFILE_MEMORY_QUOTAS"));
+}
+
+// False while another caller loads the quotas: it may be interrupted by a
+// signal handler on its own thread, which must not wait for it. The quotas
+// are not known yet, reservations are refused until they are.
+bool EnsureLoaded()
+{
+  if (load_state.load(std::memory_order_acquire) == 2)
+    return true;
+
+  int expected = 0;
+  if (!load_state.compare_exchange_strong(expected, 1))
+    return false;
+  Load();
+  load_state.store(2, std::memory_order_release);
+  return true;
+}
+
+void UpdatePeak(std::atomic<uint64_t>& peak, uint64_t value)
+{
+  uint64_t current = peak.load(std::memory_order_relaxed);
+  while (value > current &&
+         !peak.compare_exchange_weak(current, value, std::memory_order_relaxed))
+    ;
+}
+
+void AppendKB(std::string* output, uint64_t bytes)
+{
+  *output += '\t';
+  *output += std::to_string(bytes >> 10);
+}
+
+void MemoryCommand(const std::string&, std::string* output)
+{
+  EnsureLoaded();
+
+  *output += "component\tused_kb\tpeak_kb\tquota_kb\tdenied\n";
+  for (Component& component : components)
+  {
+    *output += component.name;
+    AppendKB(output, component.used.load());
+    AppendKB(output, component.peak.load());
+    AppendKB(output, component.quota);
+    *output += '\t';
+    *output += std::to_string(component.denied.load());
+    *output += '\n';
+  }
+  *output += "total";
+  AppendKB(output, total_used.load());
+  AppendKB(output, total_peak.load());
+  AppendKB(output, cap);
+  *output += "\t-\n";
+  if (container_limit != 0)
+    *output += "container limit " + std::to_string(container_limit >> 20) +
+               " MB\n";
+}
+
+}  // namespace
+
+bool ReserveMemory(MemoryComponent component, size_t bytes)
+{
+  Component& target = components[component];
+  if (!EnsureLoaded())
+  {
+    target.denied.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  uint64_t used = target.used.load(std::memory_order_relaxed);
+  do
+  {
+    if (used + bytes > target.quota)
+    {
+      target.denied.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+  } while (!target.used.compare_exchange_weak(used, used + bytes,
+                                              std::memory_order_relaxed));
+
+  uint64_t total = total_used.load(std::memory_order_relaxed);
+  do
+  {
+    if (total + bytes > cap)
+    {
+      target.used.fetch_sub(bytes, std::memory_order_relaxed);
+      target.denied.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+  } while (!total_used.compare_exchange_weak(total, total + bytes,
+                                             std::memory_order_relaxed));
+
+  UpdatePeak(target.peak, used + bytes);
+  UpdatePeak(total_peak, total + bytes);
+  return true;
+}
+
+void ChargeMemory(MemoryComponent component, size_t bytes)
+{
+  // Counted even before the quotas are loaded: they do not apply here.
+  EnsureLoaded();
+  Component& target = components[component];
+
+  UpdatePeak(target.peak, target.used.fetch_add(bytes) + bytes);
+  UpdatePeak(total_peak, total_used.fetch_add(bytes) + bytes);
+}
+
+void ReleaseMemory(MemoryComponent component, size_t bytes)
+{
+  components[component].used.fetch_sub(bytes, std::memory_order_relaxed);
+  total_used.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+size_t ReserveMemoryUnits(MemoryComponent component, size_t fixed, size_t unit,
+                          size_t units, size_t min_units)
+{
+  for (; units >= min_units && units > 0; units /= 2)
+  {
+    if (ReserveMemory(component, fixed + units * unit))
+      return units;
+  }
+  return 0;
+}
+
+bool MemoryUnderPressure()
+{
+  if (!EnsureLoaded())
+    return false;
+  return total_used.load(std::memory_order_relaxed) > cap - cap / 8;
+}
+
+void RegisterMemoryCommands()
+{
+  RegisterControlCommand("memory",
+                         "usage, peak and quota of the profiler's buffers",
+                         MemoryCommand);
+}
+
+}  // namespace microservice_profile
@@ -0,0 +1,77 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_MEMORY_BUDGET_H_
+#define MICROSERVICE_PROFILE_MEMORY_BUDGET_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace microservice_profile
+{
+
+// The profiler's own buffers, by kind. Each kind has a quota, and all of
+// them together a cap: MICROSERVICE_PROFILE_MEMORY_MB (256 by default),
+// lowered to MICROSERVICE_PROFILE_MEMORY_PCT percent (10 by default) of the
+// memory limit of the container (cgroup) when there is one. Quotas default
+// to half of the cap and are set with MICROSERVICE_PROFILE_MEMORY_QUOTAS,
+// e.g. "rings=64,tables=16" (MB).
+//
+// What a component does when refused depends on it: rings and preallocated
+// tables are made smaller, tables stop taking new entries, held records are
+// evicted.
+enum MemoryComponent
+{
+  // Flight recorder, node daemon ring, span sink ring and batches, perf
+  // counter pages.
+  kMemorySampleRings,
+  // Windowed, heap, lock and differential profiles, latency histograms and
+  // tracker, critical path and schedstat aggregates.
+  kMemoryStackTables,
+  // Relay record buffers, records held for retention, annotation blocks.
+  kMemoryAnnotations,
+  kMemorySpanPools,     // Recordables of the profiling span processor.
+  kMemoryComponents
+};
+
+// Charges `bytes` to a component. Returns false, charging nothing, when the
+// component would go over its quota or the profiler over its cap. Lock-free
+// and never allocates: it may be called from inside malloc.
+bool ReserveMemory(MemoryComponent component, size_t bytes);
+
+// Charges `bytes` even over the quota and the cap, for memory the profiler
+// cannot refuse (the recordables of the application's spans) or that grew
+// past what was reserved. It still counts: the others are refused earlier.
+void ChargeMemory(MemoryComponent component, size_t bytes);
+
+void ReleaseMemory(MemoryComponent component, size_t bytes);
+
+// For a buffer of `fixed` bytes plus `units` units of `unit` bytes, sized
+// once: reserves it with as many units as fit, halving them down to
+// `min_units`. Returns the number of units reserved, 0 if none.
+size_t ReserveMemoryUnits(MemoryComponent component, size_t fixed, size_t unit,
+                          size_t units, size_t min_units);
+
+// True when the profiler uses more than 7/8 of its cap: detail that only
+// costs memory, such as a span per syscall, is given up.
+bool MemoryUnderPressure();
+
+// Registers the "memory" control command, which reports the usage, peak,
+// quota and refusals of each component.
+void RegisterMemoryCommands();
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_MEMORY_BUDGET_H_
@@ -25,6 +25,7 @@
 
 #include "microservice-profile-base/profiling_timer.h"
 #include "microservice-profile-base/signal_handler.h"
+#include "microservice-profile-base/thread_filter.h"
 
 extern "C" {
 #include "microservice-profile-base/module_api.h"
@@ -40,28 +41,6 @@ const long kTimerPeriod = 1000;  // 1 ms
 //  in order to generate an off_cpu_sample event (nanoseconds).
 const long minSpanDuration = 100000; // 0.1 ms
 
-// Signal
-const int kSignal = SIGPROF;
-
-bool InstallSignalHandler()
-{
-  struct sigaction sigact;
-  struct sigaction sigact_old;
-
-  memset(&sigact, 0, sizeof(sigact));
-  sigact.sa_sigaction = &microservice_profile::SignalHandler;
-  sigact.sa_flags = SA_RESTART | SA_SIGINFO;
-  int ret = sigaction(kSignal, &sigact, &sigact_old);
-
-  if (ret != 0)
-  {
-    sigaction(kSignal, &sigact_old, &sigact);
-    return false;
-  }
-
-  return true;
-}
-
 }  // namespace
 
 void StartMicroserviceProfile()
@@ -71,7 +50,7 @@ void StartMicroserviceProfile()
   //unw_set_caching_policy(unw_local_addr_space, UNW_CACHE_PER_THREAD);
 
   // Install the signal handler.
-   if (!InstallSignalHandler())
+   if (!microservice_profile::InstallSignalHandler())
   {
     std::cerr << "LTTng-profile: "
               << "Unable to install a SIGPROF signal handler. "
@@ -96,5 +75,37 @@ void StartMicroserviceProfile()
               << "Microservice is not registered."
 	      	  << " -- return value : " << ret
               << std::endl;
+    return;
   }
+
+  // Threads excluded before registration are enrolled with the process.
+  microservice_profile::ReplayThreadFilter();
+}
+
+int RegisterMonitoringThread()
+{
+  return microservice_profile::TrackCurrentThread(true);
+}
+
+int UnregisterMonitoringThread()
+{
+  return microservice_profile::TrackCurrentThread(false);
+}
+
+void BeginMonitoringSdkThreads()
+{
+  microservice_profile::BeginSdkThreadCreation();
+}
+
+void EndMonitoringSdkThreads()
+{
+  microservice_profile::EndSdkThreadCreation();
+}
+
+int SetMonitoringThreadFilter(const char* include_patterns,
+                              const char* exclude_patterns)
+{
+  microservice_profile::SetThreadFilter(include_patterns, exclude_patterns);
+  microservice_profile::ApplyThreadFilter();
+  return 0;
 }
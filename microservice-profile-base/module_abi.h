@@ -18,28 +18,77 @@
 #ifndef MICROSERVICE_PROFILER_MODULE_ABI_H_
 #define MICROSERVICE_PROFILER_MODULE_ABI_H_
 
+#include <stdint.h>
+
 #define SERVICE_NAME_MAX_SIZE 28
 
 #define MODULE_CONTROL_FILE "mod_ctl"
 #define SPAN_LATENCY_TRACKER_PROC_PATH "/proc/latency-tracker-spans/" MODULE_CONTROL_FILE
 
 
+/*
+ * REGISTER/UNREGISTER act on the whole process when it is not registered yet
+ * and on the calling thread otherwise. The *_THREAD commands opt another
+ * thread (msg.tid) of a registered process in or out; the calling thread
+ * is unregistered with UNREGISTER, which every version of the module knows.
+ * SET_SPAN_SLOT gives the module the address of the calling thread's span
+ * slot (msg.span_slot, 0 to forget it).
+ */
 enum microservice_profiler_module_cmd {
   MICROSERVICE_PROFILER_MODULE_REGISTER = 0,
   MICROSERVICE_PROFILER_MODULE_UNREGISTER = 1,
+  MICROSERVICE_PROFILER_MODULE_REGISTER_THREAD = 2,
+  MICROSERVICE_PROFILER_MODULE_UNREGISTER_THREAD = 3,
+  MICROSERVICE_PROFILER_MODULE_SET_SPAN_SLOT = 4,
 };
 
 /*
- * Structure to send messages to the kernel module.
+ * Structure to send messages to the kernel module. The fields after
+ * service_name are appended: a module that knows only the first 32 bytes
+ * reads REGISTER and UNREGISTER as before.
  */
 struct microservice_profiler_module_msg {
   int cmd;                 /* Command */
   char service_name[SERVICE_NAME_MAX_SIZE];
+  int tid;                 /* Target of the *_THREAD commands, 0 for caller */
+  uint64_t span_slot;      /* SET_SPAN_SLOT: user address of the slot */
 
   //long latency_threshold;  /* Latency threshold to identify long spans. */
 } __attribute__((packed));
 
+/*
+ * The span a thread works on, in the thread's own memory. Spans of async
+ * executors and coroutines hop between threads: the slot tells the module,
+ * without a syscall, which span the syscalls and samples of the thread
+ * belong to right now. The module reads it at syscall entry.
+ *
+ * seq is odd while the slot is written; readers retry or skip it. active is
+ * 0 when the thread works on no span, and the ids are then meaningless.
+ */
+struct microservice_profiler_span_slot {
+  uint32_t seq;
+  uint32_t active;
+  uint8_t span_id[8];
+  uint8_t trace_id[16];
+} __attribute__((aligned(32)));
+
 
 #define MICROSERVICE_PROFILER_MODULE_IOCTL  _IO(0xF6, 0x91)
 
+#define SYSCALL_NAME_MAX_SIZE 16
+#define MAX_SYSCALLS_PER_RECORD 256
+#define RELAY_RECORD_HEADER_SIZE 64
+
+/*
+ * Relay channel records: a RELAY_RECORD_HEADER_SIZE header (number of
+ * syscalls as a 32-bit integer, then the span id in hex at offset 16 and the
+ * trace id in hex at offset 32), followed by that many syscall descriptors.
+ */
+struct syscall_desc {
+  char name[SYSCALL_NAME_MAX_SIZE];  /* Not null-terminated when full */
+  uint64_t start_system;
+  uint64_t start_steady;
+  uint64_t end_steady;
+};
+
 #endif
@@ -34,14 +34,17 @@ struct microservice_profiler_module_state {
 static struct microservice_profiler_module_state* state = NULL;
 
 static int microservice_profiler_module_ioctl(
-	long latency_threshold, int cmd)
+	long latency_threshold, int cmd, int tid, uint64_t span_slot)
 {
 	struct microservice_profiler_module_msg info;
 
 	if (!(state && state->fd))
 		return -1;
 
+	memset(&info, 0, sizeof(info));
 	info.cmd = cmd;
+	info.tid = tid;
+	info.span_slot = span_slot;
 	strncpy(info.service_name, "Test Service", SERVICE_NAME_MAX_SIZE);
 	//info.latency_threshold = latency_threshold;
 
@@ -78,7 +81,7 @@ int microservice_profiler_module_register(long latency_threshold)
 
 	/* install signal handler before registration */
 	ret = microservice_profiler_module_ioctl(
-		latency_threshold, MICROSERVICE_PROFILER_MODULE_REGISTER);
+		latency_threshold, MICROSERVICE_PROFILER_MODULE_REGISTER, 0, 0);
 
 	if (ret != 0)
 		goto error_ioctl;
@@ -96,18 +99,54 @@ int microservice_profiler_module_unregister()
 {
 	int ret = 0;
 	if (microservice_profiler_module_is_registered()) {
-		ret = microservice_profiler_module_ioctl(0, MICROSERVICE_PROFILER_MODULE_UNREGISTER);
+		ret = microservice_profiler_module_ioctl(0, MICROSERVICE_PROFILER_MODULE_UNREGISTER, 0, 0);
 		fclose(state->fd);
 		FREE(state);
 	}
 	return ret;
 }
 
-int UnregisterMonitoringThread()
+int microservice_profiler_module_reset_after_fork()
 {
-	int ret = 0;
-	if (microservice_profiler_module_is_registered()) {
-		ret = microservice_profiler_module_ioctl(0, MICROSERVICE_PROFILER_MODULE_UNREGISTER);
+	/*
+	 * The inherited registration belongs to the parent's pid: drop it
+	 * without telling the module, the parent is still registered.
+	 */
+	if (state) {
+		if (state->fd)
+			fclose(state->fd);
+		FREE(state);
 	}
-	return ret;
+	return 0;
+}
+
+int microservice_profiler_module_register_thread(int tid)
+{
+	if (!microservice_profiler_module_is_registered())
+		return -1;
+	return microservice_profiler_module_ioctl(0,
+		MICROSERVICE_PROFILER_MODULE_REGISTER_THREAD, tid, 0);
+}
+
+int microservice_profiler_module_unregister_thread(int tid)
+{
+	if (!microservice_profiler_module_is_registered())
+		return -1;
+	/* Older modules ignore UNREGISTER_THREAD: the calling thread keeps
+	 * the command they know */
+	if (tid == 0)
+		return microservice_profiler_module_ioctl(0,
+			MICROSERVICE_PROFILER_MODULE_UNREGISTER, 0, 0);
+	return microservice_profiler_module_ioctl(0,
+		MICROSERVICE_PROFILER_MODULE_UNREGISTER_THREAD, tid, 0);
+}
+
+int microservice_profiler_module_set_span_slot(
+	struct microservice_profiler_span_slot* slot)
+{
+	if (!microservice_profiler_module_is_registered())
+		return -1;
+	return microservice_profiler_module_ioctl(0,
+		MICROSERVICE_PROFILER_MODULE_SET_SPAN_SLOT, 0,
+		(uint64_t) (uintptr_t) slot);
 }
@@ -48,4 +48,45 @@ int microservice_profiler_module_register(long latency_threshold);
  */
 int microservice_profiler_module_unregister();
 
+/*
+ * Start tracking a thread again after it was unregistered. The process must
+ * be registered.
+ *
+ * @tid: Thread to track, 0 for the calling thread.
+ *
+ * Return: 0 in case of success, error code otherwise
+ */
+int microservice_profiler_module_register_thread(int tid);
+
+/*
+ * Stop tracking a thread; the other threads of the process stay registered.
+ * The process must be registered.
+ *
+ * @tid: Thread to stop tracking, 0 for the calling thread.
+ *
+ * Return: 0 in case of success, error code otherwise
+ */
+int microservice_profiler_module_unregister_thread(int tid);
+
+/*
+ * Tell the module where the calling thread publishes the span it works on
+ * (see struct microservice_profiler_span_slot). The process must be
+ * registered.
+ *
+ * @slot: Slot of the calling thread, NULL to forget it.
+ *
+ * Return: 0 in case of success, error code otherwise
+ */
+struct microservice_profiler_span_slot;
+int microservice_profiler_module_set_span_slot(
+	struct microservice_profiler_span_slot* slot);
+
+/*
+ * Forget the registration state inherited from the parent process. Must be
+ * called in a forked child before registering it under its own pid.
+ *
+ * Return: 0 in case of success, error code otherwise
+ */
+int microservice_profiler_module_reset_after_fork();
+
 #endif  // MICROSERVICE_PROFILE_MODULE_API_H_
@@ -0,0 +1,274 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-base/node_client.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <new>
+#include <string>
+
+#include "microservice-profile-base/fork_restart.h"
+#include "microservice-profile-base/memory_budget.h"
+#include "microservice-profile-base/node_ring.h"
+#include "microservice-profile-base/signal_handler.h"
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+const size_t kMaxFrames = 64;
+const size_t kEndpointSize = 48;
+
+std::string socket_path;
+uint64_t capacity = 8 << 20;
+
+int socket_fd = -1;
+void* mapping = nullptr;
+
+// Placement storage: fork children make their writer without malloc.
+alignas(NodeRingWriter) char writer_storage[sizeof(NodeRingWriter)];
+std::atomic<NodeRingWriter*> writer(nullptr);
+
+// Creates a ring and hands it to the daemon. Only makes system calls, so
+// that fork children can call it.
+bool Connect(const char** error)
+{
+  size_t size = NodeRingMappingSize(capacity);
+  int fd = memfd_create("microservice-profile-ring",
+                        MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+  {
+    *error = "memfd_create";
+    return false;
+  }
+  // Sealed at its size: the daemon maps it without fearing SIGBUS.
+  if (ftruncate(fd, size) != 0 ||
+      fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0)
+  {
+    *error = "ftruncate";
+    close(fd);
+    return false;
+  }
+  void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (memory == MAP_FAILED)
+  {
+    *error = "mmap";
+    close(fd);
+    return false;
+  }
+  NodeRingWriter* ring = new (writer_storage)
+      NodeRingWriter(memory, capacity, getpid());
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0 ||
+      connect(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0)
+  {
+    *error = "connect";
+    if (sock >= 0)
+      close(sock);
+    munmap(memory, size);
+    close(fd);
+    return false;
+  }
+
+  // One byte, carrying the memfd.
+  char byte = 0;
+  struct iovec iov = {&byte, 1};
+  union
+  {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  ssize_t sent;
+  do
+    sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  while (sent < 0 && errno == EINTR);
+  close(fd);
+  if (sent != 1)
+  {
+    *error = "sendmsg";
+    close(sock);
+    munmap(memory, size);
+    return false;
+  }
+
+  // The daemon notices the process exit when the socket closes.
+  socket_fd = sock;
+  mapping = memory;
+  writer.store(ring, std::memory_order_release);
+  return true;
+}
+
+// The CPU sample sink.
+void SendNodeCpuSample(void* const* stack, size_t depth)
+{
+  NodeRingWriter* ring = writer.load(std::memory_order_acquire);
+  if (ring == nullptr)
+    return;
+
+  uint64_t frames[kMaxFrames];
+  char endpoint[kEndpointSize];
+  NodeCpuSample sample;
+
+  sample.depth = std::min(depth, kMaxFrames);
+  for (size_t i = 0; i < sample.depth; i++)
+    frames[i] = reinterpret_cast<uintptr_t>(stack[i]);
+  sample.endpoint_size = SampleEndpoint(endpoint, sizeof(endpoint));
+  sample.tid = syscall(SYS_gettid);
+  ring->Write(kNodeRecordCpuSample, &sample, sizeof(sample), frames,
+              sample.depth * sizeof(uint64_t), endpoint, sample.endpoint_size);
+}
+
+// Registers a forked child with its own ring, on its first span.
+void ReconnectAfterFork()
+{
+  if (!ReserveMemory(kMemorySampleRings, NodeRingMappingSize(capacity)))
+    return;
+
+  const char* error;
+  if (!Connect(&error))
+  {
+    std::cerr << "Microservice-profiler: "
+              << "Unable to connect to the node daemon (" << error
+              << "): " << strerror(errno) << std::endl;
+    ReleaseMemory(kMemorySampleRings, NodeRingMappingSize(capacity));
+  }
+}
+
+// The parent's ring is the parent's: the child drops it, and hands over one
+// of its own if it ever starts a span. A child that calls exec right away
+// never registers with the daemon.
+void ChildAfterFork()
+{
+  writer.store(nullptr);
+  if (socket_fd >= 0)
+    close(socket_fd);
+  if (mapping != nullptr)
+  {
+    munmap(mapping, NodeRingMappingSize(capacity));
+    ReleaseMemory(kMemorySampleRings, NodeRingMappingSize(capacity));
+  }
+  socket_fd = -1;
+  mapping = nullptr;
+  DeferRestartAfterFork(ReconnectAfterFork);
+}
+
+}  // namespace
+
+bool StartNodeClient()
+{
+  const char* path = getenv("MICROSERVICE_PROFILE_NODE_SOCKET");
+  if (path == nullptr || *path == '\0')
+    return false;
+
+  if (NodeClientConnected())
+    return true;
+
+  // A power of two, for the ring offsets.
+  const char* value = getenv("MICROSERVICE_PROFILE_NODE_RING_MB");
+  if (value != nullptr && atol(value) > 0)
+  {
+    uint64_t bytes = (uint64_t) std::min(atol(value), 1024L) << 20;
+    capacity = 1 << 20;
+    while (capacity < bytes)
+      capacity <<= 1;
+  }
+
+  // Halving keeps it a power of two.
+  uint64_t megabytes = ReserveMemoryUnits(
+      kMemorySampleRings, NodeRingMappingSize(0), 1 << 20, capacity >> 20, 1);
+  if (megabytes == 0)
+  {
+    std::cerr << "Microservice-profiler: no memory left in the budget for "
+              << "the node daemon ring" << std::endl;
+    return false;
+  }
+  capacity = megabytes << 20;
+
+  socket_path = path;
+  const char* error;
+  if (!Connect(&error))
+  {
+    std::cerr << "Microservice-profiler: "
+              << "Unable to connect to the node daemon at " << path << " ("
+              << error << "): " << strerror(errno) << std::endl;
+    ReleaseMemory(kMemorySampleRings, NodeRingMappingSize(capacity));
+    return false;
+  }
+  pthread_atfork(nullptr, nullptr, ChildAfterFork);
+
+  AddCpuSampleSink(SendNodeCpuSample);
+  StartCpuSampling();
+  return true;
+}
+
+bool NodeClientConnected()
+{
+  return writer.load(std::memory_order_relaxed) != nullptr;
+}
+
+bool SendNodeAnnotation(const uint8_t* span_id, const uint8_t* trace_id,
+                        const char* endpoint, size_t endpoint_size,
+                        uint32_t nb_syscalls,
+                        const struct syscall_desc* syscalls)
+{
+  NodeRingWriter* ring = writer.load(std::memory_order_acquire);
+  if (ring == nullptr)
+    return false;
+
+  NodeAnnotation annotation;
+  memcpy(annotation.span_id, span_id, sizeof(annotation.span_id));
+  memcpy(annotation.trace_id, trace_id, sizeof(annotation.trace_id));
+  annotation.nb_syscalls = nb_syscalls;
+  annotation.endpoint_size = endpoint_size;
+  ring->Write(kNodeRecordAnnotation, &annotation, sizeof(annotation),
+              syscalls, nb_syscalls * sizeof(struct syscall_desc), endpoint,
+              endpoint_size);
+  return true;
+}
+
+}  // namespace microservice_profile
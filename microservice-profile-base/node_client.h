@@ -0,0 +1,44 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_NODE_CLIENT_H_
+#define MICROSERVICE_PROFILE_NODE_CLIENT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "microservice-profile-base/module_abi.h"
+
+namespace microservice_profile
+{
+
+// Reads MICROSERVICE_PROFILE_NODE_SOCKET and, if set, hands a ring of
+// MICROSERVICE_PROFILE_NODE_RING_MB megabytes (8 by default) to the node
+// daemon listening there (see node_ring.h), and feeds it the CPU samples.
+// Fork children hand over a ring of their own. Returns true if connected.
+bool StartNodeClient();
+
+bool NodeClientConnected();
+
+// Hands a relay record to the daemon. Returns false when not connected:
+// the record is then the process' to handle.
+bool SendNodeAnnotation(const uint8_t* span_id, const uint8_t* trace_id,
+                        const char* endpoint, size_t endpoint_size,
+                        uint32_t nb_syscalls,
+                        const struct syscall_desc* syscalls);
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_NODE_CLIENT_H_
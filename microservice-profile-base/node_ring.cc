@@ -0,0 +1,165 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-base/node_ring.h"
+
+#include <string.h>
+
+#include <new>
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+// A record starts with a 32-bit word, the rest of its 8 bytes unused:
+// its size, header included, and its type in the top bits.
+const size_t kRecordHeaderSize = 8;
+const uint32_t kSizeBits = 28;
+const uint32_t kSizeMask = (1u << kSizeBits) - 1;
+
+inline std::atomic<uint32_t>* RecordWord(uint8_t* data, uint64_t offset)
+{
+  return reinterpret_cast<std::atomic<uint32_t>*>(data + offset);
+}
+
+inline size_t Align8(size_t size)
+{
+  return (size + 7) & ~(size_t) 7;
+}
+
+}  // namespace
+
+NodeRingWriter::NodeRingWriter(void* memory, uint64_t capacity, uint32_t pid)
+    : header_(new (memory) NodeRingHeader()),
+      data_(static_cast<uint8_t*>(memory) + kNodeRingDataOffset),
+      mask_(capacity - 1)
+{
+  header_->magic = kNodeRingMagic;
+  header_->version = kNodeRingVersion;
+  header_->pid = pid;
+  header_->reserved = 0;
+  header_->capacity = capacity;
+  header_->head.store(0, std::memory_order_relaxed);
+  header_->tail.store(0, std::memory_order_relaxed);
+  header_->dropped.store(0, std::memory_order_relaxed);
+}
+
+bool NodeRingWriter::Write(NodeRecordType type, const void* part0,
+                           size_t size0, const void* part1, size_t size1,
+                           const void* part2, size_t size2)
+{
+  uint64_t capacity = mask_ + 1;
+  size_t size = Align8(kRecordHeaderSize + size0 + size1 + size2);
+
+  // A quarter of the ring at most, so that padding never wastes most of it.
+  if (size > capacity / 4 || size > kSizeMask)
+  {
+    header_->dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  uint64_t head = header_->head.load(std::memory_order_relaxed);
+  uint64_t padding;
+  for (;;)
+  {
+    uint64_t offset = head & mask_;
+    padding = offset + size > capacity ? capacity - offset : 0;
+    uint64_t tail = header_->tail.load(std::memory_order_acquire);
+    if (head + padding + size - tail > capacity)
+    {
+      header_->dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    if (header_->head.compare_exchange_weak(head, head + padding + size,
+                                            std::memory_order_acq_rel))
+      break;
+  }
+
+  if (padding > 0)
+    RecordWord(data_, head & mask_)
+        ->store(padding | (uint32_t) kNodeRecordPadding << kSizeBits,
+                std::memory_order_release);
+
+  uint64_t offset = (head + padding) & mask_;
+  uint8_t* payload = data_ + offset + kRecordHeaderSize;
+  memcpy(payload, part0, size0);
+  if (size1 > 0)
+    memcpy(payload + size0, part1, size1);
+  if (size2 > 0)
+    memcpy(payload + size0 + size1, part2, size2);
+
+  RecordWord(data_, offset)
+      ->store(size | (uint32_t) type << kSizeBits, std::memory_order_release);
+  return true;
+}
+
+bool NodeRingReader::Attach(void* memory, size_t size)
+{
+  if (size < kNodeRingDataOffset)
+    return false;
+
+  NodeRingHeader* header = static_cast<NodeRingHeader*>(memory);
+  uint64_t capacity = header->capacity;
+  if (header->magic != kNodeRingMagic ||
+      header->version != kNodeRingVersion || capacity == 0 ||
+      (capacity & (capacity - 1)) != 0 ||
+      capacity > size - kNodeRingDataOffset)
+    return false;
+
+  header_ = header;
+  data_ = static_cast<uint8_t*>(memory) + kNodeRingDataOffset;
+  mask_ = capacity - 1;
+  return true;
+}
+
+long NodeRingReader::Drain(const Visitor& visitor)
+{
+  uint64_t capacity = mask_ + 1;
+  uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+  uint64_t head = header_->head.load(std::memory_order_acquire);
+  long records = 0;
+
+  while (tail < head)
+  {
+    uint64_t offset = tail & mask_;
+    uint32_t word =
+        RecordWord(data_, offset)->load(std::memory_order_acquire);
+    if (word == 0)
+      break;  // Reserved, not committed yet.
+
+    // The producers are not trusted with the daemon's memory.
+    size_t size = word & kSizeMask;
+    if (size < kRecordHeaderSize || size % 8 != 0 ||
+        size > capacity - offset)
+      return -1;
+
+    NodeRecordType type = (NodeRecordType) (word >> kSizeBits);
+    if (type != kNodeRecordPadding)
+    {
+      visitor(type, data_ + offset + kRecordHeaderSize,
+              size - kRecordHeaderSize);
+      records++;
+    }
+
+    memset(data_ + offset, 0, size);
+    tail += size;
+    header_->tail.store(tail, std::memory_order_release);
+  }
+  return records;
+}
+
+}  // namespace microservice_profile
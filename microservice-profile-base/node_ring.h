@@ -0,0 +1,138 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_NODE_RING_H_
+#define MICROSERVICE_PROFILE_NODE_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+
+#include "microservice-profile-base/module_abi.h"
+
+namespace microservice_profile
+{
+
+// Shared-memory ring through which an instrumented process hands its raw
+// data to the node daemon (microservice-profile-noded): the process creates
+// a memfd holding a NodeRingHeader and the ring, and passes it over the
+// daemon's Unix socket with SCM_RIGHTS.
+//
+// Any number of producers, among them signal handlers: a record is
+// reserved by a compare-and-swap on the head, written, then committed by
+// the store of its header word. A record that does not fit before the end
+// of the ring is preceded by a padding record. The daemon, the only
+// consumer, zeroes what it consumed before moving the tail past it, so that
+// a zero header word means "not committed yet". Full rings drop records.
+
+const uint32_t kNodeRingMagic = 0x524e504d;  // "MPNR"
+const uint32_t kNodeRingVersion = 1;
+const size_t kNodeRingDataOffset = 4096;
+
+struct NodeRingHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t pid;
+  uint32_t reserved;
+  uint64_t capacity;  // Bytes of ring after kNodeRingDataOffset.
+
+  alignas(64) std::atomic<uint64_t> head;
+  alignas(64) std::atomic<uint64_t> tail;
+  std::atomic<uint64_t> dropped;
+};
+
+enum NodeRecordType
+{
+  kNodeRecordPadding = 1,
+  kNodeRecordAnnotation = 2,  // NodeAnnotation
+  kNodeRecordCpuSample = 3,   // NodeCpuSample
+};
+
+// Followed by nb_syscalls syscall_desc, then the endpoint.
+struct NodeAnnotation
+{
+  uint8_t span_id[8];
+  uint8_t trace_id[16];
+  uint32_t nb_syscalls;
+  uint32_t endpoint_size;
+};
+
+// Followed by depth frames (uint64_t, innermost first), then the endpoint.
+struct NodeCpuSample
+{
+  uint32_t tid;
+  uint16_t depth;
+  uint16_t endpoint_size;
+};
+
+// The producer side. Write is async-signal-safe.
+class NodeRingWriter
+{
+public:
+  // memory: the mapping of a whole ring, of capacity a power of two.
+  // Initializes the header.
+  NodeRingWriter(void* memory, uint64_t capacity, uint32_t pid);
+
+  NodeRingWriter(const NodeRingWriter&) = delete;
+  NodeRingWriter& operator=(const NodeRingWriter&) = delete;
+
+  // Writes a record of up to 3 parts. Returns false when dropped.
+  bool Write(NodeRecordType type, const void* part0, size_t size0,
+             const void* part1 = nullptr, size_t size1 = 0,
+             const void* part2 = nullptr, size_t size2 = 0);
+
+private:
+  NodeRingHeader* header_;
+  uint8_t* data_;
+  uint64_t mask_;
+};
+
+// The consumer side: one thread.
+class NodeRingReader
+{
+public:
+  typedef std::function<void(NodeRecordType type, const void* payload,
+                             size_t size)>
+      Visitor;
+
+  NodeRingReader() = default;
+
+  // Checks the header of a ring mapped in memory of `size` bytes.
+  bool Attach(void* memory, size_t size);
+
+  // Calls visitor with the committed records, in order, and frees them.
+  // Returns the number of records read, or -1 when the ring is corrupted.
+  long Drain(const Visitor& visitor);
+
+  const NodeRingHeader* header() const { return header_; }
+
+private:
+  NodeRingHeader* header_ = nullptr;
+  uint8_t* data_ = nullptr;
+  uint64_t mask_ = 0;
+};
+
+// The size of the memfd of a ring of `capacity` bytes.
+inline size_t NodeRingMappingSize(uint64_t capacity)
+{
+  return kNodeRingDataOffset + capacity;
+}
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_NODE_RING_H_
@@ -0,0 +1,442 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-base/overhead_governor.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+
+#include "microservice-profile-base/control_server.h"
+#include "microservice-profile-base/fork_restart.h"
+#include "microservice-profile-base/signal_handler.h"
+#include "microservice-profile-base/thread_filter.h"
+
+namespace microservice_profile
+{
+
+std::atomic<int> governed_syscall_detail(kSyscallDetailFull);
+std::atomic<uint32_t> governed_trace_mask(0);
+std::atomic<bool> hot_path_timing(false);
+
+namespace
+{
+
+// The knobs of a level.
+struct Level
+{
+  int sample_shift;      // CPU sampling period times 2^sample_shift.
+  SyscallDetail detail;
+  int trace_shift;       // One trace in 2^trace_shift to the kernel module.
+};
+
+// Cheapest to lose first: CPU samples, then per-syscall spans, then traces.
+const Level kLevels[] = {
+    {0, kSyscallDetailFull, 0},
+    {1, kSyscallDetailFull, 0},
+    {1, kSyscallDetailSummary, 0},
+    {2, kSyscallDetailSummary, 1},
+    {3, kSyscallDetailAggregate, 1},
+    {4, kSyscallDetailAggregate, 2},
+    {5, kSyscallDetailAggregate, 3},
+    {6, kSyscallDetailAggregate, 4},
+};
+const int kNbLevels = sizeof(kLevels) / sizeof(kLevels[0]);
+
+// A level up roughly doubles one of the costs: only after this many
+// intervals under half of the budget.
+const int kIntervalsBeforeStepUp = 5;
+
+// Hooks timed per thread: one call in kHotPathSampleEvery.
+const uint32_t kHotPathSampleEvery = 64;
+
+const size_t kMaxThreadClocks = 64;
+const size_t kMaxDecisions = 32;
+
+// The CPU clocks of the profiler threads. A slot is claimed by its thread,
+// then only the governor thread touches it.
+enum ClockState
+{
+  kClockFree,
+  kClockClaimed,
+  kClockReady,
+};
+
+struct ThreadClock
+{
+  std::atomic<int> state;
+  pid_t pid;
+  clockid_t clock;
+  uint64_t last_ns;
+};
+
+ThreadClock thread_clocks[kMaxThreadClocks];
+
+std::atomic<uint64_t> hot_path_ns(0);
+thread_local uint32_t hot_path_countdown = 0;
+
+struct Decision
+{
+  time_t time;
+  int from;
+  int to;
+  double overhead;
+};
+
+double budget = 0;  // Share of the process' CPU time.
+long interval_ms = 1000;
+std::atomic<bool> running(false);
+
+// Written by the governor thread, read by the control command.
+std::mutex state_mutex;
+int level = 0;
+int intervals_under = 0;
+uint64_t last_process_ns = 0;
+double last_overhead = 0;
+uint64_t thread_cpu_ns = 0;
+uint64_t hook_cpu_ns = 0;
+uint64_t process_cpu_ns = 0;
+uint64_t intervals = 0;
+uint64_t idle_intervals = 0;
+uint64_t steps_down = 0;
+uint64_t steps_up = 0;
+uint64_t level_ns[kNbLevels];
+Decision decisions[kMaxDecisions];
+uint64_t nb_decisions = 0;
+
+uint64_t ReadClock(clockid_t clock, bool* ok)
+{
+  struct timespec ts;
+
+  *ok = clock_gettime(clock, &ts) == 0;
+  return *ok ? (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec : 0;
+}
+
+// The CPU time of the profiler threads since the last call. Threads that
+// exited, or belong to the parent of a fork child, free their slot.
+uint64_t ThreadCpuDelta()
+{
+  pid_t pid = getpid();
+  uint64_t delta = 0;
+
+  for (ThreadClock& slot : thread_clocks)
+  {
+    if (slot.state.load(std::memory_order_acquire) != kClockReady)
+      continue;
+
+    bool ok;
+    uint64_t now = ReadClock(slot.clock, &ok);
+    if (slot.pid != pid || !ok)
+    {
+      slot.state.store(kClockFree, std::memory_order_release);
+      continue;
+    }
+    if (now > slot.last_ns)
+      delta += now - slot.last_ns;
+    slot.last_ns = now;
+  }
+  return delta;
+}
+
+void ApplyLevel(int new_level)
+{
+  const Level& knobs = kLevels[new_level];
+
+  governed_syscall_detail.store(knobs.detail);
+  governed_trace_mask.store((1u << knobs.trace_shift) - 1);
+  SetCpuSamplingShift(knobs.sample_shift);
+  level = new_level;
+}
+
+void Decide(int new_level, double overhead)
+{
+  Decision& decision = decisions[nb_decisions++ % kMaxDecisions];
+
+  decision.time = time(nullptr);
+  decision.from = level;
+  decision.to = new_level;
+  decision.overhead = overhead;
+  if (new_level > level)
+    steps_down++;
+  else
+    steps_up++;
+  intervals_under = 0;
+  ApplyLevel(new_level);
+}
+
+void Evaluate(uint64_t elapsed_ns)
+{
+  uint64_t threads = ThreadCpuDelta();
+  uint64_t hooks = hot_path_ns.exchange(0);
+  bool ok;
+  uint64_t process_now = ReadClock(CLOCK_PROCESS_CPUTIME_ID, &ok);
+
+  std::lock_guard<std::mutex> guard(state_mutex);
+  uint64_t process = process_now > last_process_ns
+                         ? process_now - last_process_ns
+                         : 0;
+  last_process_ns = process_now;
+
+  thread_cpu_ns += threads;
+  hook_cpu_ns += hooks;
+  process_cpu_ns += process;
+  level_ns[level] += elapsed_ns;
+  intervals++;
+
+  // An idle process makes a meaningless ratio of the readers' wakeups.
+  if (process < elapsed_ns / 100)
+  {
+    idle_intervals++;
+    return;
+  }
+
+  double overhead = (double) (threads + hooks) / process;
+  last_overhead = overhead;
+  if (overhead > budget)
+  {
+    intervals_under = 0;
+    if (level + 1 < kNbLevels)
+      Decide(level + 1, overhead);
+  }
+  else if (overhead < budget / 2 && level > 0)
+  {
+    if (++intervals_under >= kIntervalsBeforeStepUp)
+      Decide(level - 1, overhead);
+  }
+  else
+  {
+    intervals_under = 0;
+  }
+}
+
+void GovernorThread()
+{
+  MarkProfilerThread();
+
+  uint64_t last = GetMonotonicTime();
+  for (;;)
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+    uint64_t now = GetMonotonicTime();
+    Evaluate(now - last);
+    last = now;
+  }
+}
+
+bool StartGovernorThread()
+{
+  try
+  {
+    std::thread(GovernorThread).detach();
+  }
+  catch (const std::system_error& e)
+  {
+    std::cerr << "Microservice-profiler: "
+              << "Unable to start the overhead governor: " << e.what()
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+std::string Percent(double share)
+{
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.3f", share * 100);
+  return buffer;
+}
+
+void GovernorCommand(const std::string&, std::string* output)
+{
+  std::lock_guard<std::mutex> guard(state_mutex);
+  const Level& knobs = kLevels[level];
+
+  *output += "budget_pct " + Percent(budget) + "\n";
+  *output += "overhead_pct " + Percent(last_overhead) + "\n";
+  *output += "level " + std::to_string(level) + "\n";
+  *output += "sample_period_us " + std::to_string(CpuSamplingPeriod()) + "\n";
+  *output += "syscall_detail " +
+             std::string(SyscallDetailName(knobs.detail)) + "\n";
+  *output += "traces_kept 1/" + std::to_string(1 << knobs.trace_shift) + "\n";
+  *output += "profiler_thread_cpu_ns " + std::to_string(thread_cpu_ns) + "\n";
+  *output += "hook_cpu_ns " + std::to_string(hook_cpu_ns) + "\n";
+  *output += "process_cpu_ns " + std::to_string(process_cpu_ns) + "\n";
+  *output += "intervals " + std::to_string(intervals) + "\n";
+  *output += "idle_intervals " + std::to_string(idle_intervals) + "\n";
+  *output += "steps_down " + std::to_string(steps_down) + "\n";
+  *output += "steps_up " + std::to_string(steps_up) + "\n";
+  for (int i = 0; i < kNbLevels; i++)
+  {
+    *output += "level_" + std::to_string(i) + "_ms " +
+               std::to_string(level_ns[i] / 1000000) + "\n";
+  }
+
+  // The recent decisions, oldest first.
+  uint64_t first = nb_decisions > kMaxDecisions ? nb_decisions - kMaxDecisions
+                                                : 0;
+  for (uint64_t i = first; i < nb_decisions; i++)
+  {
+    const Decision& decision = decisions[i % kMaxDecisions];
+    *output += "decision " + std::to_string((long long) decision.time) + " " +
+               std::to_string(decision.from) + " -> " +
+               std::to_string(decision.to) + " overhead_pct " +
+               Percent(decision.overhead) + "\n";
+  }
+}
+
+void PrepareFork()
+{
+  state_mutex.lock();
+}
+
+void ParentAfterFork()
+{
+  state_mutex.unlock();
+}
+
+void RestartGovernorThread()
+{
+  StartGovernorThread();
+}
+
+// The governor thread does not exist in the child, whose CPU clock starts
+// from zero. The parent's slots are freed on the first evaluation, once the
+// child's first span has started a new thread.
+void ChildAfterFork()
+{
+  bool ok;
+
+  last_process_ns = ReadClock(CLOCK_PROCESS_CPUTIME_ID, &ok);
+  hot_path_ns.store(0);
+  intervals_under = 0;
+  state_mutex.unlock();
+  DeferRestartAfterFork(RestartGovernorThread);
+}
+
+}  // namespace
+
+const char* SyscallDetailName(SyscallDetail detail)
+{
+  switch (detail)
+  {
+    case kSyscallDetailFull:
+      return "full";
+    case kSyscallDetailSummary:
+      return "summary";
+    case kSyscallDetailAggregate:
+      return "aggregate";
+  }
+  return "unknown";
+}
+
+bool StartOverheadGovernor()
+{
+  const char* value = getenv("MICROSERVICE_PROFILE_BUDGET_PCT");
+  if (value == nullptr || *value == '\0')
+    return false;
+
+  if (OverheadGovernorEnabled())
+    return true;
+
+  double percent = strtod(value, nullptr);
+  if (percent <= 0)
+  {
+    std::cerr << "Microservice-profiler: "
+              << "invalid MICROSERVICE_PROFILE_BUDGET_PCT " << value
+              << ", no overhead governor" << std::endl;
+    return false;
+  }
+  budget = std::min(percent, 100.0) / 100;
+
+  value = getenv("MICROSERVICE_PROFILE_GOVERNOR_MS");
+  if (value != nullptr && atol(value) > 0)
+    interval_ms = std::max(atol(value), 10L);
+
+  bool ok;
+  last_process_ns = ReadClock(CLOCK_PROCESS_CPUTIME_ID, &ok);
+  if (!ok || !StartGovernorThread())
+    return false;
+  pthread_atfork(PrepareFork, ParentAfterFork, ChildAfterFork);
+
+  hot_path_timing.store(true);
+  RegisterControlCommand("governor",
+                         "profiler CPU overhead against its budget",
+                         GovernorCommand);
+  running.store(true);
+  return true;
+}
+
+bool OverheadGovernorEnabled()
+{
+  return running.load(std::memory_order_relaxed);
+}
+
+void RegisterProfilerThreadClock()
+{
+  clockid_t clock;
+  bool ok;
+
+  if (pthread_getcpuclockid(pthread_self(), &clock) != 0)
+    return;
+  uint64_t now = ReadClock(clock, &ok);
+  if (!ok)
+    return;
+
+  for (ThreadClock& slot : thread_clocks)
+  {
+    int expected = kClockFree;
+    if (!slot.state.compare_exchange_strong(expected, kClockClaimed))
+      continue;
+    slot.pid = getpid();
+    slot.clock = clock;
+    slot.last_ns = now;
+    slot.state.store(kClockReady, std::memory_order_release);
+    return;
+  }
+}
+
+bool SampleHotPath()
+{
+  if (hot_path_countdown > 0)
+  {
+    hot_path_countdown--;
+    return false;
+  }
+  hot_path_countdown = kHotPathSampleEvery - 1;
+  return true;
+}
+
+void AddHotPathCost(uint64_t ns)
+{
+  hot_path_ns.fetch_add(ns * kHotPathSampleEvery, std::memory_order_relaxed);
+}
+
+void AddSignalHandlerCost(uint64_t ns)
+{
+  if (hot_path_timing.load(std::memory_order_relaxed))
+    hot_path_ns.fetch_add(ns, std::memory_order_relaxed);
+}
+
+}  // namespace microservice_profile
@@ -0,0 +1,122 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_OVERHEAD_GOVERNOR_H_
+#define MICROSERVICE_PROFILE_OVERHEAD_GOVERNOR_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+
+#include "microservice-profile-base/get_monotonic_time.h"
+#include "microservice-profile-base/thread_filter.h"
+
+namespace microservice_profile
+{
+
+// Bounds the profiler's own CPU time to a share of the process'. Every
+// interval, the governor adds up the CPU time of the profiler threads (see
+// MarkProfilerThread) and the sampled cost of the hooks run by the
+// application's threads, divides it by the CPU time of the whole process,
+// and moves one level down when over the budget, one level up after a few
+// intervals under half of it. Each level down lowers one of the knobs
+// below: the CPU sampling rate, the detail of the kernel records, and the
+// share of the traces reported to the kernel module.
+
+// What becomes of the syscall records of the kernel module.
+enum SyscallDetail
+{
+  kSyscallDetailFull,       // A kernel span with one span per syscall.
+  kSyscallDetailSummary,    // The kernel span alone, with its breakdown.
+  kSyscallDetailAggregate,  // Only the per-endpoint totals.
+};
+
+const char* SyscallDetailName(SyscallDetail detail);
+
+// Reads MICROSERVICE_PROFILE_BUDGET_PCT and, if set, starts the governor
+// thread, evaluating every MICROSERVICE_PROFILE_GOVERNOR_MS milliseconds
+// (1000 by default), and registers the "governor" control command. Fork
+// children start over from the parent's level. Returns true if running.
+bool StartOverheadGovernor();
+
+bool OverheadGovernorEnabled();
+
+// Counts the calling thread's CPU time as the profiler's from now on.
+void RegisterProfilerThreadClock();
+
+// The knobs, read on the hot paths. Without a governor, everything is kept.
+extern std::atomic<int> governed_syscall_detail;
+extern std::atomic<uint32_t> governed_trace_mask;
+
+inline SyscallDetail GovernedSyscallDetail()
+{
+  return (SyscallDetail) governed_syscall_detail.load(std::memory_order_relaxed);
+}
+
+// Whether the spans of a trace go to the kernel module. The same traces are
+// kept by all the processes at a level: the last bytes of trace ids are
+// random.
+inline bool GovernorKeepsTrace(const uint8_t* trace_id)
+{
+  uint32_t mask = governed_trace_mask.load(std::memory_order_relaxed);
+  uint32_t bits;
+
+  if (mask == 0)
+    return true;
+  memcpy(&bits, trace_id + 12, sizeof(bits));
+  return (bits & mask) == 0;
+}
+
+extern std::atomic<bool> hot_path_timing;
+
+// True on one call out of 64 per thread, when the governor runs.
+bool SampleHotPath();
+
+// Adds the duration of a sampled hook, scaled to all the calls.
+void AddHotPathCost(uint64_t ns);
+
+// Times the enclosing hook, when sampled. Not on the profiler's own threads:
+// their whole CPU time is counted already.
+class HotPathTimer
+{
+public:
+  HotPathTimer()
+      : start_(hot_path_timing.load(std::memory_order_relaxed) &&
+                       SampleHotPath() && !IsProfilerThread()
+                   ? GetMonotonicTime()
+                   : 0)
+  {
+  }
+
+  ~HotPathTimer()
+  {
+    if (start_ != 0)
+      AddHotPathCost(GetMonotonicTime() - start_);
+  }
+
+  HotPathTimer(const HotPathTimer&) = delete;
+  HotPathTimer& operator=(const HotPathTimer&) = delete;
+
+private:
+  uint64_t start_;
+};
+
+// For the SIGPROF handler, which times every sample: unscaled.
+void AddSignalHandlerCost(uint64_t ns);
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_OVERHEAD_GOVERNOR_H_
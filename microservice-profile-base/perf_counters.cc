@@ -0,0 +1,341 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-base/perf_counters.h"
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <iostream>
+
+#include "microservice-profile-base/memory_budget.h"
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+struct CounterEvent
+{
+  uint32_t type;
+  uint64_t config;
+  const char* name;
+};
+
+const CounterEvent kEvents[kPerfCounters] = {
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "perf.task_clock_ns"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES,
+     "perf.context_switches"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "perf.page_faults"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "perf.cycles"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "perf.instructions"},
+    // The generic cache miss event counts last level cache misses.
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "perf.llc_misses"},
+};
+
+const int kGroupSize = 3;
+
+bool enabled = false;
+
+// Bumped in fork children: the counters they inherit are their parent's.
+std::atomic<uint32_t> generation(0);
+
+// Set once the software group could not count in the kernel, with
+// perf_event_paranoid above 1 and no CAP_PERFMON.
+std::atomic<bool> user_only(false);
+
+// Context switches happen in the kernel: counted in user space only, the
+// counter would always read 0.
+bool CountsInKernelOnly(int event)
+{
+  return event == kPerfContextSwitches;
+}
+
+int PerfEventOpen(const CounterEvent& event, int group_fd, bool kernel)
+{
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = event.type;
+  attr.config = event.config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  // User space only is allowed with perf_event_paranoid up to 2, the
+  // kernel as well up to 1.
+  attr.exclude_kernel = kernel ? 0 : 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+}
+
+// One group of counters, read together.
+struct CounterGroup
+{
+  int fds[kGroupSize] = {-1, -1, -1};
+  PerfCounter counters[kGroupSize];
+  perf_event_mmap_page* pages[kGroupSize] = {nullptr, nullptr, nullptr};
+  int size = 0;
+  bool rdpmc = false;
+
+  // Opens the counters [first, first + kGroupSize) that exist here,
+  // counting in the kernel too if `kernel`.
+  void Open(int first, bool map, bool kernel)
+  {
+    for (int i = first; i < first + kGroupSize; i++)
+    {
+      if (!kernel && CountsInKernelOnly(i))
+        continue;
+      int fd = PerfEventOpen(kEvents[i], size > 0 ? fds[0] : -1, kernel);
+      if (fd < 0)
+      {
+        // Without its leader, the group does not exist.
+        if (size == 0)
+          return;
+        continue;
+      }
+      fds[size] = fd;
+      counters[size] = static_cast<PerfCounter>(i);
+      size++;
+    }
+
+    if (!map)
+      return;
+
+    // rdpmc needs every counter of the group mapped and allowed in user
+    // space. Without memory for the pages, the group is read with read().
+    rdpmc = true;
+    for (int i = 0; i < size; i++)
+    {
+      if (!ReserveMemory(kMemorySampleRings, sysconf(_SC_PAGESIZE)))
+      {
+        rdpmc = false;
+        continue;
+      }
+      void* page = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED,
+                        fds[i], 0);
+      if (page == MAP_FAILED)
+      {
+        ReleaseMemory(kMemorySampleRings, sysconf(_SC_PAGESIZE));
+        rdpmc = false;
+        continue;
+      }
+      pages[i] = static_cast<perf_event_mmap_page*>(page);
+      if (!pages[i]->cap_user_rdpmc)
+        rdpmc = false;
+    }
+  }
+
+  void Close()
+  {
+    for (int i = 0; i < size; i++)
+    {
+      if (pages[i] != nullptr)
+      {
+        munmap(pages[i], sysconf(_SC_PAGESIZE));
+        ReleaseMemory(kMemorySampleRings, sysconf(_SC_PAGESIZE));
+      }
+      close(fds[i]);
+      pages[i] = nullptr;
+      fds[i] = -1;
+    }
+    size = 0;
+    rdpmc = false;
+  }
+
+  bool ReadWithSyscall(PerfSnapshot* snapshot) const
+  {
+    uint64_t buffer[1 + kGroupSize];
+
+    ssize_t rc = read(fds[0], buffer, sizeof(buffer));
+    if (rc < (ssize_t) sizeof(uint64_t) || buffer[0] > (uint64_t) size)
+      return false;
+    for (uint64_t i = 0; i < buffer[0]; i++)
+    {
+      snapshot->values[counters[i]] = buffer[1 + i];
+      snapshot->valid |= 1u << counters[i];
+    }
+    return true;
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  static uint64_t Rdpmc(uint32_t counter)
+  {
+    uint32_t low, high;
+
+    __asm__ __volatile__("rdpmc" : "=a"(low), "=d"(high) : "c"(counter));
+    return low | ((uint64_t) high << 32);
+  }
+
+  // The seqlock protocol of perf_event_mmap_page. Returns false when the
+  // counter is not scheduled on the CPU right now.
+  static bool ReadWithRdpmc(const volatile perf_event_mmap_page* page,
+                            uint64_t* value)
+  {
+    uint32_t seq, index;
+    uint64_t count;
+
+    do
+    {
+      seq = page->lock;
+      __asm__ __volatile__("" ::: "memory");
+      index = page->index;
+      count = page->offset;
+      if (index == 0)
+        return false;
+      uint64_t pmc = Rdpmc(index - 1);
+      uint16_t width = page->pmc_width;
+      pmc <<= 64 - width;
+      pmc >>= 64 - width;
+      count += pmc;
+      __asm__ __volatile__("" ::: "memory");
+    } while (page->lock != seq);
+
+    *value = count;
+    return true;
+  }
+#endif
+
+  bool Read(PerfSnapshot* snapshot) const
+  {
+    if (size == 0)
+      return false;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (rdpmc)
+    {
+      uint64_t values[kGroupSize];
+      int i;
+      for (i = 0; i < size; i++)
+      {
+        if (!ReadWithRdpmc(pages[i], &values[i]))
+          break;
+      }
+      if (i == size)
+      {
+        for (i = 0; i < size; i++)
+        {
+          snapshot->values[counters[i]] = values[i];
+          snapshot->valid |= 1u << counters[i];
+        }
+        return true;
+      }
+    }
+#endif
+    return ReadWithSyscall(snapshot);
+  }
+};
+
+class ThreadCounters
+{
+public:
+  ~ThreadCounters() { Close(); }
+
+  bool Read(PerfSnapshot* snapshot)
+  {
+    uint32_t current = generation.load(std::memory_order_relaxed);
+    if (!opened_ || generation_ != current)
+    {
+      Close();
+      // The software counters include the time and faults in the kernel
+      // when allowed; without it, context switches are left out.
+      if (!user_only.load(std::memory_order_relaxed))
+      {
+        software_.Open(kPerfTaskClock, false, true);
+        if (software_.size == 0)
+          user_only.store(true, std::memory_order_relaxed);
+      }
+      if (software_.size == 0)
+        software_.Open(kPerfTaskClock, false, false);
+      hardware_.Open(kPerfCycles, true, false);
+      opened_ = true;
+      generation_ = current;
+    }
+
+    snapshot->valid = 0;
+    bool read = software_.Read(snapshot);
+    read |= hardware_.Read(snapshot);
+    return read;
+  }
+
+private:
+  void Close()
+  {
+    software_.Close();
+    hardware_.Close();
+    opened_ = false;
+  }
+
+  bool opened_ = false;
+  uint32_t generation_ = 0;
+  CounterGroup software_;
+  CounterGroup hardware_;
+};
+
+void ChildAfterFork()
+{
+  generation.fetch_add(1, std::memory_order_relaxed);
+}
+
+}  // namespace
+
+bool StartPerfCounters()
+{
+  const char* env = getenv("MICROSERVICE_PROFILE_PERF_COUNTERS");
+  if (env == nullptr || strcmp(env, "1") != 0)
+    return false;
+
+  if (enabled)
+    return true;
+
+  // Fail early, and once, when perf_event_open is not allowed at all.
+  PerfSnapshot snapshot;
+  if (!ReadPerfCounters(&snapshot))
+  {
+    std::cerr << "Microservice-profiler: "
+              << "unable to open performance counters: " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+
+  pthread_atfork(nullptr, nullptr, ChildAfterFork);
+  enabled = true;
+  return true;
+}
+
+bool PerfCountersEnabled()
+{
+  return enabled;
+}
+
+bool ReadPerfCounters(PerfSnapshot* snapshot)
+{
+  static thread_local ThreadCounters counters;
+
+  return counters.Read(snapshot);
+}
+
+const char* PerfCounterName(PerfCounter counter)
+{
+  return kEvents[counter].name;
+}
+
+}  // namespace microservice_profile
@@ -0,0 +1,62 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_PERF_COUNTERS_H_
+#define MICROSERVICE_PROFILE_PERF_COUNTERS_H_
+
+#include <stdint.h>
+
+namespace microservice_profile
+{
+
+// Per-thread performance counters, opened with perf_event_open(2) on the
+// first read in each thread. The software counters always work, VMs
+// included, and count in the kernel too; context switches are skipped when
+// perf_event_paranoid only allows user space, the hardware counters when
+// there is no PMU access.
+enum PerfCounter
+{
+  kPerfTaskClock,  // ns on CPU
+  kPerfContextSwitches,
+  kPerfPageFaults,
+  kPerfCycles,
+  kPerfInstructions,
+  kPerfLlcMisses,
+  kPerfCounters,
+};
+
+struct PerfSnapshot
+{
+  uint64_t values[kPerfCounters];
+  uint32_t valid;  // Bit i set if values[i] was read.
+};
+
+// Reads MICROSERVICE_PROFILE_PERF_COUNTERS. Returns true if enabled.
+bool StartPerfCounters();
+
+bool PerfCountersEnabled();
+
+// Reads the calling thread's counters. The software group costs one
+// read(2); the hardware counters are read with rdpmc when the kernel allows
+// it, with another read(2) otherwise. Returns false when no counter could
+// be opened in this thread.
+bool ReadPerfCounters(PerfSnapshot* snapshot);
+
+// Attribute-style name of a counter, e.g. "perf.page_faults".
+const char* PerfCounterName(PerfCounter counter);
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_PERF_COUNTERS_H_
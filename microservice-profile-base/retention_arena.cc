@@ -0,0 +1,244 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-base/retention_arena.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "microservice-profile-base/memory_budget.h"
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+// Bookkeeping of a held trace besides its records: list node, map entry.
+const size_t kTraceOverhead = 128;
+
+// Record layout in a trace buffer: span id, endpoint size, endpoint, number
+// of syscalls, syscalls.
+const size_t kRecordHeaderSize = 8 + sizeof(uint16_t) + sizeof(uint32_t);
+
+}  // namespace
+
+RetentionArena::RetentionArena(const Options& options)
+    : max_shard_bytes_(std::max<size_t>(options.max_bytes / kShards, 1)),
+      max_shard_decisions_(std::max<size_t>(options.max_decisions / kShards, 1))
+{
+}
+
+TraceKey MakeTraceKey(const uint8_t* trace_id)
+{
+  TraceKey key;
+
+  memcpy(&key.high, trace_id, sizeof(key.high));
+  memcpy(&key.low, trace_id + sizeof(key.high), sizeof(key.low));
+  return key;
+}
+
+RetentionArena::Shard& RetentionArena::ShardOf(const TraceKey& key)
+{
+  return shards_[(key.low ^ (key.low >> 32)) % kShards];
+}
+
+size_t RetentionArena::Footprint(const HeldTrace& trace)
+{
+  return trace.records.capacity() + kTraceOverhead;
+}
+
+RetentionArena::Verdict RetentionArena::Hold(
+    const uint8_t* trace_id, const uint8_t* span_id, const char* endpoint,
+    size_t endpoint_size, uint32_t nb_syscalls,
+    const struct syscall_desc* syscalls)
+{
+  TraceKey key = MakeTraceKey(trace_id);
+  Shard& shard = ShardOf(key);
+  std::lock_guard<std::mutex> guard(shard.mutex);
+
+  auto decision = shard.decisions.find(key);
+  if (decision != shard.decisions.end())
+    return decision->second ? kKeep : kDrop;
+
+  uint16_t size = std::min<size_t>(endpoint_size, UINT16_MAX);
+  size_t record_size = kRecordHeaderSize + size +
+                       nb_syscalls * sizeof(struct syscall_desc);
+  if (record_size + kTraceOverhead > max_shard_bytes_)
+    return kDrop;
+
+  // Room in the profiler's memory budget, made by evicting the least
+  // recently touched traces of the shard, this one included if need be.
+  size_t reserved = record_size + kTraceOverhead;
+  while (!ReserveMemory(kMemoryAnnotations, reserved))
+  {
+    if (shard.lru.empty())
+      return kDrop;
+    EvictLocked(shard);
+  }
+
+  size_t grown = 0;
+  auto it = shard.traces.find(key);
+  if (it == shard.traces.end())
+  {
+    shard.lru.push_front({key, std::string()});
+    it = shard.traces.emplace(key, shard.lru.begin()).first;
+    grown = Footprint(shard.lru.front());
+    held_bytes_ += grown - kTraceOverhead;
+  }
+  else
+  {
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+  }
+
+  HeldTrace& trace = *it->second;
+  size_t before = Footprint(trace);
+  trace.records.append(reinterpret_cast<const char*>(span_id), 8);
+  trace.records.append(reinterpret_cast<const char*>(&size), sizeof(size));
+  trace.records.append(endpoint, size);
+  trace.records.append(reinterpret_cast<const char*>(&nb_syscalls),
+                       sizeof(nb_syscalls));
+  trace.records.append(reinterpret_cast<const char*>(syscalls),
+                       nb_syscalls * sizeof(struct syscall_desc));
+  size_t after = Footprint(trace);
+  grown += after - before;
+  shard.bytes += grown;
+  held_bytes_ += after - before;
+
+  // The buffer grows by more or less than the record.
+  if (grown > reserved)
+    ChargeMemory(kMemoryAnnotations, grown - reserved);
+  else
+    ReleaseMemory(kMemoryAnnotations, reserved - grown);
+
+  // The trace just touched is at the front: it goes last.
+  while (shard.bytes > max_shard_bytes_ && !shard.lru.empty())
+    EvictLocked(shard);
+  return kHeld;
+}
+
+void RetentionArena::EvictLocked(Shard& shard)
+{
+  HeldTrace& victim = shard.lru.back();
+  size_t footprint = Footprint(victim);
+  shard.bytes -= footprint;
+  held_bytes_ -= footprint - kTraceOverhead;
+  ReleaseMemory(kMemoryAnnotations, footprint);
+  shard.traces.erase(victim.key);
+  shard.lru.pop_back();
+  evicted_++;
+}
+
+void RetentionArena::RememberLocked(Shard& shard, const TraceKey& key,
+                                    bool keep)
+{
+  if (!shard.decisions.emplace(key, keep).second)
+    return;
+  shard.decision_order.push_back(key);
+  if (shard.decision_order.size() > max_shard_decisions_)
+  {
+    shard.decisions.erase(shard.decision_order.front());
+    shard.decision_order.pop_front();
+  }
+}
+
+void RetentionArena::Decide(const uint8_t* trace_id, bool keep,
+                            std::string* records)
+{
+  TraceKey key = MakeTraceKey(trace_id);
+  Shard& shard = ShardOf(key);
+  std::lock_guard<std::mutex> guard(shard.mutex);
+
+  RememberLocked(shard, key, keep);
+  (keep ? kept_ : dropped_)++;
+
+  auto it = shard.traces.find(key);
+  if (it == shard.traces.end())
+    return;
+
+  HeldTrace& trace = *it->second;
+  size_t footprint = Footprint(trace);
+  shard.bytes -= footprint;
+  held_bytes_ -= footprint - kTraceOverhead;
+  ReleaseMemory(kMemoryAnnotations, footprint);
+  if (keep)
+    records->swap(trace.records);
+  shard.lru.erase(it->second);
+  shard.traces.erase(it);
+}
+
+void RetentionArena::ForEachRecord(const std::string& records,
+                                   const RecordVisitor& visitor)
+{
+  std::vector<struct syscall_desc> syscalls;
+  const char* p = records.data();
+  const char* end = p + records.size();
+
+  while (end - p >= (ptrdiff_t) kRecordHeaderSize)
+  {
+    const uint8_t* span_id = reinterpret_cast<const uint8_t*>(p);
+    uint16_t endpoint_size;
+    uint32_t nb_syscalls;
+
+    memcpy(&endpoint_size, p + 8, sizeof(endpoint_size));
+    const char* endpoint = p + 8 + sizeof(endpoint_size);
+    memcpy(&nb_syscalls, endpoint + endpoint_size, sizeof(nb_syscalls));
+    p = endpoint + endpoint_size + sizeof(nb_syscalls);
+
+    // The buffer gives no alignment guarantee: copy the syscalls out.
+    syscalls.resize(nb_syscalls);
+    memcpy((void*) syscalls.data(), p,
+           nb_syscalls * sizeof(struct syscall_desc));
+    p += nb_syscalls * sizeof(struct syscall_desc);
+
+    visitor(span_id, endpoint, endpoint_size, nb_syscalls, syscalls.data());
+  }
+}
+
+RetentionArena::Stats RetentionArena::stats() const
+{
+  return {held_bytes_.load(), kept_.load(), dropped_.load(), evicted_.load()};
+}
+
+void RetentionArena::PrepareFork()
+{
+  for (Shard& shard : shards_)
+    shard.mutex.lock();
+}
+
+void RetentionArena::ParentAfterFork()
+{
+  for (Shard& shard : shards_)
+    shard.mutex.unlock();
+}
+
+void RetentionArena::ChildAfterFork()
+{
+  for (Shard& shard : shards_)
+  {
+    ReleaseMemory(kMemoryAnnotations, shard.bytes);
+    shard.lru.clear();
+    shard.traces.clear();
+    shard.bytes = 0;
+    shard.decisions.clear();
+    shard.decision_order.clear();
+    shard.mutex.unlock();
+  }
+  held_bytes_ = 0;
+}
+
+}  // namespace microservice_profile
@@ -0,0 +1,155 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_RETENTION_ARENA_H_
+#define MICROSERVICE_PROFILE_RETENTION_ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "microservice-profile-base/module_abi.h"
+
+namespace microservice_profile
+{
+
+// A trace id as a hash table key.
+struct TraceKey
+{
+  uint64_t high;
+  uint64_t low;
+
+  bool operator==(const TraceKey& other) const
+  {
+    return high == other.high && low == other.low;
+  }
+};
+
+struct TraceKeyHash
+{
+  size_t operator()(const TraceKey& key) const
+  {
+    return key.high ^ (key.low * 0x9e3779b97f4a7c15ULL);
+  }
+};
+
+TraceKey MakeTraceKey(const uint8_t* trace_id);
+
+// Relay records held until the outcome of their trace is known, for
+// tail-based retention. The records of a trace are appended to one buffer;
+// traces are kept in LRU order and the least recently touched ones are
+// dropped when the arena goes over its budget, or when the profiler's memory
+// budget (see memory_budget.h) has no room for a record. Decisions are remembered for
+// a while, so that records read after their trace was decided follow it.
+// Thread-safe.
+class RetentionArena
+{
+public:
+  struct Options
+  {
+    size_t max_bytes = 64 << 20;
+    size_t max_decisions = 65536;
+  };
+
+  enum Verdict
+  {
+    kHeld,  // Kept until the trace is decided.
+    kKeep,  // The trace was kept: use the record now.
+    kDrop,  // The trace was dropped, or the record can't be held.
+  };
+
+  struct Stats
+  {
+    uint64_t held_bytes;
+    uint64_t kept_traces;
+    uint64_t dropped_traces;
+    uint64_t evicted_traces;  // Dropped undecided, to stay in budget.
+  };
+
+  typedef std::function<void(const uint8_t* span_id, const char* endpoint,
+                             size_t endpoint_size, uint32_t nb_syscalls,
+                             const struct syscall_desc* syscalls)>
+      RecordVisitor;
+
+  explicit RetentionArena(const Options& options);
+
+  RetentionArena(const RetentionArena&) = delete;
+  RetentionArena& operator=(const RetentionArena&) = delete;
+
+  Verdict Hold(const uint8_t* trace_id, const uint8_t* span_id,
+               const char* endpoint, size_t endpoint_size, uint32_t nb_syscalls,
+               const struct syscall_desc* syscalls);
+
+  // Records the outcome of a trace. If it is kept, its held records are
+  // moved to *records, to be read with ForEachRecord().
+  void Decide(const uint8_t* trace_id, bool keep, std::string* records);
+
+  static void ForEachRecord(const std::string& records,
+                            const RecordVisitor& visitor);
+
+  Stats stats() const;
+
+  // Fork handlers: the shards are locked across fork(); the child then
+  // forgets everything, its parent's traces are not its own.
+  void PrepareFork();
+  void ParentAfterFork();
+  void ChildAfterFork();
+
+private:
+  static const size_t kShards = 16;
+
+  struct HeldTrace
+  {
+    TraceKey key;
+    std::string records;
+  };
+
+  typedef std::list<HeldTrace> LruList;
+
+  struct Shard
+  {
+    std::mutex mutex;
+    LruList lru;  // Most recently touched first.
+    std::unordered_map<TraceKey, LruList::iterator, TraceKeyHash> traces;
+    size_t bytes = 0;
+    std::unordered_map<TraceKey, bool, TraceKeyHash> decisions;
+    std::deque<TraceKey> decision_order;
+  };
+
+  Shard& ShardOf(const TraceKey& key);
+  void EvictLocked(Shard& shard);
+  void RememberLocked(Shard& shard, const TraceKey& key, bool keep);
+  static size_t Footprint(const HeldTrace& trace);
+
+  size_t max_shard_bytes_;
+  size_t max_shard_decisions_;
+  Shard shards_[kShards];
+
+  std::atomic<uint64_t> held_bytes_{0};
+  std::atomic<uint64_t> kept_{0};
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<uint64_t> evicted_{0};
+};
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_RETENTION_ARENA_H_
@@ -0,0 +1,137 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_ROLLING_AGGREGATES_H_
+#define MICROSERVICE_PROFILE_ROLLING_AGGREGATES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "microservice-profile-base/get_monotonic_time.h"
+#include "microservice-profile-base/memory_budget.h"
+
+namespace microservice_profile
+{
+
+// Per-endpoint totals over a rolling window: the current window and the
+// previous one are kept, so that a snapshot always covers at least one full
+// window. Beyond `max_endpoints`, new endpoints are counted as "(other)".
+// Entries are charged to the stack tables' memory. Thread-safe.
+//
+// `Totals` is default-constructible to zero, counts its spans in `spans`
+// and has a `void Merge(const Totals&)`.
+template <class Totals>
+class RollingAggregates
+{
+public:
+  typedef std::function<void(const std::string& endpoint, const Totals&)>
+      Visitor;
+
+  RollingAggregates(uint64_t window_ns, size_t max_endpoints)
+      : window_ns_(window_ns),
+        max_endpoints_(max_endpoints),
+        window_start_(GetMonotonicTime())
+  {
+  }
+
+  ~RollingAggregates()
+  {
+    ReleaseMemory(kMemoryStackTables, charged_);
+  }
+
+  // Calls `add` with the totals of the endpoint's current window, under the
+  // lock.
+  template <class Add>
+  void Update(const char* endpoint, size_t endpoint_size, const Add& add)
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    MaybeRotate(GetMonotonicTime());
+
+    std::string key(endpoint, endpoint_size);
+    auto it = endpoints_.find(key);
+    if (it == endpoints_.end())
+    {
+      if (endpoints_.size() >= max_endpoints_)
+        key = "(other)";
+      auto inserted = endpoints_.emplace(key, Windows());
+      it = inserted.first;
+      if (inserted.second)
+      {
+        // Already bounded by `max_endpoints`: charged, not reserved.
+        size_t bytes = kEntryOverhead + key.capacity() + sizeof(Windows);
+        ChargeMemory(kMemoryStackTables, bytes);
+        charged_ += bytes;
+      }
+    }
+    add(it->second.current);
+  }
+
+  // Calls visitor with the totals of the current and previous windows.
+  void ForEach(const Visitor& visitor)
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    MaybeRotate(GetMonotonicTime());
+
+    for (const auto& endpoint : endpoints_)
+    {
+      Totals totals = endpoint.second.previous;
+      totals.Merge(endpoint.second.current);
+      if (totals.spans > 0)
+        visitor(endpoint.first, totals);
+    }
+  }
+
+private:
+  struct Windows
+  {
+    Totals current;
+    Totals previous;
+  };
+
+  // A node of the map, with its key, and its bucket.
+  static const size_t kEntryOverhead = 4 * sizeof(void*) + sizeof(std::string);
+
+  void MaybeRotate(uint64_t now)
+  {
+    if (now - window_start_ < window_ns_)
+      return;
+
+    // More than one window without a rotation: the previous one is empty
+    // too.
+    bool skipped = now - window_start_ >= 2 * window_ns_;
+    for (auto& endpoint : endpoints_)
+    {
+      endpoint.second.previous = skipped ? Totals() : endpoint.second.current;
+      endpoint.second.current = Totals();
+    }
+    window_start_ = now;
+  }
+
+  std::mutex mutex_;
+  std::unordered_map<std::string, Windows> endpoints_;
+  uint64_t window_ns_;
+  size_t max_endpoints_;
+  uint64_t window_start_;
+  size_t charged_ = 0;
+};
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_ROLLING_AGGREGATES_H_
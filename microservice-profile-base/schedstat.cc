@@ -0,0 +1,225 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-base/schedstat.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <vector>
+
+#include "microservice-profile-base/control_server.h"
+#include "microservice-profile-base/get_monotonic_time.h"
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+const char kSchedStatPath[] = "/proc/thread-self/schedstat";
+
+bool enabled = false;
+
+// Bumped in fork children: the files opened before the fork describe the
+// parent's threads.
+std::atomic<uint32_t> generation(0);
+
+// How long a thread's snapshot stands for a new read.
+const uint64_t kSnapshotReuseNs = 50000;
+
+class ThreadFile
+{
+public:
+  ~ThreadFile() { Close(); }
+
+  bool Read(SchedSnapshot* snapshot)
+  {
+    uint64_t now = GetMonotonicTime();
+    if (last_read_ != 0 && now - last_read_ < kSnapshotReuseNs &&
+        generation_ == generation.load(std::memory_order_relaxed))
+    {
+      *snapshot = last_;
+      return true;
+    }
+
+    uint32_t current = generation.load(std::memory_order_relaxed);
+    if (fd_ < 0 || generation_ != current)
+    {
+      Close();
+      fd_ = open(kSchedStatPath, O_RDONLY | O_CLOEXEC);
+      generation_ = current;
+    }
+    if (fd_ < 0)
+      return false;
+
+    // "<run ns> <wait ns> <timeslices>\n"
+    char buffer[96];
+    ssize_t size = pread(fd_, buffer, sizeof(buffer) - 1, 0);
+    if (size <= 0)
+      return false;
+    buffer[size] = '\0';
+
+    char* end;
+    snapshot->run_ns = strtoull(buffer, &end, 10);
+    snapshot->wait_ns = strtoull(end, &end, 10);
+    snapshot->timeslices = strtoull(end, &end, 10);
+    last_ = *snapshot;
+    last_read_ = now;
+    return true;
+  }
+
+private:
+  void Close()
+  {
+    if (fd_ >= 0)
+      close(fd_);
+    fd_ = -1;
+  }
+
+  int fd_ = -1;
+  uint32_t generation_ = 0;
+  SchedSnapshot last_;
+  uint64_t last_read_ = 0;
+};
+
+void ChildAfterFork()
+{
+  generation.fetch_add(1, std::memory_order_relaxed);
+}
+
+void SchedCommand(const std::string&, std::string* output)
+{
+  struct Line
+  {
+    std::string endpoint;
+    SchedAggregates::Totals totals;
+  };
+  std::vector<Line> lines;
+
+  GetSchedAggregates().ForEach(
+      [&](const std::string& endpoint, const SchedAggregates::Totals& totals) {
+        lines.push_back({endpoint, totals});
+      });
+
+  // The endpoints that would gain the most from more CPUs first.
+  std::sort(lines.begin(), lines.end(), [](const Line& a, const Line& b) {
+    return a.totals.wait_ns > b.totals.wait_ns;
+  });
+
+  *output += "endpoint\tspans\twall_us\trun_us\twait_us\toff_cpu_us\twait_pct\n";
+  for (const Line& line : lines)
+  {
+    const SchedAggregates::Totals& totals = line.totals;
+    uint64_t on_cpu = totals.run_ns + totals.wait_ns;
+    uint64_t off_cpu = totals.wall_ns > on_cpu ? totals.wall_ns - on_cpu : 0;
+    char columns[160];
+
+    snprintf(columns, sizeof(columns), "\t%lu\t%lu\t%lu\t%lu\t%lu\t%.1f\n",
+             (unsigned long) totals.spans,
+             (unsigned long) totals.wall_ns / 1000,
+             (unsigned long) totals.run_ns / 1000,
+             (unsigned long) totals.wait_ns / 1000,
+             (unsigned long) off_cpu / 1000,
+             totals.wall_ns > 0 ? 100.0 * totals.wait_ns / totals.wall_ns : 0);
+    *output += line.endpoint + columns;
+  }
+}
+
+}  // namespace
+
+bool StartSchedStats()
+{
+  const char* env = getenv("MICROSERVICE_PROFILE_SCHEDSTAT");
+  if (env == nullptr || strcmp(env, "1") != 0)
+    return false;
+
+  if (enabled)
+    return true;
+
+  SchedSnapshot snapshot;
+  if (!ReadSchedStats(&snapshot))
+  {
+    std::cerr << "Microservice-profiler: "
+              << "unable to read " << kSchedStatPath << ": "
+              << strerror(errno) << std::endl;
+    return false;
+  }
+
+  pthread_atfork(nullptr, nullptr, ChildAfterFork);
+  RegisterControlCommand("sched",
+                         "run-queue wait and CPU time of the spans per "
+                         "endpoint",
+                         SchedCommand);
+  enabled = true;
+  return true;
+}
+
+bool SchedStatsEnabled()
+{
+  return enabled;
+}
+
+bool ReadSchedStats(SchedSnapshot* snapshot)
+{
+  static thread_local ThreadFile file;
+
+  return file.Read(snapshot);
+}
+
+void SchedAggregates::Totals::Merge(const Totals& other)
+{
+  spans += other.spans;
+  wall_ns += other.wall_ns;
+  run_ns += other.run_ns;
+  wait_ns += other.wait_ns;
+}
+
+SchedAggregates::SchedAggregates(uint64_t window_ns, size_t max_endpoints)
+    : windows_(window_ns, max_endpoints)
+{
+}
+
+void SchedAggregates::Add(const char* endpoint, size_t endpoint_size,
+                          uint64_t wall_ns, uint64_t run_ns, uint64_t wait_ns)
+{
+  windows_.Update(endpoint, endpoint_size, [&](Totals& totals) {
+    totals.spans++;
+    totals.wall_ns += wall_ns;
+    totals.run_ns += run_ns;
+    totals.wait_ns += wait_ns;
+  });
+}
+
+void SchedAggregates::ForEach(const Visitor& visitor)
+{
+  windows_.ForEach(visitor);
+}
+
+SchedAggregates& GetSchedAggregates()
+{
+  static SchedAggregates aggregates;
+  return aggregates;
+}
+
+}  // namespace microservice_profile
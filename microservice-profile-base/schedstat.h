@@ -0,0 +1,91 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_SCHEDSTAT_H_
+#define MICROSERVICE_PROFILE_SCHEDSTAT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include "microservice-profile-base/rolling_aggregates.h"
+
+namespace microservice_profile
+{
+
+// Scheduler statistics of the calling thread, from
+// /proc/thread-self/schedstat: time on a CPU, and time runnable but waiting
+// for one in a run queue.
+struct SchedSnapshot
+{
+  uint64_t run_ns;
+  uint64_t wait_ns;
+  uint64_t timeslices;
+};
+
+// Reads MICROSERVICE_PROFILE_SCHEDSTAT and checks that the kernel has the
+// file (CONFIG_SCHED_INFO). Registers the "sched" control command. Returns
+// true if enabled.
+bool StartSchedStats();
+
+bool SchedStatsEnabled();
+
+// The file is opened on the first read in each thread, and again in fork
+// children, and kept open: a read is one pread(2). Returns false when the
+// file cannot be read.
+//
+// A snapshot read by the thread less than 50 us before is returned again
+// without reading: the span processor decorator and the scheduler
+// statistics observer, in two processors run one after the other in any
+// order, then share one read per span start and end. What the thread ran
+// in between is the profiler's own hooks.
+bool ReadSchedStats(SchedSnapshot* snapshot);
+
+// Where the time of the spans of each endpoint went: on a CPU, waiting for
+// one, and the rest, off CPU (blocked or sleeping). Over a rolling window
+// (see RollingAggregates).
+class SchedAggregates
+{
+public:
+  struct Totals
+  {
+    uint64_t spans = 0;
+    uint64_t wall_ns = 0;
+    uint64_t run_ns = 0;
+    uint64_t wait_ns = 0;
+
+    void Merge(const Totals& other);
+  };
+
+  typedef RollingAggregates<Totals>::Visitor Visitor;
+
+  explicit SchedAggregates(uint64_t window_ns = 60000000000ULL,
+                           size_t max_endpoints = 1024);
+
+  void Add(const char* endpoint, size_t endpoint_size, uint64_t wall_ns,
+           uint64_t run_ns, uint64_t wait_ns);
+
+  void ForEach(const Visitor& visitor);
+
+private:
+  RollingAggregates<Totals> windows_;
+};
+
+SchedAggregates& GetSchedAggregates();
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_SCHEDSTAT_H_
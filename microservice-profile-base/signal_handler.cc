@@ -17,8 +17,22 @@
  */
 #include "microservice-profile-base/signal_handler.h"
 
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <mutex>
+
+#include "microservice-profile-base/flight_recorder.h"
+#include "microservice-profile-base/fork_restart.h"
 #include "microservice-profile-base/get_monotonic_time.h"
+#include "microservice-profile-base/overhead_governor.h"
+#include "microservice-profile-base/profiling_timer.h"
 #include "microservice-profile-base/stacktrace.h"
+#include "microservice-profile-base/wall_clock_sampler.h"
 
 namespace microservice_profile
 {
@@ -29,6 +43,43 @@ namespace
 // Maximum stack size to capture.
 const size_t kMaxStackSize = 60;
 
+// Signal
+const int kSignal = SIGPROF;
+
+const int kMaxSinks = 4;
+
+std::atomic<CpuSampleSink> sinks[kMaxSinks];
+std::atomic<int> nb_sinks(0);
+std::mutex sinks_mutex;
+
+std::atomic<SampleEndpointFunction> endpoint_function(nullptr);
+
+// Profiling timer period (microseconds).
+long sample_us = 10000;  // 10 ms
+
+// Set by the overhead governor.
+std::atomic<int> sample_shift(0);
+
+std::atomic<bool> sampling(false);
+
+long CurrentPeriod()
+{
+  return std::min(sample_us << sample_shift.load(), 999999L);
+}
+
+void RestartProfilingTimer()
+{
+  lttng_profile::StartProfilingTimer(CurrentPeriod());
+}
+
+// Timers are not inherited by the child. Arming one here would outlive an
+// exec, whose SIGPROF then kills the new program: the child's first span
+// arms it.
+void ChildAfterFork()
+{
+  DeferRestartAfterFork(RestartProfilingTimer);
+}
+
 }  // namespace
 
 void SignalHandler(int sig_nr, siginfo_t* info, void* context)
@@ -40,6 +91,8 @@ void SignalHandler(int sig_nr, siginfo_t* info, void* context)
 
   uint64_t overhead = GetMonotonicTime() - start;
 
+  FlightRecord(kFlightStackSample, buffer, size * sizeof(void*));
+
   if (info->si_code == SI_USER)
   {
     //tracepoint(lttng_profile,
@@ -48,14 +101,102 @@ void SignalHandler(int sig_nr, siginfo_t* info, void* context)
     //           buffer,
     //           overhead);
   }
-  else
+  else if (!DispatchWallSample(info, buffer, size))
   {
     //tracepoint(lttng_profile,
     //           on_cpu_sample,
     //           size,
     //           buffer,
     //           overhead);
+    int count = nb_sinks.load(std::memory_order_acquire);
+    for (int i = 0; i < count; i++)
+      sinks[i].load(std::memory_order_relaxed)(buffer, size);
+  }
+
+  AddSignalHandlerCost(GetMonotonicTime() - start);
+}
+
+bool InstallSignalHandler()
+{
+  struct sigaction sigact;
+  struct sigaction sigact_old;
+
+  memset(&sigact, 0, sizeof(sigact));
+  sigact.sa_sigaction = &SignalHandler;
+  sigact.sa_flags = SA_RESTART | SA_SIGINFO;
+  int ret = sigaction(kSignal, &sigact, &sigact_old);
+
+  if (ret != 0)
+  {
+    sigaction(kSignal, &sigact_old, &sigact);
+    return false;
   }
+
+  return true;
+}
+
+bool AddCpuSampleSink(CpuSampleSink sink)
+{
+  std::lock_guard<std::mutex> guard(sinks_mutex);
+  int count = nb_sinks.load(std::memory_order_relaxed);
+
+  if (count == kMaxSinks)
+    return false;
+
+  sinks[count].store(sink, std::memory_order_relaxed);
+  nb_sinks.store(count + 1, std::memory_order_release);
+  return true;
+}
+
+void SetSampleEndpointFunction(SampleEndpointFunction function)
+{
+  endpoint_function.store(function);
+}
+
+size_t SampleEndpoint(char* name, size_t size)
+{
+  SampleEndpointFunction function = endpoint_function.load();
+  return function != nullptr ? function(name, size) : 0;
+}
+
+bool StartCpuSampling()
+{
+  static std::once_flag once;
+
+  std::call_once(once, [] {
+    const char* value = getenv("MICROSERVICE_PROFILE_SAMPLE_US");
+    if (value != nullptr && atol(value) > 0)
+      sample_us = std::min(std::max(atol(value), 1000L), 999999L);
+
+    if (!InstallSignalHandler())
+    {
+      std::cerr << "Microservice-profiler: "
+                << "Unable to install a SIGPROF signal handler. "
+                << "No CPU profiling events will be generated." << std::endl;
+      return;
+    }
+    if (!lttng_profile::StartProfilingTimer(CurrentPeriod()))
+    {
+      std::cerr << "Microservice-profiler: "
+                << "Unable to start profiling timer. "
+                << "No CPU profiling events will be generated." << std::endl;
+      return;
+    }
+    pthread_atfork(nullptr, nullptr, ChildAfterFork);
+    sampling.store(true);
+  });
+  return sampling.load();
+}
+
+void SetCpuSamplingShift(int shift)
+{
+  if (sample_shift.exchange(shift) != shift && sampling.load())
+    lttng_profile::StartProfilingTimer(CurrentPeriod());
+}
+
+long CpuSamplingPeriod()
+{
+  return CurrentPeriod();
 }
 
 }  // namespace microservice_profile
@@ -19,6 +19,7 @@
 #define LTTNG_PROFILE_HANDLERS_H_
 
 #include <signal.h>
+#include <stddef.h>
 
 namespace microservice_profile
 {
@@ -26,6 +27,38 @@ namespace microservice_profile
 // This is called when a stack trace event must be generated.
 void SignalHandler(int sig_nr, siginfo_t* info, void* context);
 
+// Installs SignalHandler for SIGPROF. Installing it again is harmless.
+bool InstallSignalHandler();
+
+// Receives the on-CPU stack samples of SignalHandler, innermost first. Runs
+// in the signal handler: must be async-signal-safe.
+typedef void (*CpuSampleSink)(void* const* stack, size_t depth);
+
+// Adds a sink, at most 4. Returns false when full.
+bool AddCpuSampleSink(CpuSampleSink sink);
+
+// Names the endpoint of the calling thread's span, from a signal handler.
+// Returns 0 when the thread works on no span.
+typedef size_t (*SampleEndpointFunction)(char* name, size_t size);
+
+void SetSampleEndpointFunction(SampleEndpointFunction function);
+
+// For the sinks: the endpoint of the sampled thread's span, by the function
+// set above. Returns 0 when unknown.
+size_t SampleEndpoint(char* name, size_t size);
+
+// Installs SignalHandler and starts the SIGPROF interval timer, every
+// MICROSERVICE_PROFILE_SAMPLE_US microseconds of CPU time, once; again in
+// fork children, which do not inherit the timer. Returns true if running.
+bool StartCpuSampling();
+
+// Multiplies the SIGPROF period by 2^shift, up to a second: a knob of the
+// overhead governor. Applied right away when sampling runs.
+void SetCpuSamplingShift(int shift);
+
+// The current period, in microseconds.
+long CpuSamplingPeriod();
+
 }  // namespace lttng_profile
 
 #endif
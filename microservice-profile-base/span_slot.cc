@@ -0,0 +1,145 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-base/span_slot.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#include <atomic>
+
+extern "C" {
+#include "microservice-profile-base/module_abi.h"
+#include "microservice-profile-base/module_api.h"
+}
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+std::atomic<bool> slots_enabled(false);
+
+// Bumped when the slots must be handed to the module again: on enabling,
+// and in fork children, registered under their own pid.
+std::atomic<uint32_t> generation(1);
+
+struct ThreadSlot
+{
+  microservice_profiler_span_slot slot;
+  uint32_t generation;
+};
+
+// Read by signal handlers: initial-exec TLS with no destructor, whose first
+// access neither allocates nor registers anything.
+__thread ThreadSlot thread_slot __attribute__((tls_model("initial-exec")));
+
+// Takes the slot back from the module when a thread that handed it exits.
+pthread_key_t exit_key;
+
+void ForgetThreadSlot(void*)
+{
+  if (thread_slot.generation == generation.load())
+    microservice_profiler_module_set_span_slot(nullptr);
+}
+
+// Off the signal path: on enabling and in SetThreadSpan.
+void HandOverThreadSlot(uint32_t current)
+{
+  if (thread_slot.generation == 0)
+    pthread_setspecific(exit_key, &thread_slot);
+  thread_slot.generation = current;
+}
+
+void ChildAfterFork()
+{
+  generation.fetch_add(1);
+}
+
+void Barrier()
+{
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+}
+
+}  // namespace
+
+bool EnableSpanSlots()
+{
+  static bool fork_handler = false;
+
+  // Probe with the calling thread's slot.
+  if (microservice_profiler_module_set_span_slot(&thread_slot.slot) != 0)
+    return false;
+
+  if (!fork_handler)
+  {
+    pthread_key_create(&exit_key, ForgetThreadSlot);
+    pthread_atfork(nullptr, nullptr, ChildAfterFork);
+    fork_handler = true;
+  }
+  HandOverThreadSlot(generation.fetch_add(1) + 1);
+  slots_enabled.store(true);
+  return true;
+}
+
+void SetThreadSpan(const uint8_t* span_id, const uint8_t* trace_id)
+{
+  ThreadSlot& thread = thread_slot;
+  microservice_profiler_span_slot& slot = thread.slot;
+
+  slot.seq++;
+  Barrier();
+  if (span_id != nullptr)
+  {
+    memcpy(slot.span_id, span_id, sizeof(slot.span_id));
+    memcpy(slot.trace_id, trace_id, sizeof(slot.trace_id));
+    slot.active = 1;
+  }
+  else
+  {
+    slot.active = 0;
+  }
+  Barrier();
+  slot.seq++;
+
+  if (slots_enabled.load(std::memory_order_relaxed))
+  {
+    uint32_t current = generation.load(std::memory_order_relaxed);
+    if (thread.generation != current)
+    {
+      // Once per thread; a thread the module does not track is refused,
+      // and not asked again.
+      microservice_profiler_module_set_span_slot(&slot);
+      HandOverThreadSlot(current);
+    }
+  }
+}
+
+bool GetThreadSpan(uint8_t* span_id, uint8_t* trace_id)
+{
+  const microservice_profiler_span_slot& slot = thread_slot.slot;
+  uint32_t seq = slot.seq;
+
+  // Written by this very thread: odd only when interrupted mid-write.
+  if ((seq & 1) != 0 || slot.active == 0)
+    return false;
+  memcpy(span_id, slot.span_id, sizeof(slot.span_id));
+  memcpy(trace_id, slot.trace_id, sizeof(slot.trace_id));
+  Barrier();
+  return slot.seq == seq;
+}
+
+}  // namespace microservice_profile
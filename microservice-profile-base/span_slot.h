@@ -0,0 +1,41 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_SPAN_SLOT_H_
+#define MICROSERVICE_PROFILE_SPAN_SLOT_H_
+
+#include <stdint.h>
+
+namespace microservice_profile
+{
+
+// Lets the kernel module read the span slots of the threads (see struct
+// microservice_profiler_span_slot in module_abi.h). Each thread hands its
+// slot to the module on its first publication. Call after the process is
+// registered. Returns false if the module does not support span slots.
+bool EnableSpanSlots();
+
+// Publishes the span the calling thread now works on, or none when span_id
+// is nullptr. A couple of stores: no syscall, except on the thread's first
+// publication. Async-signal-safe readers on the same thread see either the
+// old or the new span.
+void SetThreadSpan(const uint8_t* span_id, const uint8_t* trace_id);
+
+// Reads the span the calling thread works on. Returns false if none.
+bool GetThreadSpan(uint8_t* span_id, uint8_t* trace_id);
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_SPAN_SLOT_H_
@@ -0,0 +1,296 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-base/thread_filter.h"
+
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "microservice-profile-base/overhead_governor.h"
+
+extern "C" {
+#include "microservice-profile-base/module_api.h"
+}
+
+namespace microservice_profile
+{
+
+std::atomic<unsigned> thread_filter_generation(1);
+thread_local unsigned thread_filter_applied_generation = 0;
+thread_local int sdk_thread_creation = 0;
+
+namespace
+{
+
+// Names of the worker threads of the OpenTelemetry exporters and batch
+// processors, truncated to 15 characters by the kernel.
+const char kDefaultSdkThreads[] =
+    "OTel*,otel*,BatchSpanProc*,BatchLogRecord*,PeriodicExport*";
+
+// Maximum number of threads excluded from tracking at the same time.
+const size_t kMaxExcludedThreads = 256;
+
+// A thread is tracked by the module as soon as its process registers.
+thread_local bool registered = true;
+thread_local bool pinned = false;
+thread_local bool profiler_thread = false;
+thread_local bool sdk_thread = false;
+
+// Set once the profiler runs as a no-op, to skip all filtering work.
+std::atomic<bool> disabled(false);
+
+// Excluded threads. Registering the process enrolls all of its threads, so
+// the exclusions decided before that (or inherited across fork) are replayed
+// to the module once it is registered.
+std::atomic<int> excluded_tids[kMaxExcludedThreads];
+
+int GetTid()
+{
+  return syscall(SYS_gettid);
+}
+
+void AddExcludedThread(int tid)
+{
+  for (auto& slot : excluded_tids)
+  {
+    int expected = 0;
+    if (slot.compare_exchange_strong(expected, tid))
+      return;
+  }
+}
+
+void RemoveExcludedThread(int tid)
+{
+  for (auto& slot : excluded_tids)
+  {
+    int expected = tid;
+    if (slot.compare_exchange_strong(expected, 0))
+      return;
+  }
+}
+
+// Releases the slot of an excluded thread when it exits.
+struct ExcludedThreadGuard
+{
+  ~ExcludedThreadGuard()
+  {
+    if (!registered)
+      RemoveExcludedThread(GetTid());
+  }
+};
+
+struct ThreadFilter
+{
+  std::mutex mutex;
+  bool loaded = false;
+  bool track_sdk_threads = false;
+  std::vector<std::string> include;
+  std::vector<std::string> exclude;
+  std::vector<std::string> sdk;
+};
+
+ThreadFilter& GetFilter()
+{
+  static ThreadFilter* filter = new ThreadFilter;
+  return *filter;
+}
+
+void SplitPatterns(const char* patterns, std::vector<std::string>* out)
+{
+  out->clear();
+  const char* p = patterns;
+  while (*p)
+  {
+    const char* end = strchrnul(p, ',');
+    if (end != p)
+      out->emplace_back(p, end - p);
+    p = *end ? end + 1 : end;
+  }
+}
+
+bool MatchesAny(const std::vector<std::string>& patterns, const char* name)
+{
+  for (const auto& pattern : patterns)
+  {
+    if (fnmatch(pattern.c_str(), name, 0) == 0)
+      return true;
+  }
+  return false;
+}
+
+// Must be called with the filter mutex held.
+void LoadFromEnvironment(ThreadFilter& filter)
+{
+  if (filter.loaded)
+    return;
+  filter.loaded = true;
+
+  const char* include = getenv("MICROSERVICE_PROFILE_THREADS");
+  const char* exclude = getenv("MICROSERVICE_PROFILE_EXCLUDE_THREADS");
+  const char* track_sdk = getenv("MICROSERVICE_PROFILE_TRACK_SDK_THREADS");
+  const char* sdk = getenv("MICROSERVICE_PROFILE_SDK_THREADS");
+
+  if (include)
+    SplitPatterns(include, &filter.include);
+  if (exclude)
+    SplitPatterns(exclude, &filter.exclude);
+  filter.track_sdk_threads = track_sdk && strcmp(track_sdk, "1") == 0;
+  SplitPatterns(sdk ? sdk : kDefaultSdkThreads, &filter.sdk);
+}
+
+bool IsCurrentThreadSelected()
+{
+  if (profiler_thread)
+    return false;
+
+  ThreadFilter& filter = GetFilter();
+  std::lock_guard<std::mutex> guard(filter.mutex);
+  LoadFromEnvironment(filter);
+
+  if (sdk_thread && !filter.track_sdk_threads)
+    return false;
+  if (filter.include.empty() && filter.exclude.empty() &&
+      (filter.track_sdk_threads || filter.sdk.empty()))
+    return true;
+
+  char name[16] = {0};
+  prctl(PR_GET_NAME, name, 0, 0, 0);
+
+  if (!filter.track_sdk_threads && MatchesAny(filter.sdk, name))
+    return false;
+
+  if (!filter.include.empty() && !MatchesAny(filter.include, name))
+    return false;
+  return !MatchesAny(filter.exclude, name);
+}
+
+int SetRegistered(bool tracked)
+{
+  static thread_local ExcludedThreadGuard guard;
+  (void) guard;
+
+  if (registered == tracked)
+    return 0;
+
+  // Before the process is registered the decision is only recorded.
+  if (microservice_profiler_module_is_registered())
+  {
+    int ret = tracked ? microservice_profiler_module_register_thread(0)
+                      : microservice_profiler_module_unregister_thread(0);
+    if (ret != 0)
+      return ret;
+  }
+
+  registered = tracked;
+  if (tracked)
+    RemoveExcludedThread(GetTid());
+  else
+    AddExcludedThread(GetTid());
+  return 0;
+}
+
+}  // namespace
+
+void SetThreadFilter(const char* include_patterns,
+                     const char* exclude_patterns)
+{
+  ThreadFilter& filter = GetFilter();
+  {
+    std::lock_guard<std::mutex> guard(filter.mutex);
+    LoadFromEnvironment(filter);
+    if (include_patterns)
+      SplitPatterns(include_patterns, &filter.include);
+    if (exclude_patterns)
+      SplitPatterns(exclude_patterns, &filter.exclude);
+  }
+  thread_filter_generation.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ApplyThreadFilter()
+{
+  thread_filter_applied_generation =
+      thread_filter_generation.load(std::memory_order_relaxed);
+  if (pinned || disabled.load(std::memory_order_relaxed))
+    return;
+  SetRegistered(IsCurrentThreadSelected());
+}
+
+int TrackCurrentThread(bool tracked)
+{
+  pinned = true;
+  return SetRegistered(tracked);
+}
+
+void MarkProfilerThread()
+{
+  profiler_thread = true;
+  pinned = false;
+  ApplyThreadFilter();
+  RegisterProfilerThreadClock();
+}
+
+bool IsProfilerThread()
+{
+  return profiler_thread;
+}
+
+void MarkSdkThread()
+{
+  sdk_thread = true;
+}
+
+void ReplayThreadFilter()
+{
+  for (auto& slot : excluded_tids)
+  {
+    int tid = slot.load();
+    if (tid != 0)
+      microservice_profiler_module_unregister_thread(tid);
+  }
+}
+
+void ResetThreadFilterAfterFork()
+{
+  for (auto& slot : excluded_tids)
+    slot.store(0);
+  if (!registered)
+    AddExcludedThread(GetTid());
+}
+
+void DisableThreadFilter()
+{
+  disabled.store(true);
+}
+
+void BeginSdkThreadCreation()
+{
+  sdk_thread_creation++;
+}
+
+void EndSdkThreadCreation()
+{
+  if (sdk_thread_creation > 0)
+    sdk_thread_creation--;
+}
+
+}  // namespace microservice_profile
@@ -0,0 +1,87 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_THREAD_FILTER_H_
+#define MICROSERVICE_PROFILE_THREAD_FILTER_H_
+
+#include <atomic>
+
+namespace microservice_profile
+{
+
+// Bumped whenever the filter changes or a thread is renamed by another one.
+// Each thread re-evaluates itself when its cached value is out of date.
+extern std::atomic<unsigned> thread_filter_generation;
+extern thread_local unsigned thread_filter_applied_generation;
+extern thread_local int sdk_thread_creation;
+
+// Replaces the include/exclude pattern lists (comma-separated fnmatch(3)
+// patterns). A null list is left unchanged.
+void SetThreadFilter(const char* include_patterns,
+                     const char* exclude_patterns);
+
+// Registers or unregisters the calling thread with the kernel module
+// according to its name and the current filter.
+void ApplyThreadFilter();
+
+// Explicitly tracks or untracks the calling thread; the filter no longer
+// applies to it.
+int TrackCurrentThread(bool tracked);
+
+// Marks the calling thread as one of the profiler's own threads. It is never
+// tracked, and its CPU time counts in the overhead governor's measure.
+void MarkProfilerThread();
+
+// Returns true on the threads marked by MarkProfilerThread().
+bool IsProfilerThread();
+
+// Marks the calling thread as created by the OpenTelemetry libraries.
+void MarkSdkThread();
+
+// Sends the exclusions recorded so far to the module. Called once the
+// process is registered.
+void ReplayThreadFilter();
+
+// Drops the exclusions inherited from the parent, keeping the calling thread's
+// own decision. Called in a forked child before it registers.
+void ResetThreadFilterAfterFork();
+
+// Turns all filtering into no-ops, for when profiling is disabled.
+void DisableThreadFilter();
+
+// The threads created by the calling thread between these two calls are
+// the OpenTelemetry libraries' own, like those named after them
+// (MICROSERVICE_PROFILE_SDK_THREADS). Calls nest.
+void BeginSdkThreadCreation();
+void EndSdkThreadCreation();
+
+// Checked by the pthread_create interposer: a thread-local read, no unwind.
+inline bool CreatingSdkThreads()
+{
+  return sdk_thread_creation > 0;
+}
+
+// Cheap check meant for hot paths: re-applies the filter only if it changed
+// since the calling thread last looked at it.
+inline void MaybeApplyThreadFilter()
+{
+  if (thread_filter_applied_generation !=
+      thread_filter_generation.load(std::memory_order_relaxed))
+    ApplyThreadFilter();
+}
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_THREAD_FILTER_H_
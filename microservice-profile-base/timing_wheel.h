@@ -0,0 +1,194 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_TIMING_WHEEL_H_
+#define MICROSERVICE_PROFILE_TIMING_WHEEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+
+namespace microservice_profile
+{
+
+// Intrusive timer, embedded in the objects to expire.
+struct WheelTimer
+{
+  WheelTimer* prev = nullptr;
+  WheelTimer* next = nullptr;
+  uint64_t expires = 0;  // In ticks.
+
+  bool armed() const { return prev != nullptr; }
+};
+
+// Hierarchical timing wheel: kLevels wheels of kSlots slots, each level
+// covering kSlots times the range of the previous one. Arming and disarming
+// are O(1); timers of the upper levels cascade down as time advances. Not
+// thread-safe.
+class TimingWheel
+{
+public:
+  static const int kLevels = 4;
+  static const int kSlotBits = 8;
+  static const uint64_t kSlots = 1 << kSlotBits;
+
+  explicit TimingWheel(uint64_t now = 0)
+  {
+    Reset(now);
+  }
+
+  TimingWheel(const TimingWheel&) = delete;
+  TimingWheel& operator=(const TimingWheel&) = delete;
+
+  // Empties the wheel without touching the timers it held.
+  void Reset(uint64_t now)
+  {
+    now_ = now;
+    for (int level = 0; level < kLevels; ++level)
+    {
+      for (uint64_t slot = 0; slot < kSlots; ++slot)
+      {
+        WheelTimer& head = slots_[level][slot];
+        head.prev = head.next = &head;
+      }
+    }
+  }
+
+  uint64_t now() const { return now_; }
+
+  // Arms the timer to expire at the given tick. Timers in the past expire at
+  // the next Advance().
+  void Arm(WheelTimer* timer, uint64_t expires)
+  {
+    if (timer->armed())
+      Disarm(timer);
+    timer->expires = expires;
+    Insert(timer, now_ + 1);
+  }
+
+  // A tick no later than the earliest armed timer expires, UINT64_MAX when
+  // none is armed. Exact for the timers of the first level; those of the
+  // upper levels count from when their slot cascades.
+  uint64_t NextExpiry() const
+  {
+    uint64_t next = UINT64_MAX;
+
+    for (int level = 0; level < kLevels; ++level)
+    {
+      int shift = kSlotBits * level;
+      // The current slot of the first level was just emptied, that of an
+      // upper level only holds timers a full turn ahead.
+      for (uint64_t k = level == 0 ? 1 : 0; k < kSlots; ++k)
+      {
+        uint64_t index = (now_ >> shift) + k;
+        const WheelTimer& head = slots_[level][index & (kSlots - 1)];
+        if (head.next == &head)
+          continue;
+        if (k == 0)
+          index += kSlots;
+        uint64_t expiry = index << shift;
+        if (expiry <= now_)
+          expiry = now_ + 1;
+        if (expiry < next)
+          next = expiry;
+        break;
+      }
+    }
+    return next;
+  }
+
+  void Disarm(WheelTimer* timer)
+  {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = nullptr;
+  }
+
+  // Moves time forward to the given tick and calls expire(timer) for every
+  // timer that is due, after disarming it. expire may re-arm the timer.
+  template <class Expire>
+  void Advance(uint64_t now, Expire expire)
+  {
+    while (now_ < now)
+    {
+      ++now_;
+
+      // Cascade the upper levels whenever a lower one wraps around.
+      for (int level = 1; level < kLevels; ++level)
+      {
+        if ((now_ & ((1ULL << (kSlotBits * level)) - 1)) != 0)
+          break;
+        Cascade(level, (now_ >> (kSlotBits * level)) & (kSlots - 1));
+      }
+
+      WheelTimer& head = slots_[0][now_ & (kSlots - 1)];
+      while (head.next != &head)
+      {
+        WheelTimer* timer = head.next;
+        Disarm(timer);
+        expire(timer);
+      }
+    }
+  }
+
+private:
+  // Timers due before `earliest` expire at `earliest`.
+  void Insert(WheelTimer* timer, uint64_t earliest)
+  {
+    uint64_t expires = std::max(timer->expires, earliest);
+    uint64_t delta = expires - now_;
+    int level = 0;
+
+    while (level < kLevels - 1 && delta >= (1ULL << (kSlotBits * (level + 1))))
+      ++level;
+
+    // Beyond the last level, park the timer in the farthest slot; it is
+    // re-inserted every time that slot cascades.
+    if (delta >= (1ULL << (kSlotBits * kLevels)))
+      expires = now_ + (1ULL << (kSlotBits * kLevels)) - 1;
+
+    WheelTimer& head =
+        slots_[level][(expires >> (kSlotBits * level)) & (kSlots - 1)];
+    timer->next = &head;
+    timer->prev = head.prev;
+    head.prev->next = timer;
+    head.prev = timer;
+  }
+
+  void Cascade(int level, uint64_t slot)
+  {
+    WheelTimer& head = slots_[level][slot];
+    WheelTimer* timer = head.next;
+
+    head.prev = head.next = &head;
+    while (timer != &head)
+    {
+      WheelTimer* next = timer->next;
+      timer->prev = timer->next = nullptr;
+      // The first level's slot of the current tick is expired right after
+      // the cascade: a timer due on a slot boundary is not a tick late.
+      Insert(timer, now_);
+      timer = next;
+    }
+  }
+
+  uint64_t now_;
+  WheelTimer slots_[kLevels][kSlots];
+};
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_TIMING_WHEEL_H_
@@ -0,0 +1,275 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-base/wall_clock_sampler.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
+#include "microservice-profile-base/fork_restart.h"
+#include "microservice-profile-base/signal_handler.h"
+#include "microservice-profile-base/thread_filter.h"
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+const int kMaxSinks = 4;
+
+// The si_value of the sampler's signals: this tag, and the thread state in
+// the low byte.
+const int kWallSampleTag = 0x57a11000;
+const int kTagMask = ~0xff;
+
+const int kMaxThreadsPerTick = 256;
+
+std::atomic<WallSampleSink> sinks[kMaxSinks];
+std::atomic<int> nb_sinks(0);
+std::mutex sinks_mutex;
+
+long period_us = 10000;
+int threads_per_tick = 8;
+std::atomic<bool> running(false);
+
+// Opened for the sampler thread: the child of a fork opens its own.
+DIR* task_dir = nullptr;
+
+// The state letter of /proc/self/task/<tid>/stat, 0 if the thread is gone.
+char ReadThreadState(pid_t tid)
+{
+  char path[32];
+  char stat[64];
+
+  snprintf(path, sizeof(path), "%d/stat", (int) tid);
+  int fd = openat(dirfd(task_dir), path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  ssize_t size = read(fd, stat, sizeof(stat) - 1);
+  close(fd);
+  if (size <= 0)
+    return 0;
+  stat[size] = '\0';
+
+  // "tid (comm) S ...": the name may hold parentheses and spaces, the
+  // fields after it do not.
+  const char* end = strrchr(stat, ')');
+  if (end == nullptr || end[1] != ' ' || end[2] == '\0')
+    return 0;
+  return end[2];
+}
+
+bool SendSample(pid_t pid, pid_t tid, char state)
+{
+  siginfo_t info;
+
+  memset(&info, 0, sizeof(info));
+  info.si_signo = SIGPROF;
+  info.si_code = SI_QUEUE;
+  info.si_pid = pid;
+  info.si_uid = getuid();
+  info.si_value.sival_int = kWallSampleTag | (uint8_t) state;
+  return syscall(SYS_rt_tgsigqueueinfo, pid, tid, SIGPROF, &info) == 0;
+}
+
+// Picks the next threads_per_tick threads of the directory, looking at no
+// more than twice as many entries. readdir reads the directory in batches,
+// and starts over at its end.
+void Tick(pid_t pid, pid_t self)
+{
+  int picked = 0;
+  int looked_at = 0;
+  bool rewound = false;
+
+  while (picked < threads_per_tick && looked_at < 2 * threads_per_tick)
+  {
+    struct dirent* entry = readdir(task_dir);
+    if (entry == nullptr)
+    {
+      if (rewound)
+        break;
+      rewinddir(task_dir);
+      rewound = true;
+      continue;
+    }
+    looked_at++;
+
+    pid_t tid = atoi(entry->d_name);
+    if (tid <= 0 || tid == self)
+      continue;
+
+    char state = ReadThreadState(tid);
+    if (state == 0 || state == 'Z' || state == 'X')
+      continue;
+    if (SendSample(pid, tid, state))
+      picked++;
+  }
+}
+
+void SamplerThread()
+{
+  MarkProfilerThread();
+
+  pid_t pid = getpid();
+  pid_t self = syscall(SYS_gettid);
+  for (;;)
+  {
+    std::this_thread::sleep_for(std::chrono::microseconds(period_us));
+    Tick(pid, self);
+  }
+}
+
+bool StartSamplerThread()
+{
+  task_dir = opendir("/proc/self/task");
+  if (task_dir == nullptr)
+  {
+    std::cerr << "Microservice-profiler: "
+              << "Unable to open /proc/self/task: " << strerror(errno)
+              << ". No wall-clock samples will be taken." << std::endl;
+    return false;
+  }
+
+  try
+  {
+    std::thread(SamplerThread).detach();
+  }
+  catch (const std::system_error& e)
+  {
+    std::cerr << "Microservice-profiler: "
+              << "Unable to start the wall-clock sampler: " << e.what()
+              << std::endl;
+    closedir(task_dir);
+    task_dir = nullptr;
+    return false;
+  }
+  return true;
+}
+
+void RestartSamplerThread()
+{
+  StartSamplerThread();
+}
+
+// The sampler thread does not exist in the child, and the directory it read
+// lists the parent's threads. The child's first span starts a new one.
+void ChildAfterFork()
+{
+  if (task_dir != nullptr)
+    closedir(task_dir);
+  task_dir = nullptr;
+  DeferRestartAfterFork(RestartSamplerThread);
+}
+
+}  // namespace
+
+bool AddWallSampleSink(WallSampleSink sink)
+{
+  std::lock_guard<std::mutex> guard(sinks_mutex);
+  int count = nb_sinks.load(std::memory_order_relaxed);
+
+  if (count == kMaxSinks)
+    return false;
+
+  sinks[count].store(sink, std::memory_order_relaxed);
+  nb_sinks.store(count + 1, std::memory_order_release);
+  return true;
+}
+
+const char* ThreadStateName(char state)
+{
+  switch (state)
+  {
+    case 'R':
+      return "running";
+    case 'S':
+      return "sleeping";
+    case 'D':
+      return "blocked";
+  }
+  return "other";
+}
+
+bool DispatchWallSample(const siginfo_t* info, void* const* stack,
+                        size_t depth)
+{
+  if (info->si_code != SI_QUEUE ||
+      (info->si_value.sival_int & kTagMask) != kWallSampleTag ||
+      info->si_pid != getpid())
+    return false;
+
+  // The profiler's own waits are not the application's.
+  if (IsProfilerThread())
+    return true;
+
+  char state = (char) (info->si_value.sival_int & 0xff);
+  int count = nb_sinks.load(std::memory_order_acquire);
+  for (int i = 0; i < count; i++)
+    sinks[i].load(std::memory_order_relaxed)(stack, depth, state);
+  return true;
+}
+
+bool StartWallClockSampling()
+{
+  const char* value = getenv("MICROSERVICE_PROFILE_WALL_US");
+  if (value == nullptr || atol(value) <= 0)
+    return false;
+
+  if (WallClockSamplingEnabled())
+    return true;
+
+  period_us = std::max(atol(value), 1000L);
+  value = getenv("MICROSERVICE_PROFILE_WALL_THREADS");
+  if (value != nullptr && atoi(value) > 0)
+    threads_per_tick = std::min(atoi(value), kMaxThreadsPerTick);
+
+  if (!InstallSignalHandler())
+  {
+    std::cerr << "Microservice-profiler: "
+              << "Unable to install a SIGPROF signal handler. "
+              << "No wall-clock samples will be taken." << std::endl;
+    return false;
+  }
+  if (!StartSamplerThread())
+    return false;
+  pthread_atfork(nullptr, nullptr, ChildAfterFork);
+
+  running.store(true);
+  return true;
+}
+
+bool WallClockSamplingEnabled()
+{
+  return running.load(std::memory_order_relaxed);
+}
+
+}  // namespace microservice_profile
@@ -0,0 +1,62 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_WALL_CLOCK_SAMPLER_H_
+#define MICROSERVICE_PROFILE_WALL_CLOCK_SAMPLER_H_
+
+#include <signal.h>
+#include <stddef.h>
+
+namespace microservice_profile
+{
+
+// Wall-clock sampling, without the kernel module: a thread walks
+// /proc/self/task, a few threads per tick, reads the state of each from its
+// stat file and queues it a SIGPROF carrying that state. The signal handler
+// of the picked thread then takes its stack, whether the thread was running
+// or waiting. The cost of a tick is bounded by the number of threads picked,
+// not by the number of threads of the process; with more threads, each one
+// is sampled less often.
+//
+// The signals interrupt the system calls of the threads: those that are
+// not restarted (poll, epoll_wait, nanosleep...) return EINTR.
+
+// Receives the wall-clock samples, innermost frame first, with the state of
+// the thread when it was picked: 'R' (running), 'S' (sleeping), 'D'
+// (blocked, uninterruptible) or another /proc state letter. Runs in the
+// signal handler: must be async-signal-safe.
+typedef void (*WallSampleSink)(void* const* stack, size_t depth, char state);
+
+// Adds a sink, at most 4. Returns false when full.
+bool AddWallSampleSink(WallSampleSink sink);
+
+// "running", "sleeping", "blocked" or "other".
+const char* ThreadStateName(char state);
+
+// For the SIGPROF handler: returns true, and passes the sample to the
+// sinks, if the signal was queued by the wall-clock sampler.
+bool DispatchWallSample(const siginfo_t* info, void* const* stack,
+                        size_t depth);
+
+// Reads MICROSERVICE_PROFILE_WALL_US and, if set, starts the sampler thread,
+// picking MICROSERVICE_PROFILE_WALL_THREADS threads (8 by default) every
+// that many microseconds. Again in fork children. Returns true if running.
+bool StartWallClockSampling();
+
+bool WallClockSamplingEnabled();
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_WALL_CLOCK_SAMPLER_H_
@@ -0,0 +1,444 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-base/windowed_profile.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <new>
+#include <string>
+#include <system_error>
+#include <thread>
+
+#include "microservice-profile-base/fork_restart.h"
+#include "microservice-profile-base/memory_budget.h"
+#include "microservice-profile-base/signal_handler.h"
+#include "microservice-profile-base/thread_filter.h"
+#include "microservice-profile-base/wall_clock_sampler.h"
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+// Slots looked at for a sample before it is dropped.
+const size_t kMaxProbes = 16;
+
+// Waits for another sampler to finish filling a slot it claimed, before the
+// sample is dropped.
+const int kMaxSpins = 1000;
+
+const char kNoEndpoint[] = "(none)";
+
+std::atomic<WindowedProfile*> profile(nullptr);
+std::atomic<WindowedProfile*> wall_profile(nullptr);
+
+std::string directory;
+long window_s = 60;
+size_t max_files = 60;
+
+// The files written by this process, oldest first, of each profile. Only
+// the writer thread touches them.
+std::deque<std::string> window_files;
+std::deque<std::string> wall_window_files;
+
+uint64_t Hash(const char* endpoint, size_t endpoint_size, void* const* stack,
+              size_t depth, char state)
+{
+  uint64_t hash = 0xcbf29ce484222325ull;
+
+  hash = (hash ^ (uint8_t) state) * 0x100000001b3ull;
+  for (size_t i = 0; i < endpoint_size; i++)
+    hash = (hash ^ (uint8_t) endpoint[i]) * 0x100000001b3ull;
+  for (size_t i = 0; i < depth; i++)
+    hash = (hash ^ reinterpret_cast<uintptr_t>(stack[i])) * 0x100000001b3ull;
+  return hash;
+}
+
+void WriteWindow(WindowedProfile* windows, int generation, const char* prefix,
+                 std::deque<std::string>* files, time_t end)
+{
+  struct tm tm;
+  char stamp[32];
+
+  gmtime_r(&end, &tm);
+  strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", &tm);
+  std::string path = directory + "/" + prefix + "-" +
+                     std::to_string(getpid()) + "-" + stamp + ".folded";
+  std::string temporary = path + ".tmp";
+
+  // The generation is cleared for its next window even if no file can be
+  // written.
+  FILE* file = fopen(temporary.c_str(), "we");
+  uint64_t dropped;
+  uint64_t samples = windows->WriteAndClear(generation, file, &dropped);
+  if (file == nullptr || fclose(file) != 0 ||
+      rename(temporary.c_str(), path.c_str()) != 0)
+  {
+    static bool warned = false;
+    if (!warned)
+    {
+      std::cerr << "Microservice-profiler: "
+                << "unable to write the profile window " << path << ": "
+                << strerror(errno) << std::endl;
+      warned = true;
+    }
+    unlink(temporary.c_str());
+    return;
+  }
+
+  if (dropped > 0)
+  {
+    std::cerr << "Microservice-profiler: " << dropped << " of "
+              << samples + dropped << " samples dropped from the window "
+              << "ending " << stamp << std::endl;
+  }
+
+  files->push_back(path);
+  while (files->size() > max_files)
+  {
+    unlink(files->front().c_str());
+    files->pop_front();
+  }
+}
+
+void WriterThread()
+{
+  MarkProfilerThread();
+
+  for (;;)
+  {
+    std::this_thread::sleep_for(std::chrono::seconds(window_s));
+    time_t end = time(nullptr);
+    WindowedProfile* windows = profile.load();
+    WriteWindow(windows, windows->Retire(), "profile", &window_files, end);
+
+    WindowedProfile* wall_windows = wall_profile.load();
+    if (wall_windows != nullptr)
+      WriteWindow(wall_windows, wall_windows->Retire(), "wall",
+                  &wall_window_files, end);
+  }
+}
+
+void StartWriterThread()
+{
+  std::thread(WriterThread).detach();
+}
+
+void RestartWriterThread()
+{
+  try
+  {
+    StartWriterThread();
+  }
+  catch (const std::system_error& e)
+  {
+    std::cerr << "Microservice-profiler: "
+              << "Unable to start the profile window writer: " << e.what()
+              << std::endl;
+  }
+}
+
+// The writer thread does not exist in the child. The windows in progress
+// are the parent's. The child's first span starts a new writer.
+void ChildAfterFork()
+{
+  profile.load()->Reset();
+  new (&window_files) std::deque<std::string>();
+  if (wall_profile.load() != nullptr)
+    wall_profile.load()->Reset();
+  new (&wall_window_files) std::deque<std::string>();
+  DeferRestartAfterFork(RestartWriterThread);
+}
+
+void RecordSample(WindowedProfile* windows, void* const* stack, size_t depth,
+                  char state)
+{
+  char endpoint[WindowedProfile::kEndpointSize];
+  size_t endpoint_size = SampleEndpoint(endpoint, sizeof(endpoint));
+  if (endpoint_size == 0)
+  {
+    endpoint_size = sizeof(kNoEndpoint) - 1;
+    memcpy(endpoint, kNoEndpoint, endpoint_size);
+  }
+
+  windows->Record(endpoint, endpoint_size, stack, depth, state);
+}
+
+// The CPU sample sink.
+void RecordWindowSample(void* const* stack, size_t depth)
+{
+  WindowedProfile* windows = profile.load(std::memory_order_acquire);
+  if (windows != nullptr)
+    RecordSample(windows, stack, depth, 0);
+}
+
+// The wall-clock sample sink.
+void RecordWallWindowSample(void* const* stack, size_t depth, char state)
+{
+  WindowedProfile* windows = wall_profile.load(std::memory_order_acquire);
+  if (windows != nullptr)
+    RecordSample(windows, stack, depth, state);
+}
+
+// Fewer entries per window rather than no profile when the memory budget
+// is short: more samples are dropped.
+WindowedProfile* MakeProfile(const char* kind)
+{
+  WindowedProfile::Options options;
+  size_t entry_size = WindowedProfile::Footprint(1);
+  options.entries = ReserveMemoryUnits(kMemoryStackTables, 0, entry_size,
+                                       options.entries, 256);
+  if (options.entries == 0)
+  {
+    std::cerr << "Microservice-profiler: no memory left in the budget for "
+              << "the " << kind << " profile windows" << std::endl;
+    return nullptr;
+  }
+  return new WindowedProfile(options);
+}
+
+}  // namespace
+
+WindowedProfile::WindowedProfile(const Options& options)
+    : options_(options), live_(0)
+{
+  // A power of two, for the probes.
+  size_t entries = 1;
+  while (entries < options_.entries)
+    entries <<= 1;
+  options_.entries = entries;
+
+  for (Generation& generation : generations_)
+  {
+    generation.entries.reset(new Entry[entries]);
+    generation.writers.store(0);
+    Clear(generation);
+  }
+}
+
+size_t WindowedProfile::Footprint(size_t entries)
+{
+  return 2 * entries * sizeof(Entry);
+}
+
+void WindowedProfile::Record(const char* endpoint, size_t endpoint_size,
+                             void* const* stack, size_t depth, char state)
+{
+  endpoint_size = std::min(endpoint_size, kEndpointSize);
+  depth = std::min(depth, kMaxDepth);
+  uint64_t key = Hash(endpoint, endpoint_size, stack, depth, state) | 1;
+
+  // Registered as a writer of a generation that was still live afterwards:
+  // Retire waits for this sample.
+  Generation* generation;
+  for (;;)
+  {
+    int live = live_.load();
+    generation = &generations_[live];
+    generation->writers.fetch_add(1);
+    if (live_.load() == live)
+      break;
+    generation->writers.fetch_sub(1);
+  }
+
+  size_t mask = options_.entries - 1;
+  bool counted = false;
+  for (size_t probe = 0; probe < kMaxProbes && !counted; probe++)
+  {
+    Entry& entry = generation->entries[((key >> 1) + probe) & mask];
+    uint64_t current = entry.key.load(std::memory_order_acquire);
+
+    if (current == 0 && entry.key.compare_exchange_strong(current, key))
+    {
+      entry.endpoint_size = endpoint_size;
+      entry.depth = depth;
+      entry.state = state;
+      memcpy(entry.endpoint, endpoint, endpoint_size);
+      for (size_t i = 0; i < depth; i++)
+        entry.stack[i] = reinterpret_cast<uintptr_t>(stack[i]);
+      entry.ready.store(true, std::memory_order_release);
+      entry.count.fetch_add(1, std::memory_order_relaxed);
+      counted = true;
+      break;
+    }
+    if (current != key)
+      continue;
+
+    int spins = 0;
+    while (!entry.ready.load(std::memory_order_acquire) && ++spins < kMaxSpins)
+      ;
+    if (spins == kMaxSpins)
+      break;
+
+    if (entry.endpoint_size == endpoint_size && entry.depth == depth &&
+        entry.state == state &&
+        memcmp(entry.endpoint, endpoint, endpoint_size) == 0 &&
+        memcmp(entry.stack, stack, depth * sizeof(uintptr_t)) == 0)
+    {
+      entry.count.fetch_add(1, std::memory_order_relaxed);
+      counted = true;
+    }
+  }
+
+  if (!counted)
+    generation->dropped.fetch_add(1, std::memory_order_relaxed);
+  generation->writers.fetch_sub(1);
+}
+
+int WindowedProfile::Retire()
+{
+  int retired = live_.load();
+
+  live_.store(1 - retired);
+  while (generations_[retired].writers.load() != 0)
+    sched_yield();
+  return retired;
+}
+
+uint64_t WindowedProfile::WriteAndClear(int index, FILE* file,
+                                        uint64_t* dropped)
+{
+  Generation& generation = generations_[index];
+  uint64_t samples = 0;
+
+  for (size_t i = 0; i < options_.entries; i++)
+  {
+    const Entry& entry = generation.entries[i];
+    if (!entry.ready.load(std::memory_order_acquire))
+      continue;
+
+    uint64_t count = entry.count.load(std::memory_order_relaxed);
+    samples += count;
+    if (file == nullptr)
+      continue;
+
+    // ';' separates the frames, and a line is one entry.
+    for (size_t j = 0; j < entry.endpoint_size; j++)
+    {
+      char c = entry.endpoint[j];
+      fputc(c == ';' || c == '\n' ? '_' : c, file);
+    }
+    if (entry.state != 0)
+      fprintf(file, ";%s", ThreadStateName(entry.state));
+    for (size_t j = entry.depth; j > 0; j--)
+      fprintf(file, ";0x%lx", (unsigned long) entry.stack[j - 1]);
+    fprintf(file, " %lu\n", (unsigned long) count);
+  }
+
+  *dropped = generation.dropped.load(std::memory_order_relaxed);
+  Clear(generation);
+  return samples;
+}
+
+void WindowedProfile::Clear(Generation& generation)
+{
+  for (size_t i = 0; i < options_.entries; i++)
+  {
+    Entry& entry = generation.entries[i];
+    entry.ready.store(false, std::memory_order_relaxed);
+    entry.count.store(0, std::memory_order_relaxed);
+    entry.key.store(0, std::memory_order_release);
+  }
+  generation.dropped.store(0);
+}
+
+void WindowedProfile::Reset()
+{
+  live_.store(0);
+  for (Generation& generation : generations_)
+  {
+    generation.writers.store(0);
+    Clear(generation);
+  }
+}
+
+bool StartWindowedProfiling()
+{
+  const char* path = getenv("MICROSERVICE_PROFILE_WINDOWS");
+  if (path == nullptr || *path == '\0')
+    return false;
+
+  if (WindowedProfilingEnabled())
+    return true;
+
+  const char* value = getenv("MICROSERVICE_PROFILE_WINDOW_S");
+  if (value != nullptr && atol(value) > 0)
+    window_s = atol(value);
+  value = getenv("MICROSERVICE_PROFILE_WINDOW_FILES");
+  if (value != nullptr && atol(value) > 0)
+    max_files = atol(value);
+
+  directory = path;
+  if (mkdir(path, 0755) != 0 && errno != EEXIST)
+  {
+    std::cerr << "Microservice-profiler: "
+              << "Unable to create the profile window directory " << path
+              << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  WindowedProfile* windows = MakeProfile("CPU");
+  if (windows == nullptr)
+    return false;
+  profile.store(windows);
+  try
+  {
+    StartWriterThread();
+  }
+  catch (const std::system_error& e)
+  {
+    std::cerr << "Microservice-profiler: "
+              << "Unable to start the profile window writer: " << e.what()
+              << std::endl;
+    return false;
+  }
+  pthread_atfork(nullptr, nullptr, ChildAfterFork);
+
+  AddCpuSampleSink(RecordWindowSample);
+  StartCpuSampling();
+
+  // Before the sampler starts: it sends signals right away.
+  if (getenv("MICROSERVICE_PROFILE_WALL_US") != nullptr)
+  {
+    wall_profile.store(MakeProfile("wall-clock"));
+    if (wall_profile.load() != nullptr)
+    {
+      AddWallSampleSink(RecordWallWindowSample);
+      if (!StartWallClockSampling())
+        wall_profile.store(nullptr);
+    }
+  }
+  return true;
+}
+
+bool WindowedProfilingEnabled()
+{
+  return profile.load(std::memory_order_relaxed) != nullptr;
+}
+
+}  // namespace microservice_profile
@@ -0,0 +1,113 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_WINDOWED_PROFILE_H_
+#define MICROSERVICE_PROFILE_WINDOWED_PROFILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <memory>
+
+namespace microservice_profile
+{
+
+// Stack sample counts per endpoint and stack, in two generations of fixed
+// size: the samplers write into the live one while the other, retired at
+// the end of the previous window, is written out and cleared. Retiring a
+// generation is one atomic store; the writer then waits for the samplers
+// that were still writing into it.
+//
+// Record is lock-free and async-signal-safe: it runs in SIGPROF handlers.
+// A sample is dropped when its slot is not found within a few probes.
+class WindowedProfile
+{
+public:
+  static const size_t kMaxDepth = 32;
+  static const size_t kEndpointSize = 48;
+
+  struct Options
+  {
+    size_t entries = 4096;  // Per generation.
+  };
+
+  explicit WindowedProfile(const Options& options);
+
+  WindowedProfile(const WindowedProfile&) = delete;
+  WindowedProfile& operator=(const WindowedProfile&) = delete;
+
+  // `stack` is innermost first. `state` is the thread state of a wall-clock
+  // sample (see wall_clock_sampler.h), 0 for CPU samples.
+  void Record(const char* endpoint, size_t endpoint_size, void* const* stack,
+              size_t depth, char state = 0);
+
+  // Makes the other generation live and returns the retired one, once no
+  // sampler writes into it any more.
+  int Retire();
+
+  // Writes a retired generation in the folded format of flame graph tools,
+  // one "endpoint;outermost;...;innermost count" line per entry, the state
+  // name following the endpoint for wall-clock samples, then clears
+  // it. Returns the number of samples written; `dropped` receives the number
+  // of samples lost.
+  uint64_t WriteAndClear(int generation, FILE* file, uint64_t* dropped);
+
+  // Clears both generations, for fork children.
+  void Reset();
+
+  // Bytes taken by the two generations with `entries` entries each.
+  static size_t Footprint(size_t entries);
+
+private:
+  struct Entry
+  {
+    std::atomic<uint64_t> key;  // 0 when free.
+    std::atomic<bool> ready;    // Set once the fields below are written.
+    std::atomic<uint64_t> count;
+    uint8_t endpoint_size;
+    uint8_t depth;
+    char state;
+    char endpoint[kEndpointSize];
+    uintptr_t stack[kMaxDepth];
+  };
+
+  struct Generation
+  {
+    std::unique_ptr<Entry[]> entries;
+    std::atomic<uint32_t> writers;
+    std::atomic<uint64_t> dropped;
+  };
+
+  void Clear(Generation& generation);
+
+  Options options_;
+  std::atomic<int> live_;
+  Generation generations_[2];
+};
+
+// Reads MICROSERVICE_PROFILE_WINDOWS and, if set, feeds the CPU samples of
+// the SIGPROF handler to a WindowedProfile and starts a thread writing each
+// closed window to that directory. The wall-clock samples, when enabled, go
+// to a second WindowedProfile and windows of their own. Returns true if
+// enabled.
+bool StartWindowedProfiling();
+
+bool WindowedProfilingEnabled();
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_WINDOWED_PROFILE_H_
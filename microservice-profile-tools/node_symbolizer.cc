@@ -0,0 +1,309 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-tools/node_symbolizer.h"
+
+#include <cxxabi.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "microservice-profile-base/get_monotonic_time.h"
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+// A process' mappings are read again on a miss, at most this often: code
+// loaded since, or a miss for good.
+const uint64_t kMapsRefreshNs = 1000000000ULL;
+
+// Processes are not allowed to grow the name cache without bound.
+const size_t kMaxNamesPerProcess = 65536;
+
+std::string Demangle(const char* name)
+{
+  int status;
+  char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+  if (demangled == nullptr)
+    return name;
+  std::string result(demangled);
+  free(demangled);
+  return result;
+}
+
+std::string Hex(uint64_t address)
+{
+  char hex[24];
+  snprintf(hex, sizeof(hex), "0x%lx", (unsigned long) address);
+  return hex;
+}
+
+// A bounds-checked view of a mapped file.
+struct Image
+{
+  const uint8_t* data;
+  size_t size;
+
+  template <typename T>
+  const T* At(uint64_t offset, uint64_t count = 1) const
+  {
+    if (offset > size || count > (size - offset) / sizeof(T))
+      return nullptr;
+    return reinterpret_cast<const T*>(data + offset);
+  }
+};
+
+}  // namespace
+
+void NodeSymbolizer::AddProcess(pid_t pid)
+{
+  ReadMaps(pid, &processes_[pid]);
+}
+
+void NodeSymbolizer::RemoveProcess(pid_t pid)
+{
+  processes_.erase(pid);
+
+  // Forget the files no process maps any more: upgraded binaries.
+  for (auto it = files_.begin(); it != files_.end();)
+  {
+    if (it->second.use_count() <= 1)
+      it = files_.erase(it);
+    else
+      ++it;
+  }
+}
+
+const std::string& NodeSymbolizer::Symbolize(pid_t pid, uint64_t address)
+{
+  Process& process = processes_[pid];
+  auto it = process.names.find(address);
+  if (it != process.names.end())
+    return it->second;
+
+  const Mapping* mapping = FindMapping(process, address);
+  uint64_t now = GetMonotonicTime();
+  if (mapping == nullptr && now - process.maps_read_ns >= kMapsRefreshNs)
+  {
+    ReadMaps(pid, &process);
+    mapping = FindMapping(process, address);
+  }
+
+  if (process.names.size() >= kMaxNamesPerProcess)
+    process.names.clear();
+  return process.names[address] = Name(mapping, address);
+}
+
+void NodeSymbolizer::ReadMaps(pid_t pid, Process* process)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/maps", (int) pid);
+  process->maps_read_ns = GetMonotonicTime();
+
+  FILE* maps = fopen(path, "re");
+  if (maps == nullptr)
+    return;
+
+  std::vector<Mapping> mappings;
+  char line[4096];
+  while (fgets(line, sizeof(line), maps) != nullptr)
+  {
+    unsigned long start, end, offset;
+    char perms[8];
+    int name_start = 0;
+
+    if (sscanf(line, "%lx-%lx %7s %lx %*s %*s %n", &start, &end, perms,
+               &offset, &name_start) < 4 ||
+        name_start == 0 || perms[2] != 'x')
+      continue;
+
+    std::string name(line + name_start);
+    while (!name.empty() && (name.back() == '\n' || name.back() == ' '))
+      name.pop_back();
+    if (name.empty() || name[0] != '/')
+      continue;
+
+    Mapping mapping;
+    mapping.start = start;
+    mapping.end = end;
+    mapping.offset = offset;
+    mapping.path = name;
+    mapping.file = LoadFile(pid, name);
+    mappings.push_back(std::move(mapping));
+  }
+  fclose(maps);
+
+  std::sort(mappings.begin(), mappings.end(),
+            [](const Mapping& a, const Mapping& b) { return a.start < b.start; });
+  process->mappings = std::move(mappings);
+}
+
+std::shared_ptr<const NodeSymbolizer::ElfFile> NodeSymbolizer::LoadFile(
+    pid_t pid, const std::string& path)
+{
+  // Through the process' root, for the processes of containers.
+  std::string root_path = "/proc/" + std::to_string(pid) + "/root" + path;
+  int fd = open(root_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return nullptr;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    close(fd);
+    return nullptr;
+  }
+  auto key = std::make_pair(st.st_dev, st.st_ino);
+  auto cached = files_.find(key);
+  if (cached != files_.end())
+  {
+    close(fd);
+    return cached->second;
+  }
+
+  // Unreadable files are cached too, as such.
+  std::shared_ptr<ElfFile> file;
+  void* data = st.st_size > 0 ? mmap(nullptr, st.st_size, PROT_READ,
+                                     MAP_PRIVATE, fd, 0)
+                              : MAP_FAILED;
+  close(fd);
+  if (data == MAP_FAILED)
+  {
+    files_[key] = file;
+    return file;
+  }
+
+  Image image = {static_cast<const uint8_t*>(data), (size_t) st.st_size};
+  const Elf64_Ehdr* ehdr = image.At<Elf64_Ehdr>(0);
+  if (ehdr != nullptr && memcmp(ehdr->e_ident, ELFMAG, SELFMAG) == 0 &&
+      ehdr->e_ident[EI_CLASS] == ELFCLASS64)
+  {
+    file = std::make_shared<ElfFile>();
+
+    const Elf64_Phdr* phdrs = image.At<Elf64_Phdr>(ehdr->e_phoff, ehdr->e_phnum);
+    for (int i = 0; phdrs != nullptr && i < ehdr->e_phnum; i++)
+    {
+      if (phdrs[i].p_type == PT_LOAD && (phdrs[i].p_flags & PF_X))
+        file->segments.push_back(
+            {phdrs[i].p_offset, phdrs[i].p_vaddr, phdrs[i].p_filesz});
+    }
+
+    // The full symbol table when not stripped, the dynamic one otherwise.
+    const Elf64_Shdr* shdrs = image.At<Elf64_Shdr>(ehdr->e_shoff, ehdr->e_shnum);
+    const Elf64_Shdr* table = nullptr;
+    for (int i = 0; shdrs != nullptr && i < ehdr->e_shnum; i++)
+    {
+      if (shdrs[i].sh_type == SHT_SYMTAB ||
+          (shdrs[i].sh_type == SHT_DYNSYM && table == nullptr))
+        table = &shdrs[i];
+    }
+
+    if (table != nullptr && table->sh_link < ehdr->e_shnum)
+    {
+      const Elf64_Shdr& strtab = shdrs[table->sh_link];
+      const Elf64_Sym* syms = image.At<Elf64_Sym>(
+          table->sh_offset, table->sh_size / sizeof(Elf64_Sym));
+      const char* strings = image.At<char>(strtab.sh_offset, strtab.sh_size);
+      size_t count = syms != nullptr ? table->sh_size / sizeof(Elf64_Sym) : 0;
+
+      for (size_t i = 0; strings != nullptr && i < count; i++)
+      {
+        const Elf64_Sym& sym = syms[i];
+        if (ELF64_ST_TYPE(sym.st_info) != STT_FUNC || sym.st_value == 0 ||
+            sym.st_name >= strtab.sh_size)
+          continue;
+        const char* name = strings + sym.st_name;
+        if (memchr(name, '\0', strtab.sh_size - sym.st_name) == nullptr)
+          continue;
+        file->symbols.push_back({sym.st_value, sym.st_size,
+                                 (uint32_t) file->names.size()});
+        file->names.push_back(Demangle(name));
+      }
+      std::sort(file->symbols.begin(), file->symbols.end(),
+                [](const Symbol& a, const Symbol& b) {
+                  return a.address < b.address;
+                });
+    }
+  }
+
+  munmap(data, st.st_size);
+  files_[key] = file;
+  return file;
+}
+
+const NodeSymbolizer::Mapping* NodeSymbolizer::FindMapping(
+    const Process& process, uint64_t address) const
+{
+  auto it = std::upper_bound(
+      process.mappings.begin(), process.mappings.end(), address,
+      [](uint64_t address, const Mapping& m) { return address < m.start; });
+  if (it == process.mappings.begin())
+    return nullptr;
+  --it;
+  return address < it->end ? &*it : nullptr;
+}
+
+std::string NodeSymbolizer::Name(const Mapping* mapping, uint64_t address) const
+{
+  if (mapping == nullptr)
+    return Hex(address);
+
+  std::string module =
+      "[" + mapping->path.substr(mapping->path.rfind('/') + 1) + "]";
+  const ElfFile* file = mapping->file.get();
+  if (file == nullptr)
+    return module;
+
+  // Address in the process, offset in the file, then address in the ELF
+  // image.
+  uint64_t offset = address - mapping->start + mapping->offset;
+  uint64_t vaddr = 0;
+  bool found = false;
+  for (const LoadSegment& segment : file->segments)
+  {
+    if (offset >= segment.offset && offset < segment.offset + segment.size)
+    {
+      vaddr = offset - segment.offset + segment.vaddr;
+      found = true;
+      break;
+    }
+  }
+  if (!found)
+    return module;
+
+  auto it = std::upper_bound(
+      file->symbols.begin(), file->symbols.end(), vaddr,
+      [](uint64_t vaddr, const Symbol& s) { return vaddr < s.address; });
+  if (it == file->symbols.begin())
+    return module;
+  --it;
+  if (it->size != 0 && vaddr >= it->address + it->size)
+    return module;
+  return file->names[it->name];
+}
+
+}  // namespace microservice_profile
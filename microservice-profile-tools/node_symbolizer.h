@@ -0,0 +1,100 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_NODE_SYMBOLIZER_H_
+#define MICROSERVICE_PROFILE_NODE_SYMBOLIZER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace microservice_profile
+{
+
+// Names the code addresses of the processes of the node, from their
+// /proc/<pid>/maps and the ELF symbol tables of the mapped files. The symbol
+// tables are cached per file (device and inode), hence read once for all
+// the processes running the same binaries and libraries. Not thread-safe.
+class NodeSymbolizer
+{
+public:
+  // Reads the mappings of a new process.
+  void AddProcess(pid_t pid);
+  void RemoveProcess(pid_t pid);
+
+  // The function at `address` in process pid, demangled; "[file]" or the
+  // hex address when unknown. Return addresses must be decremented by one
+  // by the caller, so that they fall into the calling instruction.
+  const std::string& Symbolize(pid_t pid, uint64_t address);
+
+  size_t cached_files() const { return files_.size(); }
+
+private:
+  struct Symbol
+  {
+    uint64_t address;
+    uint64_t size;
+    uint32_t name;  // Index in ElfFile::names.
+  };
+
+  struct LoadSegment
+  {
+    uint64_t offset;
+    uint64_t vaddr;
+    uint64_t size;
+  };
+
+  struct ElfFile
+  {
+    std::vector<LoadSegment> segments;
+    std::vector<Symbol> symbols;  // By address.
+    std::vector<std::string> names;
+  };
+
+  struct Mapping
+  {
+    uint64_t start;
+    uint64_t end;
+    uint64_t offset;
+    std::string path;
+    std::shared_ptr<const ElfFile> file;  // nullptr if unreadable.
+  };
+
+  struct Process
+  {
+    std::vector<Mapping> mappings;  // By start.
+    std::unordered_map<uint64_t, std::string> names;
+    uint64_t maps_read_ns = 0;
+  };
+
+  void ReadMaps(pid_t pid, Process* process);
+  std::shared_ptr<const ElfFile> LoadFile(pid_t pid, const std::string& path);
+  const Mapping* FindMapping(const Process& process, uint64_t address) const;
+  std::string Name(const Mapping* mapping, uint64_t address) const;
+
+  std::unordered_map<pid_t, Process> processes_;
+  std::map<std::pair<dev_t, ino_t>, std::shared_ptr<const ElfFile>> files_;
+};
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_NODE_SYMBOLIZER_H_
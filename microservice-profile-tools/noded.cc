@@ -0,0 +1,604 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+// microservice-profile-noded: the node daemon. The instrumented processes
+// of the node (MICROSERVICE_PROFILE_NODE_SOCKET) hand it shared-memory rings
+// of raw relay records and CPU samples (see node_ring.h); it symbolizes,
+// aggregates and writes them once for all of them.
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "microservice-profile-base/annotation_format.h"
+#include "microservice-profile-base/critical_path.h"
+#include "microservice-profile-base/get_monotonic_time.h"
+#include "microservice-profile-base/node_ring.h"
+#include "microservice-profile-tools/node_symbolizer.h"
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+const char kUsage[] =
+    "Usage: microservice-profile-noded [options] <directory>\n"
+    "\n"
+    "Receives the raw data of the instrumented processes of the node and\n"
+    "writes, every window, to the directory:\n"
+    "  node-<UTC time>.folded         CPU samples per process, endpoint and\n"
+    "                                 symbolized stack (flame graph format)\n"
+    "  node-<UTC time>.critical-path  time per syscall category and endpoint\n"
+    "  node-<UTC time>.capture        the relay records, for\n"
+    "                                 microservice-profile-replay\n"
+    "\n"
+    "Options:\n"
+    "  -s, --socket PATH  listening socket (default:\n"
+    "                     $MICROSERVICE_PROFILE_NODE_SOCKET, or\n"
+    "                     /run/microservice-profile/node.sock)\n"
+    "  -w, --window S     window length in seconds (default: 60)\n"
+    "  -k, --keep N       windows kept (default: 60)\n";
+
+// How often the rings are drained.
+const int kPollMs = 100;
+
+// Distinct stacks per window; the samples of the others are only counted.
+const size_t kMaxStacks = 1000000;
+
+volatile sig_atomic_t stopping = 0;
+
+struct Options
+{
+  std::string socket_path = "/run/microservice-profile/node.sock";
+  std::string directory;
+  long window_s = 60;
+  size_t keep = 60;
+};
+
+struct Client
+{
+  int fd = -1;
+  pid_t pid = 0;
+  std::string comm;
+  void* memory = nullptr;  // nullptr until the ring is received.
+  size_t size = 0;
+  NodeRingReader reader;
+  uint64_t dropped = 0;  // As last reported by the process.
+};
+
+class NodeDaemon
+{
+public:
+  explicit NodeDaemon(const Options& options) : options_(options) {}
+
+  bool Listen();
+  int Run();
+
+private:
+  void Accept();
+  bool ReceiveRing(Client* client);
+  void Drain(Client* client);
+  void Remove(size_t index);
+  void OnAnnotation(const Client& client, const void* payload, size_t size);
+  void OnCpuSample(const Client& client, const void* payload, size_t size);
+  bool OpenCapture();
+  void WriteWindow();
+
+  Options options_;
+  int listen_fd_ = -1;
+  std::vector<std::unique_ptr<Client>> clients_;
+  NodeSymbolizer symbolizer_;
+
+  // The current window.
+  std::unordered_map<std::string, uint64_t> stacks_;
+  std::map<std::string, CriticalPathAggregates::Totals> endpoints_;
+  AnnotationWriter capture_;
+  uint64_t samples_ = 0;
+  uint64_t lost_samples_ = 0;
+  uint64_t records_ = 0;
+  uint64_t dropped_ = 0;  // In the rings of the processes.
+
+  // The files of the past windows, oldest first.
+  std::deque<std::vector<std::string>> windows_;
+  std::string last_stamp_;
+  int same_stamp_ = 0;
+};
+
+std::string ReadComm(pid_t pid)
+{
+  std::string path = "/proc/" + std::to_string(pid) + "/comm";
+  char comm[64] = {};
+  FILE* file = fopen(path.c_str(), "re");
+  if (file == nullptr)
+    return std::to_string(pid);
+  if (fgets(comm, sizeof(comm), file) == nullptr)
+    comm[0] = '\0';
+  fclose(file);
+
+  std::string name(comm);
+  while (!name.empty() && name.back() == '\n')
+    name.pop_back();
+  return name.empty() ? std::to_string(pid) : name;
+}
+
+// ';' separates the frames, and a line is one stack.
+void AppendFrame(const char* name, size_t size, std::string* stack)
+{
+  if (!stack->empty())
+    *stack += ';';
+  for (size_t i = 0; i < size; i++)
+  {
+    char c = name[i];
+    *stack += c == ';' || c == '\n' ? '_' : c;
+  }
+}
+
+bool NodeDaemon::Listen()
+{
+  if (mkdir(options_.directory.c_str(), 0755) != 0 && errno != EEXIST)
+  {
+    std::cerr << "Unable to create " << options_.directory << ": "
+              << strerror(errno) << std::endl;
+    return false;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (options_.socket_path.size() >= sizeof(addr.sun_path))
+  {
+    std::cerr << "Socket path too long: " << options_.socket_path << std::endl;
+    return false;
+  }
+  strcpy(addr.sun_path, options_.socket_path.c_str());
+
+  // A stale socket of a previous daemon.
+  unlink(options_.socket_path.c_str());
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (listen_fd_ < 0 ||
+      bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr),
+           sizeof(addr)) != 0 ||
+      listen(listen_fd_, 64) != 0)
+  {
+    std::cerr << "Unable to listen on " << options_.socket_path << ": "
+              << strerror(errno) << std::endl;
+    return false;
+  }
+  return OpenCapture();
+}
+
+void NodeDaemon::Accept()
+{
+  for (;;)
+  {
+    int fd = accept4(listen_fd_, nullptr, nullptr,
+                     SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0)
+      return;
+
+    // The kernel's word for the pid, in our pid namespace.
+    struct ucred cred;
+    socklen_t length = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &length) != 0)
+    {
+      close(fd);
+      continue;
+    }
+
+    std::unique_ptr<Client> client(new Client());
+    client->fd = fd;
+    client->pid = cred.pid;
+    clients_.push_back(std::move(client));
+  }
+}
+
+bool NodeDaemon::ReceiveRing(Client* client)
+{
+  char byte;
+  struct iovec iov = {&byte, 1};
+  union
+  {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  if (recvmsg(client->fd, &msg, MSG_CMSG_CLOEXEC) != 1)
+    return false;
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+    return false;
+
+  int fd;
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  // A ring the process could shrink would crash the daemon on access.
+  struct stat st;
+  if (!(fcntl(fd, F_GET_SEALS) & F_SEAL_SHRINK) || fstat(fd, &st) != 0 ||
+      st.st_size <= (off_t) kNodeRingDataOffset)
+  {
+    close(fd);
+    return false;
+  }
+  void* memory = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED)
+    return false;
+
+  if (!client->reader.Attach(memory, st.st_size))
+  {
+    munmap(memory, st.st_size);
+    return false;
+  }
+  client->memory = memory;
+  client->size = st.st_size;
+
+  client->comm = ReadComm(client->pid);
+  symbolizer_.AddProcess(client->pid);
+  std::cerr << "Process " << client->pid << " (" << client->comm
+            << ") connected" << std::endl;
+  return true;
+}
+
+void NodeDaemon::Drain(Client* client)
+{
+  if (client->memory == nullptr)
+    return;
+
+  long records = client->reader.Drain(
+      [&](NodeRecordType type, const void* payload, size_t size) {
+        if (type == kNodeRecordAnnotation)
+          OnAnnotation(*client, payload, size);
+        else if (type == kNodeRecordCpuSample)
+          OnCpuSample(*client, payload, size);
+      });
+  if (records < 0)
+  {
+    std::cerr << "Process " << client->pid << ": corrupted ring, dropped"
+              << std::endl;
+    shutdown(client->fd, SHUT_RDWR);
+  }
+
+  uint64_t dropped =
+      client->reader.header()->dropped.load(std::memory_order_relaxed);
+  if (dropped > client->dropped)
+    dropped_ += dropped - client->dropped;
+  client->dropped = dropped;
+}
+
+void NodeDaemon::Remove(size_t index)
+{
+  Client* client = clients_[index].get();
+
+  // What the process wrote before exiting.
+  Drain(client);
+  if (client->memory != nullptr)
+  {
+    munmap(client->memory, client->size);
+    symbolizer_.RemoveProcess(client->pid);
+    std::cerr << "Process " << client->pid << " (" << client->comm
+              << ") disconnected" << std::endl;
+  }
+  close(client->fd);
+  clients_.erase(clients_.begin() + index);
+}
+
+void NodeDaemon::OnAnnotation(const Client& client, const void* payload,
+                              size_t size)
+{
+  NodeAnnotation annotation;
+  if (size < sizeof(annotation))
+    return;
+  memcpy(&annotation, payload, sizeof(annotation));
+
+  size_t syscalls_size =
+      (size_t) annotation.nb_syscalls * sizeof(struct syscall_desc);
+  if (annotation.nb_syscalls > size ||
+      sizeof(annotation) + syscalls_size + annotation.endpoint_size > size)
+    return;
+
+  const uint8_t* bytes = static_cast<const uint8_t*>(payload);
+  const struct syscall_desc* syscalls =
+      reinterpret_cast<const struct syscall_desc*>(bytes + sizeof(annotation));
+  const char* endpoint = reinterpret_cast<const char*>(
+      bytes + sizeof(annotation) + syscalls_size);
+
+  capture_.Append(annotation.span_id, annotation.trace_id, endpoint,
+                  annotation.endpoint_size, annotation.nb_syscalls, syscalls);
+
+  CriticalPathAnalyzer analyzer;
+  for (uint32_t i = 0; i < annotation.nb_syscalls; i++)
+    analyzer.AddSyscall(syscalls[i].name, SYSCALL_NAME_MAX_SIZE,
+                        syscalls[i].start_steady, syscalls[i].end_steady);
+  endpoints_[std::string(endpoint, annotation.endpoint_size)].Add(
+      analyzer.breakdown());
+  records_++;
+}
+
+void NodeDaemon::OnCpuSample(const Client& client, const void* payload,
+                             size_t size)
+{
+  NodeCpuSample sample;
+  if (size < sizeof(sample))
+    return;
+  memcpy(&sample, payload, sizeof(sample));
+  if (sizeof(sample) + sample.depth * sizeof(uint64_t) + sample.endpoint_size >
+      size)
+    return;
+
+  const uint8_t* bytes = static_cast<const uint8_t*>(payload);
+  const char* endpoint = reinterpret_cast<const char*>(
+      bytes + sizeof(sample) + sample.depth * sizeof(uint64_t));
+  samples_++;
+
+  // process;endpoint;outermost;...;innermost
+  std::string stack;
+  AppendFrame(client.comm.data(), client.comm.size(), &stack);
+  if (sample.endpoint_size > 0)
+    AppendFrame(endpoint, sample.endpoint_size, &stack);
+  else
+    AppendFrame("(none)", 6, &stack);
+  for (size_t i = sample.depth; i > 0; i--)
+  {
+    uint64_t address;
+    memcpy(&address, bytes + sizeof(sample) + (i - 1) * sizeof(uint64_t),
+           sizeof(address));
+    // Return addresses, but for the innermost frame.
+    const std::string& name =
+        symbolizer_.Symbolize(client.pid, i > 1 ? address - 1 : address);
+    AppendFrame(name.data(), name.size(), &stack);
+  }
+
+  auto it = stacks_.find(stack);
+  if (it != stacks_.end())
+    it->second++;
+  else if (stacks_.size() < kMaxStacks)
+    stacks_.emplace(std::move(stack), 1);
+  else
+    lost_samples_++;
+}
+
+bool NodeDaemon::OpenCapture()
+{
+  std::string path = options_.directory + "/current.capture.tmp";
+  unlink(path.c_str());
+  return capture_.Open(path.c_str());
+}
+
+void NodeDaemon::WriteWindow()
+{
+  time_t end = time(nullptr);
+  struct tm tm;
+  char stamp[32];
+  gmtime_r(&end, &tm);
+  strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", &tm);
+  std::string base = options_.directory + "/node-" + stamp;
+
+  // The last window, on exit, may end in the same second as the previous.
+  if (stamp == last_stamp_)
+    base += "-" + std::to_string(++same_stamp_);
+  else
+    same_stamp_ = 0;
+  last_stamp_ = stamp;
+  std::vector<std::string> files;
+
+  std::string folded;
+  for (const auto& stack : stacks_)
+    folded += stack.first + " " + std::to_string(stack.second) + "\n";
+  std::string critical_path;
+  FormatCriticalPathHeader(&critical_path);
+  for (const auto& endpoint : endpoints_)
+    FormatCriticalPathTotals(endpoint.first, endpoint.second, &critical_path);
+
+  const std::pair<const char*, const std::string*> texts[] = {
+      {".folded", &folded}, {".critical-path", &critical_path}};
+  for (const auto& text : texts)
+  {
+    std::string path = base + text.first;
+    std::string temporary = path + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "we");
+    if (file == nullptr ||
+        fwrite(text.second->data(), 1, text.second->size(), file) !=
+            text.second->size() ||
+        fclose(file) != 0 || rename(temporary.c_str(), path.c_str()) != 0)
+    {
+      std::cerr << "Unable to write " << path << ": " << strerror(errno)
+                << std::endl;
+      unlink(temporary.c_str());
+      continue;
+    }
+    files.push_back(path);
+  }
+
+  capture_.Close();
+  std::string capture = base + ".capture";
+  if (rename((options_.directory + "/current.capture.tmp").c_str(),
+             capture.c_str()) == 0)
+    files.push_back(capture);
+
+  if (dropped_ > 0 || lost_samples_ > 0)
+    std::cerr << "Window " << stamp << ": " << samples_ << " samples, "
+              << records_ << " records; " << dropped_
+              << " dropped by full rings, " << lost_samples_
+              << " samples over the stack limit" << std::endl;
+
+  stacks_.clear();
+  endpoints_.clear();
+  samples_ = lost_samples_ = records_ = dropped_ = 0;
+
+  windows_.push_back(std::move(files));
+  while (windows_.size() > options_.keep)
+  {
+    for (const std::string& path : windows_.front())
+      unlink(path.c_str());
+    windows_.pop_front();
+  }
+}
+
+int NodeDaemon::Run()
+{
+  uint64_t window_ns = options_.window_s * 1000000000ULL;
+  uint64_t window_end = GetMonotonicTime() + window_ns;
+  std::vector<struct pollfd> fds;
+
+  while (!stopping)
+  {
+    fds.clear();
+    fds.push_back({listen_fd_, POLLIN, 0});
+    for (const auto& client : clients_)
+      fds.push_back({client->fd, POLLIN, 0});
+
+    if (poll(fds.data(), fds.size(), kPollMs) < 0 && errno != EINTR)
+    {
+      std::cerr << "poll: " << strerror(errno) << std::endl;
+      return 1;
+    }
+
+    // Backwards, for the removals. The clients accepted now are not in fds.
+    for (size_t i = fds.size() - 1; i > 0; i--)
+    {
+      Client* client = clients_[i - 1].get();
+      if (fds[i].revents == 0)
+        continue;
+
+      // The ring first, then nothing but the end of the connection.
+      if (client->memory == nullptr)
+      {
+        if (!(fds[i].revents & POLLIN) || !ReceiveRing(client))
+          Remove(i - 1);
+        continue;
+      }
+      char byte;
+      ssize_t n = read(client->fd, &byte, 1);
+      if (n == 0 || (n < 0 && errno != EAGAIN) ||
+          (fds[i].revents & (POLLHUP | POLLERR)))
+        Remove(i - 1);
+    }
+    if (fds[0].revents & POLLIN)
+      Accept();
+
+    for (const auto& client : clients_)
+      Drain(client.get());
+
+    if (GetMonotonicTime() >= window_end)
+    {
+      WriteWindow();
+      OpenCapture();
+      window_end += window_ns;
+    }
+  }
+
+  for (const auto& client : clients_)
+    Drain(client.get());
+  WriteWindow();
+  unlink(options_.socket_path.c_str());
+  return 0;
+}
+
+void Stop(int)
+{
+  stopping = 1;
+}
+
+}  // namespace
+
+}  // namespace microservice_profile
+
+using namespace microservice_profile;
+
+int main(int argc, char** argv)
+{
+  static const struct option kOptions[] = {
+      {"socket", required_argument, nullptr, 's'},
+      {"window", required_argument, nullptr, 'w'},
+      {"keep", required_argument, nullptr, 'k'},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0},
+  };
+  Options options;
+  int c;
+
+  const char* socket_path = getenv("MICROSERVICE_PROFILE_NODE_SOCKET");
+  if (socket_path != nullptr && *socket_path != '\0')
+    options.socket_path = socket_path;
+
+  while ((c = getopt_long(argc, argv, "s:w:k:h", kOptions, nullptr)) != -1)
+  {
+    switch (c)
+    {
+      case 's':
+        options.socket_path = optarg;
+        break;
+      case 'w':
+        options.window_s = std::max(atol(optarg), 1L);
+        break;
+      case 'k':
+        options.keep = std::max(atol(optarg), 1L);
+        break;
+      case 'h':
+        std::cout << kUsage;
+        return 0;
+      default:
+        std::cerr << kUsage;
+        return 2;
+    }
+  }
+
+  if (optind + 1 != argc)
+  {
+    std::cerr << kUsage;
+    return 2;
+  }
+  options.directory = argv[optind];
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = Stop;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+  signal(SIGPIPE, SIG_IGN);
+
+  NodeDaemon daemon(options);
+  if (!daemon.Listen())
+    return 1;
+  return daemon.Run();
+}
@@ -0,0 +1,542 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+// microservice-profile-replay: offline queries on the files written by the
+// profiler (captures, flight recorders) and on raw relay channel dumps.
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <thread>
+#include <unordered_map>
+
+#include "microservice-profile-base/critical_path.h"
+#include "microservice-profile-tools/replay_export.h"
+#include "microservice-profile-tools/replay_scan.h"
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+struct Options
+{
+  unsigned threads = std::thread::hardware_concurrency();
+  size_t top = 10;
+  const char* output = nullptr;
+  std::string service = "microservice-profile";
+  ReplayFilter filter;
+};
+
+const char kUsage[] =
+    "Usage: microservice-profile-replay [options] <command> <files...>\n"
+    "\n"
+    "Files are captures (MICROSERVICE_PROFILE_CAPTURE), flight recorders\n"
+    "(MICROSERVICE_PROFILE_FLIGHT_RECORDER, crashed or snapshot) or raw relay\n"
+    "channel dumps, told apart by their contents.\n"
+    "\n"
+    "Commands:\n"
+    "  top                slowest spans\n"
+    "  syscalls           syscall time per endpoint\n"
+    "  stacks <trace-id>  stack samples taken during the spans of a trace,\n"
+    "                     folded (flight recorders only)\n"
+    "  otlp               OTLP-JSON traces of the syscalls\n"
+    "  pprof              pprof profile of the syscalls and stack samples\n"
+    "\n"
+    "Options:\n"
+    "  -j, --jobs N       scanning threads (default: one per core)\n"
+    "  -n, --top N        rows of top (default: 10)\n"
+    "  -o, --output FILE  output file (default: stdout)\n"
+    "  --from NS, --to NS only the data in this range of ns since the epoch\n"
+    "  --trace ID         only this trace\n"
+    "  --service NAME     service.name of the OTLP resource\n";
+
+// Slowest spans. The duration is exact for the span ends of flight
+// recorders; otherwise it is the extent of the span's syscalls.
+class TopSpans : public ReplayConsumer
+{
+public:
+  struct Span
+  {
+    uint8_t trace_id[16];
+    uint32_t name = kNoName;  // Index in names_.
+    uint64_t first = UINT64_MAX;  // ns since the epoch.
+    uint64_t last = 0;
+    uint64_t duration = 0;
+    uint32_t syscalls = 0;
+    bool exact = false;
+
+    uint64_t Duration() const
+    {
+      return exact ? duration : (last > first ? last - first : 0);
+    }
+  };
+
+  void OnRecord(const ReplayRecord& record) override
+  {
+    Span& span = Get(record.span_id, record.trace_id);
+
+    if (span.name == kNoName)
+      span.name = Intern(record.endpoint, record.endpoint_size);
+    for (uint32_t i = 0; i < record.nb_syscalls; ++i)
+    {
+      const struct syscall_desc& syscall = record.syscalls[i];
+      span.first = std::min(span.first, syscall.start_system);
+      span.last = std::max(span.last, syscall.start_system + syscall.end_steady -
+                                          syscall.start_steady);
+    }
+    span.syscalls += record.nb_syscalls;
+  }
+
+  void OnSpan(const ReplaySpan& replay_span) override
+  {
+    Span& span = Get(replay_span.span_id, replay_span.trace_id);
+
+    span.name = Intern(replay_span.name.data(), replay_span.name.size());
+    span.first = replay_span.start;
+    span.duration = replay_span.duration;
+    span.exact = true;
+  }
+
+  void Merge(TopSpans& other)
+  {
+    std::vector<uint32_t> names;
+    for (const std::string& name : other.names_)
+      names.push_back(Intern(name.data(), name.size()));
+
+    spans_.reserve(spans_.size() + other.spans_.size());
+    for (auto& entry : other.spans_)
+    {
+      Span part = entry.second;
+      if (part.name != kNoName)
+        part.name = names[part.name];
+
+      auto it = spans_.find(entry.first);
+      if (it == spans_.end())
+      {
+        spans_.emplace(entry.first, part);
+        continue;
+      }
+
+      Span& span = it->second;
+      if (span.name == kNoName || part.exact)
+        span.name = part.name;
+      if (part.exact)
+      {
+        span.duration = part.duration;
+        span.exact = true;
+      }
+      span.first = std::min(span.first, part.first);
+      span.last = std::max(span.last, part.last);
+      span.syscalls += part.syscalls;
+    }
+  }
+
+  void Print(FILE* out, size_t count) const
+  {
+    std::vector<std::pair<uint64_t, const Span*>> sorted;
+    for (const auto& entry : spans_)
+      sorted.emplace_back(entry.first, &entry.second);
+
+    count = std::min(count, sorted.size());
+    std::partial_sort(sorted.begin(), sorted.begin() + count, sorted.end(),
+                      [](const std::pair<uint64_t, const Span*>& a,
+                         const std::pair<uint64_t, const Span*>& b) {
+                        return a.second->Duration() > b.second->Duration();
+                      });
+
+    fprintf(out, "%12s %8s  %-32s %-16s %s\n", "duration_ms", "syscalls",
+            "trace", "span", "name");
+    for (size_t i = 0; i < count; ++i)
+    {
+      const Span& span = *sorted[i].second;
+      uint64_t id = sorted[i].first;
+      fprintf(out, "%12.3f%c %8u  %s %s %s\n", span.Duration() / 1e6,
+              span.exact ? ' ' : '~', span.syscalls,
+              ToHex(span.trace_id, 16).c_str(),
+              ToHex(reinterpret_cast<const uint8_t*>(&id), 8).c_str(),
+              span.name == kNoName ? "" : names_[span.name].c_str());
+    }
+  }
+
+private:
+  static const uint32_t kNoName = UINT32_MAX;
+
+  // Spans mostly share a few names: keep them once.
+  uint32_t Intern(const char* name, size_t size)
+  {
+    if (last_name_ != kNoName && names_[last_name_].size() == size &&
+        memcmp(names_[last_name_].data(), name, size) == 0)
+      return last_name_;
+
+    std::string key(name, size);
+    auto it = name_ids_.find(key);
+    if (it == name_ids_.end())
+    {
+      it = name_ids_.emplace(key, names_.size()).first;
+      names_.push_back(key);
+    }
+    last_name_ = it->second;
+    return last_name_;
+  }
+
+  Span& Get(const uint8_t* span_id, const uint8_t* trace_id)
+  {
+    uint64_t id;
+
+    memcpy(&id, span_id, sizeof(id));
+    Span& span = spans_[id];
+    memcpy(span.trace_id, trace_id, sizeof(span.trace_id));
+    return span;
+  }
+
+  std::unordered_map<uint64_t, Span> spans_;
+  std::vector<std::string> names_;
+  std::unordered_map<std::string, uint32_t> name_ids_;
+  uint32_t last_name_ = kNoName;
+};
+
+// Critical path breakdown per endpoint, as the "critical-path" control
+// command reports it, with the syscalls taking the most time.
+class SyscallsPerEndpoint : public ReplayConsumer
+{
+public:
+  struct Endpoint
+  {
+    uint64_t records = 0;
+    CriticalPathBreakdown sum;
+    std::unordered_map<SyscallName, uint64_t, SyscallNameHash> syscall_ns;
+  };
+
+  void OnRecord(const ReplayRecord& record) override
+  {
+    CriticalPathAnalyzer analyzer;
+
+    // Records of the same endpoint tend to come together.
+    if (last_ == nullptr || last_->first.size() != record.endpoint_size ||
+        memcmp(last_->first.data(), record.endpoint, record.endpoint_size) != 0)
+      last_ = &*endpoints_
+                    .emplace(std::string(record.endpoint, record.endpoint_size),
+                             Endpoint())
+                    .first;
+    Endpoint& endpoint = last_->second;
+
+    for (uint32_t i = 0; i < record.nb_syscalls; ++i)
+    {
+      const struct syscall_desc& syscall = record.syscalls[i];
+      analyzer.AddSyscall(syscall.name, SYSCALL_NAME_MAX_SIZE,
+                          syscall.start_steady, syscall.end_steady);
+      if (syscall.end_steady > syscall.start_steady)
+        endpoint.syscall_ns[SyscallName(syscall.name)] +=
+            syscall.end_steady - syscall.start_steady;
+    }
+    endpoint.records++;
+    Add(&endpoint.sum, analyzer.breakdown());
+  }
+
+  void Merge(SyscallsPerEndpoint& other)
+  {
+    for (auto& entry : other.endpoints_)
+    {
+      Endpoint& endpoint = endpoints_[entry.first];
+      endpoint.records += entry.second.records;
+      Add(&endpoint.sum, entry.second.sum);
+      for (const auto& syscall : entry.second.syscall_ns)
+        endpoint.syscall_ns[syscall.first] += syscall.second;
+    }
+  }
+
+  void Print(FILE* out) const
+  {
+    std::vector<std::pair<uint64_t, const std::string*>> sorted;
+    for (const auto& entry : endpoints_)
+    {
+      uint64_t total = 0;
+      for (int i = 0; i < kSyscallCategories; ++i)
+        total += entry.second.sum.syscall_ns[i];
+      sorted.emplace_back(total, &entry.first);
+    }
+    std::sort(sorted.rbegin(), sorted.rend());
+
+    fprintf(out, "%-32s %8s %12s %12s", "endpoint", "records", "wall_ms",
+            "user_ms");
+    for (int i = 0; i < kSyscallCategories; ++i)
+      fprintf(out, " %10s_ms", SyscallCategoryName((SyscallCategory) i));
+    fprintf(out, "  top syscalls\n");
+
+    for (const auto& entry : sorted)
+    {
+      const Endpoint& endpoint = endpoints_.at(*entry.second);
+      fprintf(out, "%-32s %8lu %12.3f %12.3f", entry.second->c_str(),
+              (unsigned long) endpoint.records, endpoint.sum.wall_ns / 1e6,
+              endpoint.sum.user_ns / 1e6);
+      for (int i = 0; i < kSyscallCategories; ++i)
+        fprintf(out, " %13.3f", endpoint.sum.syscall_ns[i] / 1e6);
+
+      std::vector<std::pair<uint64_t, std::string>> syscalls;
+      for (const auto& syscall : endpoint.syscall_ns)
+        syscalls.emplace_back(syscall.second, syscall.first.str());
+      std::sort(syscalls.rbegin(), syscalls.rend());
+      fprintf(out, " ");
+      for (size_t i = 0; i < syscalls.size() && i < 3; ++i)
+        fprintf(out, " %s:%.3f", syscalls[i].second.c_str(),
+                syscalls[i].first / 1e6);
+      fprintf(out, "\n");
+    }
+  }
+
+private:
+  static void Add(CriticalPathBreakdown* sum,
+                  const CriticalPathBreakdown& breakdown)
+  {
+    sum->wall_ns += breakdown.wall_ns;
+    sum->user_ns += breakdown.user_ns;
+    for (int i = 0; i < kSyscallCategories; ++i)
+    {
+      sum->syscall_ns[i] += breakdown.syscall_ns[i];
+      sum->syscall_count[i] += breakdown.syscall_count[i];
+    }
+  }
+
+  std::unordered_map<std::string, Endpoint> endpoints_;
+  std::pair<const std::string, Endpoint>* last_ = nullptr;
+};
+
+// Stack samples taken on the thread of a span while it ran. The spans are
+// those of the trace filter; samples are matched afterwards.
+class TraceStacks : public ReplayConsumer
+{
+public:
+  void OnSpan(const ReplaySpan& span) override { spans_.push_back(span); }
+  void OnSample(const ReplaySample& sample) override
+  {
+    samples_.push_back(sample);
+  }
+
+  void Merge(TraceStacks& other)
+  {
+    std::move(other.spans_.begin(), other.spans_.end(),
+              std::back_inserter(spans_));
+    std::move(other.samples_.begin(), other.samples_.end(),
+              std::back_inserter(samples_));
+  }
+
+  void Print(FILE* out) const
+  {
+    std::map<std::string, uint64_t> folded;
+
+    for (const ReplaySpan& span : spans_)
+    {
+      uint64_t start = span.end_monotonic - span.duration;
+      size_t matched = 0;
+
+      for (const ReplaySample& sample : samples_)
+      {
+        if (sample.tid != span.tid || sample.monotonic < start ||
+            sample.monotonic > span.end_monotonic)
+          continue;
+
+        std::string stack = span.name;
+        char ip[24];
+        for (auto it = sample.ips.rbegin(); it != sample.ips.rend(); ++it)
+        {
+          snprintf(ip, sizeof(ip), ";0x%lx", (unsigned long) *it);
+          stack += ip;
+        }
+        folded[stack]++;
+        matched++;
+      }
+      fprintf(out, "# span %s %s tid %u %.3f ms: %zu samples\n",
+              span.name.c_str(), ToHex(span.span_id, 8).c_str(), span.tid,
+              span.duration / 1e6, matched);
+    }
+    for (const auto& entry : folded)
+      fprintf(out, "%s %lu\n", entry.first.c_str(),
+              (unsigned long) entry.second);
+  }
+
+  bool empty() const { return spans_.empty(); }
+
+private:
+  std::vector<ReplaySpan> spans_;
+  std::vector<ReplaySample> samples_;
+};
+
+bool ParseTraceId(const char* hex, ReplayFilter* filter)
+{
+  if (strlen(hex) != 32 || !ParseHex(hex, filter->trace_id, 16))
+  {
+    std::cerr << "Invalid trace id: " << hex << std::endl;
+    return false;
+  }
+  filter->has_trace_id = true;
+  return true;
+}
+
+int Run(const std::string& command, const std::vector<std::string>& files,
+        const Options& options, FILE* out)
+{
+  if (command == "top")
+  {
+    TopSpans top;
+    if (!Scan(files, options.filter, options.threads, &top))
+      return 1;
+    top.Print(out, options.top);
+  }
+  else if (command == "syscalls")
+  {
+    SyscallsPerEndpoint syscalls;
+    if (!Scan(files, options.filter, options.threads, &syscalls))
+      return 1;
+    syscalls.Print(out);
+  }
+  else if (command == "stacks")
+  {
+    TraceStacks stacks;
+    if (!Scan(files, options.filter, options.threads, &stacks))
+      return 1;
+    if (stacks.empty())
+      std::cerr << "No span of this trace in the flight recorders"
+                << std::endl;
+    stacks.Print(out);
+  }
+  else if (command == "otlp")
+  {
+    OtlpOutput output(out, options.service);
+    std::vector<std::unique_ptr<ReplayConsumer>> writers;
+    if (!ScanInputs(files, options.filter, options.threads,
+                    [&output] {
+                      return std::unique_ptr<ReplayConsumer>(
+                          new OtlpWriter(&output));
+                    },
+                    &writers))
+      return 1;
+    writers.clear();
+    output.Finish();
+  }
+  else if (command == "pprof")
+  {
+    PprofProfile profile;
+    if (!Scan(files, options.filter, options.threads, &profile))
+      return 1;
+    if (!profile.Write(out))
+      return 1;
+  }
+  else
+  {
+    std::cerr << kUsage;
+    return 2;
+  }
+  return 0;
+}
+
+}  // namespace
+
+}  // namespace microservice_profile
+
+using namespace microservice_profile;
+
+int main(int argc, char** argv)
+{
+  enum { kFrom = 256, kTo, kTrace, kService };
+  static const struct option kOptions[] = {
+      {"jobs", required_argument, nullptr, 'j'},
+      {"top", required_argument, nullptr, 'n'},
+      {"output", required_argument, nullptr, 'o'},
+      {"from", required_argument, nullptr, kFrom},
+      {"to", required_argument, nullptr, kTo},
+      {"trace", required_argument, nullptr, kTrace},
+      {"service", required_argument, nullptr, kService},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0},
+  };
+  Options options;
+  int c;
+
+  while ((c = getopt_long(argc, argv, "j:n:o:h", kOptions, nullptr)) != -1)
+  {
+    switch (c)
+    {
+      case 'j':
+        options.threads = strtoul(optarg, nullptr, 10);
+        break;
+      case 'n':
+        options.top = strtoull(optarg, nullptr, 10);
+        break;
+      case 'o':
+        options.output = optarg;
+        break;
+      case kFrom:
+        options.filter.min_time = strtoull(optarg, nullptr, 10);
+        break;
+      case kTo:
+        options.filter.max_time = strtoull(optarg, nullptr, 10);
+        break;
+      case kTrace:
+        if (!ParseTraceId(optarg, &options.filter))
+          return 2;
+        break;
+      case kService:
+        options.service = optarg;
+        break;
+      case 'h':
+        std::cout << kUsage;
+        return 0;
+      default:
+        std::cerr << kUsage;
+        return 2;
+    }
+  }
+
+  if (optind >= argc)
+  {
+    std::cerr << kUsage;
+    return 2;
+  }
+  std::string command = argv[optind++];
+  if (command == "stacks")
+  {
+    if (optind >= argc || !ParseTraceId(argv[optind++], &options.filter))
+      return 2;
+  }
+  std::vector<std::string> files(argv + optind, argv + argc);
+  if (files.empty())
+  {
+    std::cerr << kUsage;
+    return 2;
+  }
+
+  FILE* out = stdout;
+  if (options.output != nullptr)
+  {
+    out = fopen(options.output, "w");
+    if (out == nullptr)
+    {
+      std::cerr << "Couldn't open " << options.output << std::endl;
+      return 1;
+    }
+  }
+
+  int rc = Run(command, files, options, out);
+  if (fclose(out) != 0 && rc == 0)
+    rc = 1;
+  return rc;
+}
@@ -0,0 +1,393 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-tools/replay_export.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+#include "microservice-profile-base/critical_path.h"
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+const size_t kOtlpChunkSize = 4 << 20;
+
+void AppendJsonString(std::string* out, const char* data, size_t size)
+{
+  out->push_back('"');
+  for (size_t i = 0; i < size; ++i)
+  {
+    unsigned char c = data[i];
+    if (c == '"' || c == '\\')
+    {
+      out->push_back('\\');
+      out->push_back(c);
+    }
+    else if (c < 0x20)
+    {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out->append(escaped);
+    }
+    else
+    {
+      out->push_back(c);
+    }
+  }
+  out->push_back('"');
+}
+
+void AppendIntAttribute(std::string* out, const char* key, uint64_t value)
+{
+  *out += ",{\"key\":\"";
+  *out += key;
+  *out += "\",\"value\":{\"intValue\":\"" + std::to_string(value) + "\"}}";
+}
+
+// Ids of the spans made up for the syscalls, derived from the record.
+void MakeSpanId(const uint8_t* parent, uint64_t salt, uint8_t* span_id)
+{
+  uint64_t x;
+
+  memcpy(&x, parent, sizeof(x));
+  x += 0x9e3779b97f4a7c15ULL * (salt + 1);
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  if (x == 0)
+    x = 1;
+  memcpy(span_id, &x, sizeof(x));
+}
+
+// Minimal protocol buffer encoder, for profile.proto.
+class ProtoWriter
+{
+public:
+  const std::string& data() const { return data_; }
+
+  void Varint(uint64_t value)
+  {
+    while (value >= 0x80)
+    {
+      data_.push_back((char) (value | 0x80));
+      value >>= 7;
+    }
+    data_.push_back((char) value);
+  }
+
+  void Uint(int field, uint64_t value)
+  {
+    Varint(field << 3);
+    Varint(value);
+  }
+
+  void Bytes(int field, const std::string& bytes)
+  {
+    Varint((field << 3) | 2);
+    Varint(bytes.size());
+    data_ += bytes;
+  }
+
+  void Packed(int field, const std::vector<uint64_t>& values)
+  {
+    ProtoWriter packed;
+    for (uint64_t value : values)
+      packed.Varint(value);
+    Bytes(field, packed.data());
+  }
+
+private:
+  std::string data_;
+};
+
+}  // namespace
+
+OtlpOutput::OtlpOutput(FILE* file, const std::string& service_name)
+    : file_(file)
+{
+  std::string head =
+      "{\"resourceSpans\":[{\"resource\":{\"attributes\":[{\"key\":"
+      "\"service.name\",\"value\":{\"stringValue\":";
+  AppendJsonString(&head, service_name.data(), service_name.size());
+  head += "}}]},\"scopeSpans\":[{\"scope\":{\"name\":"
+          "\"microservice-profile-replay\"},\"spans\":[";
+  fwrite(head.data(), 1, head.size(), file_);
+}
+
+void OtlpOutput::Finish()
+{
+  fputs("]}]}]}\n", file_);
+}
+
+void OtlpOutput::Write(const std::string& spans)
+{
+  std::lock_guard<std::mutex> guard(mutex_);
+
+  if (spans.empty())
+    return;
+  if (!empty_)
+    fputc(',', file_);
+  fwrite(spans.data(), 1, spans.size(), file_);
+  empty_ = false;
+}
+
+OtlpWriter::~OtlpWriter()
+{
+  output_->Write(buffer_);
+}
+
+void OtlpWriter::AppendSpan(const uint8_t* trace_id, const uint8_t* span_id,
+                            const uint8_t* parent_id, const char* name,
+                            size_t name_size, uint64_t start, uint64_t end)
+{
+  if (!buffer_.empty())
+    buffer_.push_back(',');
+  buffer_ += "{\"traceId\":\"" + ToHex(trace_id, 16) + "\",\"spanId\":\"" +
+             ToHex(span_id, 8) + "\",\"parentSpanId\":\"" +
+             ToHex(parent_id, 8) + "\",\"name\":";
+  AppendJsonString(&buffer_, name, name_size);
+  buffer_ += ",\"kind\":1,\"startTimeUnixNano\":\"" + std::to_string(start) +
+             "\",\"endTimeUnixNano\":\"" + std::to_string(end) + "\"";
+}
+
+void OtlpWriter::OnRecord(const ReplayRecord& record)
+{
+  const struct syscall_desc* syscalls = record.syscalls;
+  uint8_t kernel_id[8], syscall_id[8];
+  CriticalPathAnalyzer analyzer;
+
+  if (record.nb_syscalls == 0)
+    return;
+
+  // Wall clock times, from the first syscall's start_system and the
+  // steady clock deltas.
+  uint64_t base = syscalls[0].start_system - syscalls[0].start_steady;
+  uint64_t last_end = 0;
+  for (uint32_t i = 0; i < record.nb_syscalls; ++i)
+    last_end = std::max(last_end, syscalls[i].end_steady);
+
+  MakeSpanId(record.span_id, syscalls[0].start_steady, kernel_id);
+  for (uint32_t i = 0; i < record.nb_syscalls; ++i)
+  {
+    MakeSpanId(kernel_id, i, syscall_id);
+    std::string name = "__";
+    name.append(syscalls[i].name,
+                strnlen(syscalls[i].name, SYSCALL_NAME_MAX_SIZE));
+    AppendSpan(record.trace_id, syscall_id, kernel_id, name.data(),
+               name.size(), syscalls[i].start_system,
+               base + syscalls[i].end_steady);
+    buffer_ += "}";
+    analyzer.AddSyscall(syscalls[i].name, SYSCALL_NAME_MAX_SIZE,
+                        syscalls[i].start_steady, syscalls[i].end_steady);
+  }
+
+  const CriticalPathBreakdown& breakdown = analyzer.breakdown();
+  int dominant = breakdown.Dominant();
+
+  AppendSpan(record.trace_id, kernel_id, record.span_id, "kernel", 6,
+             syscalls[0].start_system, base + last_end);
+  buffer_ += ",\"attributes\":[{\"key\":\"profile.endpoint\",\"value\":"
+             "{\"stringValue\":";
+  AppendJsonString(&buffer_, record.endpoint, record.endpoint_size);
+  buffer_ += "}}";
+  AppendIntAttribute(&buffer_, "profile.wall_ns", breakdown.wall_ns);
+  AppendIntAttribute(&buffer_, "profile.user_ns", breakdown.user_ns);
+  AppendIntAttribute(&buffer_, "profile.net_ns",
+                     breakdown.syscall_ns[kSyscallNetwork]);
+  AppendIntAttribute(&buffer_, "profile.fs_ns",
+                     breakdown.syscall_ns[kSyscallFilesystem]);
+  AppendIntAttribute(&buffer_, "profile.io_ns",
+                     breakdown.syscall_ns[kSyscallIo]);
+  AppendIntAttribute(&buffer_, "profile.futex_ns",
+                     breakdown.syscall_ns[kSyscallFutex]);
+  AppendIntAttribute(&buffer_, "profile.sleep_ns",
+                     breakdown.syscall_ns[kSyscallSleep]);
+  AppendIntAttribute(&buffer_, "profile.other_ns",
+                     breakdown.syscall_ns[kSyscallOther]);
+  buffer_ += ",{\"key\":\"profile.dominant\",\"value\":{\"stringValue\":\"";
+  buffer_ += dominant == kSyscallCategories
+                 ? "user"
+                 : SyscallCategoryName((SyscallCategory) dominant);
+  buffer_ += "\"}}]}";
+
+  if (buffer_.size() >= kOtlpChunkSize)
+  {
+    output_->Write(buffer_);
+    buffer_.clear();
+  }
+}
+
+void PprofProfile::OnRecord(const ReplayRecord& record)
+{
+  // Records of the same endpoint tend to come together.
+  if (last_ == nullptr || last_->first.size() != record.endpoint_size ||
+      memcmp(last_->first.data(), record.endpoint, record.endpoint_size) != 0)
+    last_ = &*syscalls_
+                  .emplace(std::string(record.endpoint, record.endpoint_size),
+                           EndpointSyscalls())
+                  .first;
+
+  for (uint32_t i = 0; i < record.nb_syscalls; ++i)
+  {
+    const struct syscall_desc& syscall = record.syscalls[i];
+    SyscallTotals& totals = last_->second[SyscallName(syscall.name)];
+    totals.count++;
+    if (syscall.end_steady > syscall.start_steady)
+      totals.ns += syscall.end_steady - syscall.start_steady;
+  }
+}
+
+void PprofProfile::OnSample(const ReplaySample& sample)
+{
+  if (!sample.ips.empty())
+    stacks_[sample.ips]++;
+}
+
+void PprofProfile::Merge(const PprofProfile& other)
+{
+  for (const auto& endpoint : other.syscalls_)
+  {
+    EndpointSyscalls& syscalls = syscalls_[endpoint.first];
+    for (const auto& entry : endpoint.second)
+    {
+      SyscallTotals& totals = syscalls[entry.first];
+      totals.count += entry.second.count;
+      totals.ns += entry.second.ns;
+    }
+  }
+  for (const auto& entry : other.stacks_)
+    stacks_[entry.first] += entry.second;
+}
+
+bool PprofProfile::Write(FILE* file) const
+{
+  std::vector<std::string> strings = {""};
+  std::unordered_map<std::string, uint64_t> string_ids;
+  auto intern = [&](const std::string& s) {
+    auto it = string_ids.find(s);
+    if (it != string_ids.end())
+      return it->second;
+    string_ids[s] = strings.size();
+    strings.push_back(s);
+    return (uint64_t) strings.size() - 1;
+  };
+
+  ProtoWriter profile;
+  static const char* const kSampleTypes[][2] = {
+      {"samples", "count"},
+      {"syscalls", "count"},
+      {"syscall_time", "nanoseconds"},
+  };
+  for (const auto& type : kSampleTypes)
+  {
+    ProtoWriter value_type;
+    value_type.Uint(1, intern(type[0]));
+    value_type.Uint(2, intern(type[1]));
+    profile.Bytes(1, value_type.data());
+  }
+
+  // Syscalls: one function, and one location, per name.
+  std::unordered_map<std::string, uint64_t> functions;
+  std::vector<std::string> function_names;
+  auto function = [&](const std::string& name) {
+    auto it = functions.find(name);
+    if (it != functions.end())
+      return it->second;
+    function_names.push_back(name);
+    return functions[name] = function_names.size();
+  };
+
+  for (const auto& endpoint : syscalls_)
+  {
+    for (const auto& entry : endpoint.second)
+    {
+      std::string name = entry.first.str();
+      SyscallCategory category = ClassifySyscall(name.data(), name.size());
+      ProtoWriter sample;
+
+      sample.Packed(1, {function(name),
+                        function(std::string("[") +
+                                 SyscallCategoryName(category) + "]"),
+                        function(endpoint.first)});
+      sample.Packed(2, {0, entry.second.count, entry.second.ns});
+      profile.Bytes(2, sample.data());
+    }
+  }
+
+  // Stack samples: one location per address, after the functions' ones.
+  std::unordered_map<uint64_t, uint64_t> addresses;
+  std::vector<uint64_t> address_list;
+  uint64_t first_address_id = function_names.size() + 1;
+
+  for (const auto& entry : stacks_)
+  {
+    std::vector<uint64_t> locations;
+    ProtoWriter sample;
+
+    for (uint64_t ip : entry.first)
+    {
+      auto it = addresses.find(ip);
+      if (it == addresses.end())
+      {
+        it = addresses.emplace(ip, first_address_id + address_list.size())
+                 .first;
+        address_list.push_back(ip);
+      }
+      locations.push_back(it->second);
+    }
+    sample.Packed(1, locations);
+    sample.Packed(2, {entry.second, 0, 0});
+    profile.Bytes(2, sample.data());
+  }
+
+  for (size_t i = 0; i < function_names.size(); ++i)
+  {
+    ProtoWriter location, line;
+    line.Uint(1, i + 1);
+    location.Uint(1, i + 1);
+    location.Bytes(4, line.data());
+    profile.Bytes(4, location.data());
+  }
+  for (size_t i = 0; i < address_list.size(); ++i)
+  {
+    ProtoWriter location;
+    location.Uint(1, first_address_id + i);
+    location.Uint(3, address_list[i]);
+    profile.Bytes(4, location.data());
+  }
+  for (size_t i = 0; i < function_names.size(); ++i)
+  {
+    ProtoWriter fn;
+    uint64_t name = intern(function_names[i]);
+    fn.Uint(1, i + 1);
+    fn.Uint(2, name);
+    fn.Uint(3, name);
+    profile.Bytes(5, fn.data());
+  }
+
+  for (const std::string& s : strings)
+    profile.Bytes(6, s);
+
+  const std::string& data = profile.data();
+  return fwrite(data.data(), 1, data.size(), file) == data.size();
+}
+
+}  // namespace microservice_profile
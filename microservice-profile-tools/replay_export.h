@@ -0,0 +1,102 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_REPLAY_EXPORT_H_
+#define MICROSERVICE_PROFILE_REPLAY_EXPORT_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "microservice-profile-tools/replay_scan.h"
+
+namespace microservice_profile
+{
+
+// An OTLP-JSON trace export (ExportTraceServiceRequest), written as the
+// scanning threads go. Each relay record becomes a "kernel" span, child of
+// the span it was recorded in, with one "__<syscall>" child per syscall, as
+// the profiler itself reports them.
+class OtlpOutput
+{
+public:
+  OtlpOutput(FILE* file, const std::string& service_name);
+
+  // Closes the JSON document.
+  void Finish();
+
+  // Appends comma-separated span objects.
+  void Write(const std::string& spans);
+
+private:
+  std::mutex mutex_;
+  FILE* file_;
+  bool empty_ = true;
+};
+
+// Consumer formatting spans into a private buffer, written out in chunks.
+class OtlpWriter : public ReplayConsumer
+{
+public:
+  explicit OtlpWriter(OtlpOutput* output) : output_(output) {}
+  ~OtlpWriter() override;
+
+  void OnRecord(const ReplayRecord& record) override;
+
+private:
+  void AppendSpan(const uint8_t* trace_id, const uint8_t* span_id,
+                  const uint8_t* parent_id, const char* name, size_t name_size,
+                  uint64_t start, uint64_t end);
+
+  OtlpOutput* output_;
+  std::string buffer_;
+};
+
+// A pprof profile (profile.proto, uncompressed): stack samples counted by
+// instruction pointer, and syscall counts and time with endpoint / [category]
+// / syscall as their stack. Addresses are left for pprof to symbolize.
+class PprofProfile : public ReplayConsumer
+{
+public:
+  void OnRecord(const ReplayRecord& record) override;
+  void OnSample(const ReplaySample& sample) override;
+
+  void Merge(const PprofProfile& other);
+
+  bool Write(FILE* file) const;
+
+private:
+  struct SyscallTotals
+  {
+    uint64_t count = 0;
+    uint64_t ns = 0;
+  };
+
+  typedef std::unordered_map<SyscallName, SyscallTotals, SyscallNameHash>
+      EndpointSyscalls;
+
+  std::unordered_map<std::string, EndpointSyscalls> syscalls_;
+  std::pair<const std::string, EndpointSyscalls>* last_ = nullptr;
+  std::map<std::vector<uint64_t>, uint64_t> stacks_;
+};
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_REPLAY_EXPORT_H_
@@ -0,0 +1,451 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include "microservice-profile-tools/replay_scan.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <thread>
+#include <unordered_map>
+
+#include "microservice-profile-base/annotation_format.h"
+#include "microservice-profile-base/flight_recorder.h"
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+const size_t kRelayRecordsPerUnit = 4096;
+const char kUnknownEndpoint[] = "(unknown)";
+
+enum InputKind
+{
+  kCaptureInput,
+  kFlightInput,
+  kRelayInput,
+};
+
+struct Input
+{
+  InputKind kind;
+  std::string path;
+  std::unique_ptr<AnnotationReader> capture;
+  const uint8_t* data = nullptr;  // Relay dumps.
+  size_t size = 0;
+  std::vector<size_t> offsets;  // Record offsets of relay dumps.
+};
+
+struct WorkUnit
+{
+  Input* input;
+  size_t begin;  // Blocks of captures, record indexes of relay dumps.
+  size_t end;
+};
+
+int HexDigit(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+bool RecordMatches(const ReplayFilter& filter, const uint8_t* trace_id,
+                   uint32_t nb_syscalls, const struct syscall_desc* syscalls)
+{
+  if (filter.has_trace_id && memcmp(trace_id, filter.trace_id, 16) != 0)
+    return false;
+  if (filter.min_time == 0 && filter.max_time == UINT64_MAX)
+    return true;
+  for (uint32_t i = 0; i < nb_syscalls; ++i)
+  {
+    if (syscalls[i].start_system >= filter.min_time &&
+        syscalls[i].start_system <= filter.max_time)
+      return true;
+  }
+  return false;
+}
+
+// Decodes a relay record header. Returns false if the ids aren't hex.
+bool ParseRelayHeader(const uint8_t* header, uint8_t* span_id,
+                      uint8_t* trace_id)
+{
+  return ParseHex(reinterpret_cast<const char*>(header) + 16, span_id, 8) &&
+         ParseHex(reinterpret_cast<const char*>(header) + 32, trace_id, 16);
+}
+
+// Emits a relay record made of a header and its syscalls, copied out as the
+// data may not be aligned.
+void EmitRelayRecord(const uint8_t* data, uint32_t nb_syscalls,
+                     const char* endpoint, size_t endpoint_size,
+                     const ReplayFilter& filter,
+                     std::vector<syscall_desc>* syscalls,
+                     ReplayConsumer* consumer)
+{
+  uint8_t span_id[8], trace_id[16];
+
+  if (!ParseRelayHeader(data, span_id, trace_id))
+    return;
+  syscalls->resize(nb_syscalls);
+  memcpy((void*) syscalls->data(), data + RELAY_RECORD_HEADER_SIZE,
+         nb_syscalls * sizeof(syscall_desc));
+  if (!RecordMatches(filter, trace_id, nb_syscalls, syscalls->data()))
+    return;
+
+  ReplayRecord record = {span_id,       trace_id,    endpoint,
+                         endpoint_size, nb_syscalls, syscalls->data()};
+  consumer->OnRecord(record);
+}
+
+bool OpenRelayDump(Input* input)
+{
+  struct stat st;
+  int fd = open(input->path.c_str(), O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0)
+    return false;
+  if (fstat(fd, &st) != 0)
+  {
+    close(fd);
+    return false;
+  }
+  input->size = st.st_size;
+  if (input->size > 0)
+  {
+    void* data = mmap(nullptr, input->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+      close(fd);
+      return false;
+    }
+    madvise(data, input->size, MADV_SEQUENTIAL);
+    input->data = static_cast<const uint8_t*>(data);
+  }
+  close(fd);
+
+  // Records are self-delimiting: hop over them to find where they start. A
+  // truncated or corrupted tail ends the dump.
+  size_t offset = 0;
+  while (offset + RELAY_RECORD_HEADER_SIZE <= input->size)
+  {
+    uint32_t nb_syscalls;
+    memcpy(&nb_syscalls, input->data + offset, sizeof(nb_syscalls));
+    size_t size = RELAY_RECORD_HEADER_SIZE + nb_syscalls * sizeof(syscall_desc);
+    if (nb_syscalls > MAX_SYSCALLS_PER_RECORD || offset + size > input->size)
+      break;
+    input->offsets.push_back(offset);
+    offset += size;
+  }
+  if (offset != input->size)
+    std::cerr << input->path << ": ignoring " << input->size - offset
+              << " trailing bytes" << std::endl;
+  return true;
+}
+
+bool OpenInput(const std::string& path, Input* input)
+{
+  uint32_t magic = 0;
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0)
+    return false;
+  ssize_t n = read(fd, &magic, sizeof(magic));
+  close(fd);
+  if (n < 0)
+    return false;
+
+  input->path = path;
+  if (magic == kAnnotationFileMagic)
+  {
+    input->kind = kCaptureInput;
+    input->capture.reset(new AnnotationReader());
+    return input->capture->Open(path.c_str());
+  }
+  if (magic == kFlightRecorderMagic)
+  {
+    input->kind = kFlightInput;
+    return true;
+  }
+  input->kind = kRelayInput;
+  return OpenRelayDump(input);
+}
+
+void ScanCapture(const WorkUnit& unit, const ReplayFilter& filter,
+                 ReplayConsumer* consumer)
+{
+  const std::vector<AnnotationReader::Block>& blocks =
+      unit.input->capture->blocks();
+
+  for (size_t i = unit.begin; i < unit.end; ++i)
+  {
+    const AnnotationBlockHeader* header = blocks[i].header;
+    if (header->max_time < filter.min_time ||
+        header->min_time > filter.max_time)
+      continue;
+    if (filter.has_trace_id && !header->MayContain(filter.trace_id))
+      continue;
+
+    bool ok = AnnotationReader::DecodeBlock(
+        blocks[i], [&](const AnnotationRecord& annotation) {
+          if (!RecordMatches(filter, annotation.trace_id,
+                             annotation.syscalls.size(),
+                             annotation.syscalls.data()))
+            return;
+          ReplayRecord record = {
+              annotation.span_id,          annotation.trace_id,
+              annotation.endpoint.data(),  annotation.endpoint.size(),
+              (uint32_t) annotation.syscalls.size(),
+              annotation.syscalls.data()};
+          consumer->OnRecord(record);
+        });
+    if (!ok)
+      std::cerr << unit.input->path << ": corrupted block " << i << std::endl;
+  }
+}
+
+void ScanRelayDump(const WorkUnit& unit, const ReplayFilter& filter,
+                   ReplayConsumer* consumer)
+{
+  std::vector<syscall_desc> syscalls;
+
+  for (size_t i = unit.begin; i < unit.end; ++i)
+  {
+    const uint8_t* data = unit.input->data + unit.input->offsets[i];
+    uint32_t nb_syscalls;
+
+    memcpy(&nb_syscalls, data, sizeof(nb_syscalls));
+    if (nb_syscalls > 0)
+      EmitRelayRecord(data, nb_syscalls, kUnknownEndpoint,
+                      sizeof(kUnknownEndpoint) - 1, filter, &syscalls,
+                      consumer);
+  }
+}
+
+// The relay records of a ring carry no endpoint: it is taken from the span
+// ends of the same ring, hence the two passes.
+void ScanFlightRecorder(const WorkUnit& unit, const ReplayFilter& filter,
+                        ReplayConsumer* consumer)
+{
+  const char* path = unit.input->path.c_str();
+  std::unordered_map<uint64_t, std::string> names;
+  FlightRecorderHeader header;
+
+  bool ok = ReadFlightRecorder(
+      path,
+      [&](FlightEntryType type, uint64_t, uint32_t, const uint8_t* data,
+          size_t size) {
+        if (type != kFlightSpan || size < sizeof(FlightSpanRecord))
+          return;
+        uint64_t id;
+        memcpy(&id, data, sizeof(id));
+        names[id].assign(
+            reinterpret_cast<const char*>(data) + sizeof(FlightSpanRecord),
+            size - sizeof(FlightSpanRecord));
+      },
+      &header);
+  if (!ok)
+  {
+    std::cerr << path << ": not a flight recorder" << std::endl;
+    return;
+  }
+
+  int64_t to_realtime = header.realtime_base - header.monotonic_base;
+  std::vector<syscall_desc> syscalls;
+
+  ReadFlightRecorder(path, [&](FlightEntryType type, uint64_t time,
+                               uint32_t tid, const uint8_t* data,
+                               size_t size) {
+    if (type == kFlightRelayRecord && size >= RELAY_RECORD_HEADER_SIZE)
+    {
+      uint32_t nb_syscalls;
+      memcpy(&nb_syscalls, data, sizeof(nb_syscalls));
+      nb_syscalls = std::min<size_t>(
+          nb_syscalls,
+          (size - RELAY_RECORD_HEADER_SIZE) / sizeof(syscall_desc));
+      if (nb_syscalls == 0)
+        return;
+
+      uint64_t id;
+      uint8_t span_id[8], trace_id[16];
+      if (!ParseRelayHeader(data, span_id, trace_id))
+        return;
+      memcpy(&id, span_id, sizeof(id));
+      auto name = names.find(id);
+      if (name != names.end())
+        EmitRelayRecord(data, nb_syscalls, name->second.data(),
+                        name->second.size(), filter, &syscalls, consumer);
+      else
+        EmitRelayRecord(data, nb_syscalls, kUnknownEndpoint,
+                        sizeof(kUnknownEndpoint) - 1, filter, &syscalls,
+                        consumer);
+    }
+    else if (type == kFlightSpan && size >= sizeof(FlightSpanRecord))
+    {
+      FlightSpanRecord record;
+      memcpy(&record, data, sizeof(record));
+      if (filter.has_trace_id &&
+          memcmp(record.trace_id, filter.trace_id, 16) != 0)
+        return;
+      if (record.start + record.duration < filter.min_time ||
+          record.start > filter.max_time)
+        return;
+
+      ReplaySpan span;
+      memcpy(span.span_id, record.span_id, sizeof(span.span_id));
+      memcpy(span.trace_id, record.trace_id, sizeof(span.trace_id));
+      span.name.assign(
+          reinterpret_cast<const char*>(data) + sizeof(record),
+          size - sizeof(record));
+      span.start = record.start;
+      span.duration = record.duration;
+      span.tid = tid;
+      span.end_monotonic = time;
+      consumer->OnSpan(span);
+    }
+    else if (type == kFlightStackSample)
+    {
+      ReplaySample sample;
+      sample.tid = tid;
+      sample.monotonic = time;
+      sample.time = time + to_realtime;
+      if (sample.time < filter.min_time || sample.time > filter.max_time)
+        return;
+      sample.ips.resize(size / sizeof(uint64_t));
+      memcpy(sample.ips.data(), data, sample.ips.size() * sizeof(uint64_t));
+      consumer->OnSample(sample);
+    }
+  });
+}
+
+}  // namespace
+
+bool ParseHex(const char* hex, uint8_t* bytes, size_t size)
+{
+  for (size_t i = 0; i < size; ++i)
+  {
+    int high = HexDigit(hex[2 * i]);
+    int low = HexDigit(hex[2 * i + 1]);
+    if (high < 0 || low < 0)
+      return false;
+    bytes[i] = (high << 4) | low;
+  }
+  return true;
+}
+
+std::string ToHex(const uint8_t* bytes, size_t size)
+{
+  static const char kDigits[] = "0123456789abcdef";
+  std::string hex(2 * size, '0');
+
+  for (size_t i = 0; i < size; ++i)
+  {
+    hex[2 * i] = kDigits[bytes[i] >> 4];
+    hex[2 * i + 1] = kDigits[bytes[i] & 0xf];
+  }
+  return hex;
+}
+
+bool ScanInputs(const std::vector<std::string>& paths,
+                const ReplayFilter& filter, unsigned threads,
+                const ConsumerFactory& factory,
+                std::vector<std::unique_ptr<ReplayConsumer>>* consumers)
+{
+  std::vector<std::unique_ptr<Input>> inputs;
+  std::vector<WorkUnit> units;
+
+  for (const std::string& path : paths)
+  {
+    std::unique_ptr<Input> input(new Input());
+    if (!OpenInput(path, input.get()))
+    {
+      std::cerr << "Couldn't read " << path << std::endl;
+      return false;
+    }
+
+    switch (input->kind)
+    {
+      case kCaptureInput:
+        for (size_t i = 0; i < input->capture->blocks().size(); ++i)
+          units.push_back({input.get(), i, i + 1});
+        break;
+      case kRelayInput:
+        for (size_t i = 0; i < input->offsets.size(); i += kRelayRecordsPerUnit)
+          units.push_back({input.get(), i,
+                           std::min(i + kRelayRecordsPerUnit,
+                                    input->offsets.size())});
+        break;
+      case kFlightInput:
+        units.push_back({input.get(), 0, 1});
+        break;
+    }
+    inputs.push_back(std::move(input));
+  }
+
+  if (threads == 0)
+    threads = 1;
+  threads = std::min<size_t>(threads, std::max<size_t>(units.size(), 1));
+
+  // Units are taken in order, so that neighbouring blocks are read together.
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> workers;
+
+  consumers->clear();
+  for (unsigned i = 0; i < threads; ++i)
+    consumers->push_back(factory());
+  for (unsigned i = 0; i < threads; ++i)
+  {
+    ReplayConsumer* consumer = (*consumers)[i].get();
+    workers.emplace_back([&, consumer] {
+      for (size_t u = next++; u < units.size(); u = next++)
+      {
+        switch (units[u].input->kind)
+        {
+          case kCaptureInput:
+            ScanCapture(units[u], filter, consumer);
+            break;
+          case kRelayInput:
+            ScanRelayDump(units[u], filter, consumer);
+            break;
+          case kFlightInput:
+            ScanFlightRecorder(units[u], filter, consumer);
+            break;
+        }
+      }
+    });
+  }
+  for (std::thread& worker : workers)
+    worker.join();
+
+  for (auto& input : inputs)
+  {
+    if (input->data != nullptr)
+      munmap(const_cast<uint8_t*>(input->data), input->size);
+  }
+  return true;
+}
+
+}  // namespace microservice_profile
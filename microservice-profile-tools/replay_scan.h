@@ -0,0 +1,154 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_REPLAY_SCAN_H_
+#define MICROSERVICE_PROFILE_REPLAY_SCAN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "microservice-profile-base/module_abi.h"
+
+namespace microservice_profile
+{
+
+// A relay record, whatever the file it comes from.
+struct ReplayRecord
+{
+  const uint8_t* span_id;   // 8 bytes.
+  const uint8_t* trace_id;  // 16 bytes.
+  const char* endpoint;     // "(unknown)" when the file does not say.
+  size_t endpoint_size;
+  uint32_t nb_syscalls;
+  const struct syscall_desc* syscalls;
+};
+
+// A span end, from a flight recorder.
+struct ReplaySpan
+{
+  uint8_t span_id[8];
+  uint8_t trace_id[16];
+  std::string name;
+  uint64_t start;     // ns since the epoch.
+  uint64_t duration;  // ns.
+  uint32_t tid;
+  uint64_t end_monotonic;
+};
+
+// A stack sample, from a flight recorder.
+struct ReplaySample
+{
+  uint32_t tid;
+  uint64_t time;  // ns since the epoch.
+  uint64_t monotonic;
+  std::vector<uint64_t> ips;  // Innermost first.
+};
+
+struct ReplayFilter
+{
+  uint64_t min_time = 0;  // ns since the epoch.
+  uint64_t max_time = UINT64_MAX;
+  bool has_trace_id = false;
+  uint8_t trace_id[16] = {};
+};
+
+// Receives the contents of the inputs. Each scanning thread has its own
+// consumer, so the methods need no locking.
+class ReplayConsumer
+{
+public:
+  virtual ~ReplayConsumer() = default;
+
+  virtual void OnRecord(const ReplayRecord& record) {}
+  virtual void OnSpan(const ReplaySpan& span) {}
+  virtual void OnSample(const ReplaySample& sample) {}
+};
+
+typedef std::function<std::unique_ptr<ReplayConsumer>()> ConsumerFactory;
+
+// Scans capture files (annotation_format.h), flight recorder files (live,
+// crashed or snapshot) and raw relay channel dumps with the given number of
+// threads. The files are mapped, then split into work units: the blocks of a
+// capture, runs of records of a relay dump, and whole flight recorders, which
+// are small. The consumers built by factory are returned in consumers, for the
+// caller to merge. Returns false if an input can't be read.
+bool ScanInputs(const std::vector<std::string>& paths,
+                const ReplayFilter& filter, unsigned threads,
+                const ConsumerFactory& factory,
+                std::vector<std::unique_ptr<ReplayConsumer>>* consumers);
+
+// Scans into consumers of type Consumer, merged with Consumer::Merge().
+template <typename Consumer>
+bool Scan(const std::vector<std::string>& paths, const ReplayFilter& filter,
+          unsigned threads, Consumer* result)
+{
+  std::vector<std::unique_ptr<ReplayConsumer>> parts;
+
+  if (!ScanInputs(paths, filter, threads,
+                  [] { return std::unique_ptr<ReplayConsumer>(new Consumer()); },
+                  &parts))
+    return false;
+  for (auto& part : parts)
+    result->Merge(static_cast<Consumer&>(*part));
+  return true;
+}
+
+// Syscall name as the relay records store it, zero-padded.
+struct SyscallName
+{
+  char name[SYSCALL_NAME_MAX_SIZE];
+
+  explicit SyscallName(const char* syscall)
+  {
+    size_t size = strnlen(syscall, SYSCALL_NAME_MAX_SIZE);
+    memcpy(name, syscall, size);
+    memset(name + size, 0, SYSCALL_NAME_MAX_SIZE - size);
+  }
+
+  std::string str() const
+  {
+    return std::string(name, strnlen(name, SYSCALL_NAME_MAX_SIZE));
+  }
+
+  bool operator==(const SyscallName& other) const
+  {
+    return memcmp(name, other.name, SYSCALL_NAME_MAX_SIZE) == 0;
+  }
+};
+
+struct SyscallNameHash
+{
+  size_t operator()(const SyscallName& syscall) const
+  {
+    uint64_t a, b;
+    memcpy(&a, syscall.name, sizeof(a));
+    memcpy(&b, syscall.name + sizeof(a), sizeof(b));
+    return (a * 0x9e3779b97f4a7c15ULL) ^ b;
+  }
+};
+
+// Parses 2 * size hex digits. Returns false on a bad digit.
+bool ParseHex(const char* hex, uint8_t* bytes, size_t size);
+std::string ToHex(const uint8_t* bytes, size_t size);
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_REPLAY_SCAN_H_
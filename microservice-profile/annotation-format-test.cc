@@ -0,0 +1,301 @@
+/*
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Relay records written by AnnotationWriter must read back unchanged, and
+ * truncated or corrupted blocks must be rejected without reading out of
+ * bounds. Run by "make check".
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "microservice-profile-base/annotation_format.h"
+
+using microservice_profile::AnnotationBlockHeader;
+using microservice_profile::AnnotationReader;
+using microservice_profile::AnnotationRecord;
+using microservice_profile::AnnotationWriter;
+
+static const int kRecords = 64;
+
+static int failures = 0;
+
+static void Check(bool condition, const char* what)
+{
+	if (!condition) {
+		fprintf(stderr, "FAIL: %s\n", what);
+		failures++;
+	}
+}
+
+/* Distinct, random-looking ids: the bloom filter hashes their last bytes */
+static void MakeId(uint8_t* id, size_t size, int record)
+{
+	uint64_t state = 0x9e3779b97f4a7c15ULL * (record + 1);
+
+	for (size_t i = 0; i < size; i++) {
+		state ^= state >> 29;
+		state *= 0xbf58476d1ce4e5b9ULL;
+		id[i] = (uint8_t) (state >> 56);
+	}
+}
+
+/*
+ * Records that exercise the encoding: syscalls that overlap (negative gaps),
+ * durations and gaps of one to several varint bytes, a wall clock adjusted
+ * in the middle of a record and across records, and a record without
+ * syscalls.
+ */
+static std::vector<AnnotationRecord> MakeRecords()
+{
+	static const char* const kNames[] = {"read", "write", "epoll_wait",
+		"a_name_of_16_chr"};
+	std::vector<AnnotationRecord> records(kRecords);
+	uint64_t steady = 1000000000ULL;
+	int64_t offset = 1700000000000000000LL;
+
+	for (int r = 0; r < kRecords; r++) {
+		AnnotationRecord& record = records[r];
+
+		MakeId(record.span_id, sizeof(record.span_id), 2 * r);
+		MakeId(record.trace_id, sizeof(record.trace_id), 2 * r + 1);
+		record.endpoint = "/endpoint/" + std::to_string(r % 5);
+		if (r % 7 == 3)
+			continue;
+
+		record.syscalls.resize(1 + r % 6);
+		for (size_t i = 0; i < record.syscalls.size(); i++) {
+			syscall_desc& sc = record.syscalls[i];
+			const char* name = kNames[(r + i) % 4];
+
+			memset(sc.name, 0, sizeof(sc.name));
+			memcpy(sc.name, name, strnlen(name, sizeof(sc.name)));
+			if (i % 3 == 2)
+				steady -= 500;	/* Starts before the previous end */
+			else
+				steady += (uint64_t) 1 << ((r + i) % 40);
+			if ((r + i) % 11 == 5)
+				offset += (r % 2 ? 1 : -1) * 123456789LL;
+			sc.start_steady = steady;
+			sc.start_system = steady + offset;
+			steady += 100 + ((uint64_t) r << (i * 5));
+			sc.end_steady = steady;
+		}
+	}
+	return records;
+}
+
+static bool SameRecord(const AnnotationRecord& a, const AnnotationRecord& b)
+{
+	if (memcmp(a.span_id, b.span_id, sizeof(a.span_id)) != 0 ||
+	    memcmp(a.trace_id, b.trace_id, sizeof(a.trace_id)) != 0 ||
+	    a.endpoint != b.endpoint || a.syscalls.size() != b.syscalls.size())
+		return false;
+	for (size_t i = 0; i < a.syscalls.size(); i++) {
+		const syscall_desc& x = a.syscalls[i];
+		const syscall_desc& y = b.syscalls[i];
+
+		if (memcmp(x.name, y.name, sizeof(x.name)) != 0 ||
+		    x.start_system != y.start_system ||
+		    x.start_steady != y.start_steady ||
+		    x.end_steady != y.end_steady)
+			return false;
+	}
+	return true;
+}
+
+static void WriteRecords(const char* path,
+	const std::vector<AnnotationRecord>& records)
+{
+	AnnotationWriter writer;
+
+	Check(writer.Open(path), "the writer opens its file");
+	for (const auto& record : records) {
+		writer.Append(record.span_id, record.trace_id,
+			record.endpoint.data(), record.endpoint.size(),
+			record.syscalls.size(), record.syscalls.data());
+		/* A second block, with its own dictionary */
+		if (&record == &records[kRecords / 2])
+			writer.Flush();
+	}
+	writer.Close();
+}
+
+static void CheckRoundTrip(const char* path,
+	const std::vector<AnnotationRecord>& records)
+{
+	AnnotationReader reader;
+	std::vector<AnnotationRecord> read;
+
+	Check(reader.Open(path), "the reader opens the file");
+	Check(reader.blocks().size() == 2, "two blocks are read back");
+	for (const auto& block : reader.blocks()) {
+		bool ok = AnnotationReader::DecodeBlock(block,
+			[&](const AnnotationRecord& record) {
+				read.push_back(record);
+			});
+		Check(ok, "a block written by the writer decodes");
+	}
+
+	Check(read.size() == records.size(), "every record is read back");
+	for (size_t r = 0; r < read.size() && r < records.size(); r++) {
+		if (!SameRecord(read[r], records[r])) {
+			fprintf(stderr, "record %zu differs\n", r);
+			Check(false, "records read back unchanged");
+			break;
+		}
+	}
+
+	/* The bloom filter of a block has every trace id of its records */
+	for (int r = 0; r < kRecords; r++) {
+		const auto& block = reader.blocks()[r <= kRecords / 2 ? 0 : 1];
+		if (!block.header->MayContain(records[r].trace_id)) {
+			Check(false, "the bloom filter has the block's trace ids");
+			break;
+		}
+	}
+
+	/* Select by trace id finds its record, and only it */
+	const AnnotationRecord& wanted = records[kRecords - 2];
+	int found = 0;
+	reader.Select(0, UINT64_MAX, wanted.trace_id,
+		[&](const AnnotationRecord& record) {
+			found++;
+			Check(SameRecord(record, wanted), "Select finds the trace");
+		});
+	Check(found == 1, "Select finds the trace's record once");
+
+	/* An unknown trace id matches no record, whatever its bloom bits */
+	uint8_t unknown[16];
+	MakeId(unknown, sizeof(unknown), 1000);
+	found = 0;
+	reader.Select(0, UINT64_MAX, unknown,
+		[&](const AnnotationRecord&) { found++; });
+	Check(found == 0, "Select skips an unknown trace");
+}
+
+static bool Decodes(const AnnotationBlockHeader& header,
+	const std::vector<uint8_t>& payload)
+{
+	AnnotationReader::Block block = {&header, payload.data()};
+
+	return AnnotationReader::DecodeBlock(block,
+		[](const AnnotationRecord&) {});
+}
+
+/*
+ * Corruptions of a block's header and payload, decoded from copies: the
+ * cursors must stop at the payload's end.
+ */
+static void CheckCorruptBlocks(const char* path)
+{
+	AnnotationReader reader;
+
+	if (!reader.Open(path) || reader.blocks().empty())
+		return;
+	const AnnotationReader::Block& block = reader.blocks()[0];
+	AnnotationBlockHeader header = *block.header;
+	std::vector<uint8_t> payload(block.payload,
+		block.payload + header.payload_size);
+
+	Check(Decodes(header, payload), "the copied block decodes");
+
+	/* Every truncation of the payload */
+	for (uint32_t size = 0; size < header.payload_size; size++) {
+		AnnotationBlockHeader truncated = header;
+		std::vector<uint8_t> bytes(payload.begin(), payload.begin() + size);
+
+		truncated.payload_size = size;
+		if (Decodes(truncated, bytes)) {
+			fprintf(stderr, "payload truncated to %u bytes\n", size);
+			Check(false, "truncated payloads are rejected");
+			break;
+		}
+	}
+
+	/* More records or fewer syscalls than the columns hold */
+	AnnotationBlockHeader more = header;
+	more.records++;
+	Check(!Decodes(more, payload), "a record count too high is rejected");
+	AnnotationBlockHeader fewer = header;
+	fewer.syscalls = 0;
+	Check(!Decodes(fewer, payload), "a syscall count too low is rejected");
+
+	/* A column length past the payload's end */
+	std::vector<uint8_t> bytes = payload;
+	bytes[0] = bytes[1] = bytes[2] = 0xff;
+	bytes[3] = 0x0f;
+	Check(!Decodes(header, bytes), "a column length too long is rejected");
+
+	/* A varint that never ends */
+	bytes.assign(header.payload_size, 0x80);
+	Check(!Decodes(header, bytes), "an endless varint is rejected");
+
+	/* Flipped bytes may decode to other values, never out of bounds */
+	for (uint32_t i = 0; i < header.payload_size; i++) {
+		bytes = payload;
+		bytes[i] ^= 0xa5;
+		Decodes(header, bytes);
+	}
+}
+
+/* A file cut in its last block keeps its whole blocks */
+static void CheckTruncatedFile(const char* path)
+{
+	AnnotationReader reader;
+	size_t blocks;
+
+	if (!reader.Open(path))
+		return;
+	blocks = reader.blocks().size();
+	/* The file header is right before the first block */
+	const uint8_t* start = (const uint8_t*) reader.blocks()[0].header -
+		sizeof(microservice_profile::AnnotationFileHeader);
+	off_t end = reader.blocks().back().payload - start;
+	reader.Close();
+
+	Check(truncate(path, end + 1) == 0, "the file is truncated");
+	Check(reader.Open(path), "the reader opens a truncated file");
+	Check(reader.blocks().size() == blocks - 1,
+		"the truncated last block is ignored");
+}
+
+int main()
+{
+	char path[] = "/tmp/annotation-format-test-XXXXXX";
+	int fd = mkstemp(path);
+
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+
+	std::vector<AnnotationRecord> records = MakeRecords();
+	WriteRecords(path, records);
+	CheckRoundTrip(path, records);
+	CheckCorruptBlocks(path);
+	CheckTruncatedFile(path);
+
+	unlink(path);
+	return failures == 0 ? 0 : 1;
+}
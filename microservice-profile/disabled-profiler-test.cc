@@ -0,0 +1,143 @@
+/*
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Without the kernel module, building the span processors must create no
+ * thread and keep no file open, and the hooks of a processor whose profiler
+ * is disabled must return right away. Run by "make check".
+ */
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "microservice-profile-base/get_monotonic_time.h"
+#include "microservice-profile-base/module_abi.h"
+#include "profile-span-processor.h"
+
+namespace sdk_trace = opentelemetry::sdk::trace;
+namespace trace_api = opentelemetry::trace;
+
+extern char** environ;
+
+/* Loose bounds: they catch a profiler that starts anyway, not noise */
+static const uint64_t kMaxStartupNs = 50 * 1000 * 1000;
+static const uint64_t kMaxDisabledHookNs = 500;
+static const int kHookCalls = 1000000;
+
+static int failures = 0;
+
+static void Check(bool condition, const char* what)
+{
+	if (!condition) {
+		fprintf(stderr, "FAIL: %s\n", what);
+		failures++;
+	}
+}
+
+/* Entries of a /proc/self directory, "." and ".." excluded */
+static int CountEntries(const char* path)
+{
+	DIR* dir = opendir(path);
+	int count = 0;
+
+	if (dir == nullptr)
+		return -1;
+	while (struct dirent* entry = readdir(dir)) {
+		if (entry->d_name[0] != '.')
+			count++;
+	}
+	closedir(dir);
+	/* opendir's own descriptor */
+	return strcmp(path, "/proc/self/fd") == 0 ? count - 1 : count;
+}
+
+/* The test must not depend on the profiler's configuration */
+static void ClearProfilerEnvironment()
+{
+	std::vector<std::string> names;
+
+	for (char** env = environ; *env != nullptr; env++) {
+		if (strncmp(*env, "MICROSERVICE_PROFILE_", 21) == 0)
+			names.emplace_back(*env, strcspn(*env, "="));
+	}
+	for (const std::string& name : names)
+		unsetenv(name.c_str());
+}
+
+template <class Sink>
+static void CheckProcessor(const char* name, bool hooks_disabled)
+{
+	int threads = CountEntries("/proc/self/task");
+	int fds = CountEntries("/proc/self/fd");
+	std::string what;
+
+	uint64_t start = GetMonotonicTime();
+	sdk_trace::BasicProfileSpanProcessor<Sink> processor;
+	uint64_t startup = GetMonotonicTime() - start;
+
+	printf("%s: started in %llu us\n", name,
+		(unsigned long long) startup / 1000);
+	what = std::string(name) + ": startup under 50 ms";
+	Check(startup < kMaxStartupNs, what.c_str());
+	what = std::string(name) + ": no thread created";
+	Check(CountEntries("/proc/self/task") == threads, what.c_str());
+	what = std::string(name) + ": no file left open";
+	Check(CountEntries("/proc/self/fd") == fds, what.c_str());
+
+	if (!hooks_disabled)
+		return;
+
+	auto recordable = processor.MakeRecordable();
+	auto span = static_cast<sdk_trace::ProfileRecordable*>(recordable.get());
+	trace_api::SpanContext parent = trace_api::SpanContext::GetInvalid();
+
+	start = GetMonotonicTime();
+	for (int i = 0; i < kHookCalls; i++) {
+		processor.OnStart(*recordable, parent);
+		processor.OnEnd(std::move(recordable));
+	}
+	uint64_t per_call = (GetMonotonicTime() - start) / kHookCalls;
+
+	printf("%s: %llu ns per disabled OnStart + OnEnd\n", name,
+		(unsigned long long) per_call);
+	what = std::string(name) + ": hooks return early";
+	Check(recordable != nullptr && !span->IsReported(), what.c_str());
+	what = std::string(name) + ": disabled hooks under 500 ns";
+	Check(per_call < kMaxDisabledHookNs, what.c_str());
+}
+
+int main()
+{
+	/* The automake code of a skipped test */
+	if (access(SPAN_LATENCY_TRACKER_PROC_PATH, F_OK) == 0) {
+		printf("kernel module loaded, skipped\n");
+		return 77;
+	}
+
+	ClearProfilerEnvironment();
+
+	CheckProcessor<microservice_profile::NullSink>("NullSink", false);
+	CheckProcessor<microservice_profile::ProcfsTextSink>("ProcfsTextSink",
+		true);
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,193 @@
+/*
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+/*
+ * Heap interposers (MICROSERVICE_PROFILE_HEAP=1): one allocation per
+ * sampling interval of allocated bytes, on average, is recorded with its
+ * stack and the endpoint of the span active on the thread in the heap
+ * profile, until freed. The operators new and delete of libstdc++ call
+ * malloc and free. The real functions are glibc's __libc_* entry points,
+ * which need no dlsym: dlsym itself allocates.
+ */
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "microservice-profile-base/heap_profile.h"
+#include "microservice-profile-base/stacktrace.h"
+#include "microservice-profile-base/thread_filter.h"
+#include "span-names.h"
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void __libc_free(void* ptr);
+void* __libc_calloc(size_t nmemb, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+}
+
+namespace
+{
+
+const size_t kMaxStackSize = 32;
+
+/* Bytes between two checks of the flag while profiling is off */
+const int64_t kDisabledInterval = 4 << 20;
+
+/*
+ * initial-exec: the first access of a thread to a variable of the default
+ * TLS model may allocate.
+ */
+thread_local int64_t bytes_until_sample
+	__attribute__((tls_model("initial-exec"))) = 0;
+
+/* Set while an allocation or a free is recorded: the profile's own
+ * allocations, and the unwinder's, go straight to libc */
+thread_local bool in_heap_hook __attribute__((tls_model("initial-exec"))) =
+	false;
+
+__attribute__((noinline)) void SampleAllocation(void* ptr, size_t size)
+{
+	/* The next allocation after the hook returns is sampled instead */
+	if (in_heap_hook)
+		return;
+
+	if (!microservice_profile::HeapProfilingEnabled()) {
+		bytes_until_sample = kDisabledInterval;
+		return;
+	}
+
+	in_heap_hook = true;
+	bytes_until_sample = microservice_profile::NextHeapSampleInterval();
+	if (ptr != nullptr && !microservice_profile::IsProfilerThread()) {
+		char endpoint[microservice_profile::SpanNameCache::kNameSize];
+		void* stack[kMaxStackSize];
+
+		size_t endpoint_size = microservice_profile::ThreadSpanName(endpoint,
+			sizeof(endpoint));
+		if (endpoint_size == 0)
+			endpoint_size = snprintf(endpoint, sizeof(endpoint), "(none)");
+		size_t stack_size = microservice_profile::StackTrace(stack,
+			kMaxStackSize, nullptr);
+
+		microservice_profile::GetHeapProfile().RecordAllocation(ptr, size,
+			endpoint, endpoint_size, stack, stack_size);
+	}
+	in_heap_hook = false;
+}
+
+/* The whole cost of an unsampled allocation */
+inline void CountAllocation(void* ptr, size_t size)
+{
+	bytes_until_sample -= size;
+	if (__builtin_expect(bytes_until_sample <= 0, 0))
+		SampleAllocation(ptr, size);
+}
+
+inline void ForgetAllocation(void* ptr)
+{
+	if (ptr == nullptr || in_heap_hook ||
+	    !microservice_profile::HeapProfilingEnabled())
+		return;
+
+	microservice_profile::HeapProfile& profile =
+		microservice_profile::GetHeapProfile();
+	if (!profile.MaybeSampled(ptr))
+		return;
+
+	in_heap_hook = true;
+	profile.RecordFree(ptr);
+	in_heap_hook = false;
+}
+
+}  // namespace
+
+extern "C" void* malloc(size_t size)
+{
+	void* ptr = __libc_malloc(size);
+	CountAllocation(ptr, size);
+	return ptr;
+}
+
+extern "C" void free(void* ptr)
+{
+	ForgetAllocation(ptr);
+	__libc_free(ptr);
+}
+
+extern "C" void* calloc(size_t nmemb, size_t size)
+{
+	size_t total;
+	void* ptr = __libc_calloc(nmemb, size);
+	if (!__builtin_mul_overflow(nmemb, size, &total))
+		CountAllocation(ptr, total);
+	return ptr;
+}
+
+/*
+ * A moved block is a new allocation, and its old address is forgotten once
+ * realloc succeeded: on failure the old block is still allocated. A block
+ * grown in place counts for what it grew by.
+ */
+extern "C" void* realloc(void* ptr, size_t size)
+{
+	size_t old_size = ptr != nullptr ? malloc_usable_size(ptr) : 0;
+	void* new_ptr = __libc_realloc(ptr, size);
+
+	if (new_ptr == nullptr) {
+		/* realloc(ptr, 0) frees ptr */
+		if (size == 0)
+			ForgetAllocation(ptr);
+		return new_ptr;
+	}
+	if (new_ptr != ptr) {
+		ForgetAllocation(ptr);
+		CountAllocation(new_ptr, size);
+	} else if (size > old_size) {
+		CountAllocation(new_ptr, size - old_size);
+	}
+	return new_ptr;
+}
+
+extern "C" void* memalign(size_t alignment, size_t size)
+{
+	void* ptr = __libc_memalign(alignment, size);
+	CountAllocation(ptr, size);
+	return ptr;
+}
+
+extern "C" void* aligned_alloc(size_t alignment, size_t size)
+{
+	void* ptr = __libc_memalign(alignment, size);
+	CountAllocation(ptr, size);
+	return ptr;
+}
+
+extern "C" int posix_memalign(void** memptr, size_t alignment, size_t size)
+{
+	if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0)
+		return EINVAL;
+
+	void* ptr = __libc_memalign(alignment, size);
+	if (ptr == nullptr)
+		return ENOMEM;
+
+	*memptr = ptr;
+	CountAllocation(ptr, size);
+	return 0;
+}
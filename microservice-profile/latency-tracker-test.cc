@@ -0,0 +1,208 @@
+/*
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * The latency tracker's ticker sleeps until the next deadline of its timing
+ * wheels: TimingWheel::NextExpiry must never be later than a deadline, and
+ * the ticker must report slow spans on time while waking up rarely. Run by
+ * "make check".
+ */
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "microservice-profile-base/get_monotonic_time.h"
+#include "microservice-profile-base/latency_tracker.h"
+#include "microservice-profile-base/timing_wheel.h"
+
+using microservice_profile::LatencyTracker;
+using microservice_profile::OpenSpan;
+using microservice_profile::SpanAlert;
+using microservice_profile::TimingWheel;
+using microservice_profile::WheelTimer;
+
+static const int kTimers = 1000;
+
+/* Loose bounds: they catch a ticker that wakes every tick, not noise */
+static const uint64_t kThresholdNs = 20 * 1000 * 1000;
+static const uint64_t kMaxLateNs = 20 * 1000 * 1000;
+static const uint64_t kIdleNs = 500 * 1000 * 1000;
+static const uint64_t kMaxIdleWakeups = 100;
+
+static int failures = 0;
+
+static void Check(bool condition, const char* what)
+{
+	if (!condition) {
+		fprintf(stderr, "FAIL: %s\n", what);
+		failures++;
+	}
+}
+
+struct TestTimer {
+	WheelTimer timer;	/* First: timers are converted back */
+	uint64_t fired = 0;
+};
+
+/*
+ * Jumps from one NextExpiry to the next, the way the ticker sleeps: every
+ * timer must fire at its deadline, on the last tick of a jump, never on a
+ * tick the jump went past.
+ */
+static void CheckNextExpiry()
+{
+	TimingWheel wheel(0);
+	std::vector<TestTimer> timers(kTimers);
+	uint64_t state = 42;
+	uint64_t last = 0;
+	int wakeups = 0;
+	bool on_time = true;
+
+	Check(wheel.NextExpiry() == UINT64_MAX, "an empty wheel has no expiry");
+
+	for (auto& t : timers) {
+		state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+		/* Deadlines spread over the four levels */
+		uint64_t expires = 1 + ((state >> 33) >> ((state >> 20) % 32));
+		wheel.Arm(&t.timer, expires);
+		last = std::max(last, expires);
+	}
+
+	WheelTimer first;
+	TimingWheel exact(0);
+	exact.Arm(&first, 200);
+	Check(exact.NextExpiry() == 200, "the first level's expiry is exact");
+	exact.Disarm(&first);
+
+	while (wheel.NextExpiry() != UINT64_MAX) {
+		uint64_t next = wheel.NextExpiry();
+
+		Check(next > wheel.now(), "the next expiry is in the future");
+		wakeups++;
+		wheel.Advance(next, [&](WheelTimer* timer) {
+			TestTimer* t = reinterpret_cast<TestTimer*>(timer);
+			t->fired = wheel.now();
+			if (wheel.now() != next || t->timer.expires != next)
+				on_time = false;
+		});
+		if (wakeups > kTimers * TimingWheel::kLevels)
+			break;
+	}
+
+	Check(on_time, "timers fire on the tick NextExpiry gave");
+	for (const auto& t : timers) {
+		if (t.fired != t.timer.expires) {
+			Check(false, "every timer fires at its deadline");
+			break;
+		}
+	}
+	printf("TimingWheel: %d wakeups for %d timers over %llu ticks\n",
+		wakeups, kTimers, (unsigned long long) last);
+	Check(wakeups <= kTimers * TimingWheel::kLevels,
+		"a few wakeups per timer at most");
+}
+
+/* Voluntary context switches of the threads other than the main one */
+static uint64_t CountOtherThreadSleeps()
+{
+	DIR* dir = opendir("/proc/self/task");
+	uint64_t sleeps = 0;
+	std::string main_tid = std::to_string(getpid());
+
+	if (dir == nullptr)
+		return 0;
+	while (struct dirent* entry = readdir(dir)) {
+		if (entry->d_name[0] == '.' || main_tid == entry->d_name)
+			continue;
+		std::string path = std::string("/proc/self/task/") +
+			entry->d_name + "/status";
+		FILE* status = fopen(path.c_str(), "r");
+		char line[256];
+		unsigned long long count;
+
+		if (status == nullptr)
+			continue;
+		while (fgets(line, sizeof(line), status) != nullptr) {
+			if (sscanf(line, "voluntary_ctxt_switches: %llu", &count) == 1)
+				sleeps += count;
+		}
+		fclose(status);
+	}
+	closedir(dir);
+	return sleeps;
+}
+
+static void CheckTicker()
+{
+	LatencyTracker::Options options;
+	std::atomic<uint64_t> elapsed(0);
+	std::atomic<int> alerts(0);
+	uint8_t trace_id[16] = {1};
+
+	options.threshold_ns = kThresholdNs;
+	LatencyTracker tracker(options, [&](SpanAlert alert, const OpenSpan& span) {
+		if (alert == SpanAlert::kSlow) {
+			elapsed = span.elapsed;
+			alerts++;
+		}
+	});
+	Check(tracker.Start(), "the ticker starts");
+
+	/* A span that ends in time is not reported */
+	tracker.OnSpanStart(1, trace_id, "fast", 4);
+	tracker.OnSpanEnd(1);
+
+	uint64_t start = GetMonotonicTime();
+	tracker.OnSpanStart(2, trace_id, "slow", 4);
+	while (alerts == 0 && GetMonotonicTime() - start < 10 * kThresholdNs)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	tracker.OnSpanEnd(2);
+
+	printf("LatencyTracker: slow span reported after %llu us\n",
+		(unsigned long long) elapsed / 1000);
+	Check(alerts == 1, "the slow span is reported once");
+	Check(elapsed >= kThresholdNs, "the slow span is not reported early");
+	Check(elapsed < kThresholdNs + kMaxLateNs,
+		"the slow span is reported on time");
+
+	/* With no span open, the ticker sleeps up to the threshold at a time */
+	uint64_t sleeps = CountOtherThreadSleeps();
+	std::this_thread::sleep_for(std::chrono::nanoseconds(kIdleNs));
+	sleeps = CountOtherThreadSleeps() - sleeps;
+
+	printf("LatencyTracker: %llu wakeups in %llu ms without spans\n",
+		(unsigned long long) sleeps,
+		(unsigned long long) kIdleNs / 1000000);
+	Check(sleeps < kMaxIdleWakeups, "the idle ticker does not wake every tick");
+}
+
+int main()
+{
+	CheckNextExpiry();
+	CheckTicker();
+
+	return failures == 0 ? 0 : 1;
+}
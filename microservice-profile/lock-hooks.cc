@@ -0,0 +1,243 @@
+/*
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+/*
+ * Lock interposers (MICROSERVICE_PROFILE_LOCKS=1): contended acquisitions of
+ * pthread mutexes and rwlocks, and condition waits, are recorded with the
+ * endpoint of the span active on the thread (see span_slot.h) in the lock
+ * profile. An uncontended acquisition only costs a trylock.
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include <cstring>
+
+#include "microservice-profile-base/get_monotonic_time.h"
+#include "microservice-profile-base/lock_profile.h"
+#include "microservice-profile-base/stacktrace.h"
+#include "microservice-profile-base/thread_filter.h"
+#include "span-names.h"
+
+using microservice_profile::LockKind;
+
+namespace
+{
+
+typedef int (*pthread_mutex_init_fn)(pthread_mutex_t*,
+	const pthread_mutexattr_t*);
+typedef int (*pthread_mutex_fn)(pthread_mutex_t*);
+typedef int (*pthread_rwlock_init_fn)(pthread_rwlock_t*,
+	const pthread_rwlockattr_t*);
+typedef int (*pthread_rwlock_fn)(pthread_rwlock_t*);
+typedef int (*pthread_cond_wait_fn)(pthread_cond_t*, pthread_mutex_t*);
+
+const size_t kMaxStackSize = 32;
+
+/* Set while a wait is recorded: the profile's own locking and the unwinder's
+ * go straight to libc. The span name is read without locking: the wait may
+ * be for a stripe of the name cache, which the thread then holds. */
+thread_local bool in_lock_hook = false;
+
+inline bool Profiled()
+{
+	return microservice_profile::LockProfilingEnabled() && !in_lock_hook;
+}
+
+/* `caller` names the lock when its initialization was not seen */
+void RecordWait(const void* lock, LockKind kind, void* caller,
+	uint64_t start, bool span_only)
+{
+	uint64_t wait_ns = GetMonotonicTime() - start;
+	char endpoint[microservice_profile::SpanNameCache::kNameSize];
+	size_t endpoint_size;
+	void* stack[kMaxStackSize];
+	size_t stack_size = 0;
+
+	if (microservice_profile::IsProfilerThread())
+		return;
+
+	in_lock_hook = true;
+	endpoint_size = microservice_profile::ThreadSpanName(endpoint,
+		sizeof(endpoint));
+	if (endpoint_size == 0) {
+		if (span_only) {
+			in_lock_hook = false;
+			return;
+		}
+		endpoint_size = snprintf(endpoint, sizeof(endpoint), "(none)");
+	}
+
+	if (microservice_profile::SampleLockStack())
+		stack_size = microservice_profile::StackTrace(stack, kMaxStackSize,
+			nullptr);
+
+	microservice_profile::GetLockProfile().RecordWait(lock, kind, wait_ns,
+		reinterpret_cast<uintptr_t>(caller), endpoint, endpoint_size, stack,
+		stack_size);
+	in_lock_hook = false;
+}
+
+void RecordCreation(const void* lock, void* site)
+{
+	in_lock_hook = true;
+	microservice_profile::GetLockProfile().RecordCreation(lock,
+		reinterpret_cast<uintptr_t>(site));
+	in_lock_hook = false;
+}
+
+void ForgetLock(const void* lock)
+{
+	in_lock_hook = true;
+	microservice_profile::GetLockProfile().ForgetLock(lock);
+	in_lock_hook = false;
+}
+
+}  // namespace
+
+extern "C" int pthread_mutex_init(pthread_mutex_t* mutex,
+	const pthread_mutexattr_t* attr)
+{
+	static pthread_mutex_init_fn real_pthread_mutex_init =
+		reinterpret_cast<pthread_mutex_init_fn>(
+			dlsym(RTLD_NEXT, "pthread_mutex_init"));
+
+	int ret = real_pthread_mutex_init(mutex, attr);
+	if (ret == 0 && Profiled())
+		RecordCreation(mutex, __builtin_return_address(0));
+	return ret;
+}
+
+extern "C" int pthread_mutex_destroy(pthread_mutex_t* mutex)
+{
+	static pthread_mutex_fn real_pthread_mutex_destroy =
+		reinterpret_cast<pthread_mutex_fn>(
+			dlsym(RTLD_NEXT, "pthread_mutex_destroy"));
+
+	if (Profiled())
+		ForgetLock(mutex);
+	return real_pthread_mutex_destroy(mutex);
+}
+
+extern "C" int pthread_mutex_lock(pthread_mutex_t* mutex)
+{
+	static pthread_mutex_fn real_pthread_mutex_lock =
+		reinterpret_cast<pthread_mutex_fn>(
+			dlsym(RTLD_NEXT, "pthread_mutex_lock"));
+
+	if (!Profiled())
+		return real_pthread_mutex_lock(mutex);
+
+	int ret = pthread_mutex_trylock(mutex);
+	if (ret != EBUSY)
+		return ret;
+
+	uint64_t start = GetMonotonicTime();
+	ret = real_pthread_mutex_lock(mutex);
+	RecordWait(mutex, microservice_profile::kLockMutex,
+		__builtin_return_address(0), start, false);
+	return ret;
+}
+
+extern "C" int pthread_rwlock_init(pthread_rwlock_t* rwlock,
+	const pthread_rwlockattr_t* attr)
+{
+	static pthread_rwlock_init_fn real_pthread_rwlock_init =
+		reinterpret_cast<pthread_rwlock_init_fn>(
+			dlsym(RTLD_NEXT, "pthread_rwlock_init"));
+
+	int ret = real_pthread_rwlock_init(rwlock, attr);
+	if (ret == 0 && Profiled())
+		RecordCreation(rwlock, __builtin_return_address(0));
+	return ret;
+}
+
+extern "C" int pthread_rwlock_destroy(pthread_rwlock_t* rwlock)
+{
+	static pthread_rwlock_fn real_pthread_rwlock_destroy =
+		reinterpret_cast<pthread_rwlock_fn>(
+			dlsym(RTLD_NEXT, "pthread_rwlock_destroy"));
+
+	if (Profiled())
+		ForgetLock(rwlock);
+	return real_pthread_rwlock_destroy(rwlock);
+}
+
+extern "C" int pthread_rwlock_rdlock(pthread_rwlock_t* rwlock)
+{
+	static pthread_rwlock_fn real_pthread_rwlock_rdlock =
+		reinterpret_cast<pthread_rwlock_fn>(
+			dlsym(RTLD_NEXT, "pthread_rwlock_rdlock"));
+
+	if (!Profiled())
+		return real_pthread_rwlock_rdlock(rwlock);
+
+	int ret = pthread_rwlock_tryrdlock(rwlock);
+	if (ret != EBUSY)
+		return ret;
+
+	uint64_t start = GetMonotonicTime();
+	ret = real_pthread_rwlock_rdlock(rwlock);
+	RecordWait(rwlock, microservice_profile::kLockRead,
+		__builtin_return_address(0), start, false);
+	return ret;
+}
+
+extern "C" int pthread_rwlock_wrlock(pthread_rwlock_t* rwlock)
+{
+	static pthread_rwlock_fn real_pthread_rwlock_wrlock =
+		reinterpret_cast<pthread_rwlock_fn>(
+			dlsym(RTLD_NEXT, "pthread_rwlock_wrlock"));
+
+	if (!Profiled())
+		return real_pthread_rwlock_wrlock(rwlock);
+
+	int ret = pthread_rwlock_trywrlock(rwlock);
+	if (ret != EBUSY)
+		return ret;
+
+	uint64_t start = GetMonotonicTime();
+	ret = real_pthread_rwlock_wrlock(rwlock);
+	RecordWait(rwlock, microservice_profile::kLockWrite,
+		__builtin_return_address(0), start, false);
+	return ret;
+}
+
+/*
+ * Condition waits are only recorded within a span: idle workers wait on
+ * conditions all the time.
+ */
+extern "C" int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex)
+{
+	/* The unversioned lookup may find the pre-2.3.2 implementation */
+	static pthread_cond_wait_fn real_pthread_cond_wait = [] {
+		void* fn = dlvsym(RTLD_NEXT, "pthread_cond_wait", "GLIBC_2.3.2");
+		if (fn == nullptr)
+			fn = dlsym(RTLD_NEXT, "pthread_cond_wait");
+		return reinterpret_cast<pthread_cond_wait_fn>(fn);
+	}();
+
+	if (!Profiled())
+		return real_pthread_cond_wait(cond, mutex);
+
+	uint64_t start = GetMonotonicTime();
+	int ret = real_pthread_cond_wait(cond, mutex);
+	RecordWait(cond, microservice_profile::kLockCondition,
+		__builtin_return_address(0), start, true);
+	return ret;
+}
@@ -0,0 +1,135 @@
+/*
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "microservice-profile-base/perf_counters.h"
+#include "microservice-profile-base/schedstat.h"
+#include "microservice-profile-base/thread_filter.h"
+#include "perf-span-processor.h"
+
+OPENTELEMETRY_BEGIN_NAMESPACE
+namespace sdk
+{
+namespace trace
+{
+
+namespace
+{
+
+/* Spans open at once on a thread; the oldest are forgotten beyond */
+const unsigned kMaxOpenSpans = 64;
+
+struct OpenSpanCounters {
+	const Recordable* span;
+	microservice_profile::PerfSnapshot start;
+	bool sched_valid;
+	microservice_profile::SchedSnapshot sched_start;
+};
+
+thread_local OpenSpanCounters open_spans[kMaxOpenSpans];
+thread_local unsigned next_open_span = 0;
+
+}  // namespace
+
+void PerfCounterSpanProcessor::OnStart(Recordable& span,
+	const opentelemetry::trace::SpanContext& parent_context) noexcept
+{
+	/* The spans made by the profiler's threads are not the application's */
+	if (!microservice_profile::IsProfilerThread()) {
+		OpenSpanCounters& slot = open_spans[next_open_span++ % kMaxOpenSpans];
+		slot.start.valid = 0;
+		bool read = microservice_profile::PerfCountersEnabled() &&
+			microservice_profile::ReadPerfCounters(&slot.start);
+		slot.sched_valid = microservice_profile::SchedStatsEnabled() &&
+			microservice_profile::ReadSchedStats(&slot.sched_start);
+		slot.span = read || slot.sched_valid ? &span : nullptr;
+	}
+
+	processor->OnStart(span, parent_context);
+}
+
+void PerfCounterSpanProcessor::OnEnd(std::unique_ptr<Recordable>&& span) noexcept
+{
+	microservice_profile::PerfSnapshot end;
+	microservice_profile::SchedSnapshot sched_end;
+
+	/* Most recent first: spans usually end in the reverse order */
+	for (unsigned i = 1; i <= kMaxOpenSpans; i++) {
+		OpenSpanCounters& slot =
+			open_spans[(next_open_span - i) % kMaxOpenSpans];
+		if (slot.span != span.get())
+			continue;
+
+		slot.span = nullptr;
+		end.valid = 0;
+		if (slot.start.valid != 0 &&
+		    microservice_profile::ReadPerfCounters(&end)) {
+			uint32_t valid = slot.start.valid & end.valid;
+			for (int c = 0; c < microservice_profile::kPerfCounters; c++) {
+				if (valid & (1u << c))
+					span->SetAttribute(microservice_profile::PerfCounterName(
+						(microservice_profile::PerfCounter) c),
+						(int64_t) (end.values[c] - slot.start.values[c]));
+			}
+		}
+		if (slot.sched_valid &&
+		    microservice_profile::ReadSchedStats(&sched_end)) {
+			span->SetAttribute("sched.run_ns", (int64_t)
+				(sched_end.run_ns - slot.sched_start.run_ns));
+			span->SetAttribute("sched.wait_ns", (int64_t)
+				(sched_end.wait_ns - slot.sched_start.wait_ns));
+			span->SetAttribute("sched.timeslices", (int64_t)
+				(sched_end.timeslices - slot.sched_start.timeslices));
+		}
+		break;
+	}
+
+	processor->OnEnd(std::move(span));
+}
+
+std::unique_ptr<SpanProcessor> MaybeCountPerfEvents(
+	std::unique_ptr<SpanProcessor> processor)
+{
+	if (processor == nullptr)
+		return processor;
+
+	bool perf = microservice_profile::StartPerfCounters();
+	bool sched = microservice_profile::StartSchedStats();
+	if (!perf && !sched)
+		return processor;
+	return std::unique_ptr<SpanProcessor>(
+		new PerfCounterSpanProcessor(std::move(processor)));
+}
+
+void WarnPerfEventsNotCounted()
+{
+	const char* perf = getenv("MICROSERVICE_PROFILE_PERF_COUNTERS");
+	const char* sched = getenv("MICROSERVICE_PROFILE_SCHEDSTAT");
+
+	if ((perf != nullptr && strcmp(perf, "1") == 0) ||
+	    (sched != nullptr && strcmp(sched, "1") == 0))
+		std::cerr << "Microservice-profiler: the processors of a tracer "
+		          << "context are not decorated: no perf.* or sched.* "
+		          << "span attributes" << std::endl;
+}
+
+}  // namespace trace
+}  // namespace sdk
+OPENTELEMETRY_END_NAMESPACE
@@ -0,0 +1,93 @@
+/*
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_PERF_SPAN_PROCESSOR_H_
+#define MICROSERVICE_PROFILE_PERF_SPAN_PROCESSOR_H_
+
+#include <memory>
+
+#include <opentelemetry/sdk/trace/processor.h>
+
+OPENTELEMETRY_BEGIN_NAMESPACE
+namespace sdk
+{
+namespace trace
+{
+
+/*
+ * Decorates an exporting processor: snapshots the performance counters and
+ * the scheduler statistics of the thread (see
+ * microservice-profile-base/perf_counters.h and schedstat.h) when a span
+ * starts and ends, and adds the deltas to the span as "perf.*" and
+ * "sched.*" attributes before passing it on. Spans ending on another thread
+ * than the one they started on get none: per-thread counters would not
+ * describe them.
+ *
+ * The attributes must be set on the recordable the exporter reads, hence a
+ * decorator rather than another processor next to it.
+ */
+class PerfCounterSpanProcessor : public SpanProcessor
+{
+public:
+	explicit PerfCounterSpanProcessor(std::unique_ptr<SpanProcessor> processor) noexcept
+		: processor(std::move(processor)) {}
+
+	std::unique_ptr<Recordable> MakeRecordable() noexcept override
+	{
+		return processor->MakeRecordable();
+	}
+
+	void OnStart(Recordable& span,
+		const opentelemetry::trace::SpanContext& parent_context) noexcept override;
+
+	void OnEnd(std::unique_ptr<Recordable>&& span) noexcept override;
+
+	bool ForceFlush(std::chrono::microseconds timeout) noexcept override
+	{
+		return processor->ForceFlush(timeout);
+	}
+
+	bool Shutdown(std::chrono::microseconds timeout =
+		(std::chrono::microseconds::max)()) noexcept override
+	{
+		return processor->Shutdown(timeout);
+	}
+
+private:
+	std::unique_ptr<SpanProcessor> processor;
+};
+
+/*
+ * Decorates the processor with PerfCounterSpanProcessor when
+ * MICROSERVICE_PROFILE_PERF_COUNTERS=1 and the counters can be opened, or
+ * MICROSERVICE_PROFILE_SCHEDSTAT=1 and the statistics can be read; returns
+ * it unchanged otherwise.
+ */
+std::unique_ptr<SpanProcessor> MaybeCountPerfEvents(
+	std::unique_ptr<SpanProcessor> processor);
+
+/*
+ * For tracer providers built on a TracerContext, whose processors cannot be
+ * decorated: says so when the counters or the scheduler statistics were
+ * asked for, since their attributes will be missing.
+ */
+void WarnPerfEventsNotCounted();
+
+}  // namespace trace
+}  // namespace sdk
+OPENTELEMETRY_END_NAMESPACE
+
+#endif  // MICROSERVICE_PROFILE_PERF_SPAN_PROCESSOR_H_
@@ -1,10 +1,12 @@
 #include <fstream>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <cstdint>
 #include <map>
 #include <atomic>
 #include <chrono>
+#include <new>
 #include <thread>
 #include <unistd.h>
 
@@ -34,108 +36,68 @@ namespace sdk
 namespace trace
 {
 
-/**
- * This span processor intercepts span begin/end and send corresponding events through
- * the interface of latency-tracker: /proc/latency-tracker-begin and /proc/latency-tracker-end
- *
- * OnEnd and ForceFlush are no-ops.
- *
- */
-ProfileSpanProcessor::ProfileSpanProcessor() noexcept
-{
-
-	begin_file_fd = fopen(begin_file_name, "w");
-	end_file_fd = fopen(end_file_name, "w");
-
-	if(begin_file_fd == nullptr || end_file_fd == nullptr) {
-		std::cerr << "Problem opening latency tracker begin/end files"
-				<< std::endl;
-		return;
-	}
+/* Enough for the spans of a few batches in flight */
+#define SPAN_DATA_POOL_DEPOT_BLOCKS 8192
 
-	setbuf(begin_file_fd, nullptr);
-	setbuf(end_file_fd, nullptr);
+microservice_profile::BlockPool& ProfileRecordable::Pool()
+{
+	static microservice_profile::BlockPool* pool =
+		new microservice_profile::BlockPool(sizeof(ProfileRecordable),
+			SPAN_DATA_POOL_DEPOT_BLOCKS, microservice_profile::kMemorySpanPools);
+	return *pool;
 }
 
-std::unique_ptr<Recordable> ProfileSpanProcessor::MakeRecordable() noexcept
+void* ProfileRecordable::operator new(size_t size,
+	const std::nothrow_t&) noexcept
 {
-	return std::unique_ptr<Recordable>(new SpanData);
+	return Pool().Allocate();
 }
 
-void ProfileSpanProcessor::OnStart(Recordable & record,
-		const trace_api::SpanContext & parent_context) noexcept
+void ProfileRecordable::operator delete(void* block) noexcept
 {
-	char span_id_str[trace_api::SpanId::kSize * 2 + 1];
-	char trace_id_str[trace_api::TraceId::kSize * 2 + 1];
-
-	/* Ignore syscalls transformed into spans start with "__" */
-	auto spanData = static_cast<sdk::trace::SpanData *>(&record);
-	if(spanData->GetName().substr(0, 2) == "__")
-		return;
-
-	/* Write the span id in the /proc/latency-begin-file */
-	uint64_t start_ts = spanData->GetStartTime().time_since_epoch().count();
-	auto spanId = spanData->GetSpanId();
-
-	char  (&c)[16] = *static_cast<char (*)[16]>(static_cast<void*>(span_id_str));
-	spanId.ToLowerBase16(c);
-	span_id_str[16] = '\0';
-
-	auto traceId = spanData->GetTraceId();
-	char  (&d)[32] = *static_cast<char (*)[32]>(static_cast<void*>(trace_id_str));
-	traceId.ToLowerBase16(d);
-	trace_id_str[32] = '\0';
-
-	if(begin_file_fd != (void*) 0) {
-		//write(begin_file_fd, msg);
-		fprintf(begin_file_fd, "%lx:%s:%s\n", start_ts, span_id_str, trace_id_str);
-		//fprintf(begin_file_fd, "%s\n", span_id_str);
-		//fflush(begin_file_fd);
-	}
+	Pool().Free(block);
 }
 
-void ProfileSpanProcessor::OnEnd(std::unique_ptr<Recordable> &&record) noexcept
+void ProfileRecordable::operator delete(void* block,
+	const std::nothrow_t&) noexcept
 {
-
-	char span_id_str[trace_api::SpanId::kSize * 2 + 1];
-
-	/* ignore syscalls transformed into spans as their names start with "__" */
-	auto spanData = static_cast<sdk::trace::SpanData *>(record.get());
-	if(spanData->GetName().substr(0, 2) == "__")
-		return;
-
-	/* Write the span id in the /proc/latency-end-file */
-	auto spanId = spanData->GetSpanId();
-	spanId.ToLowerBase16(nostd::span<char, 16>(reinterpret_cast<char *>(span_id_str), 16));
-	span_id_str[16] = '\0';
-
-	if (end_file_fd != (void*) 0) {
-		//end_file_ostream.write(span_id_str, sizeof(span_id_str));
-		//end_file_ostream.flush();
-		fprintf(end_file_fd, "%s\n", span_id_str);
-		//fflush(end_file_fd);
-	}
+	Pool().Free(block);
 }
 
-bool ProfileSpanProcessor::ForceFlush(std::chrono::microseconds /* timeout */) noexcept
+namespace
 {
-	return true;
-}
 
-bool ProfileSpanProcessor::Shutdown(std::chrono::microseconds timeout) noexcept
+template <class Sink>
+std::unique_ptr<SpanProcessor> MakeWithClock(const char* clock)
 {
-	stop_thread = true;
-	std::cout << "shutting down profiling span processor " << std::endl;
-	return true;
+	if (clock && strcmp(clock, "monotonic") == 0)
+		return std::unique_ptr<SpanProcessor>(
+			new BasicProfileSpanProcessor<Sink, SkipSyscallSpans, MonotonicClock>());
+	return std::unique_ptr<SpanProcessor>(
+		new BasicProfileSpanProcessor<Sink, SkipSyscallSpans, SpanStartClock>());
 }
 
-ProfileSpanProcessor::~ProfileSpanProcessor()
-{
-	if(begin_file_fd)
-		fclose(begin_file_fd);
+}  // namespace
 
-	if(end_file_fd)
-		fclose(end_file_fd);
+std::unique_ptr<SpanProcessor> MakeProfileSpanProcessor()
+{
+	const char* sink = getenv("MICROSERVICE_PROFILE_SINK");
+	const char* clock = getenv("MICROSERVICE_PROFILE_CLOCK");
+
+	if (sink == nullptr || strcmp(sink, "procfs") == 0)
+		return MakeWithClock<microservice_profile::ProcfsTextSink>(clock);
+	if (strcmp(sink, "binary") == 0)
+		return MakeWithClock<microservice_profile::BinaryBatchSink>(clock);
+	if (strcmp(sink, "shm") == 0)
+		return MakeWithClock<microservice_profile::SharedMemorySink>(clock);
+	if (strcmp(sink, "ring") == 0)
+		return MakeWithClock<microservice_profile::InMemoryRingSink<>>(clock);
+	if (strcmp(sink, "null") == 0)
+		return MakeWithClock<microservice_profile::NullSink>(clock);
+
+	std::cerr << "Unknown MICROSERVICE_PROFILE_SINK " << sink
+	          << ", using procfs" << std::endl;
+	return MakeWithClock<microservice_profile::ProcfsTextSink>(clock);
 }
 
 }  // namespace trace
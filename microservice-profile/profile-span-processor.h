@@ -3,16 +3,29 @@
 
 #pragma once
 
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <string>
 #include <map>
+#include <memory>
+#include <new>
 
 #include <opentelemetry/sdk/trace/processor.h>
 #include <opentelemetry/sdk/trace/span_data.h>
 #include <opentelemetry/trace/span_context.h>
 #include <opentelemetry/trace/tracer.h>
 
+#include "microservice-profile-base/block_pool.h"
+#include "microservice-profile-base/fork_restart.h"
+#include "microservice-profile-base/get_monotonic_time.h"
+#include "microservice-profile-base/overhead_governor.h"
+#include "microservice-profile-base/thread_filter.h"
+#include "profiler.h"
+#include "span-observer.h"
+#include "span-sinks.h"
+#include "span-trigger.h"
+
 
 extern std::map<std::string, opentelemetry::trace::SpanContext*> spanContextMap;
 extern std::shared_ptr<trace_api::TracerProvider> global_provider;
@@ -23,43 +36,348 @@ namespace sdk
 {
 namespace trace
 {
-/**
- * This span processor intercepts span begin/end and send corresponding events through
- * the interface of latency-tracker: /proc/latency-tracker-begin and /proc/latency-tracker-end
- *
- * OnEnd and ForceFlush are no-ops.
+
+/*
+ * The recordable of the profiling processor, allocated from a thread-caching
+ * pool: spans are made and released at a high rate, by the relay readers
+ * especially, and the allocator is shared with the application.
  *
- * All calls to the configured SpanExporter are synchronized using a
- * spin-lock on an atomic_flag.
+ * The processor only reads the span's identity, name, status and times; the
+ * exporters have recordables of their own. Only those are stored, inline:
+ * attributes, events, links and the resource are dropped. Names longer than
+ * the inline buffer, never those of the "__<syscall>" spans, go to the heap.
+ */
+class ProfileRecordable final : public Recordable
+{
+public:
+	static constexpr size_t kInlineNameSize = 48;
+
+	/* nullptr when out of memory: MakeRecordable then hands out a
+	 * DroppedRecordable */
+	static void* operator new(size_t size, const std::nothrow_t&) noexcept;
+	static void operator delete(void* block) noexcept;
+	static void operator delete(void* block, const std::nothrow_t&) noexcept;
+
+	/* Created before the profiler, see BlockPool */
+	static microservice_profile::BlockPool& Pool();
+
+	const opentelemetry::trace::TraceId& GetTraceId() const noexcept { return trace_id; }
+	const opentelemetry::trace::SpanId& GetSpanId() const noexcept { return span_id; }
+
+	nostd::string_view GetName() const noexcept
+	{
+		return nostd::string_view(long_name ? long_name.get() : name, name_size);
+	}
+
+	opentelemetry::trace::StatusCode GetStatus() const noexcept { return status; }
+	opentelemetry::common::SystemTimestamp GetStartTime() const noexcept { return start_time; }
+	std::chrono::nanoseconds GetDuration() const noexcept { return duration; }
+
+	void SetIdentity(const opentelemetry::trace::SpanContext& span_context,
+		opentelemetry::trace::SpanId /* parent_span_id */) noexcept override
+	{
+		trace_id = span_context.trace_id();
+		span_id = span_context.span_id();
+	}
+
+	void SetAttribute(nostd::string_view /* key */,
+		const opentelemetry::common::AttributeValue& /* value */) noexcept override {}
+
+	void AddEvent(nostd::string_view /* name */,
+		opentelemetry::common::SystemTimestamp /* timestamp */,
+		const opentelemetry::common::KeyValueIterable& /* attributes */) noexcept override {}
+
+	void AddLink(const opentelemetry::trace::SpanContext& /* span_context */,
+		const opentelemetry::common::KeyValueIterable& /* attributes */) noexcept override {}
+
+	void SetStatus(opentelemetry::trace::StatusCode code,
+		nostd::string_view /* description */) noexcept override
+	{
+		status = code;
+	}
+
+	void SetName(nostd::string_view new_name) noexcept override
+	{
+		long_name.reset();
+		name_size = new_name.size();
+		if (name_size <= sizeof(name)) {
+			memcpy(name, new_name.data(), name_size);
+			return;
+		}
+		long_name.reset(new (std::nothrow) char[name_size]);
+		if (long_name)
+			memcpy(long_name.get(), new_name.data(), name_size);
+		else
+			name_size = 0;
+	}
+
+	void SetSpanKind(opentelemetry::trace::SpanKind /* span_kind */) noexcept override {}
+
+	void SetResource(const opentelemetry::sdk::resource::Resource& /* resource */)
+		noexcept override {}
+
+	void SetStartTime(opentelemetry::common::SystemTimestamp start) noexcept override
+	{
+		start_time = start;
+	}
+
+	void SetDuration(std::chrono::nanoseconds span_duration) noexcept override
+	{
+		duration = span_duration;
+	}
+
+	void SetInstrumentationScope(const InstrumentationScope& /* scope */)
+		noexcept override {}
+
+	/* Whether the start went to the sink: the end goes too, whatever the
+	 * overhead governor decided in between */
+	void SetReported(bool value) noexcept { reported = value; }
+	bool IsReported() const noexcept { return reported; }
+
+	/* Part of a request selected for deep profiling (see span-trigger.h) */
+	void SetTriggered(bool value) noexcept { triggered = value; }
+	bool IsTriggered() const noexcept { return triggered; }
+
+private:
+	opentelemetry::trace::TraceId trace_id;
+	opentelemetry::trace::SpanId span_id;
+	opentelemetry::common::SystemTimestamp start_time;
+	std::chrono::nanoseconds duration{0};
+	opentelemetry::trace::StatusCode status = opentelemetry::trace::StatusCode::kUnset;
+	size_t name_size = 0;
+	bool reported = false;
+	bool triggered = false;
+	char name[kInlineNameSize];
+	std::unique_ptr<char[]> long_name;
+};
+
+/*
+ * Stands for a span whose ProfileRecordable could not be allocated: the span
+ * goes on unprofiled rather than the application terminating.
+ */
+class DroppedRecordable final : public Recordable
+{
+public:
+	void SetIdentity(const opentelemetry::trace::SpanContext&,
+		opentelemetry::trace::SpanId) noexcept override {}
+	void SetAttribute(nostd::string_view,
+		const opentelemetry::common::AttributeValue&) noexcept override {}
+	void AddEvent(nostd::string_view, opentelemetry::common::SystemTimestamp,
+		const opentelemetry::common::KeyValueIterable&) noexcept override {}
+	void AddLink(const opentelemetry::trace::SpanContext&,
+		const opentelemetry::common::KeyValueIterable&) noexcept override {}
+	void SetStatus(opentelemetry::trace::StatusCode,
+		nostd::string_view) noexcept override {}
+	void SetName(nostd::string_view) noexcept override {}
+	void SetSpanKind(opentelemetry::trace::SpanKind) noexcept override {}
+	void SetResource(const opentelemetry::sdk::resource::Resource&)
+		noexcept override {}
+	void SetStartTime(opentelemetry::common::SystemTimestamp) noexcept override {}
+	void SetDuration(std::chrono::nanoseconds) noexcept override {}
+	void SetInstrumentationScope(const InstrumentationScope&)
+		noexcept override {}
+};
+
+/*
+ * Filter policies: which spans are reported to the sink.
+ */
+
+/* Syscalls turned into spans (names starting with "__") are never reported */
+struct SkipSyscallSpans
+{
+	static bool Accept(const ProfileRecordable& span) noexcept
+	{
+		nostd::string_view name = span.GetName();
+		return !(name.size() >= 2 && name[0] == '_' && name[1] == '_');
+	}
+};
+
+struct AcceptAllSpans
+{
+	static bool Accept(const ProfileRecordable&) noexcept { return true; }
+};
+
+/*
+ * Timestamp policies: the time reported for span begin/end events.
  */
 
+/* The span's own (system clock) start time, and start + duration at the end */
+struct SpanStartClock
+{
+	static uint64_t Start(const ProfileRecordable& span) noexcept
+	{
+		return span.GetStartTime().time_since_epoch().count();
+	}
+
+	static uint64_t End(const ProfileRecordable& span) noexcept
+	{
+		return Start(span) + span.GetDuration().count();
+	}
+};
 
-class ProfileSpanProcessor : public SpanProcessor
+/* CLOCK_MONOTONIC read when the hook runs */
+struct MonotonicClock
+{
+	static uint64_t Start(const ProfileRecordable&) noexcept { return GetMonotonicTime(); }
+	static uint64_t End(const ProfileRecordable&) noexcept { return GetMonotonicTime(); }
+};
+
+/**
+ * This span processor intercepts span begin/end and reports them to a sink,
+ * by default the interface of latency-tracker: /proc/latency-tracker-begin
+ * and /proc/latency-tracker-end
+ *
+ * Sink, Filter and Clock are compile-time policies (see span-sinks.h and
+ * above) so that each hook is fully inlined for a given configuration. The
+ * spans accepted by the filter are also passed to the span observers (see
+ * span-observer.h), which work without the kernel module. The overhead
+ * governor may keep only a share of the traces from the sink, and a trigger
+ * (see span-trigger.h) only the traces carrying it; the observers see them
+ * all.
+ */
+template <class Sink, class Filter = SkipSyscallSpans, class Clock = SpanStartClock>
+class BasicProfileSpanProcessor : public SpanProcessor
 {
 public:
-	explicit ProfileSpanProcessor() noexcept;
+	explicit BasicProfileSpanProcessor() noexcept
+	{
+		ProfileRecordable::Pool();
+
+		/* The first tracer provider starts the profiler. Without it, the
+		 * sink stays closed. */
+		if (!Sink::kNeedsModule || microservice_profile::EnsureProfilerStarted())
+			enabled = sink.Open();
 
-	std::unique_ptr<Recordable> MakeRecordable() noexcept override;
+		/* After the profiler, which may register its own observers */
+		microservice_profile::StartSpanObservers();
+		observed = microservice_profile::HasSpanObservers();
+
+		/* With neither a sink nor observers, every hook returns right away */
+		active = enabled || observed;
+
+		trigger = microservice_profile::SpanTrigger::Get();
+	}
+
+	std::unique_ptr<Recordable> MakeRecordable() noexcept override
+	{
+		ProfileRecordable* span = new (std::nothrow) ProfileRecordable;
+		if (span != nullptr)
+			return std::unique_ptr<Recordable>(span);
+		return std::unique_ptr<Recordable>(new (std::nothrow) DroppedRecordable);
+	}
 
 	void OnStart(Recordable & record, const opentelemetry::trace::SpanContext&
-		parent_context) noexcept override;
+		parent_context) noexcept override
+	{
+		if (!active)
+			return;
+
+		microservice_profile::HotPathTimer timer;
 
-	void OnEnd(std::unique_ptr<Recordable> &&record) noexcept override;
+		/* A forked child registers and starts its threads on its first
+		 * span */
+		microservice_profile::MaybeRestartAfterFork();
 
-	bool ForceFlush(std::chrono::microseconds /* timeout */) noexcept override;
+		/* Pick up thread filter changes made since this thread last checked */
+		microservice_profile::MaybeApplyThreadFilter();
 
-  	bool Shutdown(std::chrono::microseconds timeout =
-		(std::chrono::microseconds::max)()) noexcept override;
+		/* A compare of the vtable: the class is final */
+		auto spanData = dynamic_cast<ProfileRecordable *>(&record);
+		if (spanData == nullptr || !Filter::Accept(*spanData))
+			return;
 
-	~ProfileSpanProcessor() override;
+		if (trigger != nullptr)
+			spanData->SetTriggered(trigger->Matches(parent_context));
+
+		if (observed)
+			microservice_profile::NotifySpanStart(MakeSpanInfo(*spanData, 0));
+
+		/* Triggered requests are profiled whatever the governor says */
+		if (enabled && (trigger != nullptr ? spanData->IsTriggered() :
+				microservice_profile::GovernorKeepsTrace(
+					spanData->GetTraceId().Id().data()))) {
+			spanData->SetReported(true);
+			sink.OnSpanStart(Clock::Start(*spanData), spanData->GetSpanId(),
+				spanData->GetTraceId());
+		}
+	}
+
+	void OnEnd(std::unique_ptr<Recordable> &&record) noexcept override
+	{
+		if (!active)
+			return;
+
+		microservice_profile::HotPathTimer timer;
+
+		auto spanData = dynamic_cast<ProfileRecordable *>(record.get());
+		if (spanData == nullptr || !Filter::Accept(*spanData))
+			return;
+
+		if (observed)
+			microservice_profile::NotifySpanEnd(
+				MakeSpanInfo(*spanData, spanData->GetDuration().count()));
+		if (spanData->IsReported())
+			sink.OnSpanEnd(Clock::End(*spanData), spanData->GetSpanId());
+	}
+
+	bool ForceFlush(std::chrono::microseconds /* timeout */) noexcept override
+	{
+		sink.Flush();
+		return true;
+	}
+
+  	bool Shutdown(std::chrono::microseconds /* timeout */ =
+		(std::chrono::microseconds::max)()) noexcept override
+	{
+		if (Sink::kNeedsModule)
+			microservice_profile::StopProfiler();
+		sink.Flush();
+		std::cout << "shutting down profiling span processor " << std::endl;
+		return true;
+	}
+
+	~BasicProfileSpanProcessor() override
+	{
+		sink.Close();
+	}
+
+	const Sink& GetSink() const noexcept { return sink; }
 
 private:
-	const char* begin_file_name = "/proc/latency-tracker-begin";
-	const char* end_file_name = "/proc/latency-tracker-end";
+	static microservice_profile::SpanInfo MakeSpanInfo(const ProfileRecordable& span,
+		uint64_t duration) noexcept
+	{
+		return {span.GetName(), span.GetSpanId(), span.GetTraceId(),
+			SpanStartClock::Start(span), duration,
+			span.GetStatus() == opentelemetry::trace::StatusCode::kError,
+			span.IsTriggered()};
+	}
+
+	Sink sink;
+
+	/* False when the profiler runs as a no-op */
+	bool enabled = false;
+
+	/* At least one span observer is registered */
+	bool observed = false;
+
+	/* enabled || observed */
+	bool active = false;
 
-	//std::fstream begin_file_ostream {}, end_file_ostream {};
-	FILE* begin_file_fd, *end_file_fd;
+	/* MICROSERVICE_PROFILE_TRIGGER, or nullptr to report every trace */
+	const microservice_profile::SpanTrigger* trigger = nullptr;
 };
+
+/* The configuration feeding the kernel latency tracker */
+using ProfileSpanProcessor = BasicProfileSpanProcessor<microservice_profile::ProcfsTextSink>;
+
+/*
+ * Build the processor instantiation selected by the environment:
+ * MICROSERVICE_PROFILE_SINK (procfs, binary, shm, ring or null; procfs by
+ * default) and MICROSERVICE_PROFILE_CLOCK (span or monotonic).
+ */
+std::unique_ptr<SpanProcessor> MakeProfileSpanProcessor();
+
 }  // namespace trace
 }  // namespace sdk
 OPENTELEMETRY_END_NAMESPACE
@@ -18,11 +18,19 @@
 #include <thread>
 #include <iostream>
 #include <atomic>
+#include <mutex>
+#include <vector>
+#include <algorithm>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <cerrno>
 #include <charconv>
 #include <cstring>
+#include <string>
+#include <system_error>
 #include <unistd.h>
 
 #include <microservice_profile.h>
@@ -32,11 +40,33 @@
 #include <opentelemetry/trace/context.h>
 #include <opentelemetry/trace/propagation/detail/hex.h>
 
+#include "microservice-profile-base/annotation_format.h"
+#include "microservice-profile-base/critical_path.h"
+#include "microservice-profile-base/flight_recorder.h"
+#include "microservice-profile-base/fork_restart.h"
+#include "microservice-profile-base/get_monotonic_time.h"
+#include "microservice-profile-base/memory_budget.h"
+#include "microservice-profile-base/node_client.h"
+#include "microservice-profile-base/overhead_governor.h"
+#include "microservice-profile-base/thread_filter.h"
 #include "profile-span-processor.h"
+#include "profiler.h"
+#include "span-context-storage.h"
+#include "span-differential.h"
+#include "span-names.h"
+#include "span-trigger.h"
+#include "tail-retention.h"
+
+extern "C" {
+#include "microservice-profile-base/module_abi.h"
+#include "microservice-profile-base/module_api.h"
+}
 
-#define SERVICE_NAME_MAX_SIZE 28
 #define SPAN_ID_MAX_SIZE 32
-#define SYSCALL_NAME_MAX_SIZE 16
+
+/* Relay data wakes the readers up; the timeout only bounds how long a
+ * missed wakeup can delay a record. */
+#define RELAY_POLL_TIMEOUT_MS 100
 
 
 namespace trace_api = opentelemetry::trace;
@@ -44,55 +74,209 @@ namespace nostd     = opentelemetry::nostd;
 namespace context   = opentelemetry::context;
 
 
-struct syscall_desc {
-	char name[SYSCALL_NAME_MAX_SIZE];
-	uint64_t start_system;
-	uint64_t start_steady;
-	uint64_t end_steady;
-};
-
 namespace microservice_profile
 {
 
+/*
+ * One relay channel (rchan-<pid>-<n>) and the thread draining it.
+ */
+struct RelayChannel {
+	int fd;
+	std::unique_ptr<std::thread> reader_thread;
+
+	/* Held while a record is read and injected. The fork handlers take it
+	 * so that a child never inherits a half-processed record or a lock
+	 * grabbed by the reader inside the SDK. */
+	std::mutex record_mutex;
+	struct syscall_desc syscalls[MAX_SYSCALLS_PER_RECORD];
+};
+
 class Profiler
 {
 public:
   	Profiler();
   	~Profiler();
 
+	bool Start();
+	void Stop();
+
 private:
-	int OpenRelayFile();
-	void StartReaderThreads(int fd);
-    void ReaderThread(int fd);
-	void ReadAnnotation(int relay_fd);
+	bool StartOnce();
+	int OpenRelayFiles();
+	void OpenCapture();
+	void CloseRelayFiles();
+	void StartReaderThreads();
+	void ReadAnnotation(RelayChannel* channel);
 	void InjectAnnotation(uint32_t nb_syscalls, char* header_buf,
 		struct syscall_desc *syscalls);
+	void MaterializeAnnotation(const uint8_t* trace_id_bytes,
+		const uint8_t* span_id_bytes, uint32_t nb_syscalls,
+		const struct syscall_desc *syscalls,
+		const CriticalPathBreakdown& breakdown);
+
+	static void PrepareFork();
+	static void ParentAfterFork();
+	static void ChildAfterFork();
+	static void RestartAfterFork();
 
 private:
-	std::unique_ptr<std::thread> reader_thread;
+	std::vector<std::unique_ptr<RelayChannel>> channels;
 	const char* app_dirname = "/sys/kernel/debug/latency/spans/default/channels";
 	//std::atomic<bool> stop_thread = false;
+
+	std::once_flag start_once;
+	bool active = false;
+
+	/* Wakes the reader threads up when they must exit */
+	int wake_fd = -1;
+
+	/* Local copy of the relay records (MICROSERVICE_PROFILE_CAPTURE) */
+	AnnotationWriter capture;
+	bool capture_only = false;
+
+	/* Syscalls as events of the kernel span rather than child spans
+	 * (MICROSERVICE_PROFILE_SYSCALL_DETAIL=events) */
+	bool syscall_events = false;
+
+	/* Tail-based retention of the records (MICROSERVICE_PROFILE_TAIL_RETENTION) */
+	TailRetention* retention = nullptr;
+
+	/* With a trigger (MICROSERVICE_PROFILE_TRIGGER), the module only
+	 * records the triggered requests: all of their records are kept */
+	const SpanTrigger* trigger = nullptr;
+
+	static Profiler* instance;
 };
 
+Profiler* Profiler::instance = nullptr;
+
+/*
+ * Split the time covered by the syscalls of a record between the syscall
+ * categories and user space.
+ */
+static CriticalPathBreakdown AnalyzeCriticalPath(uint32_t nb_syscalls,
+	const struct syscall_desc *syscalls)
+{
+	CriticalPathAnalyzer analyzer;
+
+	for (uint32_t i = 0; i < nb_syscalls; i++)
+		analyzer.AddSyscall(syscalls[i].name, SYSCALL_NAME_MAX_SIZE,
+			syscalls[i].start_steady, syscalls[i].end_steady);
+	return analyzer.breakdown();
+}
+
+/*
+ * Nothing happens at load time: the profiler starts on the first tracer
+ * provider creation or on an explicit InitMicroserviceProfiler() call.
+ */
 Profiler::Profiler()
 {
-	int fd;
+	instance = this;
+}
+
+bool Profiler::Start()
+{
+	std::call_once(start_once, [this] { active = StartOnce(); });
+	return active;
+}
+
+/*
+ * Register with the kernel module and start draining its relay channels.
+ * When the module is not there, the library stays a no-op: no thread is
+ * created and no file is kept open.
+ */
+bool Profiler::StartOnce()
+{
+	uint64_t start = GetMonotonicTime();
+
+	if (access(SPAN_LATENCY_TRACKER_PROC_PATH, W_OK) != 0) {
+		std::cerr << "Microservice-profiler: "
+		          << "kernel module not loaded, profiling disabled"
+		          << std::endl;
+		DisableThreadFilter();
+		return false;
+	}
 
     StartMicroserviceProfile();
-	fd = OpenRelayFile();
+	if (!microservice_profiler_module_is_registered()) {
+		DisableThreadFilter();
+		return false;
+	}
+
+	wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (wake_fd < 0 || OpenRelayFiles() <= 0) {
+		std::cerr << "Microservice-profiler: profiling disabled" << std::endl;
+		if (wake_fd >= 0)
+			close(wake_fd);
+		wake_fd = -1;
+		microservice_profiler_module_unregister();
+		DisableThreadFilter();
+		return false;
+	}
 
-	if(fd > 0) {
-		StartReaderThreads(fd);
-	} else {
-		std::cerr<< "Exiting .." <<std::endl;
-		exit(-1);
+	/* Before the readers start: they only look at them once */
+	const char* detail = getenv("MICROSERVICE_PROFILE_SYSCALL_DETAIL");
+	syscall_events = detail != nullptr && strcmp(detail, "events") == 0;
+	trigger = SpanTrigger::Get();
+	retention = TailRetention::Create([this](const uint8_t* trace_id,
+			const uint8_t* span_id, const char*, size_t,
+			uint32_t nb_syscalls, const struct syscall_desc* syscalls) {
+		MaterializeAnnotation(trace_id, span_id, nb_syscalls, syscalls,
+			AnalyzeCriticalPath(nb_syscalls, syscalls));
+	});
+	if (retention != nullptr)
+		RegisterSpanObserver(retention);
+
+	try {
+		StartReaderThreads();
+	} catch (const std::system_error& e) {
+		std::cerr << "Microservice-profiler: unable to start reader threads: "
+		          << e.what() << std::endl;
+		Stop();
+		for (auto& channel : channels) {
+			if (channel->reader_thread)
+				channel->reader_thread->join();
+		}
+		CloseRelayFiles();
+		microservice_profiler_module_unregister();
+		DisableThreadFilter();
+		return false;
 	}
+
+	OpenCapture();
+
+	/* Follows spans resumed on other threads by async executors. Before
+	 * our fork handlers, so that the child resets the slots first. */
+	InstallSpanContextStorage(false);
+
+	pthread_atfork(&Profiler::PrepareFork, &Profiler::ParentAfterFork,
+		&Profiler::ChildAfterFork);
+
+	/* Lets the readers name the endpoint of each record */
+	RegisterSpanNameCache();
+	RegisterCriticalPathCommands();
+	RegisterMemoryCommands();
+
+	std::cout << "Microservice-profiler: started in "
+	          << (GetMonotonicTime() - start) / 1000 << " us" << std::endl;
+	return true;
+}
+
+void Profiler::Stop()
+{
+	uint64_t one = 1;
+
+	stop_thread = true;
+	if (wake_fd >= 0 && write(wake_fd, &one, sizeof(one)) < 0)
+		std::cerr << "Unable to wake the monitoring threads up" << std::endl;
+	capture.Flush();
 }
 
 /*
- * Open the relay file associated with this process
+ * Open the relay files associated with this process, one per channel.
+ * Returns the number of channels opened.
  */
-int Profiler::OpenRelayFile()
+int Profiler::OpenRelayFiles()
 {
 	char tmp[4096];
 	int relay_file_descr;
@@ -100,20 +284,65 @@ int Profiler::OpenRelayFile()
 
 	pid = getpid();
 
-	sprintf(tmp, "%s/rchan-%d-0", this->app_dirname, pid);
-	relay_file_descr = open(tmp, O_RDONLY);
+	for (int n = 0; ; n++) {
+		sprintf(tmp, "%s/rchan-%d-%d", this->app_dirname, pid, n);
+		relay_file_descr = open(tmp, O_RDONLY);
 
-	//std::cout << "opening the relay file " << tmp << ", fd = " << relay_file_descr<< std::endl;
+		//std::cout << "opening the relay file " << tmp << ", fd = " << relay_file_descr<< std::endl;
+
+		if (relay_file_descr < 0)
+			break;
 
-	if (relay_file_descr < 0) {
+		/* Not refused: the records of a channel left unread are lost */
+		auto channel = std::make_unique<RelayChannel>();
+		channel->fd = relay_file_descr;
+		channels.push_back(std::move(channel));
+		ChargeMemory(kMemoryAnnotations, sizeof(RelayChannel));
+	}
+
+	if (channels.empty()) {
+		sprintf(tmp, "%s/rchan-%d-0", this->app_dirname, pid);
 		std::cerr << "Couldn't open the relay file: "
 		          << tmp
 				  << std::endl;
 		return -1;
 	}
-	return relay_file_descr;
+	return channels.size();
+}
+
+/*
+ * Open the capture file named by MICROSERVICE_PROFILE_CAPTURE, where "%p"
+ * stands for the pid. With MICROSERVICE_PROFILE_CAPTURE_ONLY=1, the records
+ * are only captured, not turned into spans.
+ */
+void Profiler::OpenCapture()
+{
+	const char* path = getenv("MICROSERVICE_PROFILE_CAPTURE");
+	const char* only = getenv("MICROSERVICE_PROFILE_CAPTURE_ONLY");
+	std::string name;
+
+	if (path == nullptr || *path == '\0')
+		return;
+
+	for (const char* p = path; *p; p++) {
+		if (p[0] == '%' && p[1] == 'p') {
+			name += std::to_string(getpid());
+			p++;
+		} else {
+			name += *p;
+		}
+	}
+	if (capture.Open(name.c_str()))
+		capture_only = only != nullptr && strcmp(only, "1") == 0;
 }
 
+void Profiler::CloseRelayFiles()
+{
+	for (auto& channel : channels)
+		close(channel->fd);
+	ReleaseMemory(kMemoryAnnotations, channels.size() * sizeof(RelayChannel));
+	channels.clear();
+}
 
 nostd::shared_ptr<trace_api::Tracer> get_tracer()
 {
@@ -121,15 +350,42 @@ nostd::shared_ptr<trace_api::Tracer> get_tracer()
   return provider->GetTracer("monitoring library");
 }
 
+/*
+ * Attach the critical path breakdown of a record to its kernel span
+ */
+static void SetCriticalPath(trace_api::Span& kernel_span,
+	const CriticalPathBreakdown& breakdown)
+{
+	int dominant = breakdown.Dominant();
+
+	kernel_span.SetAttribute("profile.wall_ns", (int64_t) breakdown.wall_ns);
+	kernel_span.SetAttribute("profile.user_ns", (int64_t) breakdown.user_ns);
+	kernel_span.SetAttribute("profile.net_ns",
+		(int64_t) breakdown.syscall_ns[kSyscallNetwork]);
+	kernel_span.SetAttribute("profile.fs_ns",
+		(int64_t) breakdown.syscall_ns[kSyscallFilesystem]);
+	kernel_span.SetAttribute("profile.io_ns",
+		(int64_t) breakdown.syscall_ns[kSyscallIo]);
+	kernel_span.SetAttribute("profile.futex_ns",
+		(int64_t) breakdown.syscall_ns[kSyscallFutex]);
+	kernel_span.SetAttribute("profile.sleep_ns",
+		(int64_t) breakdown.syscall_ns[kSyscallSleep]);
+	kernel_span.SetAttribute("profile.other_ns",
+		(int64_t) breakdown.syscall_ns[kSyscallOther]);
+	kernel_span.SetAttribute("profile.dominant", dominant == kSyscallCategories ?
+		"user" : SyscallCategoryName((SyscallCategory) dominant));
+}
+
 void Profiler::InjectAnnotation(uint32_t nb_syscalls, char* header_buf,
 	struct syscall_desc *syscalls) {
 
 	uint8_t span_id_bytes[8];
 	uint8_t trace_id_bytes[16];
+	char endpoint[SpanNameCache::kNameSize];
+	size_t endpoint_size;
+	uint64_t id;
 	bool res;
 	char* span_id_hex, *trace_id_hex;
-	trace_api::StartSpanOptions startOptions, startOptionsSyscalls;
-	trace_api::EndSpanOptions endOptions, endOptionsSyscalls;
 
 	//std::cout << "- Number of syscalls : " << nb_syscalls << std::endl;
 
@@ -147,11 +403,68 @@ void Profiler::InjectAnnotation(uint32_t nb_syscalls, char* header_buf,
 		return;
 	}
 
+	/* The endpoint is the name of the span the syscalls belong to */
+	memcpy(&id, span_id_bytes, sizeof(id));
+	endpoint_size = GetSpanNameCache().Lookup(id, endpoint, sizeof(endpoint));
+	if (endpoint_size == 0)
+		endpoint_size = snprintf(endpoint, sizeof(endpoint), "(unknown)");
+
+	/* The node daemon does the rest, for all the processes of the node */
+	if (SendNodeAnnotation(span_id_bytes, trace_id_bytes, endpoint,
+			endpoint_size, nb_syscalls, syscalls))
+		return;
+
+	if (capture.is_open()) {
+		capture.Append(span_id_bytes, trace_id_bytes, endpoint, endpoint_size,
+			nb_syscalls, syscalls);
+		if (capture_only)
+			return;
+	}
+
+	/* Every record counts in its endpoint's totals, retained or not */
+	CriticalPathBreakdown breakdown = AnalyzeCriticalPath(nb_syscalls, syscalls);
+	GetCriticalPathAggregates().Add(endpoint, endpoint_size, breakdown);
+	SpanDifferential* differential = SpanDifferential::Get();
+	if (differential != nullptr)
+		differential->AddRecord(span_id_bytes, endpoint, endpoint_size,
+			nb_syscalls, syscalls);
+
+	/* Over its budget, the governor keeps the totals only */
+	if (trigger == nullptr &&
+	    GovernedSyscallDetail() == kSyscallDetailAggregate)
+		return;
+
+	if (retention != nullptr && trigger == nullptr && !retention->Admit(trace_id_bytes, span_id_bytes,
+			endpoint, endpoint_size, nb_syscalls, syscalls))
+		return;
+
+	MaterializeAnnotation(trace_id_bytes, span_id_bytes, nb_syscalls, syscalls,
+		breakdown);
+}
+
+/*
+ * Turn a relay record into a "kernel" span, child of the span it was recorded
+ * in, with one "__<syscall>" child per syscall unless the overhead governor
+ * asks for the kernel span alone (never for triggered requests) or the
+ * profiler's memory is under pressure: the spans would pile up in the
+ * exporters' queues. Every exporter makes a full recordable of each child;
+ * with syscall_events, a syscall is only an event of the kernel span, with
+ * its duration.
+ */
+void Profiler::MaterializeAnnotation(const uint8_t* trace_id_bytes,
+	const uint8_t* span_id_bytes, uint32_t nb_syscalls,
+	const struct syscall_desc *syscalls,
+	const CriticalPathBreakdown& breakdown) {
+
+	trace_api::StartSpanOptions startOptions, startOptionsSyscalls;
+	trace_api::EndSpanOptions endOptions, endOptionsSyscalls;
+	char syscall_span_name[2 + SYSCALL_NAME_MAX_SIZE] = {'_', '_'};
+
 	//std::cout << "----- span_id_hex: " << span_id_hex << ":" << std::endl;
 	/* Recreate the span context */
 	trace_api::SpanContext span_context(
-		trace_api::TraceId(trace_id_bytes),
-		trace_api::SpanId(span_id_bytes),
+		trace_api::TraceId(nostd::span<const uint8_t, 16>(trace_id_bytes, 16)),
+		trace_api::SpanId(nostd::span<const uint8_t, 8>(span_id_bytes, 8)),
 		trace_api::TraceFlags((uint8_t) true),
 		false);
 
@@ -180,7 +493,10 @@ void Profiler::InjectAnnotation(uint32_t nb_syscalls, char* header_buf,
 		auto outer_span = tracer->StartSpan(std::string("kernel"), startOptions);
 
 		startOptionsSyscalls.parent = outer_span->GetContext();
-		for (int i = 0; i < nb_syscalls; i++) {
+		uint32_t nb_syscall_spans = !MemoryUnderPressure() &&
+			(trigger != nullptr ||
+			 GovernedSyscallDetail() == kSyscallDetailFull) ? nb_syscalls : 0;
+		for (int i = 0; i < nb_syscall_spans; i++) {
 
 			ts = syscalls[i].start_system;
 			startOptionsSyscalls.start_system_time = opentelemetry::common::SystemTimestamp(
@@ -195,8 +511,20 @@ void Profiler::InjectAnnotation(uint32_t nb_syscalls, char* header_buf,
 				exit(0);
 			}
 
-			auto tracer = provider->GetTracer("Monitoring library");
-			auto span = tracer->StartSpan("__" + std::string(syscalls[i].name), startOptionsSyscalls);
+			if (syscall_events) {
+				outer_span->AddEvent(nostd::string_view(syscalls[i].name,
+					strnlen(syscalls[i].name, SYSCALL_NAME_MAX_SIZE)),
+					startOptionsSyscalls.start_system_time,
+					{{"duration_ns", (int64_t) (syscalls[i].end_steady -
+						syscalls[i].start_steady)}});
+				continue;
+			}
+
+			/* The syscall name is not null-terminated when full */
+			memcpy(syscall_span_name + 2, syscalls[i].name, SYSCALL_NAME_MAX_SIZE);
+			auto span = tracer->StartSpan(nostd::string_view(syscall_span_name,
+				2 + strnlen(syscalls[i].name, SYSCALL_NAME_MAX_SIZE)),
+				startOptionsSyscalls);
 
 			endOptionsSyscalls.end_steady_time = opentelemetry::common::SteadyTimestamp(std::chrono::nanoseconds(syscalls[i].end_steady));
 			span->End(endOptionsSyscalls);
@@ -208,6 +536,8 @@ void Profiler::InjectAnnotation(uint32_t nb_syscalls, char* header_buf,
 			//<< std::endl;
 		}
 
+		SetCriticalPath(*outer_span, breakdown);
+
 		endOptions.end_steady_time = opentelemetry::common::SteadyTimestamp(
 			std::chrono::nanoseconds(syscalls[nb_syscalls - 1].end_steady)
 			);
@@ -215,52 +545,93 @@ void Profiler::InjectAnnotation(uint32_t nb_syscalls, char* header_buf,
 	}
 }
 
+/*
+ * Read and drop the next `size` bytes of the relay file, so that the next
+ * read starts on a record header again
+ */
+static void SkipRelayBytes(int relay_fd, size_t size, void* buffer,
+	size_t buffer_size)
+{
+	while (size > 0) {
+		ssize_t rc = read(relay_fd, buffer, std::min(size, buffer_size));
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			break;
+		size -= rc;
+	}
+}
+
 /*
  * Read the relay file and inject annotation into the distributed trace
  */
-void Profiler::ReadAnnotation(int relay_fd) {
-	struct pollfd poll_fd;
-	char header_buf[64];
+void Profiler::ReadAnnotation(RelayChannel* channel) {
+	struct pollfd poll_fds[2];
+	char header_buf[RELAY_RECORD_HEADER_SIZE];
 	int rc;
 	char service_name[SERVICE_NAME_MAX_SIZE];
 	char span_id[SPAN_ID_MAX_SIZE];
 	uint32_t nb_syscalls;
-	struct syscall_desc syscalls[256];
+	int relay_fd = channel->fd;
+	struct syscall_desc *syscalls = channel->syscalls;
 
 
 	std::cout << "Monitoring thread starting ..." << std::endl;
-	UnregisterMonitoringThread();
+	MarkProfilerThread();
 
 	//opentelemetry::nostd::shared_ptr<trace_api::TracerProvider> provider =
 	//											trace_api::Provider::GetTracerProvider();
 
-	poll_fd.fd = relay_fd;
-	poll_fd.events = POLLIN;
+	poll_fds[0].fd = relay_fd;
+	poll_fds[0].events = POLLIN;
+	poll_fds[1].fd = wake_fd;
+	poll_fds[1].events = POLLIN;
 	do {
-		rc = poll(&poll_fd, 1, 1 );/*milli*/
+		rc = poll(poll_fds, 2, RELAY_POLL_TIMEOUT_MS);
 
 		if (stop_thread) break;
 
 		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
 			std::cerr << "poll error: " << std::endl;
 			break;
 		}
 		if (rc == 0) { /* timeout */
 			continue;
 		}
-		else if (poll_fd.revents & POLLIN) {
-			rc = read(relay_fd, header_buf, 64 /* header size */);
+		else if (poll_fds[0].revents & POLLIN) {
+			std::lock_guard<std::mutex> guard(channel->record_mutex);
+
+			rc = read(relay_fd, header_buf, RELAY_RECORD_HEADER_SIZE);
 			if (rc < 0) {
 				std::cerr << "Error reading from the relay file" << std::endl;
 				continue;
 			} else if (rc > 0) {
+				size_t excess = 0;
+
 				memcpy(&nb_syscalls, header_buf, (sizeof(uint32_t)));
+				if (nb_syscalls > MAX_SYSCALLS_PER_RECORD) {
+					/* Only the first syscalls are kept, the record says so */
+					excess = (nb_syscalls - MAX_SYSCALLS_PER_RECORD) *
+						sizeof(syscall_desc);
+					nb_syscalls = MAX_SYSCALLS_PER_RECORD;
+					memcpy(header_buf, &nb_syscalls, sizeof(uint32_t));
+				}
 				if(nb_syscalls > 0) {
 					rc = read(relay_fd, syscalls, nb_syscalls * sizeof(syscall_desc));
+					if (rc >= 0 && excess > 0)
+						SkipRelayBytes(relay_fd, excess, syscalls,
+							MAX_SYSCALLS_PER_RECORD * sizeof(syscall_desc));
 					if (rc < 0) {
 						std::cerr << "Error reading from the relay file" << std::endl;
 						continue;
 					} else {
+						struct iovec record[] = {
+							{header_buf, RELAY_RECORD_HEADER_SIZE},
+							{syscalls, nb_syscalls * sizeof(syscall_desc)},
+						};
+						FlightRecord(kFlightRelayRecord, record, 2);
 						InjectAnnotation(nb_syscalls, header_buf + 4, syscalls);
 					}
 				}
@@ -272,25 +643,139 @@ void Profiler::ReadAnnotation(int relay_fd) {
 }
 
 /*
- * Start reader threads
+ * Start one reader thread per relay channel
+ */
+void Profiler::StartReaderThreads() {
+	for (auto& channel : channels) {
+		channel->reader_thread = std::make_unique<std::thread> (
+			&Profiler::ReadAnnotation, this, channel.get());
+		//reader_thread->detach();
+	}
+}
+
+/*
+ * Fork handlers: readers are parked between two records while the process
+ * forks. The child only drops what it inherited: it registers and starts
+ * its readers on its first span (RestartAfterFork, deferred with the other
+ * restarts of the child), so that a child which calls exec right away costs
+ * nothing.
  */
-void Profiler::StartReaderThreads(int fd) {
-	reader_thread = std::make_unique<std::thread> (&Profiler::ReadAnnotation, this, fd);
-	//reader_thread->detach();
+void Profiler::PrepareFork()
+{
+	for (auto& channel : instance->channels)
+		channel->record_mutex.lock();
+	if (instance->retention != nullptr)
+		instance->retention->PrepareFork();
+}
+
+void Profiler::ParentAfterFork()
+{
+	if (instance->retention != nullptr)
+		instance->retention->ParentAfterFork();
+	for (auto& channel : instance->channels)
+		channel->record_mutex.unlock();
+}
+
+void Profiler::ChildAfterFork()
+{
+	/* The reader threads do not exist in the child: their handles can be
+	 * neither joined nor destroyed, so they are leaked. The channels are
+	 * the parent's: closed, and dropped on restart. */
+	for (auto& channel : instance->channels) {
+		channel->record_mutex.unlock();
+		channel->reader_thread.release();
+		close(channel->fd);
+		channel->fd = -1;
+	}
+	if (instance->retention != nullptr)
+		instance->retention->ChildAfterFork();
+	close(instance->wake_fd);
+	instance->wake_fd = -1;
+
+	/* The parent keeps writing its own records */
+	instance->capture.Abandon();
+
+	microservice_profiler_module_reset_after_fork();
+	ResetThreadFilterAfterFork();
+	DeferRestartAfterFork(&Profiler::RestartAfterFork);
+}
+
+void Profiler::RestartAfterFork()
+{
+	try {
+		instance->CloseRelayFiles();
+		instance->OpenCapture();
+		StartMicroserviceProfile();
+
+		instance->wake_fd = eventfd(0, EFD_CLOEXEC);
+		if (!microservice_profiler_module_is_registered() ||
+		    instance->wake_fd < 0 || instance->OpenRelayFiles() <= 0) {
+			std::cerr << "Child process " << getpid()
+			          << " will not be profiled" << std::endl;
+			return;
+		}
+
+		if (instance->retention != nullptr)
+			instance->retention->RestartAfterFork();
+		instance->StartReaderThreads();
+	} catch (const std::system_error& e) {
+		std::cerr << "Microservice-profiler: unable to start reader threads: "
+		          << e.what() << std::endl;
+	} catch (const std::exception& e) {
+		std::cerr << "Microservice-profiler: " << e.what() << std::endl;
+	}
 }
 
 Profiler::~Profiler()
 {
-	stop_thread = true;
+	if (!active)
+		return;
+
+	Stop();
 	std::cout << "Main thread exiting .." << std::endl;
-	if(reader_thread->joinable())
-		reader_thread->join();
+	for (auto& channel : channels) {
+		if(channel->reader_thread && channel->reader_thread->joinable())
+			channel->reader_thread->join();
+	}
+	CloseRelayFiles();
+	close(wake_fd);
+	capture.Close();
 }
 
-// Initialize the profiler when the library is loaded.
 namespace
 {
-	Profiler profiler;
+
+// Created on first use so that tracer providers built by other static
+// initializers can start the profiler.
+Profiler& GetProfiler()
+{
+	static Profiler profiler;
+	return profiler;
+}
+
+}  // namespace
+
+bool EnsureProfilerStarted() noexcept
+{
+	try {
+		if (!GetProfiler().Start())
+			return false;
+		MaybeRestartAfterFork();
+		return true;
+	} catch (const std::exception& e) {
+		std::cerr << "Microservice-profiler: " << e.what() << std::endl;
+		return false;
+	}
+}
+
+void StopProfiler() noexcept
+{
+	GetProfiler().Stop();
 }
 
 }  // namespace microservice_profile
+
+int InitMicroserviceProfiler()
+{
+	return microservice_profile::EnsureProfilerStarted() ? 0 : -1;
+}
@@ -0,0 +1,33 @@
+/*
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_PROFILER_H_
+#define MICROSERVICE_PROFILE_PROFILER_H_
+
+namespace microservice_profile
+{
+
+// Starts the profiler the first time it is called. Returns true if profiling
+// is active, false if the library runs as a no-op (kernel module missing,
+// relay channels unavailable, ...).
+bool EnsureProfilerStarted() noexcept;
+
+// Asks the reader threads to exit.
+void StopProfiler() noexcept;
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_PROFILER_H_
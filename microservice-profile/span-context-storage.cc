@@ -0,0 +1,108 @@
+/*
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <stdlib.h>
+
+#include <opentelemetry/trace/context.h>
+#include <opentelemetry/trace/span_metadata.h>
+
+#include "microservice-profile-base/span_slot.h"
+#include "span-context-storage.h"
+
+extern "C" {
+#include "microservice-profile-base/module_api.h"
+}
+
+namespace context   = opentelemetry::context;
+namespace nostd     = opentelemetry::nostd;
+namespace trace_api = opentelemetry::trace;
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+/* Publishes the active span of the context, if any */
+void PublishActiveSpan(const context::Context& current) noexcept
+{
+	/* GetSpan() makes up an invalid span when there is none */
+	if (!current.HasKey(trace_api::kSpanKey)) {
+		SetThreadSpan(nullptr, nullptr);
+		return;
+	}
+
+	trace_api::SpanContext span_context =
+		trace_api::GetSpan(current)->GetContext();
+	if (!span_context.IsValid()) {
+		SetThreadSpan(nullptr, nullptr);
+		return;
+	}
+	SetThreadSpan(span_context.span_id().Id().data(),
+		span_context.trace_id().Id().data());
+}
+
+}  // namespace
+
+nostd::unique_ptr<context::Token> SpanPublishingContextStorage::Attach(
+	const context::Context& context) noexcept
+{
+	auto token = storage->Attach(context);
+	PublishActiveSpan(context);
+	return token;
+}
+
+bool SpanPublishingContextStorage::Detach(context::Token& token) noexcept
+{
+	bool detached = storage->Detach(token);
+	PublishActiveSpan(storage->GetCurrent());
+	return detached;
+}
+
+void InstallSpanContextStorage(bool local_reader)
+{
+	static std::mutex install_mutex;
+	static bool installed = false;
+
+	const char* enabled = getenv("MICROSERVICE_PROFILE_SPAN_SLOTS");
+	if (enabled != nullptr && strcmp(enabled, "0") == 0)
+		return;
+
+	std::lock_guard<std::mutex> guard(install_mutex);
+	if (installed)
+		return;
+
+	/* The in-process profiles read the slots, module or not */
+	if (!EnableSpanSlots() && !local_reader) {
+		if (microservice_profiler_module_is_registered())
+			std::cerr << "Microservice-profiler: the kernel module does not "
+			          << "support span slots, spans hopping between threads "
+			          << "are attributed to the thread that started them"
+			          << std::endl;
+		return;
+	}
+
+	auto storage = context::RuntimeContext::GetRuntimeContextStorage();
+	context::RuntimeContext::SetRuntimeContextStorage(
+		nostd::shared_ptr<context::RuntimeContextStorage>(
+			new SpanPublishingContextStorage(storage)));
+	installed = true;
+}
+
+}  // namespace microservice_profile
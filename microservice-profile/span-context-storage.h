@@ -0,0 +1,67 @@
+/*
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_SPAN_CONTEXT_STORAGE_H_
+#define MICROSERVICE_PROFILE_SPAN_CONTEXT_STORAGE_H_
+
+#include <opentelemetry/context/runtime_context.h>
+
+namespace microservice_profile
+{
+
+/*
+ * Wraps the runtime context storage in use: every context attach and detach
+ * publishes the active span of the thread's new current context in its span
+ * slot (see microservice-profile-base/span_slot.h). Async executors and
+ * coroutines resume a span on whatever thread is free by attaching its
+ * context there; the kernel module then charges that thread's syscalls and
+ * samples to the span, and stops when the context is detached.
+ */
+class SpanPublishingContextStorage
+	: public opentelemetry::context::RuntimeContextStorage
+{
+public:
+	explicit SpanPublishingContextStorage(opentelemetry::nostd::shared_ptr<
+		opentelemetry::context::RuntimeContextStorage> storage) noexcept
+		: storage(storage) {}
+
+	opentelemetry::context::Context GetCurrent() noexcept override
+	{
+		return storage->GetCurrent();
+	}
+
+	opentelemetry::nostd::unique_ptr<opentelemetry::context::Token> Attach(
+		const opentelemetry::context::Context& context) noexcept override;
+
+	bool Detach(opentelemetry::context::Token& token) noexcept override;
+
+private:
+	opentelemetry::nostd::shared_ptr<
+		opentelemetry::context::RuntimeContextStorage> storage;
+};
+
+/*
+ * Installs SpanPublishingContextStorage over the current storage, once. Does
+ * nothing with MICROSERVICE_PROFILE_SPAN_SLOTS=0, or when neither the kernel
+ * module (registered, supporting span slots) nor an in-process profile
+ * (local_reader) would read the slots. Called again when another reader
+ * starts.
+ */
+void InstallSpanContextStorage(bool local_reader);
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_SPAN_CONTEXT_STORAGE_H_
@@ -0,0 +1,257 @@
+/*
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdlib.h>
+
+#include "microservice-profile-base/control_server.h"
+#include "microservice-profile-base/memory_budget.h"
+#include "microservice-profile-base/span_slot.h"
+#include "microservice-profile-base/thread_filter.h"
+#include "span-differential.h"
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+const size_t kDefaultTop = 10;
+
+std::atomic<SpanDifferential*> instance(nullptr);
+
+/* Spreads the span ids, whose low bits may be sequential, over the slots */
+size_t SlotIndex(uint64_t span_id, size_t slots)
+{
+	return (span_id * 0x9e3779b97f4a7c15ull) >> 32 & (slots - 1);
+}
+
+/* A pseudo-random number for the reservoir, without state: signal handlers
+ * of several threads may sample a span at once */
+uint64_t Mix(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdull;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ull;
+	return x ^ (x >> 33);
+}
+
+}  // namespace
+
+SpanDifferential::SpanDifferential()
+	: profile(DifferentialProfile::Options()), unmatched_records(0)
+{
+	for (Slot& slot : slots) {
+		slot.span_id.store(0, std::memory_order_relaxed);
+		slot.nb_samples.store(0, std::memory_order_relaxed);
+		for (auto& sequence : slot.sequence)
+			sequence.store(0, std::memory_order_relaxed);
+	}
+	for (EndedSpan& span : ended) {
+		span.span_id.store(0, std::memory_order_relaxed);
+		span.group.store(0, std::memory_order_relaxed);
+	}
+}
+
+SpanDifferential* SpanDifferential::Create()
+{
+	const char* enabled = getenv("MICROSERVICE_PROFILE_DIFFERENTIAL");
+	if (enabled == nullptr || strcmp(enabled, "1") != 0 ||
+	    instance.load() != nullptr)
+		return instance.load();
+
+	if (!ReserveMemory(kMemoryStackTables, sizeof(SpanDifferential))) {
+		std::cerr << "Microservice-profiler: no memory left in the budget "
+		          << "for the differential profile" << std::endl;
+		return nullptr;
+	}
+	instance.store(new SpanDifferential());
+	RegisterControlCommand("differential",
+		"stacks and syscalls of the slow spans vs the fast [endpoint] [top]",
+		[](const std::string& args, std::string* output) {
+			instance.load()->Command(args, output);
+		});
+	return instance.load();
+}
+
+SpanDifferential* SpanDifferential::Get()
+{
+	return instance.load(std::memory_order_acquire);
+}
+
+void SpanDifferential::RecordSample(void* const* stack, size_t depth)
+{
+	SpanDifferential* differential = Get();
+	if (differential != nullptr)
+		differential->Sample(stack, depth);
+}
+
+void SpanDifferential::Sample(void* const* stack, size_t depth)
+{
+	uint8_t span_id_bytes[8];
+	uint8_t trace_id_bytes[16];
+	uint64_t span_id;
+
+	if (!GetThreadSpan(span_id_bytes, trace_id_bytes))
+		return;
+	memcpy(&span_id, span_id_bytes, sizeof(span_id));
+
+	Slot& slot = slots[SlotIndex(span_id, kSlots)];
+	if (slot.span_id.load(std::memory_order_acquire) != span_id)
+		return;
+
+	/* Reservoir sampling: the n-th sample replaces a kept one with
+	 * probability kSamplesPerSpan / n */
+	uint32_t n = slot.nb_samples.fetch_add(1, std::memory_order_relaxed);
+	size_t index = n < kSamplesPerSpan ? n : Mix(span_id + n) % (n + 1);
+	if (index >= kSamplesPerSpan)
+		return;
+
+	/* Another thread's signal handler is writing this sample: drop ours */
+	std::atomic<uint32_t>& sequence = slot.sequence[index];
+	uint32_t before = sequence.load(std::memory_order_relaxed);
+	if ((before & 1) != 0 ||
+	    !sequence.compare_exchange_strong(before, before + 1,
+		std::memory_order_relaxed))
+		return;
+	std::atomic_thread_fence(std::memory_order_release);
+
+	depth = std::min(depth, kMaxDepth);
+	for (size_t i = 0; i < depth; i++)
+		slot.frames[index][i] = reinterpret_cast<uintptr_t>(stack[i]);
+	slot.depth[index] = depth;
+
+	/* Fails when the slot was reset for a new span meanwhile */
+	uint32_t writing = before + 1;
+	sequence.compare_exchange_strong(writing, before + 2,
+		std::memory_order_release);
+}
+
+void SpanDifferential::OnSpanStart(const SpanInfo& span) noexcept
+{
+	if (IsProfilerThread())
+		return;
+
+	uint64_t span_id = SpanIdToUint64(span.span_id);
+	Slot& slot = slots[SlotIndex(span_id, kSlots)];
+
+	slot.span_id.store(0, std::memory_order_relaxed);
+	slot.nb_samples.store(0, std::memory_order_relaxed);
+	for (auto& sequence : slot.sequence)
+		sequence.store(0, std::memory_order_relaxed);
+	slot.span_id.store(span_id, std::memory_order_release);
+}
+
+void SpanDifferential::OnSpanEnd(const SpanInfo& span) noexcept
+{
+	if (IsProfilerThread())
+		return;
+
+	uint64_t span_id = SpanIdToUint64(span.span_id);
+	DifferentialProfile::Group group =
+		span.duration >= thresholds.Of(span.name.data(), span.name.size()) ?
+		DifferentialProfile::kSlow : DifferentialProfile::kFast;
+
+	uintptr_t frames[kSamplesPerSpan][kMaxDepth];
+	DifferentialProfile::StackSample samples[kSamplesPerSpan];
+	size_t kept = 0;
+	uint32_t taken = 0;
+
+	Slot& slot = slots[SlotIndex(span_id, kSlots)];
+	uint64_t expected = span_id;
+	if (slot.span_id.compare_exchange_strong(expected, 0)) {
+		taken = slot.nb_samples.load(std::memory_order_relaxed);
+		for (size_t i = 0; i < kSamplesPerSpan; i++) {
+			uint32_t before =
+				slot.sequence[i].load(std::memory_order_acquire);
+			if (before == 0 || (before & 1) != 0)
+				continue;
+			size_t depth = std::min<size_t>(slot.depth[i], kMaxDepth);
+			memcpy(frames[kept], slot.frames[i], depth * sizeof(uintptr_t));
+			/* A sample replaced while copied is torn */
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (slot.sequence[i].load(std::memory_order_relaxed) != before)
+				continue;
+			samples[kept].frames = frames[kept];
+			samples[kept].depth = depth;
+			kept++;
+		}
+	}
+
+	try {
+		profile.AddSpan(span.name.data(), span.name.size(), group, samples,
+			kept, kept > 0 ? (double) taken / kept : 0);
+	} catch (const std::bad_alloc&) {
+	}
+
+	EndedSpan& entry = ended[SlotIndex(span_id, kEndedSpans)];
+	entry.span_id.store(0, std::memory_order_relaxed);
+	entry.group.store(group, std::memory_order_relaxed);
+	entry.span_id.store(span_id, std::memory_order_release);
+}
+
+void SpanDifferential::AddRecord(const uint8_t* span_id_bytes,
+	const char* endpoint, size_t endpoint_size, uint32_t nb_syscalls,
+	const struct syscall_desc* syscalls)
+{
+	uint64_t span_id;
+
+	memcpy(&span_id, span_id_bytes, sizeof(span_id));
+	EndedSpan& entry = ended[SlotIndex(span_id, kEndedSpans)];
+	if (entry.span_id.load(std::memory_order_acquire) != span_id) {
+		/* Not ended yet, or forgotten */
+		unmatched_records.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	profile.AddSyscalls(endpoint, endpoint_size,
+		(DifferentialProfile::Group) entry.group.load(
+			std::memory_order_relaxed),
+		nb_syscalls, syscalls);
+}
+
+/*
+ * "differential" lists the endpoints; "differential <endpoint> [top]"
+ * compares the slow and fast spans of one. Endpoint names may hold spaces.
+ */
+void SpanDifferential::Command(const std::string& args, std::string* output)
+{
+	std::string endpoint = args;
+	size_t top = kDefaultTop;
+
+	while (!endpoint.empty() && endpoint.back() == ' ')
+		endpoint.pop_back();
+	size_t last = endpoint.find_last_of(' ');
+	if (last != std::string::npos && last + 1 < endpoint.size() &&
+	    endpoint.find_first_not_of("0123456789", last + 1) ==
+	    std::string::npos) {
+		top = std::max(strtoul(endpoint.c_str() + last + 1, nullptr, 10), 1ul);
+		endpoint.resize(last);
+	}
+
+	if (endpoint.empty()) {
+		profile.ReportEndpoints(output);
+	} else {
+		profile.Report(endpoint, top, output);
+		*output += "unmatched_records " +
+			std::to_string(unmatched_records.load()) + "\n";
+	}
+}
+
+}  // namespace microservice_profile
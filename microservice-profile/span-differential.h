@@ -0,0 +1,100 @@
+/*
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_SPAN_DIFFERENTIAL_H_
+#define MICROSERVICE_PROFILE_SPAN_DIFFERENTIAL_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "microservice-profile-base/differential_profile.h"
+#include "microservice-profile-base/latency_thresholds.h"
+#include "span-observer.h"
+
+namespace microservice_profile
+{
+
+/*
+ * Differential profiling: splits the spans of each endpoint into slow and
+ * fast ones, by the thresholds of the tail-based retention, and compares the
+ * CPU stacks sampled while they ran and the syscalls the kernel module
+ * recorded for them (see DifferentialProfile).
+ *
+ * The CPU samples of a span are kept in a slot of its own until it ends,
+ * at most kSamplesPerSpan of them, picked uniformly over the span's life.
+ * Two open spans mapping to the same slot share it: the older one loses its
+ * samples, which thins the samples of both groups alike.
+ */
+class SpanDifferential : public SpanObserver
+{
+public:
+	/* Configured by the environment (see the README); nullptr when
+	 * disabled. Lives as long as the process. */
+	static SpanDifferential* Create();
+
+	/* The instance made by Create, or nullptr */
+	static SpanDifferential* Get();
+
+	/* The CPU sample sink: async-signal-safe */
+	static void RecordSample(void* const* stack, size_t depth);
+
+	void OnSpanStart(const SpanInfo& span) noexcept override;
+	void OnSpanEnd(const SpanInfo& span) noexcept override;
+
+	/* Called by the relay readers with each record of an ended span */
+	void AddRecord(const uint8_t* span_id, const char* endpoint,
+		size_t endpoint_size, uint32_t nb_syscalls,
+		const struct syscall_desc* syscalls);
+
+private:
+	static constexpr size_t kSlots = 1024;
+	static constexpr size_t kSamplesPerSpan = 8;
+	static constexpr size_t kMaxDepth = 16;
+	static constexpr size_t kEndedSpans = 4096;
+
+	struct Slot {
+		std::atomic<uint64_t> span_id;	/* 0 when free */
+		std::atomic<uint32_t> nb_samples;	/* Taken, kept or not */
+		/* Per sample: 0 when empty, odd while being written. A reader
+		 * drops a sample whose sequence changed while it copied it. */
+		std::atomic<uint32_t> sequence[kSamplesPerSpan];
+		uint8_t depth[kSamplesPerSpan];
+		uintptr_t frames[kSamplesPerSpan][kMaxDepth];
+	};
+
+	/* The group of the recently ended spans, for their kernel records */
+	struct EndedSpan {
+		std::atomic<uint64_t> span_id;
+		std::atomic<uint8_t> group;
+	};
+
+	SpanDifferential();
+
+	void Sample(void* const* stack, size_t depth);
+	void Command(const std::string& args, std::string* output);
+
+	DifferentialProfile profile;
+	LatencyThresholds thresholds;
+
+	Slot slots[kSlots];
+	EndedSpan ended[kEndedSpans];
+	std::atomic<uint64_t> unmatched_records;
+};
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_SPAN_DIFFERENTIAL_H_
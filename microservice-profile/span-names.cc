@@ -0,0 +1,136 @@
+/*
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <cstdio>
+#include <cstring>
+
+#include "microservice-profile-base/span_slot.h"
+#include "span-names.h"
+
+namespace microservice_profile
+{
+
+void SpanNameCache::OnSpanStart(const SpanInfo& span) noexcept
+{
+	uint64_t span_id = SpanIdToUint64(span.span_id);
+	size_t index = (span_id >> 4) % kSlots;
+	size_t size = span.name.size() < kNameSize ? span.name.size() : kNameSize - 1;
+	std::lock_guard<std::mutex> guard(stripes[index % kStripes]);
+	Slot& slot = slots[index];
+
+	uint32_t seq = slot.seq.load(std::memory_order_relaxed);
+	slot.seq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot.span_id = span_id;
+	slot.size = size;
+	slot.triggered = span.triggered;
+	memcpy(slot.name, span.name.data(), size);
+	slot.seq.store(seq + 2, std::memory_order_release);
+}
+
+size_t SpanNameCache::Lookup(uint64_t span_id, char* name, size_t size) noexcept
+{
+	size_t index = (span_id >> 4) % kSlots;
+	std::lock_guard<std::mutex> guard(stripes[index % kStripes]);
+	const Slot& slot = slots[index];
+
+	if (size == 0 || slot.span_id != span_id || slot.size == 0)
+		return 0;
+
+	size_t n = slot.size < size ? slot.size : size - 1;
+	memcpy(name, slot.name, n);
+	name[n] = '\0';
+	return n;
+}
+
+size_t SpanNameCache::TryLookup(uint64_t span_id, char* name,
+	size_t size, bool* triggered) noexcept
+{
+	const Slot& slot = slots[(span_id >> 4) % kSlots];
+	uint32_t seq = slot.seq.load(std::memory_order_acquire);
+
+	if (size == 0 || (seq & 1) != 0 || slot.span_id != span_id ||
+	    slot.size == 0)
+		return 0;
+
+	size_t n = slot.size < size ? slot.size : size - 1;
+	bool deep = slot.triggered;
+	memcpy(name, slot.name, n);
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (slot.seq.load(std::memory_order_relaxed) != seq)
+		return 0;
+	name[n] = '\0';
+	if (triggered != nullptr)
+		*triggered = deep;
+	return n;
+}
+
+SpanNameCache& GetSpanNameCache()
+{
+	static SpanNameCache cache;
+	return cache;
+}
+
+void RegisterSpanNameCache()
+{
+	static std::once_flag once;
+	std::call_once(once, [] { RegisterSpanObserver(&GetSpanNameCache()); });
+}
+
+size_t ThreadSpanName(char* name, size_t size) noexcept
+{
+	uint8_t span_id[8], trace_id[16];
+	uint64_t id;
+
+	if (!GetThreadSpan(span_id, trace_id))
+		return 0;
+
+	memcpy(&id, span_id, sizeof(id));
+	size_t n = GetSpanNameCache().TryLookup(id, name, size);
+	if (n == 0)
+		n = snprintf(name, size, "(unknown)");
+	return n;
+}
+
+size_t SignalSafeThreadSpanName(char* name, size_t size) noexcept
+{
+	static const char kUnknown[] = "(unknown)";
+	static const char kDeepTag[] = " [deep]";
+	uint8_t span_id[8], trace_id[16];
+	uint64_t id;
+	bool triggered = false;
+
+	if (!GetThreadSpan(span_id, trace_id))
+		return 0;
+
+	memcpy(&id, span_id, sizeof(id));
+	size_t n = GetSpanNameCache().TryLookup(id, name, size, &triggered);
+	if (n == 0 && size >= sizeof(kUnknown)) {
+		n = sizeof(kUnknown) - 1;
+		memcpy(name, kUnknown, sizeof(kUnknown));
+	}
+
+	/* Truncates the name rather than the tag */
+	if (triggered && size >= sizeof(kDeepTag)) {
+		if (n + sizeof(kDeepTag) > size)
+			n = size - sizeof(kDeepTag);
+		memcpy(name + n, kDeepTag, sizeof(kDeepTag));
+		n += sizeof(kDeepTag) - 1;
+	}
+	return n;
+}
+
+}  // namespace microservice_profile
@@ -0,0 +1,94 @@
+/*
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_SPAN_NAMES_H_
+#define MICROSERVICE_PROFILE_SPAN_NAMES_H_
+
+#include <cstddef>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+#include "span-observer.h"
+
+namespace microservice_profile
+{
+
+/*
+ * Names of the recently started spans, so that the relay readers can tell
+ * which endpoint a kernel record belongs to: the records only carry the span
+ * id. Direct-mapped on the span id; an entry is lost when a newer span takes
+ * its slot.
+ */
+class SpanNameCache : public SpanObserver
+{
+public:
+	static constexpr size_t kSlots = 4096;
+	static constexpr size_t kNameSize = 48;
+
+	void OnSpanStart(const SpanInfo& span) noexcept override;
+	void OnSpanEnd(const SpanInfo&) noexcept override {}
+
+	/* Copies the name of span_id into name (null-terminated) and returns
+	 * its length, or 0 if the span is unknown. Locks a stripe: never
+	 * called from the allocator or lock interposers. */
+	size_t Lookup(uint64_t span_id, char* name, size_t size) noexcept;
+
+	/* Same, without locking, for signal handlers: also returns 0 if the
+	 * slot is being written. `triggered` receives whether the span is
+	 * deep profiled (see span-trigger.h). */
+	size_t TryLookup(uint64_t span_id, char* name, size_t size,
+		bool* triggered = nullptr) noexcept;
+
+private:
+	static constexpr size_t kStripes = 64;
+
+	struct Slot {
+		std::atomic<uint32_t> seq{0};	/* Odd while written */
+		uint64_t span_id = 0;
+		uint8_t size = 0;
+		bool triggered = false;
+		char name[kNameSize];
+	};
+
+	std::mutex stripes[kStripes];
+	Slot slots[kSlots];
+};
+
+SpanNameCache& GetSpanNameCache();
+
+/* Registers the cache as a span observer, once, for its first user */
+void RegisterSpanNameCache();
+
+/*
+ * Copies the name of the span the calling thread works on (see span_slot.h)
+ * into name, "(unknown)" if the cache lost it or is writing it, and returns
+ * its length. Returns 0 if the thread works on no span. Takes no lock: the
+ * allocator and lock interposers call it while the thread may hold a stripe
+ * of the cache.
+ */
+size_t ThreadSpanName(char* name, size_t size) noexcept;
+
+/*
+ * Same, async-signal-safe; returns 0 as well when the name is being written.
+ * The names of deep profiled spans end with " [deep]", which tags their CPU
+ * samples.
+ */
+size_t SignalSafeThreadSpanName(char* name, size_t size) noexcept;
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_SPAN_NAMES_H_
@@ -0,0 +1,356 @@
+/*
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <iostream>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "microservice-profile-base/flight_recorder.h"
+#include "microservice-profile-base/heap_profile.h"
+#include "microservice-profile-base/latency_histogram.h"
+#include "microservice-profile-base/latency_tracker.h"
+#include "microservice-profile-base/lock_profile.h"
+#include "microservice-profile-base/memory_budget.h"
+#include "microservice-profile-base/node_client.h"
+#include "microservice-profile-base/overhead_governor.h"
+#include "microservice-profile-base/schedstat.h"
+#include "microservice-profile-base/signal_handler.h"
+#include "microservice-profile-base/thread_filter.h"
+#include "microservice-profile-base/windowed_profile.h"
+#include "span-context-storage.h"
+#include "span-differential.h"
+#include "span-names.h"
+#include "span-observer.h"
+
+namespace microservice_profile
+{
+
+SpanObserver* span_observers[kMaxSpanObservers];
+std::atomic<int> span_observer_count(0);
+
+namespace
+{
+
+std::mutex register_mutex;
+
+uint64_t GetEnvUint64(const char* name, uint64_t default_value)
+{
+	const char* value = getenv(name);
+	if (value == nullptr || *value == '\0')
+		return default_value;
+	return strtoull(value, nullptr, 10);
+}
+
+void ReportSpanAlert(SpanAlert alert, const OpenSpan& span)
+{
+	char trace_id[sizeof(span.trace_id) * 2 + 1];
+
+	for (size_t i = 0; i < sizeof(span.trace_id); i++)
+		snprintf(trace_id + i * 2, 3, "%02x", span.trace_id[i]);
+
+	std::cerr << "Microservice-profiler: "
+	          << (alert == SpanAlert::kSlow ? "slow" : "abandoned")
+	          << " span " << span.name << " (trace " << trace_id
+	          << ") open for " << span.elapsed / 1000000 << " ms"
+	          << std::endl;
+
+	/* Keep what led to a slow span before the ring overwrites it */
+	FlightRecord(kFlightSpanAlert, &span, sizeof(span));
+	if (alert == SpanAlert::kSlow) {
+		std::string path;
+		if (SnapshotFlightRecorder("slow-span", false, &path))
+			std::cerr << "Microservice-profiler: flight recorder saved in "
+			          << path << std::endl;
+	}
+}
+
+/*
+ * Feeds the in-process latency tracker, which reports spans still open after
+ * the threshold even if they never end.
+ */
+class LatencyTrackerObserver : public SpanObserver
+{
+public:
+	explicit LatencyTrackerObserver(const LatencyTracker::Options& options)
+		: tracker(options, ReportSpanAlert) {}
+
+	bool Start() { return tracker.Start(); }
+
+	void OnSpanStart(const SpanInfo& span) noexcept override
+	{
+		tracker.OnSpanStart(SpanIdToUint64(span.span_id),
+			span.trace_id.Id().data(), span.name.data(), span.name.size());
+	}
+
+	void OnSpanEnd(const SpanInfo& span) noexcept override
+	{
+		tracker.OnSpanEnd(SpanIdToUint64(span.span_id));
+	}
+
+private:
+	LatencyTracker tracker;
+};
+
+/*
+ * Feeds the per-endpoint latency histograms with the duration of each span.
+ */
+class HistogramObserver : public SpanObserver
+{
+public:
+	void OnSpanStart(const SpanInfo&) noexcept override {}
+
+	void OnSpanEnd(const SpanInfo& span) noexcept override
+	{
+		RecordLatency(span.name.data(), span.name.size(), span.duration,
+			span.trace_id.Id().data(), span.start + span.duration);
+	}
+};
+
+/*
+ * Records each span end in the flight recorder, which lets stack samples be
+ * matched with the spans running on their thread.
+ */
+class FlightRecorderObserver : public SpanObserver
+{
+public:
+	void OnSpanStart(const SpanInfo&) noexcept override {}
+
+	void OnSpanEnd(const SpanInfo& span) noexcept override
+	{
+		FlightSpanRecord record;
+
+		memcpy(record.span_id, span.span_id.Id().data(), sizeof(record.span_id));
+		memcpy(record.trace_id, span.trace_id.Id().data(),
+			sizeof(record.trace_id));
+		record.start = span.start;
+		record.duration = span.duration;
+
+		struct iovec entry[] = {
+			{&record, sizeof(record)},
+			{const_cast<char*>(span.name.data()), span.name.size()},
+		};
+		FlightRecord(kFlightSpan, entry, 2);
+	}
+};
+
+/* Spans open at once on a thread for the scheduler statistics; the oldest
+ * are forgotten beyond */
+const unsigned kMaxSchedOpenSpans = 64;
+
+struct SchedOpenSpan {
+	uint64_t span_id;
+	SchedSnapshot start;
+};
+
+thread_local SchedOpenSpan sched_open_spans[kMaxSchedOpenSpans];
+thread_local unsigned next_sched_open_span = 0;
+
+/*
+ * Splits the time of each span between CPU, run queue and the rest, per
+ * endpoint, from the scheduler statistics of its thread at its start and
+ * end. Spans ending on another thread are not counted.
+ */
+class SchedStatObserver : public SpanObserver
+{
+public:
+	void OnSpanStart(const SpanInfo& span) noexcept override
+	{
+		/* The spans made by the profiler's threads are not the application's */
+		if (IsProfilerThread())
+			return;
+
+		SchedOpenSpan& slot =
+			sched_open_spans[next_sched_open_span++ % kMaxSchedOpenSpans];
+		slot.span_id = ReadSchedStats(&slot.start) ?
+			SpanIdToUint64(span.span_id) : 0;
+	}
+
+	void OnSpanEnd(const SpanInfo& span) noexcept override
+	{
+		uint64_t span_id = SpanIdToUint64(span.span_id);
+		SchedSnapshot end;
+
+		/* Most recent first: spans usually end in the reverse order */
+		for (unsigned i = 1; i <= kMaxSchedOpenSpans; i++) {
+			SchedOpenSpan& slot = sched_open_spans[
+				(next_sched_open_span - i) % kMaxSchedOpenSpans];
+			if (slot.span_id != span_id)
+				continue;
+
+			slot.span_id = 0;
+			if (ReadSchedStats(&end))
+				GetSchedAggregates().Add(span.name.data(), span.name.size(),
+					span.duration, end.run_ns - slot.start.run_ns,
+					end.wait_ns - slot.start.wait_ns);
+			break;
+		}
+	}
+};
+
+void StartFlightRecorderObserver()
+{
+	if (!StartFlightRecorder())
+		return;
+
+	static FlightRecorderObserver observer;
+	RegisterSpanObserver(&observer);
+}
+
+void StartHistograms()
+{
+	const char* enabled = getenv("MICROSERVICE_PROFILE_HISTOGRAMS");
+	if (enabled == nullptr || strcmp(enabled, "1") != 0)
+		return;
+
+	static HistogramObserver observer;
+	if (RegisterSpanObserver(&observer))
+		RegisterLatencyHistogramCommands();
+}
+
+void StartSchedStatObserver()
+{
+	if (!StartSchedStats())
+		return;
+
+	static SchedStatObserver observer;
+	RegisterSpanObserver(&observer);
+}
+
+void StartLatencyTracker()
+{
+	const char* enabled = getenv("MICROSERVICE_PROFILE_LATENCY_TRACKER");
+	if (enabled == nullptr || strcmp(enabled, "1") != 0)
+		return;
+
+	LatencyTracker::Options options;
+	options.threshold_ns =
+		GetEnvUint64("MICROSERVICE_PROFILE_SLOW_SPAN_MS", 100) * 1000000ULL;
+	options.abandon_timeout_ns =
+		GetEnvUint64("MICROSERVICE_PROFILE_ABANDONED_SPAN_S", 60) * 1000000000ULL;
+
+	/* Lives as long as the process, like the tracer providers */
+	auto observer = new LatencyTrackerObserver(options);
+	if (!observer->Start() || !RegisterSpanObserver(observer))
+		delete observer;
+}
+
+/*
+ * Contended locks are charged to the endpoint of the span active on the
+ * waiting thread, which the context storage publishes.
+ */
+void StartLockProfiler()
+{
+	if (!StartLockProfiling())
+		return;
+
+	RegisterSpanNameCache();
+	InstallSpanContextStorage(true);
+}
+
+/* Allocations are charged to the endpoint of the active span, likewise */
+void StartHeapProfiler()
+{
+	if (!StartHeapProfiling())
+		return;
+
+	RegisterSpanNameCache();
+	InstallSpanContextStorage(true);
+}
+
+/* CPU samples, likewise, by a name lookup safe in their signal handler */
+void StartWindowedProfiler()
+{
+	SetSampleEndpointFunction(SignalSafeThreadSpanName);
+	if (!StartWindowedProfiling())
+		return;
+
+	RegisterSpanNameCache();
+	InstallSpanContextStorage(true);
+}
+
+/*
+ * The node daemon gets the raw CPU samples, named by endpoint here: it
+ * symbolizes and aggregates them for all the processes of the node.
+ */
+void StartNodeExport()
+{
+	SetSampleEndpointFunction(SignalSafeThreadSpanName);
+	if (!StartNodeClient())
+		return;
+
+	RegisterSpanNameCache();
+	InstallSpanContextStorage(true);
+}
+
+/*
+ * Slow and fast spans are told apart at their end; the CPU samples taken in
+ * between find their span through its slot.
+ */
+void StartDifferential()
+{
+	SpanDifferential* differential = SpanDifferential::Create();
+	if (differential == nullptr || !RegisterSpanObserver(differential))
+		return;
+
+	if (!AddCpuSampleSink(SpanDifferential::RecordSample) ||
+	    !StartCpuSampling())
+		std::cerr << "Microservice-profiler: no CPU samples for the "
+		          << "differential profile, syscalls only" << std::endl;
+	InstallSpanContextStorage(true);
+}
+
+}  // namespace
+
+bool RegisterSpanObserver(SpanObserver* observer) noexcept
+{
+	std::lock_guard<std::mutex> guard(register_mutex);
+	int count = span_observer_count.load(std::memory_order_relaxed);
+
+	if (count == kMaxSpanObservers)
+		return false;
+
+	span_observers[count] = observer;
+	span_observer_count.store(count + 1, std::memory_order_release);
+	return true;
+}
+
+void StartSpanObservers() noexcept
+{
+	static std::once_flag once;
+
+	try {
+		std::call_once(once, [] {
+			StartFlightRecorderObserver();
+			StartLatencyTracker();
+			StartHistograms();
+			StartSchedStatObserver();
+			StartLockProfiler();
+			StartHeapProfiler();
+			StartWindowedProfiler();
+			StartNodeExport();
+			StartDifferential();
+			StartOverheadGovernor();
+			/* Not in a process with nothing to report */
+			if (HasSpanObservers())
+				RegisterMemoryCommands();
+		});
+	} catch (const std::exception& e) {
+		std::cerr << "Microservice-profiler: " << e.what() << std::endl;
+	}
+}
+
+}  // namespace microservice_profile
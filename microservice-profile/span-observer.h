@@ -0,0 +1,103 @@
+/*
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_SPAN_OBSERVER_H_
+#define MICROSERVICE_PROFILE_SPAN_OBSERVER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+#include <opentelemetry/nostd/string_view.h>
+#include <opentelemetry/trace/span_id.h>
+#include <opentelemetry/trace/trace_id.h>
+
+/*
+ * In-process consumers of the spans seen by the profiling span processor,
+ * independent of its sink and of the kernel module. Observers are notified
+ * on the application threads, after the processor's filter, and must not
+ * block.
+ */
+
+namespace microservice_profile
+{
+
+struct SpanInfo {
+	opentelemetry::nostd::string_view name;
+	const opentelemetry::trace::SpanId& span_id;
+	const opentelemetry::trace::TraceId& trace_id;
+	uint64_t start;		/* ns since the epoch */
+	uint64_t duration;	/* ns, 0 at start */
+	bool error;		/* Ended with an error status */
+	bool triggered;		/* Selected for deep profiling */
+};
+
+class SpanObserver
+{
+public:
+	virtual ~SpanObserver() = default;
+
+	virtual void OnSpanStart(const SpanInfo& span) noexcept = 0;
+	virtual void OnSpanEnd(const SpanInfo& span) noexcept = 0;
+};
+
+const int kMaxSpanObservers = 8;
+
+extern SpanObserver* span_observers[kMaxSpanObservers];
+extern std::atomic<int> span_observer_count;
+
+/*
+ * Adds an observer for the lifetime of the process. Meant to be called before
+ * the first tracer provider is created; returns false when the table is full.
+ */
+bool RegisterSpanObserver(SpanObserver* observer) noexcept;
+
+/*
+ * Opens the flight recorder, creates the built-in observers enabled by the
+ * environment (see the README), starts the overhead governor and registers
+ * the memory budget's command. Only the first call does anything.
+ */
+void StartSpanObservers() noexcept;
+
+inline bool HasSpanObservers() noexcept
+{
+	return span_observer_count.load(std::memory_order_acquire) > 0;
+}
+
+inline void NotifySpanStart(const SpanInfo& span) noexcept
+{
+	int count = span_observer_count.load(std::memory_order_acquire);
+	for (int i = 0; i < count; i++)
+		span_observers[i]->OnSpanStart(span);
+}
+
+inline void NotifySpanEnd(const SpanInfo& span) noexcept
+{
+	int count = span_observer_count.load(std::memory_order_acquire);
+	for (int i = 0; i < count; i++)
+		span_observers[i]->OnSpanEnd(span);
+}
+
+inline uint64_t SpanIdToUint64(const opentelemetry::trace::SpanId& span_id) noexcept
+{
+	uint64_t id;
+	memcpy(&id, span_id.Id().data(), sizeof(id));
+	return id;
+}
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_SPAN_OBSERVER_H_
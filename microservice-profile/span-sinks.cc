@@ -0,0 +1,289 @@
+/*
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <iostream>
+#include <mutex>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "microservice-profile-base/memory_budget.h"
+#include "span-sinks.h"
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+thread_local uint32_t cached_tid = 0;
+
+/* The forking thread has another tid in the child */
+void ForgetTidAfterFork()
+{
+	cached_tid = 0;
+}
+
+}  // namespace
+
+uint32_t CurrentTid()
+{
+	if (cached_tid == 0) {
+		static int fork_handler = pthread_atfork(nullptr, nullptr,
+			ForgetTidAfterFork);
+		(void) fork_handler;
+		cached_tid = syscall(SYS_gettid);
+	}
+	return cached_tid;
+}
+
+/*
+ * ProcfsTextSink
+ */
+bool ProcfsTextSink::Open() noexcept
+{
+	begin_file_fd = fopen(begin_file_name, "w");
+	end_file_fd = fopen(end_file_name, "w");
+
+	if(begin_file_fd == nullptr || end_file_fd == nullptr) {
+		std::cerr << "Problem opening latency tracker begin/end files"
+				<< std::endl;
+		Close();
+		return false;
+	}
+
+	setbuf(begin_file_fd, nullptr);
+	setbuf(end_file_fd, nullptr);
+	return true;
+}
+
+void ProcfsTextSink::Close() noexcept
+{
+	if(begin_file_fd)
+		fclose(begin_file_fd);
+
+	if(end_file_fd)
+		fclose(end_file_fd);
+
+	begin_file_fd = end_file_fd = nullptr;
+}
+
+/*
+ * BinaryBatchSink
+ */
+thread_local BinaryBatchSink::Batch BinaryBatchSink::batch;
+
+std::mutex BinaryBatchSink::batches_mutex;
+BinaryBatchSink::Batch* BinaryBatchSink::batches = nullptr;
+
+namespace
+{
+
+std::once_flag fork_handlers_once;
+
+/* The calling thread's batch, once made: fork children find it without
+ * touching the thread-local object */
+thread_local void* own_batch = nullptr;
+
+}  // namespace
+
+BinaryBatchSink::Batch::Batch()
+{
+	std::call_once(fork_handlers_once, [] {
+		pthread_atfork(&BinaryBatchSink::PrepareFork,
+			&BinaryBatchSink::ParentAfterFork,
+			&BinaryBatchSink::ChildAfterFork);
+	});
+
+	/* A thread's batch cannot be refused: charged, not reserved */
+	ChargeMemory(kMemorySampleRings, sizeof(Batch));
+
+	std::lock_guard<std::mutex> guard(batches_mutex);
+	next = batches;
+	if (next != nullptr)
+		next->prev = this;
+	batches = this;
+	own_batch = this;
+}
+
+BinaryBatchSink::Batch::~Batch()
+{
+	std::lock_guard<std::mutex> guard(batches_mutex);
+	if (prev != nullptr)
+		prev->next = next;
+	else
+		batches = next;
+	if (next != nullptr)
+		next->prev = prev;
+
+	Lock();
+	FlushLocked();
+	Unlock();
+
+	ReleaseMemory(kMemorySampleRings, sizeof(Batch));
+}
+
+void BinaryBatchSink::Batch::Lock() noexcept
+{
+	while (busy.test_and_set(std::memory_order_acquire))
+		sched_yield();
+}
+
+void BinaryBatchSink::Batch::FlushLocked() noexcept
+{
+	if (count > 0 && sink != nullptr && sink->fd >= 0) {
+		/* O_APPEND keeps the batches of concurrent threads whole */
+		if (write(sink->fd, records, count * sizeof(ProfileRecord)) < 0)
+			std::cerr << "Error writing to the span sink file" << std::endl;
+	}
+	count = 0;
+}
+
+bool BinaryBatchSink::Open() noexcept
+{
+	char path[4096];
+	const char* env = getenv("MICROSERVICE_PROFILE_SINK_PATH");
+
+	if (env)
+		snprintf(path, sizeof(path), "%s", env);
+	else
+		snprintf(path, sizeof(path), "/tmp/microservice-profile-%d.bin", getpid());
+
+	fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		std::cerr << "Couldn't open the span sink file: " << path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+void BinaryBatchSink::Close() noexcept
+{
+	FlushBatches(true);
+	if (fd >= 0)
+		close(fd);
+	fd = -1;
+}
+
+void BinaryBatchSink::Flush() noexcept
+{
+	FlushBatches(false);
+}
+
+void BinaryBatchSink::FlushBatches(bool detach) noexcept
+{
+	std::lock_guard<std::mutex> guard(batches_mutex);
+
+	for (Batch* b = batches; b != nullptr; b = b->next) {
+		b->Lock();
+		if (b->sink == this) {
+			b->FlushLocked();
+			if (detach)
+				b->sink = nullptr;
+		}
+		b->Unlock();
+	}
+}
+
+void BinaryBatchSink::PrepareFork()
+{
+	batches_mutex.lock();
+}
+
+void BinaryBatchSink::ParentAfterFork()
+{
+	batches_mutex.unlock();
+}
+
+/*
+ * The records buffered before the fork are the parent's to write. The other
+ * threads do not exist in the child: their batches are forgotten.
+ */
+void BinaryBatchSink::ChildAfterFork()
+{
+	Batch* own = static_cast<Batch*>(own_batch);
+
+	for (Batch* b = batches; b != nullptr; b = b->next) {
+		b->count = 0;
+		b->busy.clear();
+	}
+	batches = own;
+	if (own != nullptr)
+		own->prev = own->next = nullptr;
+	batches_mutex.unlock();
+}
+
+/*
+ * SharedMemorySink
+ */
+bool SharedMemorySink::Open() noexcept
+{
+	const char* env = getenv("MICROSERVICE_PROFILE_SINK_PATH");
+
+	if (env)
+		snprintf(name, sizeof(name), "%s", env);
+	else
+		snprintf(name, sizeof(name), "/microservice-profile-%d", getpid());
+
+	capacity = ReserveMemoryUnits(kMemorySampleRings, sizeof(ProfileShmHeader),
+		sizeof(ProfileShmSlot), kCapacity, 1024);
+	if (capacity == 0) {
+		std::cerr << "Microservice-profiler: no memory left in the budget for "
+		          << "the shared memory sink" << std::endl;
+		return false;
+	}
+	ring_size = sizeof(ProfileShmHeader) + capacity * sizeof(ProfileShmSlot);
+
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		std::cerr << "Couldn't open the shared memory sink: " << name << std::endl;
+		ReleaseMemory(kMemorySampleRings, ring_size);
+		return false;
+	}
+
+	if (ftruncate(fd, ring_size) != 0) {
+		close(fd);
+		ReleaseMemory(kMemorySampleRings, ring_size);
+		return false;
+	}
+
+	void* addr = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		ReleaseMemory(kMemorySampleRings, ring_size);
+		return false;
+	}
+
+	ring = static_cast<ProfileShmHeader*>(addr);
+	ring->capacity = capacity;
+	ring->magic = PROFILE_SHM_MAGIC;
+	return true;
+}
+
+void SharedMemorySink::Close() noexcept
+{
+	if (ring) {
+		munmap(ring, ring_size);
+		ReleaseMemory(kMemorySampleRings, ring_size);
+	}
+	ring = nullptr;
+}
+
+}  // namespace microservice_profile
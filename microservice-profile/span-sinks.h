@@ -0,0 +1,345 @@
+/*
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_SPAN_SINKS_H_
+#define MICROSERVICE_PROFILE_SPAN_SINKS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+
+#include <opentelemetry/nostd/span.h>
+#include <opentelemetry/trace/span_id.h>
+#include <opentelemetry/trace/trace_id.h>
+
+/*
+ * Destinations of the span begin/end events produced by the profiling span
+ * processor. A sink provides:
+ *
+ *   static constexpr bool kNeedsModule;  - feeds the kernel module
+ *   bool Open();                         - false leaves the processor disabled
+ *   void Close();
+ *   void Flush();
+ *   void OnSpanStart(uint64_t ts, const SpanId&, const TraceId&);
+ *   void OnSpanEnd(uint64_t ts, const SpanId&);
+ *
+ * The two hooks are called on the application threads and are meant to be
+ * inlined in the processor.
+ */
+
+namespace microservice_profile
+{
+
+enum ProfileRecordType : uint32_t {
+	PROFILE_RECORD_SPAN_START = 1,
+	PROFILE_RECORD_SPAN_END = 2,
+};
+
+/*
+ * Fixed-size binary form of a span event, used by the binary, shared memory
+ * and in-memory sinks. The trace id is zeroed for end events.
+ */
+struct ProfileRecord {
+	uint32_t type;
+	uint32_t tid;
+	uint64_t timestamp;
+	uint8_t span_id[opentelemetry::trace::SpanId::kSize];
+	uint8_t trace_id[opentelemetry::trace::TraceId::kSize];
+};
+
+uint32_t CurrentTid();
+
+inline void FillProfileRecord(ProfileRecord* record, uint32_t type,
+	uint64_t ts, const opentelemetry::trace::SpanId& span_id,
+	const opentelemetry::trace::TraceId* trace_id)
+{
+	record->type = type;
+	record->tid = CurrentTid();
+	record->timestamp = ts;
+	memcpy(record->span_id, span_id.Id().data(), sizeof(record->span_id));
+	if (trace_id)
+		memcpy(record->trace_id, trace_id->Id().data(), sizeof(record->trace_id));
+	else
+		memset(record->trace_id, 0, sizeof(record->trace_id));
+}
+
+/*
+ * Text lines written to /proc/latency-tracker-begin and -end, read by the
+ * kernel latency tracker.
+ */
+class ProcfsTextSink
+{
+public:
+	static constexpr bool kNeedsModule = true;
+
+	bool Open() noexcept;
+	void Close() noexcept;
+	void Flush() noexcept {}
+
+	void OnSpanStart(uint64_t ts, const opentelemetry::trace::SpanId& span_id,
+		const opentelemetry::trace::TraceId& trace_id) noexcept
+	{
+		char span_id_str[opentelemetry::trace::SpanId::kSize * 2 + 1];
+		char trace_id_str[opentelemetry::trace::TraceId::kSize * 2 + 1];
+
+		span_id.ToLowerBase16(opentelemetry::nostd::span<char, 16>(span_id_str, 16));
+		span_id_str[16] = '\0';
+		trace_id.ToLowerBase16(opentelemetry::nostd::span<char, 32>(trace_id_str, 32));
+		trace_id_str[32] = '\0';
+
+		fprintf(begin_file_fd, "%lx:%s:%s\n", ts, span_id_str, trace_id_str);
+	}
+
+	void OnSpanEnd(uint64_t /* ts */,
+		const opentelemetry::trace::SpanId& span_id) noexcept
+	{
+		char span_id_str[opentelemetry::trace::SpanId::kSize * 2 + 1];
+
+		span_id.ToLowerBase16(opentelemetry::nostd::span<char, 16>(span_id_str, 16));
+		span_id_str[16] = '\0';
+
+		fprintf(end_file_fd, "%s\n", span_id_str);
+	}
+
+private:
+	const char* begin_file_name = "/proc/latency-tracker-begin";
+	const char* end_file_name = "/proc/latency-tracker-end";
+
+	FILE* begin_file_fd = nullptr, *end_file_fd = nullptr;
+};
+
+/*
+ * Binary records accumulated per thread and appended to a file with one
+ * write() per batch (MICROSERVICE_PROFILE_SINK_PATH, by default
+ * /tmp/microservice-profile-<pid>.bin). Flush() only flushes the calling
+ * thread's batch; the others are flushed when full or when their thread exits.
+ */
+class BinaryBatchSink
+{
+public:
+	static constexpr bool kNeedsModule = false;
+	static constexpr uint32_t kBatchSize = 64;
+
+	bool Open() noexcept;
+	void Close() noexcept;
+	void Flush() noexcept;
+
+	void OnSpanStart(uint64_t ts, const opentelemetry::trace::SpanId& span_id,
+		const opentelemetry::trace::TraceId& trace_id) noexcept
+	{
+		Append(PROFILE_RECORD_SPAN_START, ts, span_id, &trace_id);
+	}
+
+	void OnSpanEnd(uint64_t ts,
+		const opentelemetry::trace::SpanId& span_id) noexcept
+	{
+		Append(PROFILE_RECORD_SPAN_END, ts, span_id, nullptr);
+	}
+
+private:
+	/* A thread's records not written yet. The batches of all the threads
+	 * are linked, so that the sink flushes and detaches them all when it
+	 * closes: a thread never writes to a closed fd. */
+	struct Batch {
+		BinaryBatchSink* sink = nullptr;	/* Owner of the records */
+		uint32_t count = 0;
+		std::atomic_flag busy = ATOMIC_FLAG_INIT;
+		Batch* prev = nullptr;
+		Batch* next = nullptr;
+		ProfileRecord records[kBatchSize];
+
+		Batch();
+		~Batch();
+
+		void Lock() noexcept;
+		void Unlock() noexcept { busy.clear(std::memory_order_release); }
+		void FlushLocked() noexcept;
+	};
+
+	void Append(uint32_t type, uint64_t ts,
+		const opentelemetry::trace::SpanId& span_id,
+		const opentelemetry::trace::TraceId* trace_id) noexcept
+	{
+		Batch& b = batch;
+		b.Lock();
+		if (b.sink != this) {
+			b.FlushLocked();
+			b.sink = this;
+		}
+		FillProfileRecord(&b.records[b.count++], type, ts, span_id, trace_id);
+		if (b.count == kBatchSize)
+			b.FlushLocked();
+		b.Unlock();
+	}
+
+	/* Flushes the batches holding this sink's records, and detaches them */
+	void FlushBatches(bool detach) noexcept;
+
+	static void PrepareFork();
+	static void ParentAfterFork();
+	static void ChildAfterFork();
+
+	/* The batches of all the threads */
+	static std::mutex batches_mutex;
+	static Batch* batches;
+
+	static thread_local Batch batch;
+	int fd = -1;
+};
+
+/*
+ * Header of the shared memory ring filled by SharedMemorySink. Slot i holds
+ * the record of sequence number seq - 1, and seq is PROFILE_SHM_WRITING
+ * while a producer writes it. A consumer copies a slot whose seq matches
+ * the position it expects, and keeps the copy if seq still matches after.
+ */
+struct ProfileShmSlot {
+	std::atomic<uint64_t> seq;
+	ProfileRecord record;
+};
+
+struct ProfileShmHeader {
+	uint32_t magic;
+	uint32_t capacity;
+	std::atomic<uint64_t> head;
+
+	/* The slots follow the header */
+	ProfileShmSlot* slots() noexcept
+	{
+		return reinterpret_cast<ProfileShmSlot*>(this + 1);
+	}
+};
+
+#define PROFILE_SHM_MAGIC 0x6d707368 /* "mpsh" */
+#define PROFILE_SHM_WRITING UINT64_MAX
+
+/*
+ * Lock-free multi-producer ring in a POSIX shared memory object
+ * (MICROSERVICE_PROFILE_SINK_PATH, by default /microservice-profile-<pid>)
+ * for an external consumer. Old records are overwritten when it lags.
+ */
+class SharedMemorySink
+{
+public:
+	static constexpr bool kNeedsModule = false;
+	static constexpr uint32_t kCapacity = 65536;
+
+	bool Open() noexcept;
+	void Close() noexcept;
+	void Flush() noexcept {}
+
+	void OnSpanStart(uint64_t ts, const opentelemetry::trace::SpanId& span_id,
+		const opentelemetry::trace::TraceId& trace_id) noexcept
+	{
+		Append(PROFILE_RECORD_SPAN_START, ts, span_id, &trace_id);
+	}
+
+	void OnSpanEnd(uint64_t ts,
+		const opentelemetry::trace::SpanId& span_id) noexcept
+	{
+		Append(PROFILE_RECORD_SPAN_END, ts, span_id, nullptr);
+	}
+
+private:
+	void Append(uint32_t type, uint64_t ts,
+		const opentelemetry::trace::SpanId& span_id,
+		const opentelemetry::trace::TraceId* trace_id) noexcept
+	{
+		uint64_t pos = ring->head.fetch_add(1, std::memory_order_relaxed);
+		ProfileShmSlot& slot = ring->slots()[pos % capacity];
+
+		/* Producers a lap apart share the slot: the record is dropped
+		 * when another one writes it, or wrote a later position */
+		uint64_t seq = slot.seq.load(std::memory_order_relaxed);
+		if (seq > pos + 1 || !slot.seq.compare_exchange_strong(seq,
+				PROFILE_SHM_WRITING, std::memory_order_relaxed))
+			return;
+		std::atomic_thread_fence(std::memory_order_release);
+		FillProfileRecord(&slot.record, type, ts, span_id, trace_id);
+		slot.seq.store(pos + 1, std::memory_order_release);
+	}
+
+	ProfileShmHeader* ring = nullptr;
+	size_t ring_size = 0;
+	uint32_t capacity = kCapacity;	/* Less when the memory budget is short */
+	char name[64];
+};
+
+/*
+ * Fixed-size in-process ring keeping the last Capacity records, for tests and
+ * overhead comparisons.
+ */
+template <uint32_t Capacity = 4096>
+class InMemoryRingSink
+{
+public:
+	static constexpr bool kNeedsModule = false;
+
+	bool Open() noexcept { return true; }
+	void Close() noexcept {}
+	void Flush() noexcept {}
+
+	void OnSpanStart(uint64_t ts, const opentelemetry::trace::SpanId& span_id,
+		const opentelemetry::trace::TraceId& trace_id) noexcept
+	{
+		uint64_t pos = head.fetch_add(1, std::memory_order_relaxed);
+		FillProfileRecord(&records[pos % Capacity], PROFILE_RECORD_SPAN_START,
+			ts, span_id, &trace_id);
+	}
+
+	void OnSpanEnd(uint64_t ts,
+		const opentelemetry::trace::SpanId& span_id) noexcept
+	{
+		uint64_t pos = head.fetch_add(1, std::memory_order_relaxed);
+		FillProfileRecord(&records[pos % Capacity], PROFILE_RECORD_SPAN_END,
+			ts, span_id, nullptr);
+	}
+
+	/* Number of records written so far (including the overwritten ones) */
+	uint64_t Count() const noexcept { return head.load(); }
+
+	const ProfileRecord& At(uint64_t pos) const noexcept
+	{
+		return records[pos % Capacity];
+	}
+
+private:
+	std::atomic<uint64_t> head{0};
+	ProfileRecord records[Capacity];
+};
+
+/*
+ * Drops everything: the baseline for overhead comparisons.
+ */
+class NullSink
+{
+public:
+	static constexpr bool kNeedsModule = false;
+
+	bool Open() noexcept { return true; }
+	void Close() noexcept {}
+	void Flush() noexcept {}
+
+	void OnSpanStart(uint64_t, const opentelemetry::trace::SpanId&,
+		const opentelemetry::trace::TraceId&) noexcept {}
+	void OnSpanEnd(uint64_t, const opentelemetry::trace::SpanId&) noexcept {}
+};
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_SPAN_SINKS_H_
@@ -0,0 +1,93 @@
+/*
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <cstring>
+#include <iostream>
+#include <stdlib.h>
+
+#include <opentelemetry/baggage/baggage_context.h>
+#include <opentelemetry/context/runtime_context.h>
+
+#include "span-trigger.h"
+
+namespace nostd = opentelemetry::nostd;
+
+namespace microservice_profile
+{
+
+const SpanTrigger* SpanTrigger::Get()
+{
+	static const SpanTrigger* trigger = []() -> const SpanTrigger* {
+		const char* spec = getenv("MICROSERVICE_PROFILE_TRIGGER");
+		if (spec == nullptr || *spec == '\0')
+			return nullptr;
+
+		const char* equal = strchr(spec, '=');
+		size_t key_size = equal != nullptr ? equal - spec : strlen(spec);
+		size_t value_size = equal != nullptr ? strlen(equal + 1) : 0;
+		if (key_size == 0 || key_size > kMaxSize || value_size > kMaxSize) {
+			std::cerr << "Microservice-profiler: invalid "
+			          << "MICROSERVICE_PROFILE_TRIGGER " << spec
+			          << ", every trace is profiled" << std::endl;
+			return nullptr;
+		}
+
+		SpanTrigger* result = new SpanTrigger();
+		memcpy(result->key, spec, key_size);
+		result->key_size = key_size;
+		if (equal != nullptr) {
+			memcpy(result->value, equal + 1, value_size);
+			result->value_size = value_size;
+			result->any_value = false;
+		}
+		return result;
+	}();
+	return trigger;
+}
+
+bool SpanTrigger::Matches(nostd::string_view entry_key,
+	nostd::string_view entry_value) const noexcept
+{
+	return entry_key.size() == key_size &&
+	       memcmp(entry_key.data(), key, key_size) == 0 &&
+	       (any_value || (entry_value.size() == value_size &&
+	                      memcmp(entry_value.data(), value, value_size) == 0));
+}
+
+bool SpanTrigger::Matches(
+	const opentelemetry::trace::SpanContext& parent) const noexcept
+{
+	bool found = false;
+	auto match = [this, &found](nostd::string_view entry_key,
+			nostd::string_view entry_value) {
+		found = Matches(entry_key, entry_value);
+		return !found;
+	};
+
+	/* The parent's trace state is the new span's */
+	parent.trace_state()->GetAllEntries(match);
+	if (found)
+		return true;
+
+	/* Shares the current context, without copying the baggage */
+	auto baggage = opentelemetry::baggage::GetBaggage(
+		opentelemetry::context::RuntimeContext::GetCurrent());
+	if (baggage != nullptr)
+		baggage->GetAllEntries(match);
+	return found;
+}
+
+}  // namespace microservice_profile
@@ -0,0 +1,66 @@
+/*
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_SPAN_TRIGGER_H_
+#define MICROSERVICE_PROFILE_SPAN_TRIGGER_H_
+
+#include <cstddef>
+
+#include <opentelemetry/nostd/string_view.h>
+#include <opentelemetry/trace/span_context.h>
+
+namespace microservice_profile
+{
+
+/*
+ * Request-scoped deep profiling: with a trigger, only the traces carrying
+ * it are reported to the kernel module, and so get their syscalls turned
+ * into spans, and their CPU samples are tagged (see span-names.h).
+ *
+ * The trigger is a trace state entry or a baggage entry: a key, and
+ * optionally its value. Trace state crosses the service hops with the W3C
+ * propagator; baggage needs the baggage propagator. Looking it up walks
+ * the entries in place, without allocating.
+ */
+class SpanTrigger
+{
+public:
+	static constexpr size_t kMaxSize = 64;
+
+	/* Configured by MICROSERVICE_PROFILE_TRIGGER, "key" or "key=value";
+	 * nullptr when unset. Lives as long as the process. */
+	static const SpanTrigger* Get();
+
+	/* Whether a span started under `parent`, on the calling thread, is
+	 * part of a triggered request */
+	bool Matches(const opentelemetry::trace::SpanContext& parent) const noexcept;
+
+private:
+	SpanTrigger() = default;
+
+	bool Matches(opentelemetry::nostd::string_view key,
+		opentelemetry::nostd::string_view value) const noexcept;
+
+	char key[kMaxSize];
+	size_t key_size = 0;
+	char value[kMaxSize];
+	size_t value_size = 0;
+	bool any_value = true;
+};
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_SPAN_TRIGGER_H_
@@ -0,0 +1,258 @@
+/*
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <cstring>
+#include <iostream>
+#include <stdlib.h>
+#include <system_error>
+
+#include "microservice-profile-base/control_server.h"
+#include "microservice-profile-base/memory_budget.h"
+#include "microservice-profile-base/thread_filter.h"
+#include "tail-retention.h"
+
+namespace microservice_profile
+{
+
+namespace
+{
+
+uint64_t GetEnvUint64(const char* name, uint64_t default_value)
+{
+	const char* value = getenv(name);
+	if (value == nullptr || *value == '\0')
+		return default_value;
+	return strtoull(value, nullptr, 10);
+}
+
+TailRetention* instance = nullptr;
+
+}  // namespace
+
+TailRetention::TailRetention(const RetentionArena::Options& options,
+	Materializer materializer)
+	: arena(options), materializer(std::move(materializer)),
+	  queue_cond(new std::condition_variable()),
+	  max_queued_bytes(options.max_bytes)
+{
+}
+
+TailRetention* TailRetention::Create(Materializer materializer)
+{
+	const char* enabled = getenv("MICROSERVICE_PROFILE_TAIL_RETENTION");
+	if (enabled == nullptr || strcmp(enabled, "1") != 0 || instance != nullptr)
+		return instance;
+
+	RetentionArena::Options options;
+	options.max_bytes =
+		GetEnvUint64("MICROSERVICE_PROFILE_TAIL_MB", 64) << 20;
+
+	auto retention = new TailRetention(options, std::move(materializer));
+	if (!retention->StartThread()) {
+		delete retention;
+		return nullptr;
+	}
+
+	instance = retention;
+	RegisterControlCommand("retention",
+		"tail-based retention of the kernel records",
+		[](const std::string&, std::string* output) {
+			instance->Report(output);
+		});
+	return instance;
+}
+
+bool TailRetention::StartThread()
+{
+	try {
+		thread.reset(new std::thread(&TailRetention::MaterializeLoop, this));
+	} catch (const std::system_error& e) {
+		std::cerr << "Microservice-profiler: "
+		          << "unable to start tail-based retention: " << e.what()
+		          << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool TailRetention::Admit(const uint8_t* trace_id, const uint8_t* span_id,
+	const char* endpoint, size_t endpoint_size, uint32_t nb_syscalls,
+	const struct syscall_desc* syscalls)
+{
+	return arena.Hold(trace_id, span_id, endpoint, endpoint_size, nb_syscalls,
+		syscalls) == RetentionArena::kKeep;
+}
+
+void TailRetention::OnSpanStart(const SpanInfo& span) noexcept
+{
+	/* The spans made from the kernel records are not the trace's own */
+	if (IsProfilerThread())
+		return;
+
+	TraceKey key = MakeTraceKey(span.trace_id.Id().data());
+	Stripe& stripe = stripes[key.low % kStripes];
+	std::lock_guard<std::mutex> guard(stripe.mutex);
+
+	auto it = stripe.traces.find(key);
+	if (it == stripe.traces.end()) {
+		/* Spans that never end must not grow the table without bound: the
+		 * records of untracked traces age out of the arena instead */
+		if (stripe.traces.size() >= kMaxTracesPerStripe)
+			return;
+		it = stripe.traces.emplace(key, OpenTrace()).first;
+	}
+	it->second.open++;
+}
+
+void TailRetention::OnSpanEnd(const SpanInfo& span) noexcept
+{
+	if (IsProfilerThread())
+		return;
+
+	const uint8_t* trace_id = span.trace_id.Id().data();
+	TraceKey key = MakeTraceKey(trace_id);
+	Stripe& stripe = stripes[key.low % kStripes];
+	bool error;
+
+	{
+		std::lock_guard<std::mutex> guard(stripe.mutex);
+		auto it = stripe.traces.find(key);
+		if (it == stripe.traces.end())
+			return;
+		it->second.error |= span.error;
+		if (--it->second.open > 0)
+			return;
+		error = it->second.error;
+		stripe.traces.erase(it);
+	}
+
+	/* Local root: the trace is decided */
+	KeptTrace kept;
+	bool keep = error ||
+		span.duration >= thresholds.Of(span.name.data(), span.name.size());
+	arena.Decide(trace_id, keep, &kept.records);
+	if (kept.records.empty())
+		return;
+
+	memcpy(kept.trace_id, trace_id, sizeof(kept.trace_id));
+	{
+		std::lock_guard<std::mutex> guard(queue_mutex);
+		/* Queued records stay charged until materialized */
+		if (queued_bytes + kept.records.size() > max_queued_bytes ||
+		    !ReserveMemory(kMemoryAnnotations, kept.records.size())) {
+			overflowed++;
+			return;
+		}
+		queued_bytes += kept.records.size();
+		queue.push_back(std::move(kept));
+	}
+	queue_cond->notify_one();
+}
+
+void TailRetention::MaterializeLoop()
+{
+	MarkProfilerThread();
+
+	while (true) {
+		KeptTrace kept;
+		{
+			std::unique_lock<std::mutex> lock(queue_mutex);
+			queue_cond->wait(lock, [this] { return !queue.empty(); });
+			kept = std::move(queue.front());
+			queue.pop_front();
+			queued_bytes -= kept.records.size();
+		}
+		ReleaseMemory(kMemoryAnnotations, kept.records.size());
+
+		std::lock_guard<std::mutex> guard(materialize_mutex);
+		RetentionArena::ForEachRecord(kept.records,
+			[&](const uint8_t* span_id, const char* endpoint,
+				size_t endpoint_size, uint32_t nb_syscalls,
+				const struct syscall_desc* syscalls) {
+				materializer(kept.trace_id, span_id, endpoint, endpoint_size,
+					nb_syscalls, syscalls);
+			});
+	}
+}
+
+void TailRetention::Report(std::string* output)
+{
+	RetentionArena::Stats stats = arena.stats();
+	size_t queued;
+	uint64_t lost;
+
+	{
+		std::lock_guard<std::mutex> guard(queue_mutex);
+		queued = queued_bytes;
+		lost = overflowed;
+	}
+
+	*output += "held_bytes " + std::to_string(stats.held_bytes) + "\n";
+	*output += "kept_traces " + std::to_string(stats.kept_traces) + "\n";
+	*output += "dropped_traces " + std::to_string(stats.dropped_traces) + "\n";
+	*output += "evicted_traces " + std::to_string(stats.evicted_traces) + "\n";
+	*output += "queued_bytes " + std::to_string(queued) + "\n";
+	*output += "overflowed_traces " + std::to_string(lost) + "\n";
+}
+
+void TailRetention::PrepareFork()
+{
+	materialize_mutex.lock();
+	for (Stripe& stripe : stripes)
+		stripe.mutex.lock();
+	queue_mutex.lock();
+	arena.PrepareFork();
+}
+
+void TailRetention::ParentAfterFork()
+{
+	arena.ParentAfterFork();
+	queue_mutex.unlock();
+	for (Stripe& stripe : stripes)
+		stripe.mutex.unlock();
+	materialize_mutex.unlock();
+}
+
+/*
+ * The child's traces start afresh. Its materializer thread does not exist:
+ * leak the handle, and the condition variable it may have been waiting on.
+ * Another one is started by RestartAfterFork, when the child profiles.
+ */
+void TailRetention::ChildAfterFork()
+{
+	arena.ChildAfterFork();
+	queue.clear();
+	ReleaseMemory(kMemoryAnnotations, queued_bytes);
+	queued_bytes = 0;
+	queue_mutex.unlock();
+	for (Stripe& stripe : stripes) {
+		stripe.traces.clear();
+		stripe.mutex.unlock();
+	}
+	materialize_mutex.unlock();
+
+	queue_cond.release();
+	queue_cond.reset(new std::condition_variable());
+	thread.release();
+}
+
+void TailRetention::RestartAfterFork()
+{
+	if (!thread)
+		StartThread();
+}
+
+}  // namespace microservice_profile
@@ -0,0 +1,125 @@
+/*
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#ifndef MICROSERVICE_PROFILE_TAIL_RETENTION_H_
+#define MICROSERVICE_PROFILE_TAIL_RETENTION_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "microservice-profile-base/latency_thresholds.h"
+#include "microservice-profile-base/retention_arena.h"
+#include "span-observer.h"
+
+namespace microservice_profile
+{
+
+/*
+ * Tail-based retention of the kernel records: the records of a trace are
+ * held until its local root span ends, then turned into spans only if that
+ * span was slower than its endpoint's threshold or one of the trace's spans
+ * failed. The local root is the span whose end leaves its trace with no span
+ * open in the process.
+ *
+ * Kept traces are materialized on a thread of their own, marked as a
+ * profiler thread, never on the application thread ending the root span.
+ */
+class TailRetention : public SpanObserver
+{
+public:
+	typedef std::function<void(const uint8_t* trace_id,
+		const uint8_t* span_id, const char* endpoint, size_t endpoint_size,
+		uint32_t nb_syscalls, const struct syscall_desc* syscalls)>
+		Materializer;
+
+	/* Configured by the environment (see the README); nullptr when
+	 * disabled. Lives as long as the process. */
+	static TailRetention* Create(Materializer materializer);
+
+	/* Called by the relay readers: returns true if the record must be
+	 * turned into spans right away, false if it was held or dropped */
+	bool Admit(const uint8_t* trace_id, const uint8_t* span_id,
+		const char* endpoint, size_t endpoint_size, uint32_t nb_syscalls,
+		const struct syscall_desc* syscalls);
+
+	void OnSpanStart(const SpanInfo& span) noexcept override;
+	void OnSpanEnd(const SpanInfo& span) noexcept override;
+
+	/* Called from the profiler's fork handlers */
+	void PrepareFork();
+	void ParentAfterFork();
+	void ChildAfterFork();
+
+	/* Starts the child's materializer thread, on its first span */
+	void RestartAfterFork();
+
+private:
+	static constexpr size_t kStripes = 16;
+	static constexpr size_t kMaxTracesPerStripe = 16384;
+
+	struct OpenTrace {
+		uint32_t open = 0;
+		bool error = false;
+	};
+
+	struct Stripe {
+		std::mutex mutex;
+		std::unordered_map<TraceKey, OpenTrace, TraceKeyHash> traces;
+	};
+
+	struct KeptTrace {
+		uint8_t trace_id[16];
+		std::string records;
+	};
+
+	TailRetention(const RetentionArena::Options& options,
+		Materializer materializer);
+
+	bool StartThread();
+	void MaterializeLoop();
+	void Report(std::string* output);
+
+	RetentionArena arena;
+	Materializer materializer;
+
+	LatencyThresholds thresholds;
+
+	Stripe stripes[kStripes];
+
+	/* Kept traces waiting for the materializer thread */
+	std::mutex queue_mutex;
+	std::unique_ptr<std::condition_variable> queue_cond;
+	std::deque<KeptTrace> queue;
+	size_t max_queued_bytes;
+	size_t queued_bytes = 0;
+	uint64_t overflowed = 0;
+	std::unique_ptr<std::thread> thread;
+
+	/* Held while a trace is materialized, and across fork() like the relay
+	 * readers' record mutexes */
+	std::mutex materialize_mutex;
+};
+
+}  // namespace microservice_profile
+
+#endif  // MICROSERVICE_PROFILE_TAIL_RETENTION_H_
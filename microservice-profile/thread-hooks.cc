@@ -0,0 +1,121 @@
+/*
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Thread creation and naming interposers. They live in the preloaded library
+ * so that they take precedence over libc, and apply the thread filter as
+ * soon as a thread starts or gets a new name.
+ */
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <sys/prctl.h>
+
+#include "microservice-profile-base/thread_filter.h"
+
+namespace
+{
+
+typedef int (*pthread_create_fn)(pthread_t*, const pthread_attr_t*,
+	void* (*)(void*), void*);
+typedef int (*pthread_setname_np_fn)(pthread_t, const char*);
+typedef int (*prctl_fn)(int, unsigned long, unsigned long, unsigned long,
+	unsigned long);
+
+struct ThreadStart {
+	void* (*start_routine)(void*);
+	void* arg;
+	bool sdk_thread;
+};
+
+void* StartThread(void* data)
+{
+	ThreadStart start = *static_cast<ThreadStart*>(data);
+	free(data);
+
+	if (start.sdk_thread)
+		microservice_profile::MarkSdkThread();
+	microservice_profile::ApplyThreadFilter();
+
+	return start.start_routine(start.arg);
+}
+
+void OnThreadRenamed(pthread_t thread)
+{
+	/* A thread renamed by another one re-evaluates itself at its next span */
+	if (pthread_equal(thread, pthread_self()))
+		microservice_profile::ApplyThreadFilter();
+	else
+		microservice_profile::thread_filter_generation.fetch_add(1,
+			std::memory_order_relaxed);
+}
+
+}  // namespace
+
+extern "C" int pthread_create(pthread_t* thread, const pthread_attr_t* attr,
+	void* (*start_routine)(void*), void* arg)
+{
+	static pthread_create_fn real_pthread_create =
+		reinterpret_cast<pthread_create_fn>(dlsym(RTLD_NEXT, "pthread_create"));
+
+	auto start = static_cast<ThreadStart*>(malloc(sizeof(ThreadStart)));
+	if (start == nullptr)
+		return real_pthread_create(thread, attr, start_routine, arg);
+
+	start->start_routine = start_routine;
+	start->arg = arg;
+	start->sdk_thread = microservice_profile::CreatingSdkThreads();
+
+	int ret = real_pthread_create(thread, attr, &StartThread, start);
+	if (ret != 0)
+		free(start);
+	return ret;
+}
+
+extern "C" int pthread_setname_np(pthread_t thread, const char* name)
+{
+	static pthread_setname_np_fn real_pthread_setname_np =
+		reinterpret_cast<pthread_setname_np_fn>(
+			dlsym(RTLD_NEXT, "pthread_setname_np"));
+
+	int ret = real_pthread_setname_np(thread, name);
+	if (ret == 0)
+		OnThreadRenamed(thread);
+	return ret;
+}
+
+extern "C" int prctl(int option, ...)
+{
+	static prctl_fn real_prctl =
+		reinterpret_cast<prctl_fn>(dlsym(RTLD_NEXT, "prctl"));
+	va_list args;
+	unsigned long arg2, arg3, arg4, arg5;
+
+	va_start(args, option);
+	arg2 = va_arg(args, unsigned long);
+	arg3 = va_arg(args, unsigned long);
+	arg4 = va_arg(args, unsigned long);
+	arg5 = va_arg(args, unsigned long);
+	va_end(args);
+
+	int ret = real_prctl(option, arg2, arg3, arg4, arg5);
+	if (ret == 0 && option == PR_SET_NAME)
+		OnThreadRenamed(pthread_self());
+	return ret;
+}
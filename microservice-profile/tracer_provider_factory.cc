@@ -8,6 +8,7 @@
 #include <opentelemetry/sdk/trace/samplers/always_on_factory.h>
 #include <opentelemetry/sdk/trace/tracer_provider.h>
 
+#include "perf-span-processor.h"
 #include "profile-span-processor.h"
 
 namespace trace_api = opentelemetry::trace;
@@ -50,11 +51,11 @@ std::unique_ptr<opentelemetry::trace::TracerProvider> TracerProviderFactory::Cre
     std::unique_ptr<IdGenerator> id_generator)
 {
   	std::vector<std::unique_ptr<SpanProcessor>> processors;
-  	auto profileProcessor = std::unique_ptr<SpanProcessor> (new trace_sdk::ProfileSpanProcessor());
+  	auto profileProcessor = trace_sdk::MakeProfileSpanProcessor();
 
 	/* inject the profiling processor FIRST !!!! */
 	processors.push_back(std::move(profileProcessor));
-	processors.push_back(std::move(processor));
+	processors.push_back(MaybeCountPerfEvents(std::move(processor)));
 
   	std::unique_ptr<trace_api::TracerProvider> provider(new trace_sdk::TracerProvider(
       	std::move(processors), resource, std::move(sampler), std::move(id_generator))); /***/
@@ -93,9 +94,12 @@ std::unique_ptr<opentelemetry::trace::TracerProvider> TracerProviderFactory::Cre
     std::unique_ptr<Sampler> sampler,
     std::unique_ptr<IdGenerator> id_generator)
 {
+	for (auto& processor : processors)
+		processor = MaybeCountPerfEvents(std::move(processor));
+
 	/* inject the profiling processor */
 	// TODO: inject the profiling processor first!!
-	auto profileProcessor = std::unique_ptr<SpanProcessor> (new trace_sdk::ProfileSpanProcessor());
+	auto profileProcessor = trace_sdk::MakeProfileSpanProcessor();
 	processors.push_back(std::move(profileProcessor));
 
   	std::unique_ptr<trace_api::TracerProvider> provider(new trace_sdk::TracerProvider(
@@ -108,10 +112,11 @@ std::unique_ptr<opentelemetry::trace::TracerProvider> TracerProviderFactory::Cre
 std::unique_ptr<trace_api::TracerProvider> TracerProviderFactory::Create(
     std::shared_ptr<sdk::trace::TracerContext> context)
 {
-  auto profileProcessor = std::unique_ptr<SpanProcessor> (new trace_sdk::ProfileSpanProcessor());
+  auto profileProcessor = trace_sdk::MakeProfileSpanProcessor();
 
   // TODO: inject the profiling processor first!!
   context->AddProcessor(std::move(profileProcessor));
+  WarnPerfEventsNotCounted();
 
   std::unique_ptr<trace_api::TracerProvider> provider(new trace_sdk::TracerProvider(context));
 